@@ -4,10 +4,13 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
+QT       += core gui network
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
+CONFIG += c++11
+unix: LIBS += -lpthread
+
 TARGET = ConvolutionalNeuralNetwork
 TEMPLATE = app
 
@@ -18,6 +21,27 @@ SOURCES += main.cpp\
     graphicsviewex.cpp \
     cnnlayer.cpp \
     trainingthread.cpp \
+    quantizationthread.cpp \
+    cnnoptimizer.cpp \
+    cnnschedule.cpp \
+    cnnsampler.cpp \
+    cnnquantizedmodel.cpp \
+    cnncheckpoint.cpp \
+    inferenceserver.cpp \
+    cnnpipeline.cpp \
+    cnnnuma.cpp \
+    cnndataparallel.cpp \
+    cnnthreadpool.cpp \
+    cnngradientcheck.cpp \
+    cnnsnapshot.cpp \
+    cnnconvtuner.cpp \
+    cnnfft.cpp \
+    cnnlayoutbenchmark.cpp \
+    cnnsourcegenerator.cpp \
+    cnndistributed.cpp \
+    distributedtraining.cpp \
+    cnnactivationcheckpointing.cpp \
+    cnntrainingstep.cpp \
     ../_DefaultLibrary/io.cpp \
     ../_DefaultLibrary/text.cpp
 
@@ -26,6 +50,27 @@ HEADERS  += mainwindow.h \
     graphicsviewex.h \
     cnnlayer.h \
     trainingthread.h \
+    quantizationthread.h \
+    cnnoptimizer.h \
+    cnnschedule.h \
+    cnnsampler.h \
+    cnnquantizedmodel.h \
+    cnncheckpoint.h \
+    inferenceserver.h \
+    cnnpipeline.h \
+    cnnnuma.h \
+    cnndataparallel.h \
+    cnnthreadpool.h \
+    cnngradientcheck.h \
+    cnnsnapshot.h \
+    cnnconvtuner.h \
+    cnnfft.h \
+    cnnlayoutbenchmark.h \
+    cnnsourcegenerator.h \
+    cnndistributed.h \
+    distributedtraining.h \
+    cnnactivationcheckpointing.h \
+    cnntrainingstep.h \
     ../_DefaultLibrary/io.h \
     ../_DefaultLibrary/text.h
 
@@ -0,0 +1,283 @@
+#include "cnnactivationcheckpointing.h"
+
+CNNActivationCheckpointing::CNNActivationCheckpointing(CNNLayer **_layers, uint32_t _layerCount, uint64_t _memoryBudget)
+{
+    layers=_layers;
+    layerCount=_layerCount;
+    checkpointInputs.assign(layerCount,0);
+
+    operationCount=0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        operationCount+=getOperationCount(layers[layerIndex]);
+
+    plan(_memoryBudget);
+}
+
+bool CNNActivationCheckpointing::plan(uint64_t _memoryBudget)
+{
+    std::vector<bool> candidateCheckpoints;
+    if(_memoryBudget==CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET)
+    {
+        planSegments(0,candidateCheckpoints);
+        useCheckpoints(candidateCheckpoints);
+        return true;
+    }
+
+    // Every layer costs at least one operation, so the recomputation grows with the last checkpoint: the lowest one that fits is the cheapest
+    std::vector<bool> smallestCheckpoints;
+    uint64_t smallestPeakBytes=std::numeric_limits<uint64_t>::max();
+    for(uint32_t _lastCheckpoint=0;_lastCheckpoint<layerCount;_lastCheckpoint++)
+    {
+        uint64_t candidatePeakBytes=planSegments(_lastCheckpoint,candidateCheckpoints);
+        if(candidatePeakBytes<=_memoryBudget)
+        {
+            useCheckpoints(candidateCheckpoints);
+            return true;
+        }
+        if(candidatePeakBytes<smallestPeakBytes)
+        {
+            smallestPeakBytes=candidatePeakBytes;
+            smallestCheckpoints=candidateCheckpoints;
+        }
+    }
+
+    useCheckpoints(smallestCheckpoints);
+    return false;
+}
+
+void CNNActivationCheckpointing::setCheckpoints(const std::vector<uint32_t> &checkpointLayers)
+{
+    std::vector<bool> _checkpoints(layerCount,false);
+    _checkpoints[0]=true;
+    for(uint32_t checkpoint=0;checkpoint<checkpointLayers.size();checkpoint++)
+    {
+        if(checkpointLayers[checkpoint]>=layerCount)
+            throw;
+        _checkpoints[checkpointLayers[checkpoint]]=true;
+    }
+    useCheckpoints(_checkpoints);
+}
+
+void CNNActivationCheckpointing::useCheckpoints(const std::vector<bool> &_checkpoints)
+{
+    checkpoints=_checkpoints;
+    lastCheckpoint=0;
+    recomputedOperationCount=0;
+    for(uint32_t layerIndex=1;layerIndex<layerCount;layerIndex++)
+    {
+        if(checkpoints[layerIndex])
+            lastCheckpoint=layerIndex;
+    }
+    for(uint32_t layerIndex=0;layerIndex<lastCheckpoint;layerIndex++)
+        recomputedOperationCount+=getOperationCount(layers[layerIndex]);
+    peakBytes=getPeakBytes(checkpoints);
+}
+
+uint64_t CNNActivationCheckpointing::planSegments(uint32_t _lastCheckpoint, std::vector<bool> &_checkpoints)
+{
+    // A single segment below the last checkpoint always fits its own peak; the smallest peak that fits is searched below it
+    std::vector<bool> singleSegmentCheckpoints(layerCount,false);
+    singleSegmentCheckpoints[0]=true;
+    singleSegmentCheckpoints[_lastCheckpoint]=true;
+    uint64_t lowerPeakBytes=0;
+    uint64_t upperPeakBytes=getPeakBytes(singleSegmentCheckpoints);
+    while(lowerPeakBytes<upperPeakBytes)
+    {
+        uint64_t middlePeakBytes=lowerPeakBytes+(upperPeakBytes-lowerPeakBytes)/2;
+        if(fitSegments(_lastCheckpoint,middlePeakBytes,_checkpoints))
+            upperPeakBytes=middlePeakBytes;
+        else
+            lowerPeakBytes=middlePeakBytes+1;
+    }
+    fitSegments(_lastCheckpoint,upperPeakBytes,_checkpoints);
+    return getPeakBytes(_checkpoints);
+}
+
+bool CNNActivationCheckpointing::fitSegments(uint32_t _lastCheckpoint, uint64_t _peakBytes, std::vector<bool> &_checkpoints)
+{
+    // contextBytes[layer]: bytes of the contexts of all layers below "layer"
+    std::vector<uint64_t> contextBytes(layerCount+1,0);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        contextBytes[layerIndex+1]=contextBytes[layerIndex]+getContextBytes(layers[layerIndex]);
+    uint64_t lastSegmentBytes=contextBytes[layerCount]-contextBytes[_lastCheckpoint];
+
+    // checkpointBytes[layer]: fewest bytes of checkpoint inputs up to a checkpoint at "layer" (including its own) with all segments below within _peakBytes
+    const uint64_t unreachable=std::numeric_limits<uint64_t>::max();
+    std::vector<uint64_t> checkpointBytes(_lastCheckpoint+1,unreachable);
+    std::vector<uint32_t> previousCheckpoints(_lastCheckpoint+1,0);
+    checkpointBytes[0]=0;
+    if(_lastCheckpoint==0&&lastSegmentBytes>_peakBytes)
+        return false;
+
+    for(uint32_t checkpoint=1;checkpoint<=_lastCheckpoint;checkpoint++)
+    {
+        for(uint32_t previousCheckpoint=0;previousCheckpoint<checkpoint;previousCheckpoint++)
+        {
+            if(checkpointBytes[previousCheckpoint]==unreachable)
+                continue;
+            // The segment from previousCheckpoint is recomputed while its checkpoint input and the ones below are kept
+            uint64_t segmentBytes=contextBytes[checkpoint]-contextBytes[previousCheckpoint];
+            if(checkpointBytes[previousCheckpoint]+segmentBytes>_peakBytes)
+                continue;
+            // The last segment keeps its state from the forward pass (no checkpoint input), while the checkpoint inputs below are kept
+            uint64_t reachedBytes=checkpointBytes[previousCheckpoint];
+            if(checkpoint==_lastCheckpoint)
+            {
+                if(reachedBytes+lastSegmentBytes>_peakBytes)
+                    continue;
+            }
+            else
+            {
+                CNNLayer *checkpointLayer=layers[checkpoint];
+                reachedBytes+=getArrayBytes(checkpointLayer->previousLayerFeatureMapCount,checkpointLayer->previousLayerSingleFeatureMapHeight,
+                                            checkpointLayer->previousLayerSingleFeatureMapWidth);
+            }
+            if(reachedBytes<checkpointBytes[checkpoint])
+            {
+                checkpointBytes[checkpoint]=reachedBytes;
+                previousCheckpoints[checkpoint]=previousCheckpoint;
+            }
+        }
+    }
+    if(checkpointBytes[_lastCheckpoint]==unreachable)
+        return false;
+
+    _checkpoints.assign(layerCount,false);
+    for(uint32_t checkpoint=_lastCheckpoint;;checkpoint=previousCheckpoints[checkpoint])
+    {
+        _checkpoints[checkpoint]=true;
+        if(checkpoint==0)
+            break;
+    }
+    return true;
+}
+
+uint64_t CNNActivationCheckpointing::getPeakBytes(const std::vector<bool> &_checkpoints)
+{
+    // While a segment is recomputed and run backward, its contexts and the checkpoint inputs up to its own are stored; at the end of the forward pass,
+    // the contexts of the last segment and all checkpoint inputs below it
+    uint64_t _peakBytes=0;
+    uint64_t checkpointBytes=0;
+    uint64_t segmentBytes=0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        if(layerIndex>0&&_checkpoints[layerIndex])
+        {
+            _peakBytes=__max(_peakBytes,checkpointBytes+segmentBytes);
+            segmentBytes=0;
+            CNNLayer *checkpointLayer=layers[layerIndex];
+            checkpointBytes+=getArrayBytes(checkpointLayer->previousLayerFeatureMapCount,checkpointLayer->previousLayerSingleFeatureMapHeight,
+                                           checkpointLayer->previousLayerSingleFeatureMapWidth);
+        }
+        segmentBytes+=getContextBytes(layers[layerIndex]);
+    }
+
+    // The input of the last checkpoint isn't kept
+    uint32_t _lastCheckpoint=0;
+    for(uint32_t layerIndex=1;layerIndex<layerCount;layerIndex++)
+    {
+        if(_checkpoints[layerIndex])
+            _lastCheckpoint=layerIndex;
+    }
+    if(_lastCheckpoint>0)
+    {
+        CNNLayer *checkpointLayer=layers[_lastCheckpoint];
+        checkpointBytes-=getArrayBytes(checkpointLayer->previousLayerFeatureMapCount,checkpointLayer->previousLayerSingleFeatureMapHeight,
+                                       checkpointLayer->previousLayerSingleFeatureMapWidth);
+    }
+    return __max(_peakBytes,checkpointBytes+segmentBytes);
+}
+
+void CNNActivationCheckpointing::trainStep(double ***image, uint8_t label, CNNOptimizer *optimizer, double ***&output, double &loss)
+{
+    CNNTrainingStep step(layers,layerCount);
+    step.forwardFinished=[this](uint32_t layerIndex,double ***input)
+    {
+        if(layerIndex<lastCheckpoint)
+            layers[layerIndex]->freeContext(layers[layerIndex]->defaultContext); // The mode and the DROPOUT pass number are kept for the recomputation
+        if(layerIndex>0&&checkpoints[layerIndex]&&layerIndex<lastCheckpoint)
+        {
+            checkpointInputs[layerIndex]=input;
+            return true;
+        }
+        return false;
+    };
+    step.backwardStarting=[this,image](uint32_t layerIndex)
+    {
+        // The highest layer of a segment below the last one: the segment gets its state back
+        if(layerIndex<lastCheckpoint&&checkpoints[layerIndex+1])
+            recomputeSegment(layerIndex,image);
+    };
+    step.backwardFinished=[this](uint32_t layerIndex)
+    {
+        layers[layerIndex]->freeContext(layers[layerIndex]->defaultContext);
+    };
+    output=step.run(image,label,optimizer,loss);
+}
+
+void CNNActivationCheckpointing::recomputeSegment(uint32_t layerIndex, double ***image)
+{
+    uint32_t checkpoint=layerIndex;
+    while(!checkpoints[checkpoint])
+        checkpoint--;
+
+    // The layers of the segment haven't been updated yet, so they calculate the same state as in the forward pass
+    double ***previousLayerOutput=checkpoint==0?image:checkpointInputs[checkpoint];
+    for(uint32_t segmentLayerIndex=checkpoint;segmentLayerIndex<=layerIndex;segmentLayerIndex++)
+    {
+        CNNLayer *thisLayer=layers[segmentLayerIndex];
+        thisLayer->defaultContext.recomputation=true;
+        double ***layerOutput=thisLayer->forwardPass(previousLayerOutput);
+        thisLayer->defaultContext.recomputation=false;
+
+        if(segmentLayerIndex>0)
+            CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+        previousLayerOutput=layerOutput;
+    }
+    checkpointInputs[checkpoint]=0;
+
+    // The output is the input of the next segment, whose backward pass is done
+    CNNLayer::freeArray(previousLayerOutput,layers[layerIndex]->featureMapCount,layers[layerIndex]->singleFeatureMapHeight);
+}
+
+uint64_t CNNActivationCheckpointing::getArrayBytes(uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    return (uint64_t)zDimension*(sizeof(double**)+yDimension*(sizeof(double*)+xDimension*sizeof(double)));
+}
+
+uint64_t CNNActivationCheckpointing::getContextBytes(CNNLayer *layer)
+{
+    // See what forwardPass stores in CNNLayerContext for each layer type
+    uint64_t inputBytes=getArrayBytes(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth);
+    uint64_t outputBytes=getArrayBytes(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+
+    if(layer->type==CNN_LAYER_TYPE_CONV||layer->type==CNN_LAYER_TYPE_FC)
+    {
+        if(layer->stashPrecision!=CNN_STASH_PRECISION_DOUBLE)
+            inputBytes=(uint64_t)layer->previousLayerFeatureMapCount*layer->previousLayerSingleFeatureMapHeight*layer->previousLayerSingleFeatureMapWidth*sizeof(uint16_t);
+        return inputBytes;
+    }
+    else if(layer->type==CNN_LAYER_TYPE_MAXPOOL)
+        return inputBytes; // maxPixelMatrix
+    else if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        return inputBytes;
+    else if(layer->type==CNN_LAYER_TYPE_RELU)
+        return outputBytes;
+    else if(layer->type==CNN_LAYER_TYPE_SOFTMAX)
+        return inputBytes+outputBytes;
+    else if(layer->type==CNN_LAYER_TYPE_DROPOUT)
+        return (uint64_t)layer->featureMapCount*layer->dropoutMaskWordCount*sizeof(uint64_t);
+    else
+        return 0;
+}
+
+uint64_t CNNActivationCheckpointing::getOperationCount(CNNLayer *layer)
+{
+    uint64_t inputValueCount=(uint64_t)layer->previousLayerFeatureMapCount*layer->previousLayerSingleFeatureMapHeight*layer->previousLayerSingleFeatureMapWidth;
+    if(layer->type==CNN_LAYER_TYPE_CONV)
+        return (uint64_t)layer->featureMapCount*layer->singleFeatureMapHeight*layer->singleFeatureMapWidth*layer->previousLayerFeatureMapCount*layer->totalReceptiveFieldSize;
+    else if(layer->type==CNN_LAYER_TYPE_FC)
+        return inputValueCount*layer->featureMapCount;
+    else
+        return inputValueCount;
+}
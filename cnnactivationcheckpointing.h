@@ -0,0 +1,72 @@
+#ifndef CNNACTIVATIONCHECKPOINTING_H
+#define CNNACTIVATIONCHECKPOINTING_H
+
+#define CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET 0 // Memory budget that keeps all activations (no recomputation)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <limits>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnntrainingstep.h"
+
+// Gradient checkpointing (activation recomputation) for training on one example at a time (like TrainingThread's sequential loop):
+// only the inputs of the checkpoint layers are kept during the forward pass, the state every other layer stores for the backward pass
+// (see CNNLayerContext) is freed right away and recomputed from the nearest checkpoint below when the backward pass reaches it.
+// The layers from one checkpoint to the next one are a segment. The last segment (from the last checkpoint to the output) keeps its state
+// from the forward pass; every other segment runs forward once more (in recomputation mode, so BATCHNORM running statistics and DROPOUT masks
+// are the same as without checkpointing), then backward, and is freed before the next segment below is recomputed. Layer 0 is always a
+// checkpoint (its input is the image, which the caller keeps anyway).
+// The diffs of a layer are applied as soon as they are calculated; a recomputed segment is always below the layers updated so far, so it
+// sees the same weights as the original forward pass and the result is bit-identical to training without checkpointing.
+// Memory in bytes counts the arrays stored between the passes (contexts and checkpoint inputs, see getContextBytes); the arrays passed from
+// one layer to the next, the diffs and the weights come on top.
+
+class CNNActivationCheckpointing
+{
+public:
+    CNNLayer **layers;
+    uint32_t layerCount;
+    std::vector<bool> checkpoints; // Dimensions: layer; true: the input of the layer is kept during the forward pass (the first layer of a segment)
+    uint32_t lastCheckpoint; // First layer of the last segment (0: nothing is recomputed)
+    uint64_t peakBytes; // Most bytes stored at any time during a training step with the current checkpoints
+    uint64_t recomputedOperationCount; // Multiply-adds (or comparisons etc., see getOperationCount) repeated per training step
+    uint64_t operationCount; // Of one forward pass through all layers
+
+    std::vector<double***> checkpointInputs; // Dimensions: layer; input of a checkpoint layer during a training step (0 for layer 0 and lastCheckpoint, whose state is kept)
+
+    // Plans the checkpoints for _memoryBudget bytes (see plan)
+    CNNActivationCheckpointing(CNNLayer **_layers,uint32_t _layerCount,uint64_t _memoryBudget);
+
+    // Chooses the checkpoints that recompute the fewest operations with peakBytes<=_memoryBudget (the lowest last checkpoint that fits, with the lowest
+    // peakBytes for it; only the layers below the last checkpoint are recomputed, each of them once); returns false
+    // if no choice fits, and uses the checkpoints with the lowest peakBytes then. CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET: no recomputation.
+    // Plan again after changing the stash precision of a layer (it changes the size of the contexts).
+    bool plan(uint64_t _memoryBudget);
+    // Uses the given checkpoints instead of planned ones (layer 0 is added if it is missing)
+    void setCheckpoints(const std::vector<uint32_t> &checkpointLayers);
+    // Sets the checkpoints and the statistics derived from them
+    void useCheckpoints(const std::vector<bool> &_checkpoints);
+    // Smallest peakBytes of the checkpoints whose last one is _lastCheckpoint; stores them in _checkpoints
+    uint64_t planSegments(uint32_t _lastCheckpoint,std::vector<bool> &_checkpoints);
+    // Whether checkpoints with the last one at _lastCheckpoint and peakBytes<=_peakBytes exist: each checkpoint is reached with the fewest
+    // checkpoint input bytes below it (every later segment only gets cheaper with fewer), stored in _checkpoints if they exist
+    bool fitSegments(uint32_t _lastCheckpoint,uint64_t _peakBytes,std::vector<bool> &_checkpoints);
+    uint64_t getPeakBytes(const std::vector<bool> &_checkpoints);
+
+    // CNNTrainingStep for one example, with the contexts below the last checkpoint freed during the forward pass and recomputed by the backward pass; returns
+    // the output of the last layer (calculated before the update, to be freed by the caller) and the cross-entropy loss of the example (0 if the last layer isn't a SOFTMAX layer)
+    void trainStep(double ***image,uint8_t label,CNNOptimizer *optimizer,double ***&output,double &loss);
+    // Runs the layers from the checkpoint below "layerIndex" up to "layerIndex" forward again (restores their contexts) and frees the checkpoint input
+    void recomputeSegment(uint32_t layerIndex,double ***image);
+
+    static uint64_t getArrayBytes(uint32_t zDimension,int32_t yDimension,int32_t xDimension); // Of an array allocated by CNNLayer::allocArray
+    // Bytes a layer stores in a training context between its forward and its backward pass
+    static uint64_t getContextBytes(CNNLayer *layer);
+    // Multiply-adds of a CONV or FC forward pass; one operation per input value for the other layer types
+    static uint64_t getOperationCount(CNNLayer *layer);
+};
+
+#endif // CNNACTIVATIONCHECKPOINTING_H
@@ -0,0 +1,159 @@
+#include "cnncheckpoint.h"
+
+bool CNNCheckpoint::save(const char *fileName, CNNLayer **layers, uint32_t layerCount)
+{
+    std::string temporaryFileName=std::string(fileName)+".tmp";
+    FILE *f=fopen(temporaryFileName.c_str(),"wb");
+    if(f==0)
+        return false;
+
+    uint32_t header[3]={CNN_CHECKPOINT_MAGIC,CNN_CHECKPOINT_VERSION,layerCount};
+    bool ok=fwrite(header,sizeof(uint32_t),3,f)==3;
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount&&ok;layerIndex++)
+    {
+        CNNLayer *layer=layers[layerIndex];
+        int32_t geometry[12]={(int32_t)layer->layerId,layer->type,(int32_t)layer->featureMapCount,layer->receptiveFieldWidth,layer->receptiveFieldHeight,
+                              (int32_t)layer->strideX,(int32_t)layer->strideY,layer->zeroPaddingX,layer->zeroPaddingY,
+                              (int32_t)layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapWidth,layer->previousLayerSingleFeatureMapHeight};
+        ok=fwrite(geometry,sizeof(int32_t),12,f)==12;
+
+        if(ok&&layer->hasWeights())
+        {
+            ok=fwrite(CNNLayer::getWeightTypeArrayData(layer->weights),sizeof(double),layer->weightCount,f)==layer->weightCount
+                &&fwrite(layer->biasWeights,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount;
+        }
+        if(ok&&layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            ok=fwrite(layer->runningMeans,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount
+                &&fwrite(layer->runningVariances,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount;
+        }
+        if(ok&&layer->type==CNN_LAYER_TYPE_DROPOUT)
+            ok=fwrite(&layer->dropoutRate,sizeof(double),1,f)==1;
+    }
+
+    ok=fclose(f)==0&&ok;
+    if(!ok)
+    {
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(fileName); // rename doesn't replace existing files on Windows
+#endif
+    return rename(temporaryFileName.c_str(),fileName)==0;
+}
+
+CNNLayer **CNNCheckpoint::load(const char *fileName, uint32_t &layerCount)
+{
+    FILE *f=fopen(fileName,"rb");
+    if(f==0)
+        return 0;
+
+    uint32_t header[3];
+    if(fread(header,sizeof(uint32_t),3,f)!=3||header[0]!=CNN_CHECKPOINT_MAGIC||header[1]<1||header[1]>CNN_CHECKPOINT_VERSION||header[2]==0)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    // Bytes after the header, checked against the sizes each layer claims
+    fseek(f,0,SEEK_END);
+    long fileSize=ftell(f);
+    fseek(f,3*sizeof(uint32_t),SEEK_SET);
+    uint64_t remainingBytes=fileSize>(long)(3*sizeof(uint32_t))?(uint64_t)fileSize-3*sizeof(uint32_t):0;
+    if(header[2]>remainingBytes/(12*sizeof(int32_t)))
+    {
+        fclose(f);
+        return 0;
+    }
+
+    layerCount=header[2];
+    CNNLayer **layers=(CNNLayer**)calloc(layerCount,sizeof(CNNLayer*));
+    bool ok=true;
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount&&ok;layerIndex++)
+    {
+        int32_t geometry[12];
+        if(fread(geometry,sizeof(int32_t),12,f)!=12)
+        {
+            ok=false;
+            break;
+        }
+        remainingBytes-=12*sizeof(int32_t);
+
+        // Every layer must fit onto the layer below it
+        if(layerIndex>0)
+        {
+            CNNLayer *previousLayer=layers[layerIndex-1];
+            if((uint32_t)geometry[9]!=previousLayer->featureMapCount||geometry[10]!=previousLayer->singleFeatureMapWidth||geometry[11]!=previousLayer->singleFeatureMapHeight)
+            {
+                ok=false;
+                break;
+            }
+        }
+
+        // The constructor throws on parameters it doesn't accept, and a corrupt file must not allocate more than it holds
+        if(!CNNLayer::isValidGeometry((uint8_t)geometry[1],geometry[2],geometry[3],geometry[4],geometry[5],geometry[6],geometry[7],geometry[8],geometry[9],geometry[10],geometry[11])
+            ||getStoredValueCount(geometry,header[1])*sizeof(double)>remainingBytes)
+        {
+            ok=false;
+            break;
+        }
+        remainingBytes-=getStoredValueCount(geometry,header[1])*sizeof(double);
+
+        // The seed doesn't matter, since the weights are overwritten below
+        layers[layerIndex]=new CNNLayer(geometry[0],(uint8_t)geometry[1],geometry[2],geometry[3],geometry[4],geometry[5],geometry[6],geometry[7],geometry[8],geometry[9],geometry[10],geometry[11],0);
+        CNNLayer *layer=layers[layerIndex];
+
+        if(layer->hasWeights())
+        {
+            ok=fread(CNNLayer::getWeightTypeArrayData(layer->weights),sizeof(double),layer->weightCount,f)==layer->weightCount
+                &&fread(layer->biasWeights,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount;
+        }
+        if(ok&&layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            ok=fread(layer->runningMeans,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount
+                &&fread(layer->runningVariances,sizeof(double),layer->featureMapCount,f)==layer->featureMapCount;
+        }
+        if(ok&&layer->type==CNN_LAYER_TYPE_DROPOUT&&header[1]>=3)
+        {
+            double dropoutRate;
+            ok=fread(&dropoutRate,sizeof(double),1,f)==1&&dropoutRate>=0.0&&dropoutRate<1.0; // (setDropoutRate throws otherwise)
+            if(ok)
+                layer->setDropoutRate(dropoutRate);
+        }
+    }
+
+    fclose(f);
+
+    if(!ok)
+    {
+        freeLayers(layers,layerCount);
+        return 0;
+    }
+    return layers;
+}
+
+uint64_t CNNCheckpoint::getStoredValueCount(const int32_t *geometry, uint32_t version)
+{
+    uint64_t featureMapCount=(uint32_t)geometry[2];
+    uint64_t previousLayerFeatureMapCount=(uint32_t)geometry[9];
+    if(geometry[1]==CNN_LAYER_TYPE_CONV)
+        return previousLayerFeatureMapCount*featureMapCount*(uint64_t)geometry[4]*(uint64_t)geometry[3]+featureMapCount;
+    else if(geometry[1]==CNN_LAYER_TYPE_FC)
+        return previousLayerFeatureMapCount*(uint64_t)geometry[11]*(uint64_t)geometry[10]*featureMapCount+featureMapCount;
+    else if(geometry[1]==CNN_LAYER_TYPE_BATCHNORM)
+        return 4*featureMapCount; // Weights, bias weights, running means and running variances
+    else if(geometry[1]==CNN_LAYER_TYPE_DROPOUT&&version>=3)
+        return 1;
+    return 0;
+}
+
+void CNNCheckpoint::freeLayers(CNNLayer **layers, uint32_t layerCount)
+{
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex]; // May be 0 if loading failed
+    free(layers);
+}
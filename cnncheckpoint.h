@@ -0,0 +1,31 @@
+#ifndef CNNCHECKPOINT_H
+#define CNNCHECKPOINT_H
+
+#define CNN_CHECKPOINT_MAGIC 0x434E4E43 // "CNNC"
+#define CNN_CHECKPOINT_VERSION 3 // Version 2 added BATCHNORM layers, version 3 the DROPOUT rate; older files can still be loaded (DROPOUT layers get CNN_DROPOUT_DEFAULT_RATE)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cnnlayer.h"
+
+// Saves and loads the geometry, weights and bias weights of a network (optimizer state is not stored).
+// File format (native byte order): magic, version, layer count (uint32_t each), then for each layer the constructor parameters
+// (layer id, type, feature map count, receptive field width/height, stride x/y, zero padding x/y, previous layer feature map count/width/height),
+// followed by weightCount weights and featureMapCount bias weights (doubles) for CONV, FC and BATCHNORM layers,
+// featureMapCount running means and featureMapCount running variances (doubles) for BATCHNORM layers, and the dropout rate (double) for DROPOUT layers.
+
+class CNNCheckpoint
+{
+public:
+    // Writes to a temporary file that replaces fileName when complete, so a crash never leaves a truncated checkpoint behind.
+    static bool save(const char *fileName,CNNLayer **layers,uint32_t layerCount);
+    // Returns 0 if the file can't be read or is not a valid checkpoint
+    static CNNLayer **load(const char *fileName,uint32_t &layerCount);
+    // Doubles stored after the geometry of a layer in a file of the given version (as read from a file: only valid after CNNLayer::isValidGeometry)
+    static uint64_t getStoredValueCount(const int32_t *geometry,uint32_t version);
+    static void freeLayers(CNNLayer **layers,uint32_t layerCount);
+};
+
+#endif // CNNCHECKPOINT_H
@@ -0,0 +1,174 @@
+#include "cnnconvtuner.h"
+
+CNNConvTuner::CNNConvTuner(const char *_cacheFileName, bool _includeFFT)
+{
+    cacheFileName=_cacheFileName;
+    includeFFT=_includeFFT;
+    cpuModel=getCpuModel();
+    tuningsChanged=false;
+    load();
+}
+
+void CNNConvTuner::tune(CNNLayer **_layers, uint32_t _layerCount)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+    {
+        CNNLayer *layer=_layers[layerIndex];
+        // NHWC CONV layers have one kernel only (see CNNLayer::tensorLayout)
+        if(layer->type!=CNN_LAYER_TYPE_CONV||layer->tensorLayout!=CNN_TENSOR_LAYOUT_NCHW)
+            continue;
+
+        std::string key=getKey(layer);
+        std::map<std::string,CNNConvTuning>::iterator tuning=tunings.find(key);
+        if(tuning==tunings.end())
+        {
+            tuning=tunings.insert(std::pair<std::string,CNNConvTuning>(key,benchmark(layer))).first;
+            tuningsChanged=true;
+        }
+        layer->setConvAlgorithm(tuning->second.convAlgorithm,tuning->second.convGrain);
+    }
+
+    if(tuningsChanged&&save())
+        tuningsChanged=false;
+}
+
+CNNConvTuning CNNConvTuner::benchmark(CNNLayer *layer)
+{
+    CNNLayer *benchmarkLayer=layer->clone();
+    benchmarkLayer->setThreadPool(layer->threadPool);
+    double ***input=CNNLayer::allocArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth);
+    CNNLayerContext context=CNNLayerContext();
+    uint32_t maxGrain=layer->threadPool!=0?__min(CNN_CONV_TUNER_MAX_GRAIN,layer->featureMapCount):1;
+
+    CNNConvTuning bestTuning={CNN_CONV_ALGORITHM_DIRECT,1};
+    double bestSeconds=std::numeric_limits<double>::max();
+    for(uint8_t convAlgorithm=1;convAlgorithm<=CNN_CONV_ALGORITHM_COUNT;convAlgorithm++)
+    {
+        if(convAlgorithm==CNN_CONV_ALGORITHM_FFT&&!includeFFT)
+            continue;
+        for(uint32_t convGrain=1;convGrain<=maxGrain;convGrain*=2)
+        {
+            benchmarkLayer->setConvAlgorithm(convAlgorithm,convGrain);
+            // The first pass warms up the caches and wakes up the pool workers
+            double seconds=std::numeric_limits<double>::max();
+            for(uint32_t repetition=0;repetition<=CNN_CONV_TUNER_REPETITION_COUNT;repetition++)
+            {
+                benchmarkLayer->invalidateWeightTransforms();
+                std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+                double ***output=benchmarkLayer->forwardPass(input,context);
+                double repetitionSeconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+                CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+                if(repetition>0&&repetitionSeconds<seconds)
+                    seconds=repetitionSeconds;
+            }
+            if(seconds<bestSeconds)
+            {
+                bestSeconds=seconds;
+                bestTuning.convAlgorithm=convAlgorithm;
+                bestTuning.convGrain=convGrain;
+            }
+        }
+    }
+
+    benchmarkLayer->freeContext(context);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete benchmarkLayer;
+    return bestTuning;
+}
+
+std::string CNNConvTuner::getKey(CNNLayer *layer)
+{
+    // CPU model|feature maps,receptive field,stride,zero padding,previous layer feature maps,previous layer feature map size,pool workers,FFT candidate
+    char shape[256];
+    snprintf(shape,sizeof(shape),"%u,%dx%d,%ux%u,%dx%d,%u,%dx%d,%u,%s",layer->featureMapCount,layer->receptiveFieldWidth,layer->receptiveFieldHeight,
+             layer->strideX,layer->strideY,layer->zeroPaddingX,layer->zeroPaddingY,layer->previousLayerFeatureMapCount,
+             layer->previousLayerSingleFeatureMapWidth,layer->previousLayerSingleFeatureMapHeight,layer->threadPool!=0?layer->threadPool->getWorkerCount():0,
+             includeFFT?"fft":"exact");
+    return cpuModel+"|"+shape;
+}
+
+bool CNNConvTuner::load()
+{
+    FILE *f=fopen(cacheFileName.c_str(),"r");
+    if(f==0)
+        return false;
+
+    char line[1024];
+    if(fgets(line,sizeof(line),f)==0||strncmp(line,CNN_CONV_TUNER_CACHE_HEADER,strlen(CNN_CONV_TUNER_CACHE_HEADER))!=0)
+    {
+        fclose(f);
+        return false;
+    }
+
+    while(fgets(line,sizeof(line),f)!=0)
+    {
+        // The key may contain spaces (CPU model), but no tabs
+        char *separator=strrchr(line,'\t');
+        unsigned int convAlgorithm;
+        unsigned int convGrain;
+        if(separator==0||sscanf(separator+1,"%u %u",&convAlgorithm,&convGrain)!=2||convAlgorithm<1||convAlgorithm>CNN_CONV_ALGORITHM_COUNT||convGrain==0)
+            continue;
+        CNNConvTuning tuning={(uint8_t)convAlgorithm,convGrain};
+        tunings[std::string(line,separator-line)]=tuning;
+    }
+    fclose(f);
+    return true;
+}
+
+bool CNNConvTuner::save()
+{
+    std::string temporaryFileName=cacheFileName+".tmp";
+    FILE *f=fopen(temporaryFileName.c_str(),"w");
+    if(f==0)
+        return false;
+
+    // Entries of other CPUs are kept, so that one cache file can be shared by several machines
+    bool ok=fprintf(f,"%s\n",CNN_CONV_TUNER_CACHE_HEADER)>0;
+    for(std::map<std::string,CNNConvTuning>::iterator tuning=tunings.begin();tuning!=tunings.end()&&ok;tuning++)
+        ok=fprintf(f,"%s\t%u %u\n",tuning->first.c_str(),(unsigned int)tuning->second.convAlgorithm,tuning->second.convGrain)>0;
+
+    ok=fclose(f)==0&&ok;
+    if(!ok)
+    {
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(cacheFileName.c_str()); // rename doesn't replace existing files on Windows
+#endif
+    return rename(temporaryFileName.c_str(),cacheFileName.c_str())==0;
+}
+
+std::string CNNConvTuner::getCpuModel()
+{
+    // The brand string is stored in the registers of the extended leaves 0x80000002-0x80000004 (16 characters each)
+    uint32_t brand[13]={0};
+#if defined(__i386__)||defined(__x86_64__)
+    unsigned int maxLeaf=__get_cpuid_max(0x80000000,0);
+    if(maxLeaf<0x80000004)
+        return "unknown";
+    for(uint32_t leaf=0;leaf<3;leaf++)
+        __get_cpuid(0x80000002+leaf,&brand[4*leaf],&brand[4*leaf+1],&brand[4*leaf+2],&brand[4*leaf+3]);
+#elif defined(_M_IX86)||defined(_M_X64)
+    int registers[4];
+    __cpuid(registers,0x80000000);
+    if((uint32_t)registers[0]<0x80000004)
+        return "unknown";
+    for(uint32_t leaf=0;leaf<3;leaf++)
+        __cpuid((int*)&brand[4*leaf],0x80000002+leaf);
+#else
+    return "unknown";
+#endif
+
+    // Trim the padding and replace the characters used by the file format
+    std::string model=std::string((char*)brand);
+    for(uint32_t character=0;character<model.size();character++)
+    {
+        if(model[character]=='|'||model[character]=='\t'||model[character]=='\n')
+            model[character]=' ';
+    }
+    size_t start=model.find_first_not_of(' ');
+    size_t end=model.find_last_not_of(' ');
+    return start==std::string::npos?"unknown":model.substr(start,end-start+1);
+}
@@ -0,0 +1,68 @@
+#ifndef CNNCONVTUNER_H
+#define CNNCONVTUNER_H
+
+#define CNN_CONV_TUNER_CACHE_HEADER "# CNN conv tuning cache v2: CPU model|layer shape<TAB>algorithm grain" // First line of the cache file
+#define CNN_CONV_TUNER_REPETITION_COUNT 5 // Timed passes per candidate (the fastest one counts, which filters out interruptions)
+#define CNN_CONV_TUNER_MAX_GRAIN 8 // Candidate grains: 1, 2, 4, ... feature maps per task (only 1 without a thread pool)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <chrono>
+
+#if defined(__i386__)||defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(_M_IX86)||defined(_M_X64)
+#include <intrin.h>
+#endif
+
+#include "cnnlayer.h"
+
+// Fastest settings found for a layer shape
+struct CNNConvTuning
+{
+    uint8_t convAlgorithm; // See CNN_CONV_ALGORITHM_DIRECT
+    uint32_t convGrain;
+};
+
+// Picks the fastest conv algorithm and grain (see CNNLayer::setConvAlgorithm) for every CONV layer of a network by timing forward passes
+// of all candidates the first time a layer shape is seen. The winners are stored in a text file, keyed by the CPU model, the layer shape
+// and the amount of workers of the layer's thread pool, so later runs on the same machine pick them up without benchmarking.
+// DIRECT and ROWS produce bit-identical results, so choosing between them never changes what the network calculates, only how fast. FFT differs
+// from them by rounding errors (see CNN_CONV_ALGORITHM_FFT), so it is only a candidate if the tuner is created with _includeFFT (not for runs
+// that must be reproducible bit for bit); whether it was a candidate is part of the key.
+// The network is trained on single examples, so unlike for batched convolutions the batch size is not part of the shape.
+
+class CNNConvTuner
+{
+public:
+    std::string cacheFileName;
+    std::string cpuModel;
+    std::map<std::string,CNNConvTuning> tunings; // Key: see getKey
+    bool tuningsChanged; // Since the cache file was loaded
+    bool includeFFT;
+
+    // Loads the cache file if it exists
+    CNNConvTuner(const char *_cacheFileName,bool _includeFFT);
+
+    // Sets the algorithm and grain of every NCHW CONV layer, benchmarking the shapes that are not in the cache yet, and saves the cache if new shapes were tuned.
+    // The layers must not be used by other threads while tune runs (the benchmarks use clones, but the settings are changed in place).
+    void tune(CNNLayer **_layers,uint32_t _layerCount);
+    // Times forward passes of all candidates on a clone of the layer (with the layer's thread pool). The FFT passes include transforming the filters,
+    // since training changes the weights before every pass.
+    CNNConvTuning benchmark(CNNLayer *layer);
+    std::string getKey(CNNLayer *layer);
+
+    // Returns false if the file doesn't exist or has another header (e.g. an older version); unreadable lines are skipped
+    bool load();
+    // Written to a temporary file that replaces the cache file when complete (like CNNCheckpoint::save)
+    bool save();
+
+    // The brand string of the CPU (from CPUID on x86), or "unknown"
+    static std::string getCpuModel();
+};
+
+#endif // CNNCONVTUNER_H
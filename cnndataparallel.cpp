@@ -0,0 +1,306 @@
+#include "cnndataparallel.h"
+
+CNNDataParallelTrainer::CNNDataParallelTrainer(CNNLayer **_layers, uint32_t _layerCount, double ****_images, uint8_t *_labels, uint32_t _imageCount, uint32_t _workerCount, uint32_t _synchronizationInterval, uint64_t _seed)
+{
+    if(!isValidConfiguration(_layerCount,_imageCount,_workerCount,_synchronizationInterval))
+        throw;
+
+    layers=_layers;
+    layerCount=_layerCount;
+    images=_images;
+    labels=_labels;
+    imageCount=_imageCount;
+    synchronizationInterval=_synchronizationInterval;
+    seed=_seed;
+    parameterCount=getParameterCount(layers,layerCount);
+
+    optimizer=0;
+    imageIds=0;
+    outputs=0;
+    losses=0;
+    phase=0;
+    phaseGeneration=0;
+    pendingWorkerCount=0;
+
+    uint32_t workerCount=_workerCount>0?_workerCount:topology.getCoreCount();
+
+    uint32_t nodeCount=topology.getNodeCount();
+    nodeParameters.assign(nodeCount,(double*)0);
+    nodeWorkerCounts.assign(nodeCount,0);
+
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+    {
+        CNNDataParallelWorker *worker=new CNNDataParallelWorker();
+        worker->node=workerIndex%nodeCount;
+        std::vector<uint32_t> &cores=topology.nodeCores[worker->node];
+        worker->core=cores[(workerIndex/nodeCount)%cores.size()];
+        worker->nodeLeader=workerIndex<nodeCount;
+        worker->layers=0;
+        worker->sampler=0;
+        worker->optimizer=0;
+        worker->optimizerType=0;
+        worker->seenPhaseGeneration=0;
+        nodeWorkerCounts[worker->node]++;
+        workers.push_back(worker);
+    }
+
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+        workers[workerIndex]->thread=std::thread(&CNNDataParallelTrainer::workerMain,this,workerIndex);
+
+    // The samplers are created by the workers (on their nodes)
+    runPhase(CNN_DATA_PARALLEL_PHASE_INIT);
+}
+
+CNNDataParallelTrainer::~CNNDataParallelTrainer()
+{
+    runPhase(CNN_DATA_PARALLEL_PHASE_STOP);
+    for(uint32_t workerIndex=0;workerIndex<workers.size();workerIndex++)
+    {
+        CNNDataParallelWorker *worker=workers[workerIndex];
+        worker->thread.join();
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            delete worker->layers[layerIndex];
+        free(worker->layers);
+        delete worker->sampler;
+        delete worker->optimizer;
+        delete worker;
+    }
+    for(uint32_t node=0;node<nodeParameters.size();node++)
+        free(nodeParameters[node]);
+}
+
+bool CNNDataParallelTrainer::isValidConfiguration(uint32_t _layerCount, uint32_t _imageCount, uint32_t _workerCount, uint32_t _synchronizationInterval)
+{
+    uint32_t workerCount=_workerCount>0?_workerCount:CNNNumaTopology().getCoreCount();
+    return _layerCount>0&&_synchronizationInterval>0&&workerCount<=_imageCount;
+}
+
+uint32_t CNNDataParallelTrainer::getParameterCount(CNNLayer **_layers, uint32_t _layerCount)
+{
+    uint32_t count=0;
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=_layers[layerIndex];
+        if(thisLayer->hasWeights())
+            count+=thisLayer->weightCount+thisLayer->featureMapCount;
+        if(thisLayer->type==CNN_LAYER_TYPE_BATCHNORM)
+            count+=2*thisLayer->featureMapCount; // Running statistics
+    }
+    return count;
+}
+
+void CNNDataParallelTrainer::getParameters(CNNLayer **_layers, uint32_t _layerCount, double *parameters)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=_layers[layerIndex];
+        if(!thisLayer->hasWeights())
+            continue;
+        memcpy(parameters,CNNLayer::getWeightTypeArrayData(thisLayer->weights),thisLayer->weightCount*sizeof(double));
+        parameters+=thisLayer->weightCount;
+        memcpy(parameters,thisLayer->biasWeights,thisLayer->featureMapCount*sizeof(double));
+        parameters+=thisLayer->featureMapCount;
+        if(thisLayer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            // The running statistics are averaged like the parameters
+            memcpy(parameters,thisLayer->runningMeans,thisLayer->featureMapCount*sizeof(double));
+            parameters+=thisLayer->featureMapCount;
+            memcpy(parameters,thisLayer->runningVariances,thisLayer->featureMapCount*sizeof(double));
+            parameters+=thisLayer->featureMapCount;
+        }
+    }
+}
+
+void CNNDataParallelTrainer::setParameters(CNNLayer **_layers, uint32_t _layerCount, double *parameters)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=_layers[layerIndex];
+        if(!thisLayer->hasWeights())
+            continue;
+        memcpy(CNNLayer::getWeightTypeArrayData(thisLayer->weights),parameters,thisLayer->weightCount*sizeof(double));
+        parameters+=thisLayer->weightCount;
+        memcpy(thisLayer->biasWeights,parameters,thisLayer->featureMapCount*sizeof(double));
+        parameters+=thisLayer->featureMapCount;
+        if(thisLayer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            memcpy(thisLayer->runningMeans,parameters,thisLayer->featureMapCount*sizeof(double));
+            parameters+=thisLayer->featureMapCount;
+            memcpy(thisLayer->runningVariances,parameters,thisLayer->featureMapCount*sizeof(double));
+            parameters+=thisLayer->featureMapCount;
+        }
+        if(thisLayer->type==CNN_LAYER_TYPE_CONV)
+            thisLayer->invalidateWeightTransforms();
+    }
+}
+
+void CNNDataParallelTrainer::trainRound(CNNOptimizer *_optimizer, uint32_t *_imageIds, double ****_outputs, double *_losses)
+{
+    optimizer=_optimizer;
+    imageIds=_imageIds;
+    outputs=_outputs;
+    losses=_losses;
+
+    // Replicate the shared weights once per node
+    for(uint32_t node=0;node<nodeParameters.size();node++)
+    {
+        if(nodeParameters[node]!=0)
+            getParameters(layers,layerCount,nodeParameters[node]);
+    }
+
+    runPhase(CNN_DATA_PARALLEL_PHASE_TRAIN);
+    runPhase(CNN_DATA_PARALLEL_PHASE_REDUCE);
+
+    // Average the node replicas (weighted by the amount of workers of each node), in a fixed order
+    std::vector<double> average(parameterCount,0.0);
+    for(uint32_t node=0;node<nodeParameters.size();node++)
+    {
+        if(nodeParameters[node]==0)
+            continue;
+        double weight=((double)nodeWorkerCounts[node])/workers.size();
+        double *parameters=nodeParameters[node];
+        for(uint32_t parameter=0;parameter<parameterCount;parameter++)
+            average[parameter]+=weight*parameters[parameter];
+    }
+    setParameters(layers,layerCount,&average[0]);
+
+    optimizer->stepCount+=synchronizationInterval;
+}
+
+void CNNDataParallelTrainer::runPhase(uint8_t _phase)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    phase=_phase;
+    pendingWorkerCount=workers.size();
+    phaseGeneration++;
+    phaseStarted.notify_all();
+    while(pendingWorkerCount>0)
+        phaseFinished.wait(lock);
+}
+
+void CNNDataParallelTrainer::workerMain(uint32_t workerIndex)
+{
+    CNNDataParallelWorker *worker=workers[workerIndex];
+
+    for(;;)
+    {
+        uint8_t currentPhase;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while(phaseGeneration==worker->seenPhaseGeneration)
+                phaseStarted.wait(lock);
+            worker->seenPhaseGeneration=phaseGeneration;
+            currentPhase=phase;
+        }
+
+        if(currentPhase==CNN_DATA_PARALLEL_PHASE_INIT)
+            init(workerIndex);
+        else if(currentPhase==CNN_DATA_PARALLEL_PHASE_TRAIN)
+            train(workerIndex);
+        else if(currentPhase==CNN_DATA_PARALLEL_PHASE_REDUCE&&worker->nodeLeader)
+            reduce(workerIndex);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pendingWorkerCount--;
+            if(pendingWorkerCount==0)
+                phaseFinished.notify_all();
+        }
+
+        if(currentPhase==CNN_DATA_PARALLEL_PHASE_STOP)
+            return;
+    }
+}
+
+void CNNDataParallelTrainer::init(uint32_t workerIndex)
+{
+    CNNDataParallelWorker *worker=workers[workerIndex];
+    CNNNumaTopology::pinCurrentThreadToCore(worker->core);
+
+    // Everything allocated from here on is first touched by this thread, and therefore placed on its node
+    // (this includes the activations that forwardPass allocates while training).
+
+    worker->layers=(CNNLayer**)malloc(layerCount*sizeof(CNNLayer*));
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        worker->layers[layerIndex]=layers[layerIndex]->clone();
+        worker->layers[layerIndex]->setDropoutSeed(layers[layerIndex]->dropoutSeed+workerIndex); // Every replica drops different values
+    }
+
+    if(worker->nodeLeader)
+    {
+        // Written here (not just allocated), so the pages belong to this node
+        nodeParameters[worker->node]=(double*)malloc(parameterCount*sizeof(double));
+        getParameters(layers,layerCount,nodeParameters[worker->node]);
+    }
+
+    uint32_t shardFirstIndex,shardIndexCount;
+    CNNSampler::getShard(imageCount,workerIndex,workers.size(),shardFirstIndex,shardIndexCount);
+    worker->sampler=new CNNSampler(shardFirstIndex,shardIndexCount,seed+workerIndex);
+    worker->optimizer=new CNNOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.0,0.0,0.0); // The hyperparameters are copied at the beginning of each round
+
+    // The dataset was loaded by the main thread; migrate the shard to this node
+    if(topology.getNodeCount()>1)
+    {
+        uint32_t featureMapCount=layers[0]->previousLayerFeatureMapCount;
+        int32_t height=layers[0]->previousLayerSingleFeatureMapHeight;
+        std::vector<void*> addresses;
+        for(uint32_t image=shardFirstIndex;image<shardFirstIndex+shardIndexCount;image++)
+        {
+            addresses.push_back(images[image]);
+            for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+            {
+                addresses.push_back(images[image][featureMap]);
+                for(int32_t y=0;y<height;y++)
+                    addresses.push_back(images[image][featureMap][y]);
+            }
+        }
+        CNNNumaTopology::moveToNode(addresses,worker->node); // Only an optimization; the data stays usable if it fails
+    }
+}
+
+void CNNDataParallelTrainer::train(uint32_t workerIndex)
+{
+    CNNDataParallelWorker *worker=workers[workerIndex];
+
+    setParameters(worker->layers,layerCount,nodeParameters[worker->node]);
+
+    if(worker->optimizerType!=optimizer->type)
+    {
+        // The optimizer state of one optimizer type is meaningless to another one
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            worker->layers[layerIndex]->resetOptimizerState();
+        worker->optimizerType=optimizer->type;
+    }
+    *worker->optimizer=*optimizer; // Hyperparameters and step count
+
+    CNNTrainingStep step(worker->layers,layerCount);
+    for(uint32_t example=0;example<synchronizationInterval;example++)
+    {
+        uint32_t imageId=worker->sampler->next();
+        worker->optimizer->beginStep();
+        uint32_t exampleInRound=workerIndex*synchronizationInterval+example;
+        imageIds[exampleInRound]=imageId;
+        outputs[exampleInRound]=step.run(images[imageId],labels[imageId],worker->optimizer,losses[exampleInRound]);
+    }
+}
+
+void CNNDataParallelTrainer::reduce(uint32_t workerIndex)
+{
+    // All workers of the node are on this node, so this doesn't cross sockets
+    CNNDataParallelWorker *worker=workers[workerIndex];
+    double *average=nodeParameters[worker->node];
+    std::vector<double> parameters(parameterCount);
+    double weight=1.0/nodeWorkerCounts[worker->node];
+
+    memset(average,0,parameterCount*sizeof(double));
+    for(uint32_t otherWorkerIndex=0;otherWorkerIndex<workers.size();otherWorkerIndex++)
+    {
+        CNNDataParallelWorker *otherWorker=workers[otherWorkerIndex];
+        if(otherWorker->node!=worker->node)
+            continue;
+        getParameters(otherWorker->layers,layerCount,&parameters[0]);
+        for(uint32_t parameter=0;parameter<parameterCount;parameter++)
+            average[parameter]+=weight*parameters[parameter];
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef CNNDATAPARALLEL_H
+#define CNNDATAPARALLEL_H
+
+#define CNN_DATA_PARALLEL_PHASE_INIT 1 // Pin the thread, create the replica, move the dataset shard to the local node
+#define CNN_DATA_PARALLEL_PHASE_TRAIN 2 // Load the weights from the node replica, train on the own shard
+#define CNN_DATA_PARALLEL_PHASE_REDUCE 3 // Node leaders only: average the weights of the workers of their node into the node replica
+#define CNN_DATA_PARALLEL_PHASE_STOP 4
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnntrainingstep.h"
+#include "cnnsampler.h"
+#include "cnnnuma.h"
+
+struct CNNDataParallelWorker
+{
+    uint32_t node;
+    uint32_t core;
+    bool nodeLeader; // The first worker of each node maintains the node replica
+    CNNLayer **layers; // Own replica (allocated on the own node)
+    CNNSampler *sampler; // Own shard of the dataset
+    CNNOptimizer *optimizer;
+    uint8_t optimizerType; // Type the optimizer state of the replica belongs to
+    std::thread thread;
+    uint64_t seenPhaseGeneration;
+};
+
+// Data-parallel training on all cores, NUMA-aware:
+// every worker is pinned to a core, trains its own replica of the network on its own shard of the dataset (which is migrated to the worker's node),
+// and allocates its activations on its own node (first touch). The weights are replicated once per node.
+// Every synchronizationInterval examples per worker, the weights are averaged (local SGD / periodic model averaging): first within each node
+// into the node replica, then across the node replicas into the shared layers - the only memory traffic between the sockets is one copy
+// of the weights per node and round. The next round starts from the average.
+
+class CNNDataParallelTrainer
+{
+public:
+    CNNNumaTopology topology;
+    CNNLayer **layers; // The shared layers (used by the GUI); receive the average after each round
+    uint32_t layerCount;
+    double ****images;
+    uint8_t *labels;
+    uint32_t imageCount;
+    uint32_t synchronizationInterval; // Examples per worker and round
+    uint64_t seed;
+
+    std::vector<CNNDataParallelWorker*> workers;
+    uint32_t parameterCount; // Weights and bias weights of all layers
+    std::vector<double*> nodeParameters; // Node replicas (flat, allocated by the node leader)
+    std::vector<uint32_t> nodeWorkerCounts;
+
+    // Current round
+    CNNOptimizer *optimizer;
+    uint32_t *imageIds; // Dimensions: worker -> example in round
+    double ****outputs;
+    double *losses;
+
+    // Phase barrier
+    std::mutex mutex;
+    std::condition_variable phaseStarted;
+    std::condition_variable phaseFinished;
+    uint8_t phase;
+    uint64_t phaseGeneration;
+    uint32_t pendingWorkerCount;
+
+    // _workerCount=0: one worker per core. The workers are distributed round-robin over the nodes. The configuration must be valid (see isValidConfiguration).
+    CNNDataParallelTrainer(CNNLayer **_layers,uint32_t _layerCount,double ****_images,uint8_t *_labels,uint32_t _imageCount,uint32_t _workerCount,uint32_t _synchronizationInterval,uint64_t _seed);
+    ~CNNDataParallelTrainer();
+    // Every worker needs at least one example of its own, and at least one example per round
+    static bool isValidConfiguration(uint32_t _layerCount,uint32_t _imageCount,uint32_t _workerCount,uint32_t _synchronizationInterval);
+
+    static uint32_t getParameterCount(CNNLayer **_layers,uint32_t _layerCount);
+    static void getParameters(CNNLayer **_layers,uint32_t _layerCount,double *parameters);
+    static void setParameters(CNNLayer **_layers,uint32_t _layerCount,double *parameters);
+
+    // Trains workers.size()*synchronizationInterval examples. _optimizer provides the hyperparameters; its stepCount advances by synchronizationInterval.
+    // _imageIds, _outputs and _losses receive the examples (worker by worker); the outputs are to be freed by the caller.
+    void trainRound(CNNOptimizer *_optimizer,uint32_t *_imageIds,double ****_outputs,double *_losses);
+
+    void runPhase(uint8_t _phase);
+    void workerMain(uint32_t workerIndex);
+    void init(uint32_t workerIndex);
+    void train(uint32_t workerIndex);
+    void reduce(uint32_t workerIndex);
+};
+
+#endif // CNNDATAPARALLEL_H
@@ -0,0 +1,503 @@
+#include "cnndistributed.h"
+
+CNNRingAllReduce::CNNRingAllReduce(uint32_t _rank, uint32_t _worldSize)
+{
+    if(_worldSize==0||_rank>=_worldSize)
+        throw;
+    rank=_rank;
+    worldSize=_worldSize;
+    listenSocket=-1;
+    nextSocket=-1;
+    previousSocket=-1;
+    receiveBuffer=0;
+    receiveBufferSize=0;
+    pendingRequestCount=0;
+    failed=false;
+    stopRequested=false;
+}
+
+CNNRingAllReduce::~CNNRingAllReduce()
+{
+    disconnect();
+    free(receiveBuffer);
+}
+
+bool CNNRingAllReduce::connect(const std::vector<std::string> &hosts, uint16_t basePort, uint32_t timeoutMs)
+{
+    if(hosts.size()!=worldSize||thread.joinable())
+        throw;
+
+    if(worldSize>1)
+    {
+#ifdef _WIN32
+        return false;
+#else
+        std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::now()+std::chrono::milliseconds(timeoutMs);
+        uint32_t nextRank=(rank+1)%worldSize;
+        uint32_t previousRank=(rank+worldSize-1)%worldSize;
+
+        // Listen on the own host's address (so a ring on 127.0.0.1 isn't reachable from other machines)
+        addrinfo hints;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family=AF_UNSPEC;
+        hints.ai_socktype=SOCK_STREAM;
+        hints.ai_flags=AI_PASSIVE;
+        char port[16];
+        snprintf(port,sizeof(port),"%u",(unsigned int)(basePort+rank));
+        addrinfo *addresses;
+        if(getaddrinfo(hosts[rank].c_str(),port,&hints,&addresses)!=0)
+            return false;
+        for(addrinfo *address=addresses;address!=0&&listenSocket<0;address=address->ai_next)
+        {
+            listenSocket=socket(address->ai_family,address->ai_socktype,address->ai_protocol);
+            if(listenSocket<0)
+                continue;
+            int reuseAddress=1;
+            setsockopt(listenSocket,SOL_SOCKET,SO_REUSEADDR,&reuseAddress,sizeof(reuseAddress));
+            if(bind(listenSocket,address->ai_addr,address->ai_addrlen)!=0||listen(listenSocket,4)!=0)
+                closeSocket(listenSocket);
+        }
+        freeaddrinfo(addresses);
+        if(listenSocket<0)
+            return false;
+
+        // Connect to the next rank, which may not have started yet (a connection is accepted into the backlog of its listening socket,
+        // so every rank can connect before it accepts, without waiting for the others)
+        snprintf(port,sizeof(port),"%u",(unsigned int)(basePort+nextRank));
+        hints.ai_flags=0;
+        while(nextSocket<0)
+        {
+            if(getaddrinfo(hosts[nextRank].c_str(),port,&hints,&addresses)==0)
+            {
+                for(addrinfo *address=addresses;address!=0&&nextSocket<0;address=address->ai_next)
+                {
+                    nextSocket=socket(address->ai_family,address->ai_socktype,address->ai_protocol);
+                    if(nextSocket>=0&&::connect(nextSocket,address->ai_addr,address->ai_addrlen)!=0)
+                        closeSocket(nextSocket);
+                }
+                freeaddrinfo(addresses);
+            }
+            if(nextSocket<0)
+            {
+                if(std::chrono::steady_clock::now()>=deadline)
+                {
+                    disconnect();
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(CNN_DISTRIBUTED_CONNECT_RETRY_MS));
+            }
+        }
+        uint32_t handshake[3]={CNN_DISTRIBUTED_HANDSHAKE_MAGIC,rank,worldSize};
+        if(!sendAll(nextSocket,handshake,sizeof(handshake)))
+        {
+            disconnect();
+            return false;
+        }
+
+        // Accept the previous rank (connections of anything else are closed)
+        while(previousSocket<0)
+        {
+            int64_t remainingMs=std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+            pollfd listenPoll={listenSocket,POLLIN,0};
+            int pollResult=remainingMs>0?poll(&listenPoll,1,(int)remainingMs):0;
+            if(pollResult<0&&errno==EINTR)
+                continue;
+            if(pollResult<=0)
+            {
+                disconnect();
+                return false;
+            }
+            previousSocket=accept(listenSocket,0,0);
+            if(previousSocket<0)
+                continue;
+            uint32_t previousHandshake[3];
+            if(!receiveAll(previousSocket,previousHandshake,sizeof(previousHandshake))||previousHandshake[0]!=CNN_DISTRIBUTED_HANDSHAKE_MAGIC
+                    ||previousHandshake[1]!=previousRank||previousHandshake[2]!=worldSize)
+                closeSocket(previousSocket);
+        }
+        closeSocket(listenSocket);
+
+        // Small chunks (the bias weights of a layer) are sent at once; exchange needs non-blocking sockets
+        int sockets[2]={nextSocket,previousSocket};
+        for(uint32_t socketIndex=0;socketIndex<2;socketIndex++)
+        {
+            int noDelay=1;
+            setsockopt(sockets[socketIndex],IPPROTO_TCP,TCP_NODELAY,&noDelay,sizeof(noDelay));
+#ifdef SO_NOSIGPIPE
+            int noSigPipe=1;
+            setsockopt(sockets[socketIndex],SOL_SOCKET,SO_NOSIGPIPE,&noSigPipe,sizeof(noSigPipe));
+#endif
+            fcntl(sockets[socketIndex],F_SETFL,fcntl(sockets[socketIndex],F_GETFL,0)|O_NONBLOCK);
+        }
+#endif
+    }
+
+    failed=false;
+    stopRequested=false;
+    thread=std::thread(&CNNRingAllReduce::threadMain,this);
+    return true;
+}
+
+void CNNRingAllReduce::disconnect()
+{
+    if(thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopRequested=true;
+        }
+        requestQueued.notify_all();
+        thread.join();
+    }
+    closeSocket(listenSocket);
+    closeSocket(nextSocket);
+    closeSocket(previousSocket);
+}
+
+bool CNNRingAllReduce::allReduce(double *values, uint32_t count)
+{
+    startAllReduce(values,count);
+    return finishAllReduces();
+}
+
+void CNNRingAllReduce::startAllReduce(double *values, uint32_t count)
+{
+    CNNAllReduceRequest request={values,count};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(request);
+        pendingRequestCount++;
+    }
+    requestQueued.notify_one();
+}
+
+bool CNNRingAllReduce::finishAllReduces()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    requestsFinished.wait(lock,[this]{return pendingRequestCount==0;});
+    return !failed;
+}
+
+bool CNNRingAllReduce::broadcast(double *values, uint32_t count, uint32_t sourceRank)
+{
+    // The sum of the source's values and zeros
+    if(rank!=sourceRank)
+        memset(values,0,count*sizeof(double));
+    return allReduce(values,count);
+}
+
+void CNNRingAllReduce::threadMain()
+{
+    for(;;)
+    {
+        CNNAllReduceRequest request;
+        bool skip;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            requestQueued.wait(lock,[this]{return stopRequested||!requests.empty();});
+            if(requests.empty())
+                return;
+            request=requests.front();
+            requests.pop_front();
+            // After a failure the ranks may be at different steps of the ring, so nothing that is sent can be trusted anymore
+            skip=failed;
+        }
+
+        bool ok=!skip&&reduce(request.values,request.count);
+        if(!ok)
+        {
+            // The neighbors see the closed connections and fail, too, instead of waiting for data that never comes (and so on around the ring)
+            closeSocket(nextSocket);
+            closeSocket(previousSocket);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(!ok)
+                failed=true;
+            pendingRequestCount--;
+        }
+        requestsFinished.notify_all();
+    }
+}
+
+bool CNNRingAllReduce::reduce(double *values, uint32_t count)
+{
+    if(worldSize==1)
+        return true;
+
+    uint32_t largestChunkCount=(count+worldSize-1)/worldSize;
+    if(largestChunkCount>receiveBufferSize)
+    {
+        free(receiveBuffer);
+        receiveBuffer=(double*)malloc(largestChunkCount*sizeof(double));
+        receiveBufferSize=largestChunkCount;
+    }
+
+    // Reduce-scatter: in step s, chunk rank-s goes to the next rank, which adds it to its own; afterwards this rank holds the sum of chunk rank+1
+    for(uint32_t step=0;step<worldSize-1;step++)
+    {
+        uint32_t sendChunkFirst,sendChunkCount,receiveChunkFirst,receiveChunkCount;
+        getChunk(count,(rank+worldSize-step)%worldSize,sendChunkFirst,sendChunkCount);
+        getChunk(count,(rank+2*worldSize-step-1)%worldSize,receiveChunkFirst,receiveChunkCount);
+        if(!exchange(values+sendChunkFirst,sendChunkCount*sizeof(double),receiveBuffer,receiveChunkCount*sizeof(double)))
+            return false;
+        double *chunk=values+receiveChunkFirst;
+        for(uint32_t index=0;index<receiveChunkCount;index++)
+            chunk[index]+=receiveBuffer[index];
+    }
+
+    // All-gather: in step s, the sum of chunk rank+1-s goes to the next rank, which replaces its own
+    for(uint32_t step=0;step<worldSize-1;step++)
+    {
+        uint32_t sendChunkFirst,sendChunkCount,receiveChunkFirst,receiveChunkCount;
+        getChunk(count,(rank+1+worldSize-step)%worldSize,sendChunkFirst,sendChunkCount);
+        getChunk(count,(rank+worldSize-step)%worldSize,receiveChunkFirst,receiveChunkCount);
+        if(!exchange(values+sendChunkFirst,sendChunkCount*sizeof(double),values+receiveChunkFirst,receiveChunkCount*sizeof(double)))
+            return false;
+    }
+    return true;
+}
+
+bool CNNRingAllReduce::exchange(const void *sendData, uint32_t sendSize, void *receiveData, uint32_t receiveSize)
+{
+#ifdef _WIN32
+    return false;
+#else
+#ifdef MSG_NOSIGNAL
+    const int sendFlags=MSG_NOSIGNAL; // A closed connection is reported as an error instead of killing the process
+#else
+    const int sendFlags=0; // SO_NOSIGPIPE (see connect)
+#endif
+    uint32_t sentSize=0;
+    uint32_t receivedSize=0;
+    std::chrono::steady_clock::time_point progressTime=std::chrono::steady_clock::now(); // Of the last send or receive that moved data
+    while(sentSize<sendSize||receivedSize<receiveSize)
+    {
+        pollfd polls[2];
+        uint32_t pollCount=0;
+        if(sentSize<sendSize)
+            polls[pollCount++]={nextSocket,POLLOUT,0};
+        if(receivedSize<receiveSize)
+            polls[pollCount++]={previousSocket,POLLIN,0};
+        int64_t remainingMs=CNN_DISTRIBUTED_EXCHANGE_TIMEOUT_MS-std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-progressTime).count();
+        int pollResult=remainingMs>0?poll(polls,pollCount,(int)remainingMs):0;
+        if(pollResult<0&&errno==EINTR)
+            continue;
+        if(pollResult<=0)
+            return false; // Error or timeout
+
+        for(uint32_t pollIndex=0;pollIndex<pollCount;pollIndex++)
+        {
+            if(polls[pollIndex].revents==0)
+                continue;
+            if(polls[pollIndex].fd==nextSocket)
+            {
+                ssize_t size=send(nextSocket,(const char*)sendData+sentSize,sendSize-sentSize,sendFlags);
+                if(size<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR)
+                    return false;
+                if(size>0)
+                {
+                    sentSize+=size;
+                    progressTime=std::chrono::steady_clock::now();
+                }
+            }
+            else
+            {
+                ssize_t size=recv(previousSocket,(char*)receiveData+receivedSize,receiveSize-receivedSize,0);
+                if(size==0||(size<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR))
+                    return false; // The previous rank closed the connection or it broke
+                if(size>0)
+                {
+                    receivedSize+=size;
+                    progressTime=std::chrono::steady_clock::now();
+                }
+            }
+        }
+    }
+    return true;
+#endif
+}
+
+void CNNRingAllReduce::getChunk(uint32_t count, uint32_t chunk, uint32_t &chunkFirst, uint32_t &chunkCount)
+{
+    chunkFirst=(uint32_t)((uint64_t)count*chunk/worldSize);
+    chunkCount=(uint32_t)((uint64_t)count*(chunk+1)/worldSize)-chunkFirst;
+}
+
+bool CNNRingAllReduce::sendAll(int socket, const void *data, uint32_t size)
+{
+#ifdef _WIN32
+    return false;
+#else
+    uint32_t sentSize=0;
+    while(sentSize<size)
+    {
+        ssize_t sent=send(socket,(const char*)data+sentSize,size-sentSize,0);
+        if(sent<0&&errno==EINTR)
+            continue;
+        if(sent<=0)
+            return false;
+        sentSize+=sent;
+    }
+    return true;
+#endif
+}
+
+bool CNNRingAllReduce::receiveAll(int socket, void *data, uint32_t size)
+{
+#ifdef _WIN32
+    return false;
+#else
+    uint32_t receivedSize=0;
+    while(receivedSize<size)
+    {
+        ssize_t received=recv(socket,(char*)data+receivedSize,size-receivedSize,0);
+        if(received<0&&errno==EINTR)
+            continue;
+        if(received<=0)
+            return false;
+        receivedSize+=received;
+    }
+    return true;
+#endif
+}
+
+void CNNRingAllReduce::closeSocket(int &socket)
+{
+#ifndef _WIN32
+    if(socket>=0)
+        close(socket);
+#endif
+    socket=-1;
+}
+
+CNNDistributedTrainer::CNNDistributedTrainer(CNNLayer **_layers, uint32_t _layerCount, double ****_images, uint8_t *_labels, uint32_t _imageCount, CNNRingAllReduce *_ring, uint64_t _seed)
+{
+    layers=_layers;
+    layerCount=_layerCount;
+    images=_images;
+    labels=_labels;
+    ring=_ring;
+    lossSum=0.0;
+    meanLoss=0.0;
+
+    uint32_t shardFirstIndex;
+    uint32_t shardIndexCount;
+    CNNSampler::getShard(_imageCount,ring->rank,ring->worldSize,shardFirstIndex,shardIndexCount);
+    sampler=new CNNSampler(shardFirstIndex,shardIndexCount,_seed+ring->rank);
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        diffBuckets.push_back(thisLayer->hasWeights()?(double*)malloc((thisLayer->weightCount+thisLayer->featureMapCount)*sizeof(double)):0);
+        if(thisLayer->type==CNN_LAYER_TYPE_DROPOUT)
+            thisLayer->setDropoutSeed(thisLayer->dropoutSeed+ring->rank); // Every rank drops different values (like the replicas of CNNDataParallelTrainer)
+    }
+}
+
+CNNDistributedTrainer::~CNNDistributedTrainer()
+{
+    delete sampler;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        free(diffBuckets[layerIndex]);
+}
+
+bool CNNDistributedTrainer::synchronizeParameters()
+{
+    uint32_t parameterCount=CNNDataParallelTrainer::getParameterCount(layers,layerCount);
+    double *parameters=(double*)malloc(parameterCount*sizeof(double));
+    CNNDataParallelTrainer::getParameters(layers,layerCount,parameters);
+    bool ok=ring->broadcast(parameters,parameterCount,0);
+    if(ok)
+        CNNDataParallelTrainer::setParameters(layers,layerCount,parameters);
+    free(parameters);
+    return ok;
+}
+
+bool CNNDistributedTrainer::trainStep(CNNOptimizer *optimizer, uint32_t &imageId, double ***&output, double &loss)
+{
+    // CNNTrainingStep, except that the updates wait for the all-reduces of the diffs
+
+    imageId=sampler->next();
+
+    std::vector<double****> weightDiffs(layerCount,(double****)0);
+    std::vector<double*> biasDiffs(layerCount,(double*)0);
+    CNNTrainingStep step(layers,layerCount);
+    step.diffsCalculated=[this,&weightDiffs,&biasDiffs](uint32_t layerIndex,double ****_weightDiffs,double *_biasDiffs)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        if(layerIndex==layerCount-1)
+        {
+            lossSum=thisLayer->type==CNN_LAYER_TYPE_SOFTMAX?thisLayer->defaultContext.loss:0.0;
+            ring->startAllReduce(&lossSum,1);
+        }
+
+        // Sent while the layers below calculate their diffs
+        if(_weightDiffs!=0)
+        {
+            double *bucket=diffBuckets[layerIndex];
+            memcpy(bucket,CNNLayer::getWeightTypeArrayData(_weightDiffs),thisLayer->weightCount*sizeof(double));
+            memcpy(bucket+thisLayer->weightCount,_biasDiffs,thisLayer->featureMapCount*sizeof(double));
+            ring->startAllReduce(bucket,thisLayer->weightCount+thisLayer->featureMapCount);
+        }
+        weightDiffs[layerIndex]=_weightDiffs;
+        biasDiffs[layerIndex]=_biasDiffs;
+        return true;
+    };
+    output=step.run(images[imageId],labels[imageId],optimizer,loss);
+
+    bool ok=ring->finishAllReduces();
+    if(ok)
+        meanLoss=lossSum/ring->worldSize;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        if(weightDiffs[layerIndex]==0)
+            continue;
+        if(ok)
+        {
+            // The mean over all ranks (the same on every rank, since the sums are bit-identical)
+            double *bucket=diffBuckets[layerIndex];
+            double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs[layerIndex]);
+            for(uint32_t weight=0;weight<thisLayer->weightCount;weight++)
+                weightDiffData[weight]=bucket[weight]/ring->worldSize;
+            for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+                biasDiffs[layerIndex][featureMap]=bucket[thisLayer->weightCount+featureMap]/ring->worldSize;
+            thisLayer->applyDiffs(weightDiffs[layerIndex],biasDiffs[layerIndex],optimizer);
+        }
+        thisLayer->freeWeightDiffs(weightDiffs[layerIndex]);
+        CNNLayer::freeBiasTypeArray(biasDiffs[layerIndex]);
+    }
+    return ok;
+}
+
+bool CNNDistributedTrainer::averageRunningStatistics()
+{
+    std::vector<double> statistics;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        if(thisLayer->type!=CNN_LAYER_TYPE_BATCHNORM)
+            continue;
+        statistics.insert(statistics.end(),thisLayer->runningMeans,thisLayer->runningMeans+thisLayer->featureMapCount);
+        statistics.insert(statistics.end(),thisLayer->runningVariances,thisLayer->runningVariances+thisLayer->featureMapCount);
+    }
+    if(statistics.empty())
+        return true;
+    if(!ring->allReduce(&statistics[0],statistics.size()))
+        return false;
+
+    uint32_t position=0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        if(thisLayer->type!=CNN_LAYER_TYPE_BATCHNORM)
+            continue;
+        for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+            thisLayer->runningMeans[featureMap]=statistics[position++]/ring->worldSize;
+        for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+            thisLayer->runningVariances[featureMap]=statistics[position++]/ring->worldSize;
+    }
+    return true;
+}
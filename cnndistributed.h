@@ -0,0 +1,144 @@
+#ifndef CNNDISTRIBUTED_H
+#define CNNDISTRIBUTED_H
+
+#define CNN_DISTRIBUTED_DEFAULT_BASE_PORT 29500 // Rank r listens on basePort+r
+#define CNN_DISTRIBUTED_CONNECT_TIMEOUT_MS 60000 // How long a rank waits for its neighbors to start
+#define CNN_DISTRIBUTED_CONNECT_RETRY_MS 50
+#define CNN_DISTRIBUTED_EXCHANGE_TIMEOUT_MS 300000 // How long a send or receive may make no progress before the connection counts as failed (a neighbor may still be busy with its own step)
+#define CNN_DISTRIBUTED_HANDSHAKE_MAGIC 0x434E4E52U // "CNNR", followed by the rank and the world size of the connecting process
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnnsampler.h"
+#include "cnndataparallel.h"
+#include "cnntrainingstep.h"
+
+// Values of an all-reduce that was started but may not have finished yet
+struct CNNAllReduceRequest
+{
+    double *values;
+    uint32_t count;
+};
+
+// Sums arrays of doubles across worldSize processes (ranks) connected in a ring over TCP: every rank sends to the next rank and receives from
+// the previous one. The array is split into worldSize chunks; in worldSize-1 reduce-scatter steps every chunk travels once around the ring
+// and collects the sum, in worldSize-1 all-gather steps the sums are passed on. Every rank sends and receives 2*(worldSize-1)/worldSize times the
+// array, independently of the amount of ranks. The chunks are always added up in the same order, so all ranks receive bit-identical sums and runs
+// with the same world size are reproducible.
+// The values are sent in the byte order of the machine (all ranks must run on the same architecture). POSIX sockets only (Linux, macOS);
+// connect fails elsewhere.
+// All-reduces run on a communication thread in the order they are started, which must be the same on all ranks; so the caller can
+// keep calculating while earlier arrays are being reduced.
+
+class CNNRingAllReduce
+{
+public:
+    uint32_t rank;
+    uint32_t worldSize;
+    int listenSocket;
+    int nextSocket; // Sends to rank+1
+    int previousSocket; // Receives from rank-1
+    double *receiveBuffer; // One chunk (grows with the largest one)
+    uint32_t receiveBufferSize;
+
+    // Communication thread
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable requestQueued;
+    std::condition_variable requestsFinished;
+    std::deque<CNNAllReduceRequest> requests;
+    uint32_t pendingRequestCount; // Queued or running
+    bool failed; // A send or receive failed; all later requests fail, too
+    bool stopRequested;
+
+    CNNRingAllReduce(uint32_t _rank,uint32_t _worldSize);
+    ~CNNRingAllReduce();
+
+    // Listens on basePort+rank and connects to the next rank at hosts[(rank+1)%worldSize]:basePort+rank+1 (retrying until the rank has started),
+    // then starts the communication thread. hosts: one host name or address per rank. Returns false on errors or after timeoutMs.
+    // Nothing to connect for a world size of 1.
+    bool connect(const std::vector<std::string> &hosts,uint16_t basePort,uint32_t timeoutMs);
+    void disconnect();
+
+    // Sums values over all ranks (in place) and returns when done; false if the connection failed
+    bool allReduce(double *values,uint32_t count);
+    // Queues an all-reduce of values (in place); values must stay valid and unchanged until finishAllReduces returns
+    void startAllReduce(double *values,uint32_t count);
+    // Waits for all started all-reduces; false if any of them failed
+    bool finishAllReduces();
+    // values of rank "sourceRank" on all ranks
+    bool broadcast(double *values,uint32_t count,uint32_t sourceRank);
+
+    void threadMain();
+    bool reduce(double *values,uint32_t count);
+    // Sends to the next rank and receives from the previous one at the same time (a blocking send could wait for a rank that is itself blocked sending);
+    // false if the connection broke or nothing could be sent or received for CNN_DISTRIBUTED_EXCHANGE_TIMEOUT_MS (e.g. a rank hangs or its machine went away)
+    bool exchange(const void *sendData,uint32_t sendSize,void *receiveData,uint32_t receiveSize);
+    void getChunk(uint32_t count,uint32_t chunk,uint32_t &chunkFirst,uint32_t &chunkCount);
+
+    static bool sendAll(int socket,const void *data,uint32_t size);
+    static bool receiveAll(int socket,void *data,uint32_t size);
+    static void closeSocket(int &socket);
+};
+
+// Synchronous data-parallel training across processes: every rank trains on its own shard of the dataset, one example per step, and the weight
+// and bias weight diffs of all ranks are averaged before every update, so all replicas apply the same update and stay bit-identical (one step
+// is a batch of worldSize examples, like a batch of the pipeline).
+// Communication overlaps the backward pass: as soon as the diffs of a layer are calculated, their all-reduce is started, and the backward pass
+// continues with the layers below while they are sent (the diffs of a layer don't depend on the weights of the layers above after calculateDiffs,
+// so the updates can wait until all diffs are there).
+// Every rank keeps its own BATCHNORM running statistics; averageRunningStatistics averages them (e.g. before saving a checkpoint).
+// Unlike CNNDataParallelTrainer (threads in one process, periodic model averaging), the ranks can be separate processes, containers or machines.
+
+class CNNDistributedTrainer
+{
+public:
+    CNNLayer **layers;
+    uint32_t layerCount;
+    double ****images;
+    uint8_t *labels;
+    CNNRingAllReduce *ring;
+    CNNSampler *sampler; // Own shard of the dataset
+    std::vector<double*> diffBuckets; // Dimensions: layer -> weight diffs followed by bias weight diffs (0 for layers without weights)
+    double lossSum; // All-reduced with the diffs
+    // Mean loss of the examples of all ranks in the last step: the same on every rank, so schedules that depend on the loss (see
+    // CNNLearningRateSchedule::reportLoss) keep the ranks in sync
+    double meanLoss;
+
+    // The dataset is split into ring->worldSize shards (see CNNSampler::getShard); the DROPOUT layers of every rank draw their own masks
+    CNNDistributedTrainer(CNNLayer **_layers,uint32_t _layerCount,double ****_images,uint8_t *_labels,uint32_t _imageCount,CNNRingAllReduce *_ring,uint64_t _seed);
+    ~CNNDistributedTrainer();
+
+    // Replaces the parameters and running statistics of all ranks with those of rank 0 (call once before training, in case the ranks were initialized differently)
+    bool synchronizeParameters();
+    // Trains on the next example of the own shard and applies the diffs averaged over all ranks. Returns the id of the example, its output (calculated
+    // before the update, to be freed by the caller) and its cross-entropy loss; false if the communication failed (no update is applied then).
+    bool trainStep(CNNOptimizer *optimizer,uint32_t &imageId,double ***&output,double &loss);
+    bool averageRunningStatistics();
+};
+
+#endif // CNNDISTRIBUTED_H
@@ -0,0 +1,215 @@
+#include "cnnfft.h"
+
+CNNFFT::CNNFFT(uint32_t _size)
+{
+    if(!isPowerOfTwo(_size))
+        throw;
+    size=_size;
+
+    uint32_t bitCount=0;
+    while((1U<<bitCount)<size)
+        bitCount++;
+    bitReversedIndices=(uint32_t*)malloc(size*sizeof(uint32_t));
+    for(uint32_t index=0;index<size;index++)
+    {
+        uint32_t reversedIndex=0;
+        for(uint32_t bit=0;bit<bitCount;bit++)
+        {
+            if(index&(1U<<bit))
+                reversedIndex|=1U<<(bitCount-1-bit);
+        }
+        bitReversedIndices[index]=reversedIndex;
+    }
+
+    cosTable=(double*)malloc(__max(1U,size/2)*sizeof(double));
+    sinTable=(double*)malloc(__max(1U,size/2)*sizeof(double));
+    for(uint32_t k=0;k<size/2;k++)
+    {
+        cosTable[k]=cos(2.0*M_PI*k/size);
+        sinTable[k]=sin(2.0*M_PI*k/size);
+    }
+}
+
+CNNFFT::~CNNFFT()
+{
+    free(bitReversedIndices);
+    free(cosTable);
+    free(sinTable);
+}
+
+void CNNFFT::transform(double *real, double *imaginary, bool inverse)
+{
+    for(uint32_t index=0;index<size;index++)
+    {
+        uint32_t reversedIndex=bitReversedIndices[index];
+        if(index<reversedIndex)
+        {
+            double value=real[index];
+            real[index]=real[reversedIndex];
+            real[reversedIndex]=value;
+            value=imaginary[index];
+            imaginary[index]=imaginary[reversedIndex];
+            imaginary[reversedIndex]=value;
+        }
+    }
+
+    // Butterflies of the blocks of length 2, 4, ..., size; the twiddle of butterfly k in a block of length n is exp(-+2*pi*i*k/n)
+    double sign=inverse?1.0:-1.0;
+    for(uint32_t blockLength=2;blockLength<=size;blockLength*=2)
+    {
+        uint32_t halfBlockLength=blockLength/2;
+        uint32_t tableStep=size/blockLength;
+        for(uint32_t blockStart=0;blockStart<size;blockStart+=blockLength)
+        {
+            for(uint32_t k=0;k<halfBlockLength;k++)
+            {
+                double twiddleReal=cosTable[k*tableStep];
+                double twiddleImaginary=sign*sinTable[k*tableStep];
+                uint32_t a=blockStart+k;
+                uint32_t b=a+halfBlockLength;
+                double productReal=real[b]*twiddleReal-imaginary[b]*twiddleImaginary;
+                double productImaginary=real[b]*twiddleImaginary+imaginary[b]*twiddleReal;
+                real[b]=real[a]-productReal;
+                imaginary[b]=imaginary[a]-productImaginary;
+                real[a]+=productReal;
+                imaginary[a]+=productImaginary;
+            }
+        }
+    }
+}
+
+bool CNNFFT::isPowerOfTwo(uint32_t value)
+{
+    return value!=0&&(value&(value-1))==0;
+}
+
+uint32_t CNNFFT::getNextPowerOfTwo(uint32_t value)
+{
+    uint32_t powerOfTwo=1;
+    while(powerOfTwo<value)
+        powerOfTwo*=2;
+    return powerOfTwo;
+}
+
+CNNRealFFT2D::CNNRealFFT2D(uint32_t _width, uint32_t _height)
+{
+    if(_width<2||_height<2)
+        throw;
+    width=_width;
+    height=_height;
+    spectrumWidth=width/2+1;
+    spectrumSize=height*spectrumWidth;
+    rowFFT=new CNNFFT(width);
+    columnFFT=new CNNFFT(height);
+}
+
+CNNRealFFT2D::~CNNRealFFT2D()
+{
+    delete rowFFT;
+    delete columnFFT;
+}
+
+uint32_t CNNRealFFT2D::getScratchSize()
+{
+    return 2*__max(width,height);
+}
+
+void CNNRealFFT2D::forward(const double *input, double *spectrumReal, double *spectrumImaginary, double *scratch)
+{
+    double *real=scratch;
+    double *imaginary=scratch+__max(width,height);
+
+    // Rows y and y+1 as the real and imaginary part of z; their spectra a and b follow from the symmetry of real spectra:
+    // a[k]=(z[k]+conj(z[width-k]))/2, b[k]=(z[k]-conj(z[width-k]))/(2i)
+    for(uint32_t y=0;y<height;y+=2)
+    {
+        for(uint32_t x=0;x<width;x++)
+        {
+            real[x]=input[y*width+x];
+            imaginary[x]=input[(y+1)*width+x];
+        }
+        rowFFT->transform(real,imaginary,false);
+
+        double *rowReal=spectrumReal+y*spectrumWidth;
+        double *rowImaginary=spectrumImaginary+y*spectrumWidth;
+        for(uint32_t k=0;k<spectrumWidth;k++)
+        {
+            uint32_t mirroredK=(width-k)&(width-1);
+            rowReal[k]=0.5*(real[k]+real[mirroredK]);
+            rowImaginary[k]=0.5*(imaginary[k]-imaginary[mirroredK]);
+            rowReal[spectrumWidth+k]=0.5*(imaginary[k]+imaginary[mirroredK]);
+            rowImaginary[spectrumWidth+k]=-0.5*(real[k]-real[mirroredK]);
+        }
+    }
+
+    for(uint32_t k=0;k<spectrumWidth;k++)
+    {
+        for(uint32_t y=0;y<height;y++)
+        {
+            real[y]=spectrumReal[y*spectrumWidth+k];
+            imaginary[y]=spectrumImaginary[y*spectrumWidth+k];
+        }
+        columnFFT->transform(real,imaginary,false);
+        for(uint32_t y=0;y<height;y++)
+        {
+            spectrumReal[y*spectrumWidth+k]=real[y];
+            spectrumImaginary[y*spectrumWidth+k]=imaginary[y];
+        }
+    }
+}
+
+void CNNRealFFT2D::inverse(double *spectrumReal, double *spectrumImaginary, double *output, double *scratch)
+{
+    double *real=scratch;
+    double *imaginary=scratch+__max(width,height);
+
+    for(uint32_t k=0;k<spectrumWidth;k++)
+    {
+        for(uint32_t y=0;y<height;y++)
+        {
+            real[y]=spectrumReal[y*spectrumWidth+k];
+            imaginary[y]=spectrumImaginary[y*spectrumWidth+k];
+        }
+        columnFFT->transform(real,imaginary,true);
+        for(uint32_t y=0;y<height;y++)
+        {
+            spectrumReal[y*spectrumWidth+k]=real[y];
+            spectrumImaginary[y*spectrumWidth+k]=imaginary[y];
+        }
+    }
+
+    // The spectra a and b of the real rows y and y+1 are combined to z=a+i*b (the missing half of each follows from a[k]=conj(a[width-k])),
+    // so that the real part of the inverse of z is row y and the imaginary part is row y+1
+    double scale=1.0/(width*height);
+    for(uint32_t y=0;y<height;y+=2)
+    {
+        double *aReal=spectrumReal+y*spectrumWidth;
+        double *aImaginary=spectrumImaginary+y*spectrumWidth;
+        double *bReal=aReal+spectrumWidth;
+        double *bImaginary=aImaginary+spectrumWidth;
+        for(uint32_t k=0;k<width;k++)
+        {
+            uint32_t storedK=k<spectrumWidth?k:width-k;
+            double conjugateSign=k<spectrumWidth?1.0:-1.0;
+            real[k]=aReal[storedK]-conjugateSign*bImaginary[storedK];
+            imaginary[k]=conjugateSign*aImaginary[storedK]+bReal[storedK];
+        }
+        rowFFT->transform(real,imaginary,true);
+        for(uint32_t x=0;x<width;x++)
+        {
+            output[y*width+x]=real[x]*scale;
+            output[(y+1)*width+x]=imaginary[x]*scale;
+        }
+    }
+}
+
+void CNNRealFFT2D::multiplyAccumulate(double *accumulatorReal, double *accumulatorImaginary, const double *aReal, const double *aImaginary, const double *bReal, const double *bImaginary, bool conjugateB)
+{
+    double sign=conjugateB?-1.0:1.0;
+    for(uint32_t index=0;index<spectrumSize;index++)
+    {
+        double bImaginaryValue=sign*bImaginary[index];
+        accumulatorReal[index]+=aReal[index]*bReal[index]-aImaginary[index]*bImaginaryValue;
+        accumulatorImaginary[index]+=aReal[index]*bImaginaryValue+aImaginary[index]*bReal[index];
+    }
+}
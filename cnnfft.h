@@ -0,0 +1,65 @@
+#ifndef CNNFFT_H
+#define CNNFFT_H
+
+#ifndef _USE_MATH_DEFINES
+#define _USE_MATH_DEFINES
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "../_DefaultLibrary/text.h"
+
+// Iterative radix-2 FFT of complex values (real and imaginary parts in separate arrays) for one power-of-two size.
+// The tables are only read by transform, so one object can be used by several threads at the same time.
+
+class CNNFFT
+{
+public:
+    uint32_t size;
+    uint32_t *bitReversedIndices;
+    double *cosTable; // cos(2*pi*k/size) for k in [0,size/2)
+    double *sinTable;
+
+    CNNFFT(uint32_t _size);
+    ~CNNFFT();
+
+    // In place; inverse=true uses the conjugate twiddles. Neither direction is scaled.
+    void transform(double *real,double *imaginary,bool inverse);
+
+    static bool isPowerOfTwo(uint32_t value);
+    static uint32_t getNextPowerOfTwo(uint32_t value); // Smallest power of two >=value
+};
+
+// 2D FFT of real data of height x width values (row-major, both powers of two and at least 2).
+// Since the spectrum of real data is Hermitian, only the columns [0,width/2] are stored (spectrumWidth=width/2+1 per row), and two
+// rows are transformed with one complex FFT (one as the real and one as the imaginary part), which halves the work of the row transforms.
+// Thread-safe like CNNFFT, as long as every thread passes its own scratch buffer.
+
+class CNNRealFFT2D
+{
+public:
+    uint32_t width;
+    uint32_t height;
+    uint32_t spectrumWidth;
+    uint32_t spectrumSize; // height*spectrumWidth complex values
+    CNNFFT *rowFFT;
+    CNNFFT *columnFFT;
+
+    CNNRealFFT2D(uint32_t _width,uint32_t _height);
+    ~CNNRealFFT2D();
+
+    uint32_t getScratchSize(); // In doubles
+
+    // spectrumReal and spectrumImaginary receive spectrumSize values each (row-major, spectrumWidth per row)
+    void forward(const double *input,double *spectrumReal,double *spectrumImaginary,double *scratch);
+    // Overwrites the spectrum; the output is scaled by 1/(width*height), so that inverse(forward(x))=x
+    void inverse(double *spectrumReal,double *spectrumImaginary,double *output,double *scratch);
+
+    // accumulator+=a*b (conjugateB: a*conj(b)) for all spectrumSize values. A product of spectra is the spectrum of the circular convolution
+    // of the data; with the conjugate of b, it is the spectrum of the circular correlation sum(b[j]*a[j+k]).
+    void multiplyAccumulate(double *accumulatorReal,double *accumulatorImaginary,const double *aReal,const double *aImaginary,const double *bReal,const double *bImaginary,bool conjugateB);
+};
+
+#endif // CNNFFT_H
@@ -0,0 +1,2374 @@
+#include "cnngradientcheck.h"
+
+// Layers under test (description, type, feature maps, receptive field width/height, stride x/y, zero padding x/y, previous layer feature maps/width/height, training).
+// MAXPOOL windows don't overlap: maxPixelMatrix can only mark the maximum of one window per input pixel.
+static const CNNGradientCheckGeometry gradientCheckGeometries[]=
+{
+    {"CONV 3x3, stride 1, padding 1",CNN_LAYER_TYPE_CONV,3,3,3,1,1,1,1,2,6,6,true},
+    {"CONV 5x5, stride 1, padding 2",CNN_LAYER_TYPE_CONV,4,5,5,1,1,2,2,3,8,8,true},
+    {"CONV 3x3, stride 2, no padding",CNN_LAYER_TYPE_CONV,3,3,3,2,2,0,0,2,7,7,true},
+    {"CONV 3x2, stride 1x2, padding 1x0",CNN_LAYER_TYPE_CONV,2,3,2,1,2,1,0,2,6,6,true},
+    {"CONV 1x1",CNN_LAYER_TYPE_CONV,2,1,1,1,1,0,0,4,5,5,true},
+    {"CONV 7x7, stride 1, padding 3 (several FFT tiles)",CNN_LAYER_TYPE_CONV,3,7,7,1,1,3,3,2,13,11,true},
+    {"MAXPOOL 2x2, stride 2",CNN_LAYER_TYPE_MAXPOOL,3,2,2,2,2,0,0,3,8,8,true},
+    {"MAXPOOL 3x3, stride 3",CNN_LAYER_TYPE_MAXPOOL,2,3,3,3,3,0,0,2,9,9,true},
+    {"MAXPOOL 2x2, stride 2, padding 1",CNN_LAYER_TYPE_MAXPOOL,2,2,2,2,2,1,1,2,6,6,true},
+    {"AVGPOOL 2x2, stride 2",CNN_LAYER_TYPE_AVGPOOL,3,2,2,2,2,0,0,3,8,8,true},
+    {"AVGPOOL 3x3, stride 1, padding 1 (overlapping windows)",CNN_LAYER_TYPE_AVGPOOL,2,3,3,1,1,1,1,2,7,6,true},
+    {"AVGPOOL 3x2, stride 2x1, padding 1x0",CNN_LAYER_TYPE_AVGPOOL,2,3,2,2,1,1,0,2,7,5,true},
+    {"GLOBAL_AVGPOOL 5x7",CNN_LAYER_TYPE_GLOBAL_AVGPOOL,3,0,0,1,1,0,0,3,5,7,true},
+    {"RELU",CNN_LAYER_TYPE_RELU,3,1,1,1,1,0,0,3,5,5,true},
+    {"FC 3x2x2 -> 5",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,3,2,2,true},
+    {"FC 4x1x1 -> 3",CNN_LAYER_TYPE_FC,3,0,0,1,1,0,0,4,1,1,true},
+    {"SOFTMAX 10",CNN_LAYER_TYPE_SOFTMAX,10,0,0,1,1,0,0,10,1,1,true},
+    {"BATCHNORM, training",CNN_LAYER_TYPE_BATCHNORM,3,1,1,1,1,0,0,3,5,4,true},
+    {"BATCHNORM, inference",CNN_LAYER_TYPE_BATCHNORM,3,1,1,1,1,0,0,3,5,4,false},
+    {"DROPOUT 9x8 (two mask words per feature map), training",CNN_LAYER_TYPE_DROPOUT,3,1,1,1,1,0,0,3,9,8,true},
+    {"DROPOUT, inference",CNN_LAYER_TYPE_DROPOUT,2,1,1,1,1,0,0,2,4,4,false}
+};
+
+CNNGradientCheck::CNNGradientCheck(uint64_t _seed, std::ostream &_out) : random(_seed), out(_out)
+{
+    checkCount=0;
+    failedCheckCount=0;
+}
+
+bool CNNGradientCheck::run()
+{
+    uint32_t geometryCount=sizeof(gradientCheckGeometries)/sizeof(gradientCheckGeometries[0]);
+
+    for(uint32_t geometry=0;geometry<geometryCount;geometry++)
+    {
+        // There are no diffs of inference passes
+        if(gradientCheckGeometries[geometry].training)
+            checkLayerGradients(gradientCheckGeometries[geometry]);
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_BATCHNORM&&gradientCheckGeometries[geometry].training)
+            checkBatchnormBatch(gradientCheckGeometries[geometry]);
+        checkInferencePass(gradientCheckGeometries[geometry]);
+    }
+
+    CNNThreadPool threadPool(CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT);
+    for(uint32_t geometry=0;geometry<geometryCount;geometry++)
+    {
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_CONV||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_AVGPOOL)
+            checkWindowAgainstReference(gradientCheckGeometries[geometry]);
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_CONV)
+        {
+            checkConvAlgorithms(gradientCheckGeometries[geometry]);
+            checkBatchnormFolding(gradientCheckGeometries[geometry]);
+        }
+        if(gradientCheckGeometries[geometry].type!=CNN_LAYER_TYPE_MAXPOOL&&gradientCheckGeometries[geometry].type!=CNN_LAYER_TYPE_RELU
+                &&gradientCheckGeometries[geometry].type!=CNN_LAYER_TYPE_SOFTMAX&&gradientCheckGeometries[geometry].type!=CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
+            checkThreadPool(gradientCheckGeometries[geometry],&threadPool);
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_CONV||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_FC
+                ||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_MAXPOOL||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_AVGPOOL)
+            checkTensorLayout(gradientCheckGeometries[geometry],&threadPool);
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_CONV||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_MAXPOOL)
+            checkSpecializedKernels(gradientCheckGeometries[geometry]);
+        if(gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_CONV||gradientCheckGeometries[geometry].type==CNN_LAYER_TYPE_FC)
+        {
+            checkStashPrecision(gradientCheckGeometries[geometry],CNN_STASH_PRECISION_BF16);
+            checkStashPrecision(gradientCheckGeometries[geometry],CNN_STASH_PRECISION_FP16);
+        }
+        // The masks of DROPOUT layers in training mode depend on the order in which the passes start
+        if(gradientCheckGeometries[geometry].type!=CNN_LAYER_TYPE_DROPOUT||!gradientCheckGeometries[geometry].training)
+            checkConcurrentContexts(gradientCheckGeometries[geometry]);
+    }
+
+    checkChainedTensorLayout(&threadPool);
+
+    for(uint8_t optimizerType=1;optimizerType<=CNN_OPTIMIZER_TYPE_COUNT;optimizerType++)
+        checkOptimizer(optimizerType);
+
+    checkQuantizedModel();
+    checkSourceGenerator();
+    checkCheckpoint();
+    checkReducedPrecisionConversions();
+    checkDropoutMasks();
+    checkActivationCheckpointing();
+    checkDataParallelTraining();
+    checkDistributedTraining();
+    checkPipelineTraining();
+    checkSoftmaxLoss();
+    checkSnapshots();
+
+    out<<(checkCount-failedCheckCount)<<" of "<<checkCount<<" checks passed"<<std::endl;
+    return failedCheckCount==0;
+}
+
+void CNNGradientCheck::checkLayerGradients(const CNNGradientCheckGeometry &geometry)
+{
+    CNNLayer *layer=createLayer(geometry);
+
+    // Random bias weights (they are initialized to 0), so that RELU/MAXPOOL layers behind a CONV layer would see both signs
+    if(layer->hasWeights())
+    {
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            layer->biasWeights[featureMap]=-0.1+random.nextDouble()*0.2;
+    }
+    randomizeBatchnormStatistics(layer);
+
+    double ***input=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+    double ***lossCoefficients=createRandomArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth,-1.0,1.0);
+    uint32_t desiredLabel=random.nextBelow(layer->featureMapCount);
+
+    // Analytic diffs (the loss coefficients are the diffs of the loss w.r.t. the output values; SOFTMAX layers calculate their own)
+    layer->setDropoutSeed(0); // See calculateLoss
+    double ***output=layer->forwardPass(input);
+    CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+
+    double ****weightDiffs=0;
+    double *biasWeightDiffs=0;
+    double ***inputDiffs=0;
+    layer->calculateDiffs(weightDiffs,biasWeightDiffs,lossCoefficients,inputDiffs,desiredLabel);
+
+    std::vector<double*> values;
+    std::vector<double> analyticDiffs;
+
+    if(weightDiffs!=0)
+    {
+        double *weightData=CNNLayer::getWeightTypeArrayData(layer->weights);
+        double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+        for(uint32_t weight=0;weight<layer->weightCount;weight++)
+        {
+            values.push_back(weightData+weight);
+            analyticDiffs.push_back(weightDiffData[weight]);
+        }
+        checkTensor(geometry,"weights",values,analyticDiffs,layer,input,lossCoefficients,desiredLabel);
+
+        values.clear();
+        analyticDiffs.clear();
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+        {
+            values.push_back(layer->biasWeights+featureMap);
+            analyticDiffs.push_back(biasWeightDiffs[featureMap]);
+        }
+        checkTensor(geometry,"bias weights",values,analyticDiffs,layer,input,lossCoefficients,desiredLabel);
+    }
+
+    values.clear();
+    analyticDiffs.clear();
+    collectValues(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,values);
+    std::vector<double*> inputDiffValues;
+    collectValues(inputDiffs,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,inputDiffValues);
+    for(uint32_t value=0;value<inputDiffValues.size();value++)
+        analyticDiffs.push_back(*inputDiffValues[value]);
+    checkTensor(geometry,"inputs",values,analyticDiffs,layer,input,lossCoefficients,desiredLabel);
+
+    freeDiffs(layer,weightDiffs,biasWeightDiffs,inputDiffs);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    CNNLayer::freeArray(lossCoefficients,layer->featureMapCount,layer->singleFeatureMapHeight);
+    delete layer;
+}
+
+void CNNGradientCheck::checkBatchnormBatch(const CNNGradientCheckGeometry &geometry)
+{
+    // The examples of a batch normalized together (see CNNLayerContext::batchMeans), as CNNPipeline does it: the loss is the sum over the examples,
+    // and every diff depends on all of them
+    CNNLayer *layer=createTestLayer(geometry);
+    uint32_t exampleCount=CNN_GRADIENT_CHECK_BATCH_SIZE;
+    uint32_t featureMapCount=layer->featureMapCount;
+    int32_t height=layer->singleFeatureMapHeight;
+    int32_t width=layer->singleFeatureMapWidth;
+
+    std::vector<double***> inputs;
+    std::vector<double***> lossCoefficients;
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        // Different offsets, so the statistics of the batch differ from those of each example
+        inputs.push_back(createRandomArray(featureMapCount,height,width,-1.0+0.5*example,1.0+0.5*example));
+        lossCoefficients.push_back(createRandomArray(featureMapCount,height,width,-1.0,1.0));
+    }
+    std::vector<double> means(featureMapCount);
+    std::vector<double> variances(featureMapCount);
+    std::vector<double> outputDiffMeans(featureMapCount);
+    std::vector<double> normalizedOutputDiffMeans(featureMapCount);
+    std::vector<CNNLayerContext> contexts(exampleCount,CNNLayerContext());
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        contexts[example].training=true;
+        contexts[example].batchMeans=means.data();
+        contexts[example].batchVariances=variances.data();
+        contexts[example].batchOutputDiffMeans=outputDiffMeans.data();
+        contexts[example].batchNormalizedOutputDiffMeans=normalizedOutputDiffMeans.data();
+    }
+
+    // Statistics and running statistics against plain loops
+    double valueCount=(double)exampleCount*height*width;
+    double error=0.0;
+    std::vector<double> referenceRunningMeans(layer->runningMeans,layer->runningMeans+featureMapCount);
+    std::vector<double> referenceRunningVariances(layer->runningVariances,layer->runningVariances+featureMapCount);
+    layer->calculateBatchnormBatchStatistics(inputs.data(),exampleCount,means.data(),variances.data());
+    layer->updateBatchnormRunningStatistics(means.data(),variances.data(),exampleCount);
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        double referenceSum=0.0;
+        for(uint32_t example=0;example<exampleCount;example++)
+        {
+            for(int32_t y=0;y<height;y++)
+            {
+                for(int32_t x=0;x<width;x++)
+                    referenceSum+=inputs[example][featureMap][y][x];
+            }
+        }
+        double referenceMean=referenceSum/valueCount;
+        double referenceSquareSum=0.0;
+        for(uint32_t example=0;example<exampleCount;example++)
+        {
+            for(int32_t y=0;y<height;y++)
+            {
+                for(int32_t x=0;x<width;x++)
+                    referenceSquareSum+=(inputs[example][featureMap][y][x]-referenceMean)*(inputs[example][featureMap][y][x]-referenceMean);
+            }
+        }
+        referenceRunningMeans[featureMap]=(1.0-CNN_BATCHNORM_MOMENTUM)*referenceRunningMeans[featureMap]+CNN_BATCHNORM_MOMENTUM*referenceMean;
+        referenceRunningVariances[featureMap]=(1.0-CNN_BATCHNORM_MOMENTUM)*referenceRunningVariances[featureMap]+CNN_BATCHNORM_MOMENTUM*referenceSquareSum/(valueCount-1.0);
+        error=__max(error,getRelativeError(means[featureMap],referenceMean));
+        error=__max(error,getRelativeError(variances[featureMap],referenceSquareSum/valueCount));
+        error=__max(error,getRelativeError(layer->runningMeans[featureMap],referenceRunningMeans[featureMap]));
+        error=__max(error,getRelativeError(layer->runningVariances[featureMap],referenceRunningVariances[featureMap]));
+    }
+    report(geometry.description,"statistics of a batch against plain loops",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+    // The passes do not update the running statistics themselves
+    auto calculateBatchLoss=[layer,exampleCount,featureMapCount,height,width,&inputs,&lossCoefficients,&means,&variances,&contexts](){
+        layer->calculateBatchnormBatchStatistics(inputs.data(),exampleCount,means.data(),variances.data());
+        double loss=0.0;
+        for(uint32_t example=0;example<exampleCount;example++)
+        {
+            double ***output=layer->forwardPass(inputs[example],contexts[example]);
+            layer->freeContext(contexts[example]);
+            for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+            {
+                for(int32_t y=0;y<height;y++)
+                {
+                    for(int32_t x=0;x<width;x++)
+                        loss+=output[featureMap][y][x]*lossCoefficients[example][featureMap][y][x];
+                }
+            }
+            CNNLayer::freeArray(output,featureMapCount,height);
+        }
+        return loss;};
+
+    // Analytic diffs: forward passes of all examples, the means of the output diffs, then the backward passes
+    std::vector<double> runningMeans(layer->runningMeans,layer->runningMeans+featureMapCount);
+    std::vector<double> runningVariances(layer->runningVariances,layer->runningVariances+featureMapCount);
+    layer->calculateBatchnormBatchStatistics(inputs.data(),exampleCount,means.data(),variances.data());
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        double ***output=layer->forwardPass(inputs[example],contexts[example]);
+        CNNLayer::freeArray(output,featureMapCount,height);
+        layer->addBatchnormDiffSums(lossCoefficients[example],contexts[example],outputDiffMeans.data(),normalizedOutputDiffMeans.data());
+    }
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        outputDiffMeans[featureMap]/=valueCount;
+        normalizedOutputDiffMeans[featureMap]/=valueCount;
+    }
+
+    std::vector<double> weightDiffSums(featureMapCount,0.0);
+    std::vector<double> biasWeightDiffSums(featureMapCount,0.0);
+    std::vector<double*> inputValues;
+    std::vector<double> inputDiffValues;
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        double ****weightDiffs=0;
+        double *biasWeightDiffs=0;
+        double ***inputDiffs=0;
+        layer->calculateDiffs(weightDiffs,biasWeightDiffs,lossCoefficients[example],inputDiffs,0,contexts[example]);
+        layer->freeContext(contexts[example]);
+        for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+        {
+            weightDiffSums[featureMap]+=weightDiffs[featureMap][0][0][0];
+            biasWeightDiffSums[featureMap]+=biasWeightDiffs[featureMap];
+        }
+        collectValues(inputs[example],featureMapCount,height,width,inputValues);
+        std::vector<double*> exampleInputDiffValues;
+        collectValues(inputDiffs,featureMapCount,height,width,exampleInputDiffValues);
+        for(uint32_t value=0;value<exampleInputDiffValues.size();value++)
+            inputDiffValues.push_back(*exampleInputDiffValues[value]);
+        freeDiffs(layer,weightDiffs,biasWeightDiffs,inputDiffs);
+    }
+    error=0.0;
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        error=__max(error,getRelativeError(layer->runningMeans[featureMap],runningMeans[featureMap]));
+        error=__max(error,getRelativeError(layer->runningVariances[featureMap],runningVariances[featureMap]));
+    }
+    report(geometry.description,"passes with the statistics of a batch leave the running statistics alone",error,0.0);
+
+    std::vector<double*> values;
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+        values.push_back(&layer->weights[featureMap][0][0][0]);
+    checkTensor(geometry,"weights (batch)",values,weightDiffSums,calculateBatchLoss);
+    values.clear();
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+        values.push_back(layer->biasWeights+featureMap);
+    checkTensor(geometry,"bias weights (batch)",values,biasWeightDiffSums,calculateBatchLoss);
+    checkTensor(geometry,"inputs (batch)",inputValues,inputDiffValues,calculateBatchLoss);
+
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        CNNLayer::freeArray(inputs[example],featureMapCount,height);
+        CNNLayer::freeArray(lossCoefficients[example],featureMapCount,height);
+    }
+    delete layer;
+}
+
+void CNNGradientCheck::checkInferencePass(const CNNGradientCheckGeometry &geometry)
+{
+    // An inference pass must leave its context empty (CONV and FC layers with a reduced stash precision must not stash either) and give the output
+    // of a training pass, except for BATCHNORM (normalizes with the running statistics) and DROPOUT (passes the input on unchanged)
+    CNNLayer *layer=createTestLayer(geometry);
+    if(layer->type==CNN_LAYER_TYPE_CONV||layer->type==CNN_LAYER_TYPE_FC)
+        layer->setStashPrecision(CNN_STASH_PRECISION_BF16);
+    double ***input=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+    CNNLayerContext context=CNNLayerContext();
+    double ***output=layer->forwardPass(input,context);
+
+    double ***referenceOutput;
+    if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+    {
+        referenceOutput=CNNLayer::allocArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+        {
+            double standardDeviation=sqrt(layer->runningVariances[featureMap]+CNN_BATCHNORM_EPSILON);
+            for(int32_t y=0;y<layer->singleFeatureMapHeight;y++)
+            {
+                for(int32_t x=0;x<layer->singleFeatureMapWidth;x++)
+                    referenceOutput[featureMap][y][x]=layer->weights[featureMap][0][0][0]*(input[featureMap][y][x]-layer->runningMeans[featureMap])/standardDeviation
+                            +layer->biasWeights[featureMap];
+            }
+        }
+    }
+    else if(layer->type==CNN_LAYER_TYPE_DROPOUT)
+        referenceOutput=layer->cloneArray(input,layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+    else
+    {
+        CNNLayerContext trainingContext=CNNLayerContext();
+        trainingContext.training=true;
+        referenceOutput=layer->forwardPass(input,trainingContext);
+        layer->freeContext(trainingContext);
+    }
+
+    double error=compareArrays(output,referenceOutput,layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+    if(context.input!=0||context.output!=0||context.stashedInput!=0||context.maxPixelMatrix!=0||context.dropoutMask!=0)
+        error=1.0;
+    report(geometry.description,"inference pass against the reference (and no stored state)",error,
+           layer->type==CNN_LAYER_TYPE_BATCHNORM?CNN_GRADIENT_CHECK_KERNEL_TOLERANCE:0.0);
+
+    layer->freeContext(context);
+    CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(referenceOutput,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete layer;
+}
+
+double CNNGradientCheck::calculateLoss(CNNLayer *layer, double ***input, double ***lossCoefficients, uint32_t desiredLabel)
+{
+    // DROPOUT layers must draw the same mask for every forward pass
+    layer->setDropoutSeed(0);
+    double ***output=layer->forwardPass(input);
+    double loss=0.0;
+
+    if(layer->type==CNN_LAYER_TYPE_SOFTMAX)
+        loss=-log(output[desiredLabel][0][0]);
+    else
+    {
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+        {
+            for(int32_t y=0;y<layer->singleFeatureMapHeight;y++)
+            {
+                for(int32_t x=0;x<layer->singleFeatureMapWidth;x++)
+                    loss+=output[featureMap][y][x]*lossCoefficients[featureMap][y][x];
+            }
+        }
+    }
+
+    CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+    return loss;
+}
+
+void CNNGradientCheck::checkTensor(const CNNGradientCheckGeometry &geometry, const char *tensorName, std::vector<double*> &values, std::vector<double> &analyticDiffs,
+                                   CNNLayer *layer, double ***input, double ***lossCoefficients, uint32_t desiredLabel)
+{
+    checkTensor(geometry,tensorName,values,analyticDiffs,[this,layer,input,lossCoefficients,desiredLabel](){return calculateLoss(layer,input,lossCoefficients,desiredLabel);});
+}
+
+void CNNGradientCheck::checkTensor(const CNNGradientCheckGeometry &geometry, const char *tensorName, std::vector<double*> &values, std::vector<double> &analyticDiffs,
+                                   const std::function<double()> &calculateLoss)
+{
+    uint32_t valueCount=values.size();
+    uint32_t sampleCount=__min(valueCount,(uint32_t)CNN_GRADIENT_CHECK_SAMPLES_PER_TENSOR);
+    double maxError=0.0;
+
+    for(uint32_t sample=0;sample<sampleCount;sample++)
+    {
+        uint32_t value=valueCount<=CNN_GRADIENT_CHECK_SAMPLES_PER_TENSOR?sample:random.nextBelow(valueCount);
+        double originalValue=*values[value];
+
+        *values[value]=originalValue+CNN_GRADIENT_CHECK_EPSILON;
+        double lossPlus=calculateLoss();
+        *values[value]=originalValue-CNN_GRADIENT_CHECK_EPSILON;
+        double lossMinus=calculateLoss();
+        *values[value]=originalValue;
+
+        double numericalDiff=(lossPlus-lossMinus)/(2.0*CNN_GRADIENT_CHECK_EPSILON);
+        maxError=__max(maxError,getRelativeError(analyticDiffs[value],numericalDiff));
+    }
+
+    std::string checkName=std::string("gradients of the ")+tensorName;
+    report(geometry.description,checkName.c_str(),maxError,CNN_GRADIENT_CHECK_TOLERANCE);
+}
+
+void CNNGradientCheck::checkWindowAgainstReference(const CNNGradientCheckGeometry &geometry)
+{
+    // The interior/border split of "conv" and the column sums of "avgpool" against a plain loop that checks the bounds of every receptive field pixel
+    CNNLayer *layer=createTestLayer(geometry);
+    double ***input=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+    double ***output=layer->forwardPass(input);
+    double ***referenceOutput=CNNLayer::allocArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+
+    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<layer->featureMapCount;featureMapInThisLayer++)
+    {
+        // AVGPOOL: the mean of the window in the same feature map
+        uint32_t firstFeatureMapInPreviousLayer=layer->type==CNN_LAYER_TYPE_CONV?0:featureMapInThisLayer;
+        uint32_t endFeatureMapInPreviousLayer=layer->type==CNN_LAYER_TYPE_CONV?layer->previousLayerFeatureMapCount:featureMapInThisLayer+1;
+        for(int32_t y=0;y<layer->singleFeatureMapHeight;y++)
+        {
+            for(int32_t x=0;x<layer->singleFeatureMapWidth;x++)
+            {
+                double sum=layer->type==CNN_LAYER_TYPE_CONV?layer->biasWeights[featureMapInThisLayer]:0.0;
+                for(uint32_t featureMapInPreviousLayer=firstFeatureMapInPreviousLayer;featureMapInPreviousLayer<endFeatureMapInPreviousLayer;featureMapInPreviousLayer++)
+                {
+                    for(int32_t receptiveFieldY=0;receptiveFieldY<layer->receptiveFieldHeight;receptiveFieldY++)
+                    {
+                        for(int32_t receptiveFieldX=0;receptiveFieldX<layer->receptiveFieldWidth;receptiveFieldX++)
+                        {
+                            int32_t pixelInFeatureMapInPreviousLayerX=-layer->zeroPaddingX+(int32_t)layer->strideX*x+receptiveFieldX;
+                            int32_t pixelInFeatureMapInPreviousLayerY=-layer->zeroPaddingY+(int32_t)layer->strideY*y+receptiveFieldY;
+                            if(pixelInFeatureMapInPreviousLayerX<0||pixelInFeatureMapInPreviousLayerX>=layer->previousLayerSingleFeatureMapWidth||
+                               pixelInFeatureMapInPreviousLayerY<0||pixelInFeatureMapInPreviousLayerY>=layer->previousLayerSingleFeatureMapHeight)
+                                continue; // Zero padding
+                            double weight=layer->type==CNN_LAYER_TYPE_CONV?layer->weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]:1.0;
+                            sum+=input[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]*weight;
+                        }
+                    }
+                }
+                referenceOutput[featureMapInThisLayer][y][x]=layer->type==CNN_LAYER_TYPE_CONV?sum:sum/(double)layer->totalReceptiveFieldSize;
+            }
+        }
+    }
+
+    double error=compareArrays(output,referenceOutput,layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+    report(geometry.description,layer->type==CNN_LAYER_TYPE_CONV?"conv against the scalar reference":"avgpool against the scalar reference",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+    CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(referenceOutput,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete layer;
+}
+
+void CNNGradientCheck::checkConvAlgorithms(const CNNGradientCheckGeometry &geometry)
+{
+    // The other algorithms against the direct one: ROWS adds up the products in the same order (see CNN_CONV_ALGORITHM_DIRECT), FFT only agrees up to
+    // rounding. The diffs are compared too, since FFT has its own backward pass, and so is the output after a weight update (stale filter spectra).
+    for(uint8_t convAlgorithm=CNN_CONV_ALGORITHM_DIRECT+1;convAlgorithm<=CNN_CONV_ALGORITHM_COUNT;convAlgorithm++)
+    {
+        std::string checkName=std::string(CNNLayer::getConvAlgorithmName(convAlgorithm))+" conv algorithm against the direct one";
+        checkAgainstReference(geometry,checkName.c_str(),convAlgorithm==CNN_CONV_ALGORITHM_FFT?CNN_GRADIENT_CHECK_FFT_TOLERANCE:0.0,
+                              0,[convAlgorithm](CNNLayer *layer){layer->setConvAlgorithm(convAlgorithm,1);});
+    }
+}
+
+void CNNGradientCheck::checkBatchnormFolding(const CNNGradientCheckGeometry &geometry)
+{
+    // CONV followed by BATCHNORM (inference) against the CONV layer that createInferenceLayers folds them into
+    CNNGradientCheckGeometry batchnormGeometry={"",CNN_LAYER_TYPE_BATCHNORM,geometry.featureMapCount,1,1,1,1,0,0,geometry.featureMapCount,0,0,false};
+    CNNLayer *layers[2];
+    layers[0]=createLayer(geometry);
+    batchnormGeometry.previousLayerSingleFeatureMapWidth=layers[0]->singleFeatureMapWidth;
+    batchnormGeometry.previousLayerSingleFeatureMapHeight=layers[0]->singleFeatureMapHeight;
+    layers[1]=createLayer(batchnormGeometry);
+    for(uint32_t featureMap=0;featureMap<layers[0]->featureMapCount;featureMap++)
+        layers[0]->biasWeights[featureMap]=-0.1+random.nextDouble()*0.2;
+    randomizeBatchnormStatistics(layers[1]);
+
+    uint32_t inferenceLayerCount;
+    CNNLayer **inferenceLayers=CNNLayer::createInferenceLayers(layers,2,inferenceLayerCount);
+
+    double ***input=createRandomArray(layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight,layers[0]->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+    double ***convOutput=layers[0]->forwardPass(input);
+    double ***output=layers[1]->forwardPass(convOutput);
+    double ***foldedOutput=inferenceLayers[0]->forwardPass(input);
+
+    double error=inferenceLayerCount==1?compareArrays(output,foldedOutput,layers[1]->featureMapCount,layers[1]->singleFeatureMapHeight,layers[1]->singleFeatureMapWidth):1.0;
+    report(geometry.description,"folded BATCHNORM against CONV followed by BATCHNORM",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+    CNNLayer::freeArray(convOutput,layers[0]->featureMapCount,layers[0]->singleFeatureMapHeight);
+    CNNLayer::freeArray(output,layers[1]->featureMapCount,layers[1]->singleFeatureMapHeight);
+    CNNLayer::freeArray(foldedOutput,inferenceLayers[0]->featureMapCount,inferenceLayers[0]->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        delete inferenceLayers[layerIndex];
+    free(inferenceLayers);
+    delete layers[0];
+    delete layers[1];
+}
+
+void CNNGradientCheck::checkThreadPool(const CNNGradientCheckGeometry &geometry, CNNThreadPool *threadPool)
+{
+    // The thread pool paths must be bit-identical to the sequential ones (see CNNLayer::threadPool)
+    checkAgainstReference(geometry,"thread pool against the sequential path",0.0,0,[threadPool](CNNLayer *layer){layer->setThreadPool(threadPool);});
+}
+
+void CNNGradientCheck::checkTensorLayout(const CNNGradientCheckGeometry &geometry, CNNThreadPool *threadPool)
+{
+    // The NHWC kernels add up in another order than the NCHW ones, but their thread pool paths must be bit-identical to their sequential ones.
+    // NHWC CONV layers pack their weights once per update, which the output after the update checks.
+    auto setNhwc=[](CNNLayer *layer){layer->setTensorLayout(CNN_TENSOR_LAYOUT_NHWC);};
+    checkAgainstReference(geometry,"NHWC layout against NCHW",CNN_GRADIENT_CHECK_KERNEL_TOLERANCE,0,setNhwc);
+    checkAgainstReference(geometry,"NHWC layout thread pool against the sequential path",0.0,setNhwc,
+                          [threadPool](CNNLayer *layer){layer->setTensorLayout(CNN_TENSOR_LAYOUT_NHWC);layer->setThreadPool(threadPool);});
+}
+
+void CNNGradientCheck::checkChainedTensorLayout(CNNThreadPool *threadPool)
+{
+    // NHWC layers next to each other pass channels-last arrays, the other layers break the chain: RELU and DROPOUT in training, only RELU
+    // in the inference layers (DROPOUT is dropped). The stashes of the second CONV and the second FC layer are made from channels-last inputs.
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_CONV,6,3,3,1,1,1,1,4,4,4,true},
+        {"",CNN_LAYER_TYPE_AVGPOOL,6,2,2,2,2,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_DROPOUT,6,1,1,1,1,0,0,6,2,2,true},
+        {"",CNN_LAYER_TYPE_FC,8,0,0,1,1,0,0,6,2,2,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,8,1,1,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+    const bool channelsLastOutputs[layerCount]={false,false,true,true,false,false,true,false,false};
+    const bool inferenceChannelsLastOutputs[layerCount-1]={false,false,true,true,true,true,false,false};
+    const char *description="NHWC network";
+
+    CNNLayer *referenceLayers[layerCount];
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        referenceLayers[layerIndex]=createTestLayer(geometries[layerIndex]);
+        if(layerIndex==3)
+            referenceLayers[layerIndex]->setStashPrecision(CNN_STASH_PRECISION_BF16);
+        else if(layerIndex==7)
+            referenceLayers[layerIndex]->setStashPrecision(CNN_STASH_PRECISION_FP16);
+        layers[layerIndex]=referenceLayers[layerIndex]->clone();
+        layers[layerIndex]->setThreadPool(threadPool);
+    }
+    CNNLayer::setNetworkTensorLayout(layers,layerCount,CNN_TENSOR_LAYOUT_NHWC);
+
+    double error=0.0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        if(layers[layerIndex]->channelsLastOutput!=channelsLastOutputs[layerIndex]||referenceLayers[layerIndex]->channelsLastOutput)
+            error=1.0;
+    }
+    report(description,"layers with channels-last outputs",error,0.0);
+
+    // Training steps with the reference loop; the NHWC kernels add up in another order
+    CNNOptimizer referenceOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+    CNNOptimizer optimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+    error=0.0;
+    for(uint32_t step=0;step<CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT;step++)
+    {
+        double ***image=createRandomArray(3,8,8,-1.0,1.0);
+        uint8_t label=(uint8_t)(random.next()%5);
+
+        referenceOptimizer.beginStep();
+        double referenceLoss;
+        double ***referenceOutput=runReferenceTrainingStep(referenceLayers,layerCount,image,label,&referenceOptimizer,referenceLoss);
+        optimizer.beginStep();
+        double loss;
+        double ***output=runReferenceTrainingStep(layers,layerCount,image,label,&optimizer,loss);
+
+        error=__max(error,compareArrays(output,referenceOutput,5,1,1));
+        error=__max(error,getRelativeError(loss,referenceLoss));
+        CNNLayer::freeArray(output,5,1);
+        CNNLayer::freeArray(referenceOutput,5,1);
+        CNNLayer::freeArray(image,3,8);
+    }
+    error=__max(error,compareParameters(layers,referenceLayers,layerCount));
+    report(description,"training steps against the NCHW network (outputs, losses and weights)",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+    // The inference layers are linked again; every array passed between them must have the layout their flags announce
+    uint32_t inferenceLayerCount;
+    uint32_t referenceInferenceLayerCount;
+    CNNLayer **inferenceLayers=CNNLayer::createInferenceLayers(layers,layerCount,inferenceLayerCount);
+    CNNLayer **referenceInferenceLayers=CNNLayer::createInferenceLayers(referenceLayers,layerCount,referenceInferenceLayerCount);
+    double ***image=createRandomArray(3,8,8,-1.0,1.0);
+    double ***output=image;
+    double ***referenceOutput=image;
+    double layoutError=inferenceLayerCount==layerCount-1?0.0:1.0;
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount&&layoutError==0.0;layerIndex++)
+    {
+        CNNLayer *layer=inferenceLayers[layerIndex];
+        double ***layerOutput=layer->forwardPass(output);
+        double ***referenceLayerOutput=referenceInferenceLayers[layerIndex]->forwardPass(referenceOutput);
+        if(layer->channelsLastOutput!=inferenceChannelsLastOutputs[layerIndex]
+                ||CNNLayer::isChannelsLastArray(layerOutput,layer->featureMapCount,layer->singleFeatureMapHeight)!=layer->channelsLastOutput)
+            layoutError=1.0;
+        if(layerIndex>0)
+        {
+            CNNLayer::freeArray(output,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+            CNNLayer::freeArray(referenceOutput,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+        }
+        output=layerOutput;
+        referenceOutput=referenceLayerOutput;
+    }
+    report(description,"layouts of the arrays passed between the inference layers",layoutError,0.0);
+    if(layoutError==0.0)
+    {
+        report(description,"inference output against the NCHW network",compareArrays(output,referenceOutput,5,1,1),CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+        CNNLayer::freeArray(output,5,1);
+        CNNLayer::freeArray(referenceOutput,5,1);
+    }
+    CNNLayer::freeArray(image,3,8);
+
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        delete inferenceLayers[layerIndex];
+    for(uint32_t layerIndex=0;layerIndex<referenceInferenceLayerCount;layerIndex++)
+        delete referenceInferenceLayers[layerIndex];
+    free(inferenceLayers);
+    free(referenceInferenceLayers);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        delete referenceLayers[layerIndex];
+        delete layers[layerIndex];
+    }
+}
+
+void CNNGradientCheck::checkSpecializedKernels(const CNNGradientCheckGeometry &geometry)
+{
+    // The specialized kernels add up the same values in the same order as the generic ones, so they must be bit-identical
+    // (for geometries without a specialization, both layers use the generic kernels)
+    checkAgainstReference(geometry,"specialized kernels against the generic ones",0.0,0,[](CNNLayer *layer){layer->setSpecializedKernels(false);});
+}
+
+void CNNGradientCheck::checkStashPrecision(const CNNGradientCheckGeometry &geometry, uint8_t stashPrecision)
+{
+    CNNLayer *layer=createTestLayer(geometry);
+    CNNLayer *stashLayer=layer->clone();
+    stashLayer->setStashPrecision(stashPrecision);
+
+    double ***input=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1e5,1e5);
+    double ***outputDiffs=createRandomArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth,-1.0,1.0);
+    CNNGradientCheckPasses passes;
+    CNNGradientCheckPasses stashPasses;
+    runPasses(layer,input,outputDiffs,0,layer->defaultContext,false,passes);
+    runPasses(stashLayer,input,outputDiffs,0,stashLayer->defaultContext,false,stashPasses);
+
+    // The weight diffs are the only results calculated from the stash
+    double ****stashWeightDiffs=stashPasses.weightDiffs;
+    stashPasses.weightDiffs=passes.weightDiffs;
+    double exactError=comparePasses(layer,stashPasses,passes);
+    stashPasses.weightDiffs=stashWeightDiffs;
+    // The backward pass frees the expanded input again, only the stash stays
+    if(stashLayer->defaultContext.input!=0||stashLayer->defaultContext.stashedInput==0)
+        exactError=1.0;
+
+    // Relative to the largest weight diff: single weight diffs may be sums that cancel out almost completely
+    double *weightDiffData=CNNLayer::getWeightTypeArrayData(passes.weightDiffs);
+    double *stashWeightDiffData=CNNLayer::getWeightTypeArrayData(stashPasses.weightDiffs);
+    double maxAbsWeightDiff=0.0;
+    double maxWeightDiffError=0.0;
+    for(uint32_t weight=0;weight<layer->weightCount;weight++)
+    {
+        maxAbsWeightDiff=__max(maxAbsWeightDiff,fabs(weightDiffData[weight]));
+        maxWeightDiffError=__max(maxWeightDiffError,fabs(stashWeightDiffData[weight]-weightDiffData[weight]));
+    }
+    double weightDiffError=maxAbsWeightDiff>0.0?maxWeightDiffError/maxAbsWeightDiff:maxWeightDiffError;
+
+    std::string checkName=std::string(CNNLayer::getStashPrecisionName(stashPrecision))+" stash";
+    report(geometry.description,(checkName+": output, bias weight and input diffs against the double stash").c_str(),exactError,0.0);
+    report(geometry.description,(checkName+": weight diffs against the double stash").c_str(),weightDiffError,
+           stashPrecision==CNN_STASH_PRECISION_BF16?CNN_GRADIENT_CHECK_BF16_STASH_TOLERANCE:CNN_GRADIENT_CHECK_FP16_STASH_TOLERANCE);
+
+    freePasses(layer,passes);
+    freePasses(layer,stashPasses);
+    CNNLayer::freeArray(outputDiffs,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete layer;
+    delete stashLayer;
+}
+
+void CNNGradientCheck::checkReducedPrecisionConversions()
+{
+    // Known roundings (value, bfloat16, fp16): ties go to the even neighbor, float denormals become zeros in bfloat16, fp16 has denormals down to 2^-24
+    const double knownValues[][3]={
+        {1.0,0x3F80,0x3C00},{-2.0,0xC000,0xC000},{-0.0,0x8000,0x8000},
+        {1.0+ldexp(1.0,-8),0x3F80,0x3C04},{1.0+3.0*ldexp(1.0,-8),0x3F82,0x3C0C},{1.0+ldexp(1.0,-11),0x3F80,0x3C00},{1.0+3.0*ldexp(1.0,-11),0x3F80,0x3C02},
+        {65504.0,0x4780,0x7BFF},{65519.0,0x4780,0x7BFF},{65520.0,0x4780,0x7C00},{1e300,0x7F80,0x7C00},{-1e300,0xFF80,0xFC00},
+        {ldexp(1.0,-14),0x3880,0x0400},{ldexp(1.0,-24),0x3380,0x0001},{ldexp(1.0,-25),0x3300,0x0000},{3.0*ldexp(1.0,-25),0x33C0,0x0002},
+        {1e-40,0x0000,0x0000},{-1e-40,0x8000,0x8000}};
+    uint32_t knownValueCount=sizeof(knownValues)/sizeof(knownValues[0]);
+    uint32_t wrongCount=0;
+    for(uint32_t knownValue=0;knownValue<knownValueCount;knownValue++)
+    {
+        if(CNNLayer::doubleToBf16(knownValues[knownValue][0])!=(uint16_t)knownValues[knownValue][1])
+            wrongCount++;
+        if(CNNLayer::doubleToFp16(knownValues[knownValue][0])!=(uint16_t)knownValues[knownValue][2])
+            wrongCount++;
+    }
+    double nan=std::numeric_limits<double>::quiet_NaN();
+    if(!std::isnan(CNNLayer::bf16ToDouble(CNNLayer::doubleToBf16(nan)))||!std::isnan(CNNLayer::fp16ToDouble(CNNLayer::doubleToFp16(nan))))
+        wrongCount++;
+    report("conversions","rounding of known values to bfloat16 and fp16 (wrong results)",wrongCount,0.0);
+
+    // Every value that isn't a NaN (or a bfloat16 denormal) converts back to itself
+    wrongCount=0;
+    for(uint32_t bits=0;bits<65536;bits++)
+    {
+        uint16_t value=(uint16_t)bits;
+        bool bf16NaN=(value&0x7F80)==0x7F80&&(value&0x007F)!=0;
+        bool bf16Denormal=(value&0x7F80)==0&&(value&0x007F)!=0;
+        if(!bf16NaN&&!bf16Denormal&&CNNLayer::doubleToBf16(CNNLayer::bf16ToDouble(value))!=value)
+            wrongCount++;
+        bool fp16NaN=(value&0x7C00)==0x7C00&&(value&0x03FF)!=0;
+        if(!fp16NaN&&CNNLayer::doubleToFp16(CNNLayer::fp16ToDouble(value))!=value)
+            wrongCount++;
+    }
+    report("conversions","round trips of all bfloat16 and fp16 values (wrong results)",wrongCount,0.0);
+
+    // Rows of magnitudes from 2^-40 to 2^20 (denormals, normals and overflows of both formats after scaling), plus the known values; odd lengths test the tails
+    const int32_t rowLength=1001;
+    double *row=(double*)malloc(rowLength*sizeof(double));
+    double *unpackedRow=(double*)malloc(rowLength*sizeof(double));
+    uint16_t *packedRow=(uint16_t*)malloc(rowLength*sizeof(uint16_t));
+    for(int32_t x=0;x<rowLength;x++)
+    {
+        if((uint32_t)x<knownValueCount)
+            row[x]=knownValues[x][0];
+        else
+            row[x]=(random.nextDouble()<0.5?-1.0:1.0)*ldexp(0.5+0.5*random.nextDouble(),-40+(int32_t)random.nextBelow(61));
+    }
+    wrongCount=0;
+    const double scales[]={1.0,ldexp(1.0,-12),ldexp(1.0,12)};
+    for(uint32_t scale=0;scale<sizeof(scales)/sizeof(scales[0]);scale++)
+    {
+        for(uint8_t stashPrecision=CNN_STASH_PRECISION_BF16;stashPrecision<=CNN_STASH_PRECISION_FP16;stashPrecision++)
+        {
+            CNNLayer::packReducedPrecisionRow(row,packedRow,scales[scale],rowLength,stashPrecision);
+            CNNLayer::unpackReducedPrecisionRow(packedRow,unpackedRow,1.0/scales[scale],rowLength,stashPrecision);
+            for(int32_t x=0;x<rowLength;x++)
+            {
+                uint16_t value=stashPrecision==CNN_STASH_PRECISION_BF16?CNNLayer::doubleToBf16(row[x]*scales[scale]):CNNLayer::doubleToFp16(row[x]*scales[scale]);
+                double unpackedValue=(stashPrecision==CNN_STASH_PRECISION_BF16?CNNLayer::bf16ToDouble(value):CNNLayer::fp16ToDouble(value))/scales[scale];
+                if(packedRow[x]!=value||memcmp(&unpackedRow[x],&unpackedValue,sizeof(double))!=0)
+                    wrongCount++;
+            }
+        }
+    }
+    report("conversions","SIMD bfloat16 and fp16 row conversions against the scalar ones (wrong results)",wrongCount,0.0);
+
+    free(row);
+    free(unpackedRow);
+    free(packedRow);
+}
+
+void CNNGradientCheck::checkConcurrentContexts(const CNNGradientCheckGeometry &geometry)
+{
+    // Every thread runs the forward and backward pass of its own example; the results must be bit-identical to those of sequential passes
+    const uint32_t exampleCount=CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT;
+    CNNLayer *layer=createTestLayer(geometry);
+
+    double ***inputs[exampleCount];
+    double ***outputDiffs[exampleCount];
+    CNNGradientCheckPasses passes[exampleCount][2]; // Sequential, concurrent
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        inputs[example]=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+        outputDiffs[example]=createRandomArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth,-1.0,1.0);
+    }
+
+    auto runExample=[layer,&geometry,&inputs,&outputDiffs,&passes](uint32_t example,uint32_t run){
+        CNNLayerContext context=CNNLayerContext();
+        context.training=geometry.training;
+        runPasses(layer,inputs[example],outputDiffs[example],example%layer->featureMapCount,context,false,passes[example][run]);
+        layer->freeContext(context);
+    };
+
+    for(uint32_t example=0;example<exampleCount;example++)
+        runExample(example,0);
+    std::vector<std::thread> threads;
+    for(uint32_t example=0;example<exampleCount;example++)
+        threads.push_back(std::thread(runExample,example,1));
+    for(uint32_t example=0;example<exampleCount;example++)
+        threads[example].join();
+
+    double error=0.0;
+    for(uint32_t example=0;example<exampleCount;example++)
+        error=__max(error,comparePasses(layer,passes[example][1],passes[example][0]));
+    report(geometry.description,"concurrent passes with separate contexts against sequential passes",error,0.0);
+
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        freePasses(layer,passes[example][0]);
+        freePasses(layer,passes[example][1]);
+        CNNLayer::freeArray(inputs[example],layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+        CNNLayer::freeArray(outputDiffs[example],layer->featureMapCount,layer->singleFeatureMapHeight);
+    }
+    delete layer;
+}
+
+void CNNGradientCheck::checkOptimizer(uint8_t optimizerType)
+{
+    // One call for the whole buffer (SIMD kernel plus scalar remainder) against one call per value (scalar remainder only).
+    // An odd value count makes sure the remainder loop is used in the first case, too.
+    const uint32_t valueCount=37;
+    const uint32_t stepCount=3;
+
+    std::vector<double> parameters(valueCount),scalarParameters(valueCount),diffs(valueCount);
+    std::vector<double> state1(valueCount,0.0),state2(valueCount,0.0),scalarState1(valueCount,0.0),scalarState2(valueCount,0.0);
+    for(uint32_t value=0;value<valueCount;value++)
+        parameters[value]=scalarParameters[value]=-1.0+random.nextDouble()*2.0;
+
+    CNNOptimizer optimizer(optimizerType,0.01,0.5,0.0001);
+    CNNOptimizer scalarOptimizer(optimizerType,0.01,0.5,0.0001);
+
+    for(uint32_t step=0;step<stepCount;step++)
+    {
+        for(uint32_t value=0;value<valueCount;value++)
+            diffs[value]=-1.0+random.nextDouble()*2.0;
+
+        optimizer.beginStep();
+        optimizer.update(&parameters[0],&diffs[0],&state1[0],&state2[0],valueCount);
+        scalarOptimizer.beginStep();
+        for(uint32_t value=0;value<valueCount;value++)
+            scalarOptimizer.update(&scalarParameters[value],&diffs[value],&scalarState1[value],&scalarState2[value],1);
+    }
+
+    double error=0.0;
+    for(uint32_t value=0;value<valueCount;value++)
+        error=__max(error,getRelativeError(parameters[value],scalarParameters[value]));
+
+    report(CNNOptimizer::getTypeName(optimizerType),"update against the scalar reference",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+}
+
+void CNNGradientCheck::checkQuantizedModel()
+{
+    // A small network with all layer sequences the int8 model supports
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,6,3,3,1,1,1,1,3,8,8,false},
+        {"",CNN_LAYER_TYPE_RELU,6,1,1,1,1,0,0,6,8,8,false},
+        {"",CNN_LAYER_TYPE_MAXPOOL,6,2,2,2,2,0,0,6,8,8,false},
+        {"",CNN_LAYER_TYPE_FC,10,0,0,1,1,0,0,6,4,4,false},
+        {"",CNN_LAYER_TYPE_SOFTMAX,10,0,0,1,1,0,0,10,1,1,false}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        layers[layerIndex]=createLayer(geometries[layerIndex]);
+
+    // Image pixels are never negative (see CNNQuantizedLayer)
+    double ***images[CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT];
+    for(uint32_t image=0;image<CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT;image++)
+        images[image]=createRandomArray(3,8,8,0.0,1.0);
+
+    CNNQuantizedModel model(layers,layerCount,images,CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT);
+    double probabilities[10];
+    double error=0.0;
+
+    for(uint32_t image=0;image<CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT;image++)
+    {
+        double ***previousLayerOutput=images[image];
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            double ***output=layers[layerIndex]->forwardPass(previousLayerOutput);
+            if(layerIndex>0)
+                CNNLayer::freeArray(previousLayerOutput,layers[layerIndex]->previousLayerFeatureMapCount,layers[layerIndex]->previousLayerSingleFeatureMapHeight);
+            previousLayerOutput=output;
+        }
+
+        model.classify(images[image],probabilities);
+        for(uint32_t label=0;label<10;label++)
+            error=__max(error,fabs(probabilities[label]-previousLayerOutput[label][0][0]));
+
+        CNNLayer::freeArray(previousLayerOutput,10,1);
+    }
+
+    report("int8 model","class probabilities against the double network",error,CNN_GRADIENT_CHECK_QUANTIZED_TOLERANCE);
+
+    for(uint32_t image=0;image<CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT;image++)
+        CNNLayer::freeArray(images[image],3,8);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex];
+}
+
+void CNNGradientCheck::checkSourceGenerator()
+{
+    // All kernel templates: the first BATCHNORM layer is folded into the CONV layer, the second one is written as factors and offsets, the
+    // DROPOUT layer is left out
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,false},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,4,4,false},
+        {"",CNN_LAYER_TYPE_AVGPOOL,4,3,3,1,1,1,1,4,4,4,false},
+        {"",CNN_LAYER_TYPE_DROPOUT,4,1,1,1,1,0,0,4,4,4,false},
+        {"",CNN_LAYER_TYPE_GLOBAL_AVGPOOL,4,0,0,1,1,0,0,4,4,4,false},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,4,1,1,false},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,false}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+    // The calls of the classify function (the layers are numbered after the inference layers, the outputs alternate between the workspace buffers)
+    const char *expectedLines[]=
+    {
+        "constexpr uint32_t inputCount=192;",
+        "constexpr uint32_t outputCount=5;",
+        "constexpr uint32_t workspaceBufferSize=256;",
+        "    conv<3,8,8,4,8,8,3,3,1,1,1,1>(input,layer1Weights,layer1BiasWeights,workspace.buffer1);",
+        "    relu<256>(workspace.buffer1,workspace.buffer2);",
+        "    maxpool<4,8,8,4,4,2,2,2,2,0,0>(workspace.buffer2,workspace.buffer1);",
+        "    batchnorm<4,16>(workspace.buffer1,layer4Factors,layer4Offsets,workspace.buffer2);",
+        "    avgpool<4,4,4,4,4,3,3,1,1,1,1>(workspace.buffer2,workspace.buffer1);",
+        "    globalAvgpool<4,4,4>(workspace.buffer1,workspace.buffer2);",
+        "    fc<4,5>(workspace.buffer2,layer7Weights,layer7BiasWeights,workspace.buffer1);",
+        "    softmax<5>(workspace.buffer1,outputs);"
+    };
+    // A classification must not allocate anything
+    const char *forbiddenTexts[]={"malloc","calloc","realloc"," new ","new[","std::"};
+
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        layers[layerIndex]=createTestLayer(geometries[layerIndex]);
+
+    std::string source;
+    bool ok=CNNSourceGenerator::generate(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME,layers,layerCount,CNN_SOURCE_GENERATOR_DEFAULT_NAMESPACE);
+    FILE *f=ok?fopen(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME,"rb"):0;
+    if(f!=0)
+    {
+        char buffer[4096];
+        size_t readCount;
+        while((readCount=fread(buffer,1,sizeof(buffer),f))>0)
+            source.append(buffer,readCount);
+        fclose(f);
+    }
+    remove(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME);
+    report("Source generator","generate",ok&&f!=0?0.0:1.0,0.0);
+
+    double error=0.0;
+    for(uint32_t line=0;line<sizeof(expectedLines)/sizeof(expectedLines[0]);line++)
+    {
+        if(source.find(std::string(expectedLines[line])+"\n")==std::string::npos)
+            error=1.0;
+    }
+    report("Source generator","kernel specializations and constexpr shapes",error,0.0);
+
+    error=0.0;
+    for(uint32_t text=0;text<sizeof(forbiddenTexts)/sizeof(forbiddenTexts[0]);text++)
+    {
+        if(source.find(forbiddenTexts[text])!=std::string::npos)
+            error=1.0;
+    }
+    report("Source generator","no allocations",error,0.0);
+
+    // The weight arrays read back with strtod against the inference layers (the factors and offsets calculated like CNNSourceGenerator::writeSource)
+    uint32_t inferenceLayerCount;
+    CNNLayer **inferenceLayers=CNNLayer::createInferenceLayers(layers,layerCount,inferenceLayerCount);
+    CNNLayer *batchnormLayer=inferenceLayers[3];
+    std::vector<double> factors(batchnormLayer->featureMapCount);
+    std::vector<double> offsets(batchnormLayer->featureMapCount);
+    for(uint32_t featureMap=0;featureMap<batchnormLayer->featureMapCount;featureMap++)
+    {
+        double inverseStandardDeviation=1.0/sqrt(batchnormLayer->runningVariances[featureMap]+CNN_BATCHNORM_EPSILON);
+        factors[featureMap]=batchnormLayer->weights[featureMap][0][0][0]*inverseStandardDeviation;
+        offsets[featureMap]=batchnormLayer->biasWeights[featureMap]-factors[featureMap]*batchnormLayer->runningMeans[featureMap];
+    }
+    const char *arrayNames[]={"layer1Weights","layer1BiasWeights","layer4Factors","layer4Offsets","layer7Weights","layer7BiasWeights"};
+    const double *arrayValues[]={CNNLayer::getWeightTypeArrayData(inferenceLayers[0]->weights),inferenceLayers[0]->biasWeights,&factors[0],&offsets[0],
+                                 CNNLayer::getWeightTypeArrayData(inferenceLayers[6]->weights),inferenceLayers[6]->biasWeights};
+    const uint32_t arrayCounts[]={inferenceLayers[0]->weightCount,inferenceLayers[0]->featureMapCount,batchnormLayer->featureMapCount,
+                                  batchnormLayer->featureMapCount,inferenceLayers[6]->weightCount,inferenceLayers[6]->featureMapCount};
+    error=0.0;
+    for(uint32_t array=0;array<sizeof(arrayNames)/sizeof(arrayNames[0]);array++)
+    {
+        std::string declaration=std::string("static const double ")+arrayNames[array]+"["+std::to_string(arrayCounts[array])+"]=\n{";
+        size_t position=source.find(declaration);
+        if(position==std::string::npos)
+        {
+            error=1.0;
+            continue;
+        }
+        const char *text=source.c_str()+position+declaration.size();
+        for(uint32_t index=0;index<arrayCounts[array];index++)
+        {
+            char *end;
+            double value=strtod(text,&end);
+            if(end==text||memcmp(&value,&arrayValues[array][index],sizeof(double))!=0)
+                error=1.0;
+            text=end+strspn(end,", \n");
+        }
+        if(*text!='}')
+            error=1.0;
+    }
+    report("Source generator","weights read back bit-identically",error,0.0);
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        delete inferenceLayers[layerIndex];
+    free(inferenceLayers);
+
+    // Values whose text is easy to get wrong: integers (must stay double literals), -0, subnormals, the extremes
+    const double values[]={1.0,-0.0,0.1,-2.5e-300,std::numeric_limits<double>::denorm_min(),std::numeric_limits<double>::max(),
+                           -std::numeric_limits<double>::min(),1e22,123456789012345678.0};
+    error=0.0;
+    for(uint32_t index=0;index<sizeof(values)/sizeof(values[0]);index++)
+    {
+        char text[64];
+        CNNSourceGenerator::formatDouble(values[index],text,sizeof(text));
+        double value=strtod(text,0);
+        if(memcmp(&value,&values[index],sizeof(double))!=0||strpbrk(text,".e")==0)
+            error=1.0;
+    }
+    report("Source generator","formatDouble round trips",error,0.0);
+
+    // A weight that isn't finite can't be written
+    layers[8]->weights[0][0][0][0]=std::numeric_limits<double>::quiet_NaN();
+    ok=CNNSourceGenerator::generate(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME,layers,layerCount,CNN_SOURCE_GENERATOR_DEFAULT_NAMESPACE);
+    f=fopen(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME,"rb");
+    report("Source generator","a NaN weight is refused",!ok&&f==0?0.0:1.0,0.0);
+    if(f!=0)
+    {
+        fclose(f);
+        remove(CNN_GRADIENT_CHECK_SOURCE_FILE_NAME);
+    }
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex];
+}
+
+void CNNGradientCheck::checkCheckpoint()
+{
+    // All layer types, with state that only a version 3 file stores completely: BATCHNORM running statistics, a DROPOUT rate other than the
+    // default one, AVGPOOL and CONV layers with different receptive fields, strides and zero paddings per dimension
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,false},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,false},
+        {"",CNN_LAYER_TYPE_AVGPOOL,4,3,2,1,2,1,0,4,4,4,false},
+        {"",CNN_LAYER_TYPE_CONV,5,1,3,1,1,0,1,4,4,2,false},
+        {"",CNN_LAYER_TYPE_DROPOUT,5,1,1,1,1,0,0,5,4,2,false},
+        {"",CNN_LAYER_TYPE_GLOBAL_AVGPOOL,5,0,0,1,1,0,0,5,4,2,false},
+        {"",CNN_LAYER_TYPE_FC,6,0,0,1,1,0,0,5,1,1,false},
+        {"",CNN_LAYER_TYPE_SOFTMAX,6,0,0,1,1,0,0,6,1,1,false}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        layers[layerIndex]=createTestLayer(geometries[layerIndex]);
+        layers[layerIndex]->layerId=layerIndex+1;
+    }
+    layers[6]->setDropoutRate(0.3);
+
+    uint32_t loadedLayerCount=0;
+    CNNLayer **loadedLayers=0;
+    if(CNNCheckpoint::save(CNN_GRADIENT_CHECK_CHECKPOINT_FILE_NAME,layers,layerCount))
+        loadedLayers=CNNCheckpoint::load(CNN_GRADIENT_CHECK_CHECKPOINT_FILE_NAME,loadedLayerCount);
+    remove(CNN_GRADIENT_CHECK_CHECKPOINT_FILE_NAME);
+    report("Checkpoint","save and load",loadedLayers!=0&&loadedLayerCount==layerCount?0.0:1.0,0.0);
+    if(loadedLayers==0||loadedLayerCount!=layerCount)
+    {
+        if(loadedLayers!=0)
+            CNNCheckpoint::freeLayers(loadedLayers,loadedLayerCount);
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            delete layers[layerIndex];
+        return;
+    }
+
+    double error=0.0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *layer=layers[layerIndex];
+        CNNLayer *loadedLayer=loadedLayers[layerIndex];
+        if(loadedLayer->layerId!=layer->layerId||loadedLayer->type!=layer->type||loadedLayer->featureMapCount!=layer->featureMapCount
+                ||loadedLayer->receptiveFieldWidth!=layer->receptiveFieldWidth||loadedLayer->receptiveFieldHeight!=layer->receptiveFieldHeight
+                ||loadedLayer->strideX!=layer->strideX||loadedLayer->strideY!=layer->strideY
+                ||loadedLayer->zeroPaddingX!=layer->zeroPaddingX||loadedLayer->zeroPaddingY!=layer->zeroPaddingY
+                ||loadedLayer->previousLayerFeatureMapCount!=layer->previousLayerFeatureMapCount
+                ||loadedLayer->previousLayerSingleFeatureMapWidth!=layer->previousLayerSingleFeatureMapWidth
+                ||loadedLayer->previousLayerSingleFeatureMapHeight!=layer->previousLayerSingleFeatureMapHeight
+                ||loadedLayer->singleFeatureMapWidth!=layer->singleFeatureMapWidth||loadedLayer->singleFeatureMapHeight!=layer->singleFeatureMapHeight
+                ||(layer->type==CNN_LAYER_TYPE_DROPOUT&&loadedLayer->dropoutRate!=layer->dropoutRate))
+            error=1.0;
+    }
+    report("Checkpoint","geometry and dropout rate of every layer",error,0.0);
+
+    uint64_t checksumSeed=random.next();
+    uint64_t checksum=checksumSeed;
+    uint64_t loadedChecksum=checksumSeed;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        checksum=layers[layerIndex]->getParameterChecksum(checksum);
+        loadedChecksum=loadedLayers[layerIndex]->getParameterChecksum(loadedChecksum);
+    }
+    error=compareParameters(loadedLayers,layers,layerCount);
+    if(loadedChecksum!=checksum)
+        error=1.0;
+    report("Checkpoint","parameter checksum, weights and running statistics",error,0.0);
+
+    // Inference passes (BATCHNORM layers use the running statistics), then training passes (the DROPOUT masks depend on the rate; the dropout seed isn't stored)
+    error=0.0;
+    double ***image=createRandomArray(3,8,8,0.0,1.0);
+    for(uint32_t mode=0;mode<2;mode++)
+    {
+        double ***outputs[2];
+        for(uint32_t network=0;network<2;network++)
+        {
+            CNNLayer **networkLayers=network==0?layers:loadedLayers;
+            double ***previousLayerOutput=image;
+            for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            {
+                networkLayers[layerIndex]->setTraining(mode==1);
+                if(networkLayers[layerIndex]->type==CNN_LAYER_TYPE_DROPOUT)
+                    networkLayers[layerIndex]->setDropoutSeed(checksumSeed);
+                double ***output=networkLayers[layerIndex]->forwardPass(previousLayerOutput);
+                if(layerIndex>0)
+                    CNNLayer::freeArray(previousLayerOutput,networkLayers[layerIndex]->previousLayerFeatureMapCount,networkLayers[layerIndex]->previousLayerSingleFeatureMapHeight);
+                previousLayerOutput=output;
+            }
+            outputs[network]=previousLayerOutput;
+        }
+        error=__max(error,compareArrays(outputs[1],outputs[0],6,1,1));
+        CNNLayer::freeArray(outputs[0],6,1);
+        CNNLayer::freeArray(outputs[1],6,1);
+    }
+    report("Checkpoint","inference and training outputs of the loaded network",error,0.0);
+
+    CNNLayer::freeArray(image,3,8);
+    CNNCheckpoint::freeLayers(loadedLayers,loadedLayerCount);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex];
+}
+
+void CNNGradientCheck::checkDropoutMasks()
+{
+    // CNNVectorRandom::next (SIMD) against nextScalar
+    CNNVectorRandom vectorRandom(random.next());
+    CNNVectorRandom scalarRandom=vectorRandom;
+    uint64_t values[CNN_VECTOR_RANDOM_LANE_COUNT];
+    uint64_t scalarValues[CNN_VECTOR_RANDOM_LANE_COUNT];
+    double error=0.0;
+    for(uint32_t call=0;call<100;call++)
+    {
+        vectorRandom.next(values);
+        scalarRandom.nextScalar(scalarValues);
+        for(uint32_t lane=0;lane<CNN_VECTOR_RANDOM_LANE_COUNT;lane++)
+        {
+            if(values[lane]!=scalarValues[lane])
+                error=1.0;
+        }
+    }
+    report("CNNVectorRandom","next against the scalar reference",error,0.0);
+
+    // The fraction of dropped values must match the rate, and the kept ones must be scaled so that the expected output equals the input
+    const double rates[]={0.1,0.5,0.8};
+    for(uint32_t rateIndex=0;rateIndex<sizeof(rates)/sizeof(rates[0]);rateIndex++)
+    {
+        CNNGradientCheckGeometry geometry={"",CNN_LAYER_TYPE_DROPOUT,8,1,1,1,1,0,0,8,50,50,true};
+        CNNLayer *layer=createLayer(geometry);
+        layer->setDropoutRate(rates[rateIndex]);
+        double ***input=createRandomArray(8,50,50,1.0,1.0);
+
+        double keptCount=0.0;
+        double valueCount=0.0;
+        error=0.0;
+        for(uint32_t pass=0;pass<4;pass++)
+        {
+            double ***output=layer->forwardPass(input);
+            for(uint32_t featureMap=0;featureMap<8;featureMap++)
+            {
+                for(int32_t y=0;y<50;y++)
+                {
+                    for(int32_t x=0;x<50;x++)
+                    {
+                        valueCount++;
+                        if(output[featureMap][y][x]==0.0)
+                            continue;
+                        keptCount++;
+                        error=__max(error,getRelativeError(output[featureMap][y][x],1.0/(1.0-rates[rateIndex])));
+                    }
+                }
+            }
+            CNNLayer::freeArray(output,8,50);
+        }
+        error=__max(error,fabs(keptCount/valueCount-(1.0-rates[rateIndex])));
+
+        std::string description=std::string("DROPOUT, rate ")+std::to_string(rates[rateIndex]).substr(0,3);
+        report(description.c_str(),"fraction and scale of the kept values",error,CNN_GRADIENT_CHECK_DROPOUT_RATE_TOLERANCE);
+
+        CNNLayer::freeArray(input,8,50);
+        delete layer;
+    }
+}
+
+void CNNGradientCheck::checkActivationCheckpointing()
+{
+    // All layer types that store state for the backward pass, including the BATCHNORM running statistics and the DROPOUT masks that must not
+    // change when a segment is recomputed
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_CONV,6,3,3,1,1,1,1,4,4,4,true},
+        {"",CNN_LAYER_TYPE_BATCHNORM,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_RELU,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_DROPOUT,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        layers[layerIndex]=createLayer(geometries[layerIndex]);
+        randomizeBatchnormStatistics(layers[layerIndex]);
+    }
+    layers[4]->setStashPrecision(CNN_STASH_PRECISION_BF16); // The stash is recomputed, too
+
+    double ***images[CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT];
+    uint8_t labels[CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT];
+    for(uint32_t step=0;step<CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT;step++)
+    {
+        images[step]=createRandomArray(3,8,8,-1.0,1.0);
+        labels[step]=(uint8_t)(random.next()%5);
+    }
+
+    // The planner against an exhaustive search of all checkpoints with the same last checkpoint
+    CNNActivationCheckpointing planner(layers,layerCount,CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET);
+    uint64_t fullPeakBytes=planner.peakBytes;
+    uint64_t smallestPeakBytes=fullPeakBytes;
+    double error=0.0;
+    for(uint32_t lastCheckpoint=0;lastCheckpoint<layerCount;lastCheckpoint++)
+    {
+        std::vector<bool> checkpoints;
+        uint64_t plannedPeakBytes=planner.planSegments(lastCheckpoint,checkpoints);
+        uint64_t searchedPeakBytes=std::numeric_limits<uint64_t>::max();
+        for(uint32_t subset=0;subset<(1U<<lastCheckpoint);subset++)
+        {
+            // Bit b: checkpoint at layer b+1 (layer 0 and lastCheckpoint are always checkpoints)
+            if(lastCheckpoint>0&&(subset>>(lastCheckpoint-1))!=0)
+                continue;
+            std::vector<bool> subsetCheckpoints(layerCount,false);
+            subsetCheckpoints[0]=true;
+            subsetCheckpoints[lastCheckpoint]=true;
+            for(uint32_t layerIndex=1;layerIndex<lastCheckpoint;layerIndex++)
+                subsetCheckpoints[layerIndex]=((subset>>(layerIndex-1))&1)!=0;
+            searchedPeakBytes=__min(searchedPeakBytes,planner.getPeakBytes(subsetCheckpoints));
+        }
+        if(plannedPeakBytes!=searchedPeakBytes||!checkpoints[0]||!checkpoints[lastCheckpoint])
+            error=1.0;
+        smallestPeakBytes=__min(smallestPeakBytes,plannedPeakBytes);
+    }
+    report("Activation checkpointing","planned peak memory against an exhaustive search",error,0.0);
+
+    // Budgets: unlimited, between the smallest and the full peak, too small (the smallest peak is used), checkpoints at every layer
+    const char *descriptions[]={"Activation checkpointing, unlimited budget","Activation checkpointing, medium budget",
+                                "Activation checkpointing, budget below the smallest peak","Activation checkpointing, checkpoints at every layer"};
+    const uint32_t configurationCount=sizeof(descriptions)/sizeof(descriptions[0]);
+    for(uint32_t configuration=0;configuration<configurationCount;configuration++)
+    {
+        CNNLayer *referenceLayers[layerCount];
+        CNNLayer *checkpointingLayers[layerCount];
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            referenceLayers[layerIndex]=layers[layerIndex]->clone();
+            checkpointingLayers[layerIndex]=layers[layerIndex]->clone();
+        }
+
+        uint64_t budget=CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET;
+        if(configuration==1)
+            budget=(smallestPeakBytes+fullPeakBytes)/2;
+        else if(configuration==2)
+            budget=smallestPeakBytes-1;
+        CNNActivationCheckpointing checkpointing(checkpointingLayers,layerCount,budget);
+        error=0.0;
+        if(configuration==3)
+        {
+            std::vector<uint32_t> checkpointLayers;
+            for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+                checkpointLayers.push_back(layerIndex);
+            checkpointing.setCheckpoints(checkpointLayers);
+        }
+        else if(checkpointing.plan(budget)!=(configuration!=2)||(configuration==1&&checkpointing.peakBytes>budget)
+                ||(configuration==2&&checkpointing.peakBytes!=smallestPeakBytes)||(configuration==0&&checkpointing.recomputedOperationCount!=0))
+            error=1.0;
+        report(descriptions[configuration],"plan",error,0.0);
+
+        // Training steps with the reference loop; the results must be bit-identical
+        CNNOptimizer referenceOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+        CNNOptimizer checkpointingOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+        error=0.0;
+        for(uint32_t step=0;step<CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT;step++)
+        {
+            referenceOptimizer.beginStep();
+            double referenceLoss;
+            double ***referenceOutput=runReferenceTrainingStep(referenceLayers,layerCount,images[step],labels[step],&referenceOptimizer,referenceLoss);
+
+            checkpointingOptimizer.beginStep();
+            double ***output;
+            double loss;
+            checkpointing.trainStep(images[step],labels[step],&checkpointingOptimizer,output,loss);
+
+            error=__max(error,compareArrays(output,referenceOutput,5,1,1));
+            error=__max(error,getRelativeError(loss,referenceLoss));
+            CNNLayer::freeArray(output,5,1);
+            CNNLayer::freeArray(referenceOutput,5,1);
+        }
+        error=__max(error,compareParameters(checkpointingLayers,referenceLayers,layerCount));
+        report(descriptions[configuration],"outputs, losses, weights and running statistics against training without checkpointing",error,0.0);
+
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            delete referenceLayers[layerIndex];
+            delete checkpointingLayers[layerIndex];
+        }
+    }
+
+    for(uint32_t step=0;step<CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT;step++)
+        CNNLayer::freeArray(images[step],3,8);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex];
+}
+
+void CNNGradientCheck::checkDataParallelTraining()
+{
+    // All parameters the trainer averages (weights, bias weights, BATCHNORM running statistics) and a DROPOUT layer, whose replicas are seeded per worker
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_DROPOUT,4,1,1,1,1,0,0,4,4,4,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,4,4,4,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+    const uint32_t workerCount=CNN_GRADIENT_CHECK_DATA_PARALLEL_WORKER_COUNT;
+    const uint32_t roundExampleCount=workerCount*CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL;
+
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        layers[layerIndex]=createTestLayer(geometries[layerIndex]);
+    double ***images[CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT];
+    uint8_t labels[CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT];
+    for(uint32_t image=0;image<CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT;image++)
+    {
+        images[image]=createRandomArray(3,8,8,-1.0,1.0);
+        labels[image]=(uint8_t)(random.next()%5);
+    }
+    uint64_t seed=random.next();
+
+    // Two trainers with the same seed on copies of the same layers
+    CNNLayer *trainerLayers[2][layerCount];
+    CNNDataParallelTrainer *trainers[2];
+    CNNOptimizer *trainerOptimizers[2];
+    for(uint32_t trainer=0;trainer<2;trainer++)
+    {
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            trainerLayers[trainer][layerIndex]=layers[layerIndex]->clone();
+        trainers[trainer]=new CNNDataParallelTrainer(trainerLayers[trainer],layerCount,images,labels,CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT,
+                                                     workerCount,CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL,seed);
+        trainerOptimizers[trainer]=new CNNOptimizer(CNN_OPTIMIZER_TYPE_ADAM,0.01,0.0,0.0001);
+    }
+
+    // The reference trains a replica per worker on one thread (with the shard, sampler seed and dropout seed of the worker, and an optimizer
+    // state that is kept across rounds) and averages the replicas like the trainer: within each node, then across the nodes. On one node the
+    // result is the plain average of the replicas.
+    CNNLayer *referenceLayers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        referenceLayers[layerIndex]=layers[layerIndex]->clone();
+    std::vector<std::vector<CNNLayer*>> replicas(workerCount,std::vector<CNNLayer*>(layerCount));
+    std::vector<CNNSampler*> samplers(workerCount);
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+    {
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            replicas[workerIndex][layerIndex]=layers[layerIndex]->clone();
+            replicas[workerIndex][layerIndex]->setDropoutSeed(layers[layerIndex]->dropoutSeed+workerIndex);
+        }
+        uint32_t shardFirstIndex,shardIndexCount;
+        CNNSampler::getShard(CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT,workerIndex,workerCount,shardFirstIndex,shardIndexCount);
+        samplers[workerIndex]=new CNNSampler(shardFirstIndex,shardIndexCount,seed+workerIndex);
+    }
+    CNNOptimizer referenceOptimizer(CNN_OPTIMIZER_TYPE_ADAM,0.01,0.0,0.0001);
+    uint32_t parameterCount=CNNDataParallelTrainer::getParameterCount(layers,layerCount);
+    const std::vector<uint32_t> &nodeWorkerCounts=trainers[0]->nodeWorkerCounts;
+
+    double referenceError=0.0;
+    double determinismError=0.0;
+    for(uint32_t round=0;round<CNN_GRADIENT_CHECK_DATA_PARALLEL_ROUND_COUNT;round++)
+    {
+        std::vector<uint32_t> imageIds[2];
+        std::vector<double***> outputs[2];
+        std::vector<double> losses[2];
+        for(uint32_t trainer=0;trainer<2;trainer++)
+        {
+            imageIds[trainer].assign(roundExampleCount,0);
+            outputs[trainer].assign(roundExampleCount,(double***)0);
+            losses[trainer].assign(roundExampleCount,0.0);
+            trainers[trainer]->trainRound(trainerOptimizers[trainer],&imageIds[trainer][0],&outputs[trainer][0],&losses[trainer][0]);
+        }
+
+        std::vector<double> parameters(parameterCount);
+        CNNDataParallelTrainer::getParameters(referenceLayers,layerCount,&parameters[0]);
+        std::vector<std::vector<double>> nodeAverages(nodeWorkerCounts.size(),std::vector<double>(parameterCount,0.0));
+        for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+        {
+            CNNDataParallelTrainer::setParameters(replicas[workerIndex].data(),layerCount,&parameters[0]);
+            CNNOptimizer workerOptimizer=referenceOptimizer;
+            for(uint32_t example=0;example<CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL;example++)
+            {
+                uint32_t exampleInRound=workerIndex*CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL+example;
+                uint32_t imageId=samplers[workerIndex]->next();
+                workerOptimizer.beginStep();
+                double loss;
+                double ***output=runReferenceTrainingStep(replicas[workerIndex].data(),layerCount,images[imageId],labels[imageId],&workerOptimizer,loss);
+                if(imageIds[0][exampleInRound]!=imageId)
+                    referenceError=1.0;
+                referenceError=__max(referenceError,compareArrays(outputs[0][exampleInRound],output,5,1,1));
+                referenceError=__max(referenceError,getRelativeError(losses[0][exampleInRound],loss));
+                CNNLayer::freeArray(output,5,1);
+            }
+
+            std::vector<double> replicaParameters(parameterCount);
+            CNNDataParallelTrainer::getParameters(replicas[workerIndex].data(),layerCount,&replicaParameters[0]);
+            uint32_t node=trainers[0]->workers[workerIndex]->node;
+            double weight=1.0/nodeWorkerCounts[node];
+            for(uint32_t parameter=0;parameter<parameterCount;parameter++)
+                nodeAverages[node][parameter]+=weight*replicaParameters[parameter];
+        }
+        std::vector<double> average(parameterCount,0.0);
+        for(uint32_t node=0;node<nodeWorkerCounts.size();node++)
+        {
+            if(nodeWorkerCounts[node]==0)
+                continue;
+            double weight=((double)nodeWorkerCounts[node])/workerCount;
+            for(uint32_t parameter=0;parameter<parameterCount;parameter++)
+                average[parameter]+=weight*nodeAverages[node][parameter];
+        }
+        CNNDataParallelTrainer::setParameters(referenceLayers,layerCount,&average[0]);
+        referenceOptimizer.stepCount+=CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL;
+
+        for(uint32_t example=0;example<roundExampleCount;example++)
+        {
+            if(imageIds[1][example]!=imageIds[0][example])
+                determinismError=1.0;
+            determinismError=__max(determinismError,compareArrays(outputs[1][example],outputs[0][example],5,1,1));
+            determinismError=__max(determinismError,getRelativeError(losses[1][example],losses[0][example]));
+            CNNLayer::freeArray(outputs[0][example],5,1);
+            CNNLayer::freeArray(outputs[1][example],5,1);
+        }
+        if(trainerOptimizers[0]->stepCount!=referenceOptimizer.stepCount)
+            referenceError=1.0;
+    }
+    referenceError=__max(referenceError,compareParameters(trainerLayers[0],referenceLayers,layerCount));
+    determinismError=__max(determinismError,compareParameters(trainerLayers[1],trainerLayers[0],layerCount));
+    report("Data-parallel training","sampled images, outputs, losses, weights and running statistics against replicas averaged on one thread",referenceError,0.0);
+    report("Data-parallel training","two trainers with the same seed",determinismError,0.0);
+
+    for(uint32_t trainer=0;trainer<2;trainer++)
+    {
+        delete trainers[trainer]; // Before its layers
+        delete trainerOptimizers[trainer];
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            delete trainerLayers[trainer][layerIndex];
+    }
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+    {
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            delete replicas[workerIndex][layerIndex];
+        delete samplers[workerIndex];
+    }
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        delete referenceLayers[layerIndex];
+        delete layers[layerIndex];
+    }
+    for(uint32_t image=0;image<CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT;image++)
+        CNNLayer::freeArray(images[image],3,8);
+}
+
+void CNNGradientCheck::checkDistributedTraining()
+{
+#ifndef _WIN32
+    const uint32_t worldSize=CNN_GRADIENT_CHECK_DISTRIBUTED_WORLD_SIZE;
+    const char *description="Distributed training";
+    const CNNGradientCheckGeometry geometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,4,4,4,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+
+    // Every rank reduces its own random arrays: a single value, fewer values than ranks (empty chunks) and several values per chunk
+    const uint32_t arraySizes[]={1,worldSize-1,1000};
+    const uint32_t arrayCount=sizeof(arraySizes)/sizeof(arraySizes[0]);
+    std::vector<std::vector<std::vector<double> > > arrays(worldSize,std::vector<std::vector<double> >(arrayCount)); // Dimensions: rank -> array -> value
+    for(uint32_t rank=0;rank<worldSize;rank++)
+    {
+        for(uint32_t array=0;array<arrayCount;array++)
+        {
+            for(uint32_t value=0;value<arraySizes[array];value++)
+                arrays[rank][array].push_back(-1.0+random.nextDouble()*2.0);
+        }
+    }
+    std::vector<std::vector<std::vector<double> > > sums=arrays; // Reduced in place by the ranks
+
+    CNNLayer *referenceLayers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        referenceLayers[layerIndex]=createTestLayer(geometries[layerIndex]);
+    const uint32_t imageCount=worldSize*CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT;
+    double ***images[imageCount];
+    uint8_t labels[imageCount];
+    for(uint32_t image=0;image<imageCount;image++)
+    {
+        images[image]=createRandomArray(3,8,8,-1.0,1.0);
+        labels[image]=(uint8_t)(random.next()%5);
+    }
+    uint32_t parameterCount=CNNDataParallelTrainer::getParameterCount(referenceLayers,layerCount);
+
+    // What every rank did in every step (dimensions: rank -> step), and its layers after the last step
+    std::vector<std::vector<uint32_t> > imageIds(worldSize,std::vector<uint32_t>(CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT,0));
+    std::vector<std::vector<std::vector<double> > > reducedDiffs(worldSize,std::vector<std::vector<double> >(CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT));
+    std::vector<std::vector<double> > meanLosses(worldSize,std::vector<double>(CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT,0.0));
+    std::vector<CNNLayer**> rankLayers(worldSize);
+    std::vector<uint8_t> rankFinished(worldSize,0); // Not std::vector<bool>: the ranks write their flags at the same time
+    uint64_t samplerSeed=random.next(); // The trainers add the rank
+
+    std::vector<std::thread> threads;
+    for(uint32_t rank=0;rank<worldSize;rank++)
+    {
+        rankLayers[rank]=(CNNLayer**)malloc(layerCount*sizeof(CNNLayer*));
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            rankLayers[rank][layerIndex]=referenceLayers[layerIndex]->clone();
+
+        threads.push_back(std::thread([&,rank]()
+        {
+            CNNRingAllReduce ring(rank,worldSize);
+            if(!ring.connect(std::vector<std::string>(worldSize,"127.0.0.1"),CNN_GRADIENT_CHECK_DISTRIBUTED_BASE_PORT,CNN_GRADIENT_CHECK_DISTRIBUTED_TIMEOUT_MS))
+                return;
+            // Queued together, so the later ones wait for the earlier ones on the communication thread
+            for(uint32_t array=0;array<arrayCount;array++)
+                ring.startAllReduce(&sums[rank][array][0],arraySizes[array]);
+            if(!ring.finishAllReduces())
+                return;
+
+            CNNDistributedTrainer trainer(rankLayers[rank],layerCount,images,labels,imageCount,&ring,samplerSeed);
+            CNNOptimizer optimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+            if(!trainer.synchronizeParameters())
+                return;
+            for(uint32_t step=0;step<CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT;step++)
+            {
+                optimizer.beginStep();
+                double ***output;
+                double loss;
+                if(!trainer.trainStep(&optimizer,imageIds[rank][step],output,loss))
+                    return;
+                CNNLayer::freeArray(output,5,1);
+                for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+                {
+                    CNNLayer *thisLayer=rankLayers[rank][layerIndex];
+                    if(trainer.diffBuckets[layerIndex]!=0)
+                        reducedDiffs[rank][step].insert(reducedDiffs[rank][step].end(),trainer.diffBuckets[layerIndex],trainer.diffBuckets[layerIndex]+thisLayer->weightCount+thisLayer->featureMapCount);
+                }
+                meanLosses[rank][step]=trainer.meanLoss;
+            }
+            rankFinished[rank]=1;
+        }));
+    }
+    for(uint32_t rank=0;rank<worldSize;rank++)
+        threads[rank].join();
+
+    double error=0.0;
+    for(uint32_t rank=0;rank<worldSize;rank++)
+    {
+        if(rankFinished[rank]==0)
+            error=1.0;
+    }
+    report(description,"connecting and training the ranks",error,0.0);
+
+    if(error==0.0)
+    {
+        // All ranks receive bit-identical sums; they add up in another order than a plain loop
+        double rankError=0.0;
+        error=0.0;
+        for(uint32_t array=0;array<arrayCount;array++)
+        {
+            for(uint32_t value=0;value<arraySizes[array];value++)
+            {
+                double sum=0.0;
+                for(uint32_t rank=0;rank<worldSize;rank++)
+                    sum+=arrays[rank][array][value];
+                for(uint32_t rank=0;rank<worldSize;rank++)
+                {
+                    error=__max(error,getRelativeError(sums[rank][array][value],sum));
+                    rankError=__max(rankError,getRelativeError(sums[rank][array][value],sums[0][array][value]));
+                }
+            }
+        }
+        report(description,"all-reduced random arrays of all ranks against rank 0",rankError,0.0);
+        report(description,"all-reduced random arrays against plain sums",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+        // The reference averages the diffs of the examples the ranks trained on in each step and applies them once
+        CNNOptimizer referenceOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+        double shardError=0.0;
+        rankError=0.0;
+        error=0.0;
+        for(uint32_t step=0;step<CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT;step++)
+        {
+            std::vector<double> diffSums(parameterCount,0.0);
+            double lossSum=0.0;
+            for(uint32_t rank=0;rank<worldSize;rank++)
+            {
+                uint32_t shardFirstIndex;
+                uint32_t shardIndexCount;
+                CNNSampler::getShard(imageCount,rank,worldSize,shardFirstIndex,shardIndexCount);
+                uint32_t imageId=imageIds[rank][step];
+                if(imageId<shardFirstIndex||imageId>=shardFirstIndex+shardIndexCount)
+                    shardError=1.0;
+                addReferenceDiffs(referenceLayers,layerCount,images[imageId],labels[imageId],diffSums,lossSum);
+            }
+
+            for(uint32_t rank=0;rank<worldSize;rank++)
+            {
+                error=__max(error,getRelativeError(meanLosses[rank][step],lossSum/worldSize));
+                for(uint32_t parameter=0;parameter<parameterCount;parameter++)
+                {
+                    error=__max(error,getRelativeError(reducedDiffs[rank][step][parameter]/worldSize,diffSums[parameter]/worldSize));
+                    rankError=__max(rankError,getRelativeError(reducedDiffs[rank][step][parameter],reducedDiffs[0][step][parameter]));
+                }
+            }
+
+            referenceOptimizer.beginStep();
+            uint32_t position=0;
+            for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            {
+                CNNLayer *thisLayer=referenceLayers[layerIndex];
+                if(!thisLayer->hasWeights())
+                    continue;
+                double ****weightDiffs=thisLayer->allocWeightDiffs();
+                double *biasWeightDiffs=(double*)malloc(thisLayer->featureMapCount*sizeof(double));
+                double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+                for(uint32_t weight=0;weight<thisLayer->weightCount;weight++)
+                    weightDiffData[weight]=diffSums[position++]/worldSize;
+                for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+                    biasWeightDiffs[featureMap]=diffSums[position++]/worldSize;
+                thisLayer->applyDiffs(weightDiffs,biasWeightDiffs,&referenceOptimizer);
+                freeDiffs(thisLayer,weightDiffs,biasWeightDiffs,0);
+            }
+        }
+        report(description,"examples drawn from the own shard of each rank",shardError,0.0);
+        report(description,"averaged diffs and losses of all ranks against rank 0",rankError,0.0);
+        report(description,"averaged diffs and losses against the single-process average",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+        // The ranks apply bit-identical updates, so their replicas stay the same
+        rankError=0.0;
+        error=0.0;
+        for(uint32_t rank=0;rank<worldSize;rank++)
+        {
+            rankError=__max(rankError,compareParameters(rankLayers[rank],rankLayers[0],layerCount));
+            error=__max(error,compareParameters(rankLayers[rank],referenceLayers,layerCount));
+        }
+        report(description,"parameters of all ranks against rank 0",rankError,0.0);
+        report(description,"parameters against the single-process average",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+    }
+
+    for(uint32_t rank=0;rank<worldSize;rank++)
+    {
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            delete rankLayers[rank][layerIndex];
+        free(rankLayers[rank]);
+    }
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete referenceLayers[layerIndex];
+    for(uint32_t image=0;image<imageCount;image++)
+        CNNLayer::freeArray(images[image],3,8);
+#endif
+}
+
+void CNNGradientCheck::checkPipelineTraining()
+{
+    // Without BATCHNORM layers the examples of a batch are independent of each other; the second network has stages that buffer the whole batch
+    // (one of them with a DROPOUT layer, whose masks must be drawn in the same order)
+    const CNNGradientCheckGeometry plainGeometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_CONV,6,3,3,1,1,1,1,4,4,4,true},
+        {"",CNN_LAYER_TYPE_RELU,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_DROPOUT,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const CNNGradientCheckGeometry batchnormGeometries[]=
+    {
+        {"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,true},
+        {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_RELU,4,1,1,1,1,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_MAXPOOL,4,2,2,2,2,0,0,4,8,8,true},
+        {"",CNN_LAYER_TYPE_CONV,6,3,3,1,1,1,1,4,4,4,true},
+        {"",CNN_LAYER_TYPE_BATCHNORM,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_RELU,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_DROPOUT,6,1,1,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_FC,5,0,0,1,1,0,0,6,4,4,true},
+        {"",CNN_LAYER_TYPE_SOFTMAX,5,0,0,1,1,0,0,5,1,1,true}
+    };
+    const CNNGradientCheckGeometry *configurationGeometries[]={plainGeometries,batchnormGeometries};
+    const uint32_t configurationLayerCounts[]={sizeof(plainGeometries)/sizeof(plainGeometries[0]),sizeof(batchnormGeometries)/sizeof(batchnormGeometries[0])};
+    const char *descriptions[]={"Pipeline training","Pipeline training, BATCHNORM stages"};
+
+    for(uint32_t configuration=0;configuration<2;configuration++)
+    {
+        uint32_t layerCount=configurationLayerCounts[configuration];
+        std::vector<CNNLayer*> referenceLayers(layerCount);
+        std::vector<CNNLayer*> pipelineLayers(layerCount);
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            pipelineLayers[layerIndex]=createTestLayer(configurationGeometries[configuration][layerIndex]);
+            referenceLayers[layerIndex]=pipelineLayers[layerIndex]->clone();
+        }
+
+        double ***images[CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT][CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+        uint8_t labels[CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT][CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+        for(uint32_t step=0;step<CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT;step++)
+        {
+            for(uint32_t example=0;example<CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE;example++)
+            {
+                images[step][example]=createRandomArray(3,8,8,-1.0,1.0);
+                labels[step][example]=(uint8_t)(random.next()%5);
+            }
+        }
+
+        // SGD without momentum and weight decay: the optimizer state of every weight is -learningRate times its averaged diff of the last step,
+        // so comparing the states compares the diffs
+        CNNPipeline *pipeline=new CNNPipeline(pipelineLayers.data(),layerCount,CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE,0);
+        CNNOptimizer referenceOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.0,0.0);
+        CNNOptimizer pipelineOptimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.0,0.0);
+        double outputError=0.0;
+        double diffError=0.0;
+        for(uint32_t step=0;step<CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT;step++)
+        {
+            double ***referenceOutputs[CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+            double referenceLosses[CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+            referenceOptimizer.beginStep();
+            if(configuration==0)
+                runReferenceBatchStep(referenceLayers.data(),layerCount,images[step],labels[step],CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE,&referenceOptimizer,referenceOutputs,referenceLosses);
+            else
+                runReferenceBatchnormBatchStep(referenceLayers.data(),layerCount,images[step],labels[step],CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE,&referenceOptimizer,referenceOutputs,referenceLosses);
+
+            double ***outputs[CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+            double losses[CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE];
+            pipelineOptimizer.beginStep();
+            pipeline->train(images[step],labels[step],CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE,&pipelineOptimizer,outputs,losses);
+
+            for(uint32_t example=0;example<CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE;example++)
+            {
+                outputError=__max(outputError,compareArrays(outputs[example],referenceOutputs[example],5,1,1));
+                outputError=__max(outputError,getRelativeError(losses[example],referenceLosses[example]));
+                CNNLayer::freeArray(outputs[example],5,1);
+                CNNLayer::freeArray(referenceOutputs[example],5,1);
+            }
+            for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+            {
+                CNNLayer *layer=pipelineLayers[layerIndex];
+                if(!layer->hasWeights())
+                    continue;
+                for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                    diffError=__max(diffError,getRelativeError(layer->weightOptimizerState1[weight],referenceLayers[layerIndex]->weightOptimizerState1[weight]));
+                for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+                    diffError=__max(diffError,getRelativeError(layer->biasWeightOptimizerState1[featureMap],referenceLayers[layerIndex]->biasWeightOptimizerState1[featureMap]));
+            }
+        }
+        report(descriptions[configuration],"outputs and losses against training on one thread",outputError,0.0);
+        report(descriptions[configuration],"averaged diffs against training on one thread",diffError,0.0);
+        report(descriptions[configuration],"weights and running statistics against training on one thread",
+               compareParameters(pipelineLayers.data(),referenceLayers.data(),layerCount),0.0);
+
+        delete pipeline; // Stops the stage threads before their layers are deleted
+        for(uint32_t step=0;step<CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT;step++)
+        {
+            for(uint32_t example=0;example<CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE;example++)
+                CNNLayer::freeArray(images[step][example],3,8);
+        }
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            delete referenceLayers[layerIndex];
+            delete pipelineLayers[layerIndex];
+        }
+    }
+}
+
+void CNNGradientCheck::checkSoftmaxLoss()
+{
+    // The loss is invariant to adding a constant to all logits, so the loss of logits shifted by +-1000 (whose exponentials overflow or
+    // underflow) must match the plain -log(exp(logit[desiredLabel])/sum of exp(logits)) of the unshifted logits
+    const double shifts[]={0.0,1000.0,-1000.0};
+    CNNGradientCheckGeometry geometry={"",CNN_LAYER_TYPE_SOFTMAX,10,0,0,1,1,0,0,10,1,1,true};
+    CNNLayer *layer=createLayer(geometry);
+    double ***input=createRandomArray(10,1,1,-5.0,5.0);
+
+    double error=0.0;
+    for(uint32_t desiredLabel=0;desiredLabel<10;desiredLabel++)
+    {
+        double ePowSum=0.0;
+        for(uint32_t featureMap=0;featureMap<10;featureMap++)
+            ePowSum+=exp(input[featureMap][0][0]);
+        double referenceLoss=-log(exp(input[desiredLabel][0][0])/ePowSum);
+
+        for(uint32_t shiftIndex=0;shiftIndex<sizeof(shifts)/sizeof(shifts[0]);shiftIndex++)
+        {
+            double ***shiftedInput=layer->cloneArray(input,10,1,1);
+            for(uint32_t featureMap=0;featureMap<10;featureMap++)
+                shiftedInput[featureMap][0][0]+=shifts[shiftIndex];
+
+            double ***output=layer->forwardPass(shiftedInput);
+            double ****weightDiffs=0;
+            double *biasWeightDiffs=0;
+            double ***inputDiffs=0;
+            layer->calculateDiffs(weightDiffs,biasWeightDiffs,0,inputDiffs,desiredLabel);
+            error=__max(error,getRelativeError(layer->defaultContext.loss,referenceLoss));
+
+            freeDiffs(layer,weightDiffs,biasWeightDiffs,inputDiffs);
+            CNNLayer::freeArray(output,10,1);
+            CNNLayer::freeArray(shiftedInput,10,1);
+        }
+    }
+    report("SOFTMAX 10","loss of shifted logits against the reference",error,CNN_GRADIENT_CHECK_KERNEL_TOLERANCE);
+
+    CNNLayer::freeArray(input,10,1);
+    delete layer;
+}
+
+void CNNGradientCheck::report(const char *description, const char *checkName, double error, double tolerance)
+{
+    bool passed=error<=tolerance;
+    checkCount++;
+    if(!passed)
+        failedCheckCount++;
+    out<<(passed?"PASS ":"FAIL ")<<description<<": "<<checkName<<" (max error "<<error<<", tolerance "<<tolerance<<")"<<std::endl;
+}
+
+CNNLayer *CNNGradientCheck::createLayer(const CNNGradientCheckGeometry &geometry)
+{
+    CNNLayer *layer=new CNNLayer(1,geometry.type,geometry.featureMapCount,geometry.receptiveFieldWidth,geometry.receptiveFieldHeight,geometry.strideX,geometry.strideY,
+                                 geometry.zeroPaddingX,geometry.zeroPaddingY,geometry.previousLayerFeatureMapCount,geometry.previousLayerSingleFeatureMapWidth,
+                                 geometry.previousLayerSingleFeatureMapHeight,random.next());
+    layer->setTraining(geometry.training);
+    return layer;
+}
+
+void CNNGradientCheck::randomizeBatchnormStatistics(CNNLayer *layer)
+{
+    // Scales and running statistics that differ from their initial values (1, 0 and 1), so that they are actually tested
+    if(layer->type!=CNN_LAYER_TYPE_BATCHNORM)
+        return;
+    for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+    {
+        layer->weights[featureMap][0][0][0]=0.5+random.nextDouble();
+        layer->runningMeans[featureMap]=-0.5+random.nextDouble();
+        layer->runningVariances[featureMap]=0.5+random.nextDouble();
+    }
+}
+
+double ***CNNGradientCheck::createRandomArray(uint32_t zDimension, int32_t yDimension, int32_t xDimension, double minValue, double maxValue)
+{
+    double ***out=CNNLayer::allocArray(zDimension,yDimension,xDimension);
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            for(int32_t x=0;x<xDimension;x++)
+                out[z][y][x]=minValue+random.nextDouble()*(maxValue-minValue);
+        }
+    }
+    return out;
+}
+
+void CNNGradientCheck::collectValues(double ***_array, uint32_t zDimension, int32_t yDimension, int32_t xDimension, std::vector<double*> &values)
+{
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            for(int32_t x=0;x<xDimension;x++)
+                values.push_back(&_array[z][y][x]);
+        }
+    }
+}
+
+double CNNGradientCheck::getRelativeError(double value, double referenceValue)
+{
+    // Values below 1e-3 are compared absolutely, so that rounding noise around gradients that are (almost) 0 is not reported as an error
+    return fabs(value-referenceValue)/__max(fabs(value)+fabs(referenceValue),1e-3);
+}
+
+double CNNGradientCheck::compareArrays(double ***array1, double ***array2, uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    double error=0.0;
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            for(int32_t x=0;x<xDimension;x++)
+                error=__max(error,getRelativeError(array1[z][y][x],array2[z][y][x]));
+        }
+    }
+    return error;
+}
+
+void CNNGradientCheck::freeDiffs(CNNLayer *layer, double ****weightDiffs, double *biasWeightDiffs, double ***inputDiffs)
+{
+    if(weightDiffs!=0)
+        layer->freeWeightDiffs(weightDiffs);
+    if(biasWeightDiffs!=0)
+        CNNLayer::freeBiasTypeArray(biasWeightDiffs);
+    if(inputDiffs!=0)
+        CNNLayer::freeArray(inputDiffs,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+}
+
+CNNLayer *CNNGradientCheck::createTestLayer(const CNNGradientCheckGeometry &geometry)
+{
+    CNNLayer *layer=createLayer(geometry);
+    if(layer->type==CNN_LAYER_TYPE_CONV||layer->type==CNN_LAYER_TYPE_FC)
+    {
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            layer->biasWeights[featureMap]=-0.1+random.nextDouble()*0.2;
+    }
+    randomizeBatchnormStatistics(layer);
+    return layer;
+}
+
+void CNNGradientCheck::checkAgainstReference(const CNNGradientCheckGeometry &geometry, const char *checkName, double tolerance,
+                                             const std::function<void(CNNLayer*)> &configureReference, const std::function<void(CNNLayer*)> &configure)
+{
+    CNNLayer *referenceLayer=createTestLayer(geometry);
+    CNNLayer *layer=referenceLayer->clone();
+    if(configureReference)
+        configureReference(referenceLayer);
+    configure(layer);
+
+    double ***input=createRandomArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,-1.0,1.0);
+    double ***outputDiffs=createRandomArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth,-1.0,1.0);
+    CNNGradientCheckPasses referencePasses;
+    CNNGradientCheckPasses passes;
+    runPasses(referenceLayer,input,outputDiffs,0,referenceLayer->defaultContext,true,referencePasses);
+    runPasses(layer,input,outputDiffs,0,layer->defaultContext,true,passes);
+    report(geometry.description,checkName,comparePasses(layer,passes,referencePasses),tolerance);
+
+    freePasses(layer,passes);
+    freePasses(layer,referencePasses);
+    CNNLayer::freeArray(outputDiffs,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete layer;
+    delete referenceLayer;
+}
+
+void CNNGradientCheck::runPasses(CNNLayer *layer, double ***input, double ***outputDiffs, uint32_t desiredLabel, CNNLayerContext &context, bool update, CNNGradientCheckPasses &passes)
+{
+    passes=CNNGradientCheckPasses();
+    passes.output=layer->forwardPass(input,context);
+    if(!context.training)
+        return;
+    layer->calculateDiffs(passes.weightDiffs,passes.biasWeightDiffs,outputDiffs,passes.inputDiffs,desiredLabel,context);
+    if(update&&layer->hasWeights())
+    {
+        CNNOptimizer optimizer(CNN_OPTIMIZER_TYPE_SGD_MOMENTUM,0.01,0.5,0.0001);
+        optimizer.beginStep();
+        layer->applyDiffs(passes.weightDiffs,passes.biasWeightDiffs,&optimizer);
+        passes.updatedOutput=layer->forwardPass(input,context);
+    }
+}
+
+double CNNGradientCheck::comparePasses(CNNLayer *layer, const CNNGradientCheckPasses &passes, const CNNGradientCheckPasses &referencePasses)
+{
+    double error=compareArrays(passes.output,referencePasses.output,layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+    if((passes.inputDiffs==0)!=(referencePasses.inputDiffs==0))
+        return 1.0;
+    if(passes.inputDiffs==0)
+        return error; // Inference passes
+    error=__max(error,compareArrays(passes.inputDiffs,referencePasses.inputDiffs,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,
+                                    layer->previousLayerSingleFeatureMapWidth));
+    if(layer->hasWeights())
+    {
+        double *weightDiffData=CNNLayer::getWeightTypeArrayData(passes.weightDiffs);
+        double *referenceWeightDiffData=CNNLayer::getWeightTypeArrayData(referencePasses.weightDiffs);
+        for(uint32_t weight=0;weight<layer->weightCount;weight++)
+            error=__max(error,getRelativeError(weightDiffData[weight],referenceWeightDiffData[weight]));
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            error=__max(error,getRelativeError(passes.biasWeightDiffs[featureMap],referencePasses.biasWeightDiffs[featureMap]));
+    }
+    if((passes.updatedOutput==0)!=(referencePasses.updatedOutput==0))
+        return 1.0;
+    if(passes.updatedOutput!=0)
+        error=__max(error,compareArrays(passes.updatedOutput,referencePasses.updatedOutput,layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth));
+    return error;
+}
+
+void CNNGradientCheck::freePasses(CNNLayer *layer, CNNGradientCheckPasses &passes)
+{
+    freeDiffs(layer,passes.weightDiffs,passes.biasWeightDiffs,passes.inputDiffs);
+    CNNLayer::freeArray(passes.output,layer->featureMapCount,layer->singleFeatureMapHeight);
+    if(passes.updatedOutput!=0)
+        CNNLayer::freeArray(passes.updatedOutput,layer->featureMapCount,layer->singleFeatureMapHeight);
+    passes=CNNGradientCheckPasses();
+}
+
+double ***CNNGradientCheck::runReferenceTrainingStep(CNNLayer **layers, uint32_t layerCount, double ***image, uint8_t label, CNNOptimizer *optimizer, double &loss)
+{
+    // Written out like CNNTrainingStep::run, so that the checks of the trainers don't depend on it
+    double ***previousLayerOutput=image;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        double ***output=layers[layerIndex]->forwardPass(previousLayerOutput);
+        if(layerIndex>0)
+            CNNLayer::freeArray(previousLayerOutput,layers[layerIndex]->previousLayerFeatureMapCount,layers[layerIndex]->previousLayerSingleFeatureMapHeight);
+        previousLayerOutput=output;
+    }
+    double ***higherLayerInputDiffs=0;
+    for(uint32_t _layerIndex=layerCount;_layerIndex>0;_layerIndex--)
+    {
+        CNNLayer *layer=layers[_layerIndex-1];
+        double ****weightDiffs=0;
+        double *biasWeightDiffs=0;
+        double ***inputDiffs=0;
+        layer->calculateDiffs(weightDiffs,biasWeightDiffs,higherLayerInputDiffs,inputDiffs,label);
+        layer->applyDiffs(weightDiffs,biasWeightDiffs,optimizer);
+        freeDiffs(layer,weightDiffs,biasWeightDiffs,0);
+        if(higherLayerInputDiffs!=0)
+            CNNLayer::freeArray(higherLayerInputDiffs,layer->featureMapCount,layer->singleFeatureMapHeight);
+        higherLayerInputDiffs=inputDiffs;
+    }
+    CNNLayer::freeArray(higherLayerInputDiffs,layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+    loss=layers[layerCount-1]->type==CNN_LAYER_TYPE_SOFTMAX?layers[layerCount-1]->defaultContext.loss:0.0;
+    return previousLayerOutput;
+}
+
+void CNNGradientCheck::addReferenceDiffs(CNNLayer **layers, uint32_t layerCount, double ***image, uint8_t label, std::vector<double> &diffSums, double &lossSum)
+{
+    double ***previousLayerOutput=image;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        double ***output=layers[layerIndex]->forwardPass(previousLayerOutput);
+        if(layerIndex>0)
+            CNNLayer::freeArray(previousLayerOutput,layers[layerIndex]->previousLayerFeatureMapCount,layers[layerIndex]->previousLayerSingleFeatureMapHeight);
+        previousLayerOutput=output;
+    }
+    CNNLayer::freeArray(previousLayerOutput,layers[layerCount-1]->featureMapCount,layers[layerCount-1]->singleFeatureMapHeight);
+
+    // The positions of the layers in diffSums, from the bottom up
+    std::vector<uint32_t> positions(layerCount,0);
+    uint32_t position=0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        positions[layerIndex]=position;
+        if(layers[layerIndex]->hasWeights())
+            position+=layers[layerIndex]->weightCount+layers[layerIndex]->featureMapCount;
+    }
+
+    double ***higherLayerInputDiffs=0;
+    for(uint32_t _layerIndex=layerCount;_layerIndex>0;_layerIndex--)
+    {
+        CNNLayer *layer=layers[_layerIndex-1];
+        double ****weightDiffs=0;
+        double *biasWeightDiffs=0;
+        double ***inputDiffs=0;
+        layer->calculateDiffs(weightDiffs,biasWeightDiffs,higherLayerInputDiffs,inputDiffs,label);
+        if(weightDiffs!=0)
+        {
+            double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+            double *sums=&diffSums[positions[_layerIndex-1]];
+            for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                sums[weight]+=weightDiffData[weight];
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+                sums[layer->weightCount+featureMap]+=biasWeightDiffs[featureMap];
+        }
+        freeDiffs(layer,weightDiffs,biasWeightDiffs,0);
+        if(higherLayerInputDiffs!=0)
+            CNNLayer::freeArray(higherLayerInputDiffs,layer->featureMapCount,layer->singleFeatureMapHeight);
+        higherLayerInputDiffs=inputDiffs;
+    }
+    CNNLayer::freeArray(higherLayerInputDiffs,layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+    lossSum+=layers[layerCount-1]->type==CNN_LAYER_TYPE_SOFTMAX?layers[layerCount-1]->defaultContext.loss:0.0;
+}
+
+void CNNGradientCheck::runReferenceBatchStep(CNNLayer **layers, uint32_t layerCount, double ****images, uint8_t *labels, uint32_t exampleCount,
+                                             CNNOptimizer *optimizer, double ****outputs, double *losses)
+{
+    std::vector<double****> weightDiffSums(layerCount,0);
+    std::vector<double*> biasWeightDiffSums(layerCount,0);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        if(!layers[layerIndex]->hasWeights())
+            continue;
+        weightDiffSums[layerIndex]=layers[layerIndex]->allocWeightDiffs();
+        biasWeightDiffSums[layerIndex]=(double*)calloc(layers[layerIndex]->featureMapCount,sizeof(double));
+    }
+
+    // The diffs are taken over, so the weights don't change within the batch
+    CNNTrainingStep trainingStep(layers,layerCount);
+    trainingStep.diffsCalculated=[&](uint32_t layerIndex,double ****weightDiffs,double *biasDiffs){
+        if(weightDiffs==0)
+            return false;
+        CNNLayer *layer=layers[layerIndex];
+        double *weightDiffSumData=CNNLayer::getWeightTypeArrayData(weightDiffSums[layerIndex]);
+        double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+        for(uint32_t weight=0;weight<layer->weightCount;weight++)
+            weightDiffSumData[weight]+=weightDiffData[weight];
+        for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            biasWeightDiffSums[layerIndex][featureMap]+=biasDiffs[featureMap];
+        freeDiffs(layer,weightDiffs,biasDiffs,0);
+        return true;
+    };
+    for(uint32_t example=0;example<exampleCount;example++)
+        outputs[example]=trainingStep.run(images[example],labels[example],optimizer,losses[example]);
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        if(weightDiffSums[layerIndex]!=0)
+            applyAverageDiffs(layers[layerIndex],weightDiffSums[layerIndex],biasWeightDiffSums[layerIndex],exampleCount,optimizer);
+    }
+}
+
+void CNNGradientCheck::runReferenceBatchnormBatchStep(CNNLayer **layers, uint32_t layerCount, double ****images, uint8_t *labels, uint32_t exampleCount,
+                                                      CNNOptimizer *optimizer, double ****outputs, double *losses)
+{
+    // Dimensions: layer -> example
+    std::vector<std::vector<CNNLayerContext>> contexts(layerCount,std::vector<CNNLayerContext>(exampleCount,CNNLayerContext()));
+    // Dimensions: layer -> feature map (BATCHNORM layers only)
+    std::vector<std::vector<double>> means(layerCount);
+    std::vector<std::vector<double>> variances(layerCount);
+    std::vector<std::vector<double>> outputDiffMeans(layerCount);
+    std::vector<std::vector<double>> normalizedOutputDiffMeans(layerCount);
+
+    std::vector<double***> arrays(images,images+exampleCount);
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *layer=layers[layerIndex];
+        if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            means[layerIndex].assign(layer->featureMapCount,0.0);
+            variances[layerIndex].assign(layer->featureMapCount,0.0);
+            outputDiffMeans[layerIndex].assign(layer->featureMapCount,0.0);
+            normalizedOutputDiffMeans[layerIndex].assign(layer->featureMapCount,0.0);
+            layer->calculateBatchnormBatchStatistics(arrays.data(),exampleCount,means[layerIndex].data(),variances[layerIndex].data());
+            layer->updateBatchnormRunningStatistics(means[layerIndex].data(),variances[layerIndex].data(),exampleCount);
+        }
+        for(uint32_t example=0;example<exampleCount;example++)
+        {
+            CNNLayerContext &context=contexts[layerIndex][example];
+            context.training=true;
+            if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+            {
+                context.batchMeans=means[layerIndex].data();
+                context.batchVariances=variances[layerIndex].data();
+                context.batchOutputDiffMeans=outputDiffMeans[layerIndex].data();
+                context.batchNormalizedOutputDiffMeans=normalizedOutputDiffMeans[layerIndex].data();
+            }
+            double ***output=layer->forwardPass(arrays[example],context);
+            if(layerIndex>0)
+                CNNLayer::freeArray(arrays[example],layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+            arrays[example]=output;
+        }
+    }
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        outputs[example]=arrays[example];
+        arrays[example]=0; // The SOFTMAX layer gets no output diffs
+    }
+
+    for(uint32_t _layerIndex=layerCount;_layerIndex>0;_layerIndex--)
+    {
+        uint32_t layerIndex=_layerIndex-1;
+        CNNLayer *layer=layers[layerIndex];
+        if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            for(uint32_t example=0;example<exampleCount;example++)
+                layer->addBatchnormDiffSums(arrays[example],contexts[layerIndex][example],outputDiffMeans[layerIndex].data(),normalizedOutputDiffMeans[layerIndex].data());
+            double valueCount=(double)exampleCount*layer->singleFeatureMapWidth*layer->singleFeatureMapHeight;
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            {
+                outputDiffMeans[layerIndex][featureMap]/=valueCount;
+                normalizedOutputDiffMeans[layerIndex][featureMap]/=valueCount;
+            }
+        }
+
+        double ****weightDiffSums=layer->hasWeights()?layer->allocWeightDiffs():0;
+        double *biasWeightDiffSums=layer->hasWeights()?(double*)calloc(layer->featureMapCount,sizeof(double)):0;
+        for(uint32_t example=0;example<exampleCount;example++)
+        {
+            double ****weightDiffs=0;
+            double *biasWeightDiffs=0;
+            double ***inputDiffs=0;
+            layer->calculateDiffs(weightDiffs,biasWeightDiffs,arrays[example],inputDiffs,labels[example],contexts[layerIndex][example]);
+            if(layer->type==CNN_LAYER_TYPE_SOFTMAX)
+                losses[example]=contexts[layerIndex][example].loss;
+            layer->freeContext(contexts[layerIndex][example]);
+            if(weightDiffs!=0)
+            {
+                double *weightDiffSumData=CNNLayer::getWeightTypeArrayData(weightDiffSums);
+                double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+                for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                    weightDiffSumData[weight]+=weightDiffData[weight];
+                for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+                    biasWeightDiffSums[featureMap]+=biasWeightDiffs[featureMap];
+            }
+            freeDiffs(layer,weightDiffs,biasWeightDiffs,0);
+            if(arrays[example]!=0)
+                CNNLayer::freeArray(arrays[example],layer->featureMapCount,layer->singleFeatureMapHeight);
+            arrays[example]=inputDiffs;
+        }
+        if(weightDiffSums!=0)
+            applyAverageDiffs(layer,weightDiffSums,biasWeightDiffSums,exampleCount,optimizer);
+    }
+    for(uint32_t example=0;example<exampleCount;example++)
+        CNNLayer::freeArray(arrays[example],layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+}
+
+void CNNGradientCheck::applyAverageDiffs(CNNLayer *layer, double ****weightDiffSums, double *biasWeightDiffSums, uint32_t exampleCount, CNNOptimizer *optimizer)
+{
+    double scale=1.0/exampleCount;
+    double *weightDiffSumData=CNNLayer::getWeightTypeArrayData(weightDiffSums);
+    for(uint32_t weight=0;weight<layer->weightCount;weight++)
+        weightDiffSumData[weight]*=scale;
+    for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+        biasWeightDiffSums[featureMap]*=scale;
+    layer->applyDiffs(weightDiffSums,biasWeightDiffSums,optimizer);
+    freeDiffs(layer,weightDiffSums,biasWeightDiffSums,0);
+}
+
+double CNNGradientCheck::compareParameters(CNNLayer **layers, CNNLayer **referenceLayers, uint32_t layerCount)
+{
+    double error=0.0;
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *layer=layers[layerIndex];
+        CNNLayer *referenceLayer=referenceLayers[layerIndex];
+        if(layer->hasWeights())
+        {
+            double *weightData=CNNLayer::getWeightTypeArrayData(layer->weights);
+            double *referenceWeightData=CNNLayer::getWeightTypeArrayData(referenceLayer->weights);
+            for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                error=__max(error,getRelativeError(weightData[weight],referenceWeightData[weight]));
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+                error=__max(error,getRelativeError(layer->biasWeights[featureMap],referenceLayer->biasWeights[featureMap]));
+        }
+        if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            {
+                error=__max(error,getRelativeError(layer->runningMeans[featureMap],referenceLayer->runningMeans[featureMap]));
+                error=__max(error,getRelativeError(layer->runningVariances[featureMap],referenceLayer->runningVariances[featureMap]));
+            }
+        }
+    }
+    return error;
+}
+
+void CNNGradientCheck::checkSnapshots()
+{
+    // Before each publish, every parameter of the layers is set to the number of the publish
+    CNNGradientCheckGeometry geometries[]={{"",CNN_LAYER_TYPE_CONV,4,3,3,1,1,1,1,3,8,8,false},
+                                           {"",CNN_LAYER_TYPE_BATCHNORM,4,1,1,1,1,0,0,4,8,8,false},
+                                           {"",CNN_LAYER_TYPE_FC,10,0,0,1,1,0,0,4,8,8,false}};
+    const uint32_t layerCount=sizeof(geometries)/sizeof(geometries[0]);
+    CNNLayer *layers[layerCount];
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        layers[layerIndex]=createLayer(geometries[layerIndex]);
+    auto setParameters=[&layers,layerCount](double value){
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            CNNLayer *layer=layers[layerIndex];
+            double *weightData=CNNLayer::getWeightTypeArrayData(layer->weights);
+            for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                weightData[weight]=value;
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            {
+                layer->biasWeights[featureMap]=value;
+                if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+                {
+                    layer->runningMeans[featureMap]=value;
+                    layer->runningVariances[featureMap]=value;
+                }
+            }
+        }
+    };
+    setParameters(0.0);
+    CNNSnapshotPublisher publisher(layers,layerCount,0);
+
+    // Every reader counts the snapshots that mix publishes or are older than one it has seen before
+    std::atomic<bool> publishing(true);
+    uint32_t inconsistentSnapshotCounts[CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT];
+    std::vector<std::thread> readers;
+    for(uint32_t reader=0;reader<CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT;reader++)
+    {
+        inconsistentSnapshotCounts[reader]=0;
+        readers.push_back(std::thread([&publisher,&publishing,&inconsistentSnapshotCounts,reader](){
+            uint32_t slot=publisher.registerReader();
+            uint64_t previousIteration=0;
+            while(publishing.load())
+            {
+                CNNWeightSnapshot *snapshot=publisher.acquire(slot);
+                double value=(double)snapshot->iteration;
+                bool consistent=snapshot->iteration>=previousIteration;
+                for(uint32_t layerIndex=0;layerIndex<snapshot->layerCount;layerIndex++)
+                {
+                    CNNLayer *layer=snapshot->layers[layerIndex];
+                    double *weightData=CNNLayer::getWeightTypeArrayData(layer->weights);
+                    for(uint32_t weight=0;weight<layer->weightCount;weight++)
+                        consistent&=weightData[weight]==value;
+                    for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+                    {
+                        consistent&=layer->biasWeights[featureMap]==value;
+                        if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+                            consistent&=layer->runningMeans[featureMap]==value&&layer->runningVariances[featureMap]==value;
+                    }
+                }
+                previousIteration=snapshot->iteration;
+                publisher.release(slot);
+                if(!consistent)
+                    inconsistentSnapshotCounts[reader]++;
+            }
+            publisher.unregisterReader(slot);
+        }));
+    }
+    for(uint32_t publish=1;publish<=CNN_GRADIENT_CHECK_SNAPSHOT_PUBLISH_COUNT;publish++)
+    {
+        setParameters((double)publish);
+        publisher.publish(layers,layerCount,publish);
+    }
+    publishing=false;
+    double error=0.0;
+    for(uint32_t reader=0;reader<CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT;reader++)
+    {
+        readers[reader].join();
+        error+=inconsistentSnapshotCounts[reader];
+    }
+    report("CNNSnapshotPublisher","snapshots read while publishing",error,0.0);
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        delete layers[layerIndex];
+}
@@ -0,0 +1,217 @@
+#ifndef CNNGRADIENTCHECK_H
+#define CNNGRADIENTCHECK_H
+
+#define CNN_GRADIENT_CHECK_EPSILON 1e-5 // Step of the central differences
+#define CNN_GRADIENT_CHECK_TOLERANCE 1e-6 // Max relative error between the diffs of calculateDiffs and the numerical gradients
+#define CNN_GRADIENT_CHECK_SAMPLES_PER_TENSOR 40 // Values checked per weight/bias weight/input tensor (all of them if there are fewer)
+#define CNN_GRADIENT_CHECK_KERNEL_TOLERANCE 1e-12 // Max relative error between an alternate kernel and the scalar reference
+#define CNN_GRADIENT_CHECK_FFT_TOLERANCE 1e-9 // Max relative error between the FFT conv algorithm and the direct one (it adds up the products in another order)
+#define CNN_GRADIENT_CHECK_QUANTIZED_TOLERANCE 0.05 // Max difference between the class probabilities of the int8 model and the double network
+#define CNN_GRADIENT_CHECK_QUANTIZED_IMAGE_COUNT 20 // Random images used to calibrate and to compare the int8 model
+#define CNN_GRADIENT_CHECK_SOURCE_FILE_NAME "gradient_check_model.cpp" // Written to the working directory by the source generator check and removed again
+#define CNN_GRADIENT_CHECK_CHECKPOINT_FILE_NAME "gradient_check_checkpoint.cnn" // Written to the working directory by the checkpoint check and removed again
+#define CNN_GRADIENT_CHECK_DROPOUT_RATE_TOLERANCE 0.01 // Max difference between the fraction of values a DROPOUT layer keeps and 1-dropoutRate (80000 values are drawn)
+#define CNN_GRADIENT_CHECK_SNAPSHOT_PUBLISH_COUNT 2000 // Snapshots published while the readers of the snapshot check run
+// Max error of the weight diffs calculated from a stashed input, relative to the largest weight diff (the rounding error of each input value
+// is up to 2^-9 for bfloat16 and 2^-11 for fp16)
+#define CNN_GRADIENT_CHECK_BF16_STASH_TOLERANCE 1e-2
+#define CNN_GRADIENT_CHECK_FP16_STASH_TOLERANCE 2e-3
+#define CNN_GRADIENT_CHECK_CHECKPOINTING_STEP_COUNT 3 // Training steps compared with and without activation checkpointing
+#define CNN_GRADIENT_CHECK_BATCH_SIZE 3 // Examples of the BATCHNORM batch checks
+#define CNN_GRADIENT_CHECK_THREAD_POOL_WORKER_COUNT 3 // Fixed, so the tasks really run on several threads even on machines with few cores
+#define CNN_GRADIENT_CHECK_DATA_PARALLEL_WORKER_COUNT 3 // Workers of the data-parallel training check
+#define CNN_GRADIENT_CHECK_DATA_PARALLEL_IMAGE_COUNT 8 // Images of the data-parallel training check (shards of different sizes)
+#define CNN_GRADIENT_CHECK_DATA_PARALLEL_SYNCHRONIZATION_INTERVAL 2 // Examples per worker and round of the data-parallel training check
+#define CNN_GRADIENT_CHECK_DATA_PARALLEL_ROUND_COUNT 3 // Rounds of the data-parallel training check
+#define CNN_GRADIENT_CHECK_DISTRIBUTED_WORLD_SIZE 3 // Ranks of the distributed training check (threads connected over 127.0.0.1)
+#define CNN_GRADIENT_CHECK_DISTRIBUTED_BASE_PORT 29600 // Rank r of the distributed training check listens on this port+r (away from CNN_DISTRIBUTED_DEFAULT_BASE_PORT)
+#define CNN_GRADIENT_CHECK_DISTRIBUTED_TIMEOUT_MS 10000 // How long the ranks of the distributed training check wait for each other to connect
+#define CNN_GRADIENT_CHECK_DISTRIBUTED_STEP_COUNT 3 // Training steps of the distributed training check
+#define CNN_GRADIENT_CHECK_PIPELINE_BATCH_SIZE 4 // Examples per batch of the pipeline training check (several examples in the queues at the same time)
+#define CNN_GRADIENT_CHECK_PIPELINE_STEP_COUNT 3 // Training steps of the pipeline training check
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <thread>
+#include <functional>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnnsampler.h"
+#include "cnnthreadpool.h"
+#include "cnnquantizedmodel.h"
+#include "cnnsourcegenerator.h"
+#include "cnncheckpoint.h"
+#include "cnndistributed.h"
+#include "cnnpipeline.h"
+#include "cnntrainingstep.h"
+#include "cnnsnapshot.h"
+#include "cnnactivationcheckpointing.h"
+
+// Constructor arguments of a layer under test
+struct CNNGradientCheckGeometry
+{
+    const char *description;
+    uint8_t type;
+    uint32_t featureMapCount;
+    int32_t receptiveFieldWidth;
+    int32_t receptiveFieldHeight;
+    uint32_t strideX;
+    uint32_t strideY;
+    uint32_t zeroPaddingX;
+    uint32_t zeroPaddingY;
+    uint32_t previousLayerFeatureMapCount;
+    int32_t previousLayerSingleFeatureMapWidth;
+    int32_t previousLayerSingleFeatureMapHeight;
+    bool training; // Mode of the default context (see CNNLayerContext::training); false: only the inference pass is checked
+};
+
+// Results of the passes of a layer under test (see CNNGradientCheck::runPasses)
+struct CNNGradientCheckPasses
+{
+    double ***output;
+    double ****weightDiffs; // 0 for layers without weights
+    double *biasWeightDiffs;
+    double ***inputDiffs;
+    double ***updatedOutput; // Output for the same input after a weight update (0 if there was none)
+};
+
+// Correctness checks of the layer kernels (run with --gradient-check, see main.cpp):
+// - Gradient checks: the weight, bias weight and input diffs of calculateDiffs are compared with central differences of a loss for every layer type
+//   and several geometries (the loss is a random linear function of the output, or the cross-entropy for SOFTMAX layers), and for BATCHNORM
+//   layers that normalize a batch of several examples together.
+// - Kernel checks: every alternate kernel is compared with a scalar reference (conv and avgpool against plain bounds-checked loops, the thread pool
+//   paths and concurrent passes with separate contexts against the sequential ones, the conv algorithms (output, diffs and output after a weight
+//   update) against the direct one, the NHWC kernels and the kernels specialized on the geometry against the generic ones, the passes with a reduced
+//   stash precision against the double ones, inference passes against training passes, CONV layers with folded BATCHNORM layers against the two
+//   layers, the SIMD optimizer updates and dropout generators against the scalar ones, the int8 model against the double network, the SIMD
+//   bfloat16/fp16 conversions against the scalar ones, training with activation checkpointing against training without, data-parallel rounds against
+//   replicas averaged on one thread, all-reduces and distributed training steps of ranks on threads against single-process sums and averages,
+//   pipelined training against sequential training on the same batch), plus the rounding of the bfloat16/fp16 conversions, the source generated for a
+//   network, checkpoint round trips, the statistics of the dropout masks, the loss of the SOFTMAX layer for logits whose exponentials overflow, and
+//   the consistency of weight snapshots read while they are published.
+// Run this before trusting a new or optimized kernel.
+
+class CNNGradientCheck
+{
+public:
+    CNNRandom random;
+    std::ostream &out;
+    uint32_t checkCount;
+    uint32_t failedCheckCount;
+
+    CNNGradientCheck(uint64_t _seed,std::ostream &_out);
+
+    // Runs all checks, writes one line per check to "out" and returns true if all of them passed
+    bool run();
+
+    // Gradient checks
+    void checkLayerGradients(const CNNGradientCheckGeometry &geometry);
+    // BATCHNORM with the statistics of a batch of several examples: the statistics and the running statistics against plain loops, the diffs
+    // against central differences of the loss of the batch
+    void checkBatchnormBatch(const CNNGradientCheckGeometry &geometry);
+    // An inference pass against a training pass (or the running statistics for BATCHNORM, the input for DROPOUT); it must not store any state
+    void checkInferencePass(const CNNGradientCheckGeometry &geometry);
+    // Cross-entropy of the output for SOFTMAX layers, else the sum of the output values multiplied by lossCoefficients
+    double calculateLoss(CNNLayer *layer,double ***input,double ***lossCoefficients,uint32_t desiredLabel);
+    // Compares analyticDiffs[i] with the central difference of the loss w.r.t. *values[i] for up to CNN_GRADIENT_CHECK_SAMPLES_PER_TENSOR values
+    void checkTensor(const CNNGradientCheckGeometry &geometry,const char *tensorName,std::vector<double*> &values,std::vector<double> &analyticDiffs,
+                     CNNLayer *layer,double ***input,double ***lossCoefficients,uint32_t desiredLabel);
+    // The same for any loss function
+    void checkTensor(const CNNGradientCheckGeometry &geometry,const char *tensorName,std::vector<double*> &values,std::vector<double> &analyticDiffs,
+                     const std::function<double()> &calculateLoss);
+
+    // Kernel checks
+    // CONV and AVGPOOL against plain loops
+    void checkWindowAgainstReference(const CNNGradientCheckGeometry &geometry);
+    // The conv algorithms against the direct one (output, diffs and output after a weight update)
+    void checkConvAlgorithms(const CNNGradientCheckGeometry &geometry);
+    void checkBatchnormFolding(const CNNGradientCheckGeometry &geometry);
+    // Thread pool paths against the sequential ones (output, diffs and output after a weight update, like the checks below)
+    void checkThreadPool(const CNNGradientCheckGeometry &geometry,CNNThreadPool *threadPool);
+    // NHWC kernels against the NCHW ones and their thread pool paths against their sequential ones
+    void checkTensorLayout(const CNNGradientCheckGeometry &geometry,CNNThreadPool *threadPool);
+    // A network of NHWC layers that pass channels-last arrays to each other against the NCHW network (training steps and inference layers)
+    void checkChainedTensorLayout(CNNThreadPool *threadPool);
+    // CONV and MAXPOOL kernels specialized on the geometry against the generic ones
+    void checkSpecializedKernels(const CNNGradientCheckGeometry &geometry);
+    // Passes with a reduced stash precision against passes with the double one: the output and the input diffs must be bit-identical (they don't
+    // use the stash), the weight diffs must be within the stash tolerance (the input exceeds the fp16 range, which tests the scaling of fp16 stashes)
+    void checkStashPrecision(const CNNGradientCheckGeometry &geometry,uint8_t stashPrecision);
+    // Rounding of known values, round trips of all 16 bit values, and the SIMD row conversions against the scalar ones
+    void checkReducedPrecisionConversions();
+    // Passes of several threads on the same layer (each with its own context) against sequential passes
+    void checkConcurrentContexts(const CNNGradientCheckGeometry &geometry);
+    void checkOptimizer(uint8_t optimizerType);
+    void checkQuantizedModel();
+    // The source generated for a small network: the kernel specializations and constexpr shapes of every layer, no allocations, the weight
+    // arrays read back bit-identically, and formatDouble round trips. Compiling and running the generated file is left to its user.
+    void checkSourceGenerator();
+    // A network with all layer types saved and loaded again: the geometry, the DROPOUT rate, the parameter checksum, the weights and running
+    // statistics, and the inference and training outputs must be identical
+    void checkCheckpoint();
+    void checkDropoutMasks();
+    // Training steps with several checkpoint choices against training without checkpointing (bit-identical), and the planner against an exhaustive search
+    void checkActivationCheckpointing();
+    // Rounds of CNNDataParallelTrainer against replicas trained and averaged on one thread (the sampled images, outputs, losses and the averaged
+    // parameters must be bit-identical), and two trainers with the same seed against each other
+    void checkDataParallelTraining();
+    // Ranks on threads connected over 127.0.0.1: all-reduces of random arrays against plain sums, and the averaged diffs, losses and parameters of
+    // distributed training steps against a single process that averages the diffs of the examples of all ranks (POSIX sockets only, see CNNRingAllReduce)
+    void checkDistributedTraining();
+    // Training steps of CNNPipeline against the same batch trained on one thread: the outputs, losses, averaged diffs, weights and running
+    // statistics must be bit-identical. Without BATCHNORM layers the reference is CNNTrainingStep with the diffs of the examples averaged,
+    // with them (stages that buffer the whole batch) runReferenceBatchnormBatchStep
+    void checkPipelineTraining();
+    void checkSoftmaxLoss();
+    // Readers acquiring snapshots while another thread changes the layers and publishes them must never see a mix of two publishes
+    void checkSnapshots();
+
+    void report(const char *description,const char *checkName,double error,double tolerance);
+
+    // Fixture of the kernel checks: a test layer and a clone of it, configured by the two functions (configureReference may be empty), run
+    // forward, backward and forward again after a weight update on the same random input and output diffs; reports the max error of all results
+    void checkAgainstReference(const CNNGradientCheckGeometry &geometry,const char *checkName,double tolerance,
+                               const std::function<void(CNNLayer*)> &configureReference,const std::function<void(CNNLayer*)> &configure);
+    // Forward and backward pass with "context", and with "update" (layers with weights only) a fixed SGD update and another forward pass
+    static void runPasses(CNNLayer *layer,double ***input,double ***outputDiffs,uint32_t desiredLabel,CNNLayerContext &context,bool update,CNNGradientCheckPasses &passes);
+    // Max relative error of all results of two runPasses
+    static double comparePasses(CNNLayer *layer,const CNNGradientCheckPasses &passes,const CNNGradientCheckPasses &referencePasses);
+    static void freePasses(CNNLayer *layer,CNNGradientCheckPasses &passes);
+    // The plain training loop the trainers are checked against; returns the output of the last layer (to be freed by the caller)
+    static double ***runReferenceTrainingStep(CNNLayer **layers,uint32_t layerCount,double ***image,uint8_t label,CNNOptimizer *optimizer,double &loss);
+    // runReferenceTrainingStep without the update: adds the weight diffs and bias weight diffs of every layer with weights to diffSums (layer by layer,
+    // like CNNDistributedTrainer::diffBuckets) and the loss to lossSum
+    static void addReferenceDiffs(CNNLayer **layers,uint32_t layerCount,double ***image,uint8_t label,std::vector<double> &diffSums,double &lossSum);
+    // A training step on a batch with CNNTrainingStep: the diffs of the examples are added up in example order and their average is applied.
+    // outputs[example] receives the output of the last layer (to be freed by the caller), losses[example] the loss
+    static void runReferenceBatchStep(CNNLayer **layers,uint32_t layerCount,double ****images,uint8_t *labels,uint32_t exampleCount,
+                                      CNNOptimizer *optimizer,double ****outputs,double *losses);
+    // The same written out layer by layer, for networks with BATCHNORM layers that normalize with the statistics of the batch: the forward passes
+    // of all examples through a layer before the next layer (a BATCHNORM layer updates its running statistics once per batch), then the backward
+    // passes the same way from the top
+    static void runReferenceBatchnormBatchStep(CNNLayer **layers,uint32_t layerCount,double ****images,uint8_t *labels,uint32_t exampleCount,
+                                               CNNOptimizer *optimizer,double ****outputs,double *losses);
+    // Divides the diff sums of a layer by exampleCount (like CNNPipeline::applyDiffs), applies and frees them
+    static void applyAverageDiffs(CNNLayer *layer,double ****weightDiffSums,double *biasWeightDiffSums,uint32_t exampleCount,CNNOptimizer *optimizer);
+    // Max relative error of the weights, bias weights and BATCHNORM running statistics of two networks with the same geometry
+    static double compareParameters(CNNLayer **layers,CNNLayer **referenceLayers,uint32_t layerCount);
+
+    CNNLayer *createLayer(const CNNGradientCheckGeometry &geometry);
+    // createLayer with random bias weights (CONV and FC) and random BATCHNORM statistics
+    CNNLayer *createTestLayer(const CNNGradientCheckGeometry &geometry);
+    double ***createRandomArray(uint32_t zDimension,int32_t yDimension,int32_t xDimension,double minValue,double maxValue);
+    static void collectValues(double ***_array,uint32_t zDimension,int32_t yDimension,int32_t xDimension,std::vector<double*> &values);
+    static double getRelativeError(double value,double referenceValue);
+    // Max relative error between two arrays of the same dimensions
+    static double compareArrays(double ***array1,double ***array2,uint32_t zDimension,int32_t yDimension,int32_t xDimension);
+    static void freeDiffs(CNNLayer *layer,double ****weightDiffs,double *biasWeightDiffs,double ***inputDiffs);
+    void randomizeBatchnormStatistics(CNNLayer *layer);
+};
+
+#endif // CNNGRADIENTCHECK_H
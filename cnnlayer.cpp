@@ -1,5 +1,12 @@
 #include "cnnlayer.h"
 
+#ifdef CNN_LAYER_USE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(CNN_LAYER_USE_AVX512_BF16)||defined(CNN_LAYER_USE_F16C)
+#include <immintrin.h>
+#endif
+
 double CNNLayer::sig(double input)
 {
     // Derivative: sig(input)*(1.0-sig(input))
@@ -12,12 +19,31 @@ double CNNLayer::tanh(double input)
     return (1.0-pow(M_E,-2.0*input))/(1.0+pow(M_E,-2.0*input));
 }
 
-CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount, int32_t _receptiveFieldWidth, int32_t _receptiveFieldHeight, uint32_t _strideX /*Default: 1*/, uint32_t _strideY /*Default: 1*/, uint32_t _zeroPaddingX, uint32_t _zeroPaddingY, uint32_t _previousLayerFeatureMapCount, int32_t _previousLayerSingleFeatureMapWidth, int32_t _previousLayerSingleFeatureMapHeight)
+CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount, int32_t _receptiveFieldWidth, int32_t _receptiveFieldHeight, uint32_t _strideX /*Default: 1*/, uint32_t _strideY /*Default: 1*/, uint32_t _zeroPaddingX, uint32_t _zeroPaddingY, uint32_t _previousLayerFeatureMapCount, int32_t _previousLayerSingleFeatureMapWidth, int32_t _previousLayerSingleFeatureMapHeight, uint64_t _seed)
 {
     layerId=_layerId; // Useful when debugging
-    input=0;
-    output=0;
-    srand((unsigned int)time(0));
+    defaultContext=CNNLayerContext();
+    threadPool=0;
+    convAlgorithm=CNN_CONV_ALGORITHM_DIRECT;
+    convGrain=1;
+    fft=0;
+    fftTileWidth=0;
+    fftTileHeight=0;
+    filterSpectra=0;
+    filterSpectraValid=false;
+    tensorLayout=CNN_TENSOR_LAYOUT_NCHW;
+    channelsLastOutput=false;
+    packedWeights=0;
+    packedWeightsValid=false;
+    specializedKernels=true;
+    stashPrecision=CNN_STASH_PRECISION_DOUBLE;
+    runningMeans=0;
+    runningVariances=0;
+    dropoutRate=CNN_DROPOUT_DEFAULT_RATE;
+    dropoutMaskWordCount=0;
+    dropoutSeed=0;
+    dropoutPassCount=0;
+    CNNRandom random(_seed+_layerId); // Each layer gets its own, reproducible sequence
     type=_type;
     receptiveFieldWidth=_receptiveFieldWidth;
     receptiveFieldHeight=_receptiveFieldHeight;
@@ -32,6 +58,12 @@ CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount,
     zeroPaddingX=_zeroPaddingX;
     zeroPaddingY=_zeroPaddingY;
 
+    // Only used by conv and maxpool layers (set below)
+    interiorStartX=0;
+    interiorEndX=0;
+    interiorStartY=0;
+    interiorEndY=0;
+
     // ATTENTION:
 
     // Quote from A. Karpathy:
@@ -63,44 +95,30 @@ CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount,
         if(singleFeatureMapWidth<=0||singleFeatureMapHeight<=0) // Receptive field too large.
             throw;
 
-        maxPixelMatrix=0;
+        calculateInteriorRange(previousLayerSingleFeatureMapWidth,singleFeatureMapWidth,receptiveFieldWidth,strideX,zeroPaddingX,interiorStartX,interiorEndX);
+        calculateInteriorRange(previousLayerSingleFeatureMapHeight,singleFeatureMapHeight,receptiveFieldHeight,strideY,zeroPaddingY,interiorStartY,interiorEndY);
+
 
         double initialMaxWeightValue=0.1;
 
         // Initialize weights and biases (modify for CNN_LAYER_TYPE_FC, too!)
 
-        weights=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
-        previousWeightDiffDeltas=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
-        biasWeights=(double*)malloc(featureMapCount*sizeof(double));
-        previousBiasWeightDiffDeltas=(double*)malloc(featureMapCount*sizeof(double));
+        weights=allocWeightTypeArray(previousLayerFeatureMapCount,featureMapCount,receptiveFieldHeight,receptiveFieldWidth);
+        weightCount=previousLayerFeatureMapCount*featureMapCount*receptiveFieldHeight*receptiveFieldWidth;
+        biasWeights=(double*)calloc(featureMapCount,sizeof(double)); // Initialize bias weights to 0
 
-        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-        {
-            biasWeights[featureMapInThisLayer]=0.0; // Initialize bias weights to 0
-            previousBiasWeightDiffDeltas[featureMapInThisLayer]=0.0; // "previousBiasWeightDiffs" needs to be zero-initialized
-        }
-        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
-        {
-            weights[featureMapInPreviousLayer]=(double***)malloc(featureMapCount*sizeof(double**));
-            previousWeightDiffDeltas[featureMapInPreviousLayer]=(double***)malloc(featureMapCount*sizeof(double**));
-            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-            {
-                weights[featureMapInPreviousLayer][featureMapInThisLayer]=(double**)malloc(_receptiveFieldHeight*sizeof(double*));
-                previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer]=(double**)malloc(_receptiveFieldHeight*sizeof(double*));
-                for(int32_t y=0;y<_receptiveFieldHeight;y++)
-                {
-                    weights[featureMapInPreviousLayer][featureMapInThisLayer][y]=(double*)malloc(_receptiveFieldWidth*sizeof(double));
-                    previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer][y]=(double*)malloc(_receptiveFieldWidth*sizeof(double));
-                    for(int32_t x=0;x<_receptiveFieldWidth;x++)
-                    {
-                        weights[featureMapInPreviousLayer][featureMapInThisLayer][y][x]=-initialMaxWeightValue+(((double)rand())/((double)RAND_MAX))*2.0*initialMaxWeightValue;
-                        previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer][y][x]=0.0; // "previousWeightDiffs" needs to be zero-initialized
-                    }
-                }
-            }
-        }
+        // "weights" is stored contiguously in the order feature map in previous layer -> feature map in this layer -> y -> x
+        double *weightData=getWeightTypeArrayData(weights);
+        for(uint32_t weight=0;weight<weightCount;weight++)
+            weightData[weight]=-initialMaxWeightValue+random.nextDouble()*2.0*initialMaxWeightValue;
+
+        // The optimizer state needs to be zero-initialized
+        weightOptimizerState1=(double*)calloc(weightCount,sizeof(double));
+        weightOptimizerState2=(double*)calloc(weightCount,sizeof(double));
+        biasWeightOptimizerState1=(double*)calloc(featureMapCount,sizeof(double));
+        biasWeightOptimizerState2=(double*)calloc(featureMapCount,sizeof(double));
     }
-    else if(type==CNN_LAYER_TYPE_MAXPOOL)
+    else if(type==CNN_LAYER_TYPE_MAXPOOL||type==CNN_LAYER_TYPE_AVGPOOL)
     {
         // Modify CNN_LAYER_TYPE_CONV, too!
 
@@ -121,26 +139,28 @@ CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount,
         if(singleFeatureMapWidth<=0||singleFeatureMapHeight<=0) // Receptive field too large.
             throw;
 
+        calculateInteriorRange(previousLayerSingleFeatureMapWidth,singleFeatureMapWidth,receptiveFieldWidth,strideX,zeroPaddingX,interiorStartX,interiorEndX);
+        calculateInteriorRange(previousLayerSingleFeatureMapHeight,singleFeatureMapHeight,receptiveFieldHeight,strideY,zeroPaddingY,interiorStartY,interiorEndY);
+
         weights=0;
+        weightCount=0;
         biasWeights=0;
-        previousWeightDiffDeltas=0;
-        previousBiasWeightDiffDeltas=0;
-        maxPixelMatrix=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
-        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
-        {
-            maxPixelMatrix[featureMapInPreviousLayer]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
-            // These values do not need to be initialized.
-            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
-                maxPixelMatrix[featureMapInPreviousLayer][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
-        }
+        weightOptimizerState1=0;
+        weightOptimizerState2=0;
+        biasWeightOptimizerState1=0;
+        biasWeightOptimizerState2=0;
     }
     else if(type==CNN_LAYER_TYPE_RELU)
     {
         // Zero padding needed only to adjust output size (used in the calculation above)
 
         weights=0;
+        weightCount=0;
         biasWeights=0;
-        maxPixelMatrix=0;
+        weightOptimizerState1=0;
+        weightOptimizerState2=0;
+        biasWeightOptimizerState1=0;
+        biasWeightOptimizerState2=0;
 
         featureMapCount=_previousLayerFeatureMapCount;
         singleFeatureMapWidth=_previousLayerSingleFeatureMapWidth;
@@ -151,8 +171,12 @@ CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount,
         // Zero padding needed only to adjust output size (used in the calculation above)
 
         weights=0;
+        weightCount=0;
         biasWeights=0;
-        maxPixelMatrix=0;
+        weightOptimizerState1=0;
+        weightOptimizerState2=0;
+        biasWeightOptimizerState1=0;
+        biasWeightOptimizerState2=0;
 
         if(_featureMapCount!=_previousLayerFeatureMapCount)
             throw;
@@ -173,108 +197,474 @@ CNNLayer::CNNLayer(uint32_t _layerId, uint8_t _type, uint32_t _featureMapCount,
         if(strideX!=1||strideY!=1)
             throw;
 
-        maxPixelMatrix=0;
 
         double initialMaxWeightValue=0.1; // A FC layer can and should have negative weights.
 
         // This layer's dimensions: 1x1xneuronCount; featureMapCount=neuronCount
 
-        weights=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
-        previousWeightDiffDeltas=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
-        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
-        {
-            weights[featureMapInPreviousLayer]=(double***)malloc(previousLayerSingleFeatureMapHeight*sizeof(double**));
-            previousWeightDiffDeltas[featureMapInPreviousLayer]=(double***)malloc(previousLayerSingleFeatureMapHeight*sizeof(double**));
-            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
-            {
-                weights[featureMapInPreviousLayer][y]=(double**)malloc(previousLayerSingleFeatureMapWidth*sizeof(double*));
-                previousWeightDiffDeltas[featureMapInPreviousLayer][y]=(double**)malloc(previousLayerSingleFeatureMapWidth*sizeof(double*));
-                for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
-                {
-                    weights[featureMapInPreviousLayer][y][x]=(double*)malloc(featureMapCount*sizeof(double));
-                    previousWeightDiffDeltas[featureMapInPreviousLayer][y][x]=(double*)malloc(featureMapCount*sizeof(double));
-                    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-                    {
-                        weights[featureMapInPreviousLayer][y][x][featureMapInThisLayer]=-initialMaxWeightValue+(((double)rand())/((double)RAND_MAX))*2.0*initialMaxWeightValue;
-                        previousWeightDiffDeltas[featureMapInPreviousLayer][y][x][featureMapInThisLayer]=0.0; // "previousWeightDiffs" needs to be zero-initialized
-                    }
-                }
-            }
-        }
+        weights=allocWeightTypeArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth,featureMapCount);
+        weightCount=previousLayerFeatureMapCount*previousLayerSingleFeatureMapHeight*previousLayerSingleFeatureMapWidth*featureMapCount;
+        biasWeights=(double*)calloc(featureMapCount,sizeof(double)); // Initialize bias weights to 0
 
-        biasWeights=(double*)malloc(featureMapCount*sizeof(double));
-        previousBiasWeightDiffDeltas=(double*)malloc(featureMapCount*sizeof(double));
-        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-        {
-            biasWeights[featureMapInThisLayer]=0.0; // Initialize bias weights to 0
-            previousBiasWeightDiffDeltas[featureMapInThisLayer]=0.0; // "previousBiasWeightDiffs" needs to be zero-initialized
-        }
+        // "weights" is stored contiguously in the order feature map in previous layer -> y -> x -> neuron in this layer
+        double *weightData=getWeightTypeArrayData(weights);
+        for(uint32_t weight=0;weight<weightCount;weight++)
+            weightData[weight]=-initialMaxWeightValue+random.nextDouble()*2.0*initialMaxWeightValue;
+
+        // The optimizer state needs to be zero-initialized
+        weightOptimizerState1=(double*)calloc(weightCount,sizeof(double));
+        weightOptimizerState2=(double*)calloc(weightCount,sizeof(double));
+        biasWeightOptimizerState1=(double*)calloc(featureMapCount,sizeof(double));
+        biasWeightOptimizerState2=(double*)calloc(featureMapCount,sizeof(double));
+    }
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
+    {
+        if(_featureMapCount!=_previousLayerFeatureMapCount)
+            throw;
+
+        featureMapCount=_previousLayerFeatureMapCount;
+        singleFeatureMapWidth=_previousLayerSingleFeatureMapWidth;
+        singleFeatureMapHeight=_previousLayerSingleFeatureMapHeight;
+
+        // Start with the identity: scale 1, shift 0 (nothing random, so _seed isn't used)
+        weights=allocWeightTypeArray(featureMapCount,1,1,1);
+        weightCount=featureMapCount;
+        biasWeights=(double*)calloc(featureMapCount,sizeof(double));
+        double *weightData=getWeightTypeArrayData(weights);
+        for(uint32_t weight=0;weight<weightCount;weight++)
+            weightData[weight]=1.0;
+
+        runningMeans=(double*)calloc(featureMapCount,sizeof(double));
+        runningVariances=(double*)malloc(featureMapCount*sizeof(double));
+        for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+            runningVariances[featureMap]=1.0;
+
+        // The optimizer state needs to be zero-initialized
+        weightOptimizerState1=(double*)calloc(weightCount,sizeof(double));
+        weightOptimizerState2=(double*)calloc(weightCount,sizeof(double));
+        biasWeightOptimizerState1=(double*)calloc(featureMapCount,sizeof(double));
+        biasWeightOptimizerState2=(double*)calloc(featureMapCount,sizeof(double));
+    }
+    else if(type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
+    {
+        weights=0;
+        weightCount=0;
+        biasWeights=0;
+        weightOptimizerState1=0;
+        weightOptimizerState2=0;
+        biasWeightOptimizerState1=0;
+        biasWeightOptimizerState2=0;
+
+        if(_featureMapCount!=_previousLayerFeatureMapCount)
+            throw;
+
+        featureMapCount=_featureMapCount;
+        singleFeatureMapWidth=1;
+        singleFeatureMapHeight=1;
+    }
+    else if(type==CNN_LAYER_TYPE_DROPOUT)
+    {
+        if(_featureMapCount!=_previousLayerFeatureMapCount)
+            throw;
+
+        weights=0;
+        weightCount=0;
+        biasWeights=0;
+        weightOptimizerState1=0;
+        weightOptimizerState2=0;
+        biasWeightOptimizerState1=0;
+        biasWeightOptimizerState2=0;
+
+        featureMapCount=_previousLayerFeatureMapCount;
+        singleFeatureMapWidth=_previousLayerSingleFeatureMapWidth;
+        singleFeatureMapHeight=_previousLayerSingleFeatureMapHeight;
+
+        dropoutMaskWordCount=(singleFeatureMapWidth*singleFeatureMapHeight+63)/64;
+        setDropoutSeed(random.next());
     }
     else
         throw;
+
+    selectKernels();
+}
+
+bool CNNLayer::isValidGeometry(uint8_t _type, uint32_t _featureMapCount, int32_t _receptiveFieldWidth, int32_t _receptiveFieldHeight, uint32_t _strideX, uint32_t _strideY, uint32_t _zeroPaddingX, uint32_t _zeroPaddingY, uint32_t _previousLayerFeatureMapCount, int32_t _previousLayerSingleFeatureMapWidth, int32_t _previousLayerSingleFeatureMapHeight)
+{
+    // Same checks as the constructor (modify it, too!), plus the ones it leaves to the caller
+    if(_featureMapCount==0||_previousLayerFeatureMapCount==0||_previousLayerSingleFeatureMapWidth<=0||_previousLayerSingleFeatureMapHeight<=0)
+        return false;
+
+    if(_type==CNN_LAYER_TYPE_CONV||_type==CNN_LAYER_TYPE_MAXPOOL||_type==CNN_LAYER_TYPE_AVGPOOL)
+    {
+        if((_type==CNN_LAYER_TYPE_MAXPOOL||_type==CNN_LAYER_TYPE_AVGPOOL)&&_featureMapCount!=_previousLayerFeatureMapCount)
+            return false;
+        if(_receptiveFieldWidth<=0||_receptiveFieldHeight<=0||_strideX==0||_strideY==0)
+            return false;
+
+        // The receptive field must fit into the padded input and be tiled across it without remainder
+        int64_t paddedRemainderX=(int64_t)_previousLayerSingleFeatureMapWidth-_receptiveFieldWidth+2*(int64_t)_zeroPaddingX;
+        int64_t paddedRemainderY=(int64_t)_previousLayerSingleFeatureMapHeight-_receptiveFieldHeight+2*(int64_t)_zeroPaddingY;
+        return paddedRemainderX>=0&&paddedRemainderY>=0&&paddedRemainderX%_strideX==0&&paddedRemainderY%_strideY==0;
+    }
+    else if(_type==CNN_LAYER_TYPE_FC)
+        return _strideX==1&&_strideY==1;
+    else if(_type==CNN_LAYER_TYPE_SOFTMAX||_type==CNN_LAYER_TYPE_BATCHNORM||_type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL||_type==CNN_LAYER_TYPE_DROPOUT)
+        return _featureMapCount==_previousLayerFeatureMapCount;
+    else if(_type==CNN_LAYER_TYPE_RELU)
+        return true;
+    return false;
 }
 
 CNNLayer::~CNNLayer()
+{
+    if(hasWeights())
+        freeWeightDiffs(weights); // Same dimensions
+
+    if(type==CNN_LAYER_TYPE_BATCHNORM)
+    {
+        free(runningMeans);
+        free(runningVariances);
+    }
+
+    if(hasWeights())
+    {
+        free(biasWeights);
+        free(weightOptimizerState1);
+        free(weightOptimizerState2);
+        free(biasWeightOptimizerState1);
+        free(biasWeightOptimizerState2);
+    }
+
+    delete fft;
+    free(filterSpectra);
+    free(packedWeights);
+
+    freeContext(defaultContext);
+}
+
+CNNLayer *CNNLayer::clone()
+{
+    // The seed doesn't matter, since the weights are overwritten
+    CNNLayer *out=new CNNLayer(layerId,type,featureMapCount,receptiveFieldWidth,receptiveFieldHeight,strideX,strideY,zeroPaddingX,zeroPaddingY,
+                               previousLayerFeatureMapCount,previousLayerSingleFeatureMapWidth,previousLayerSingleFeatureMapHeight,0);
+    out->copyParameters(this);
+    if(type==CNN_LAYER_TYPE_DROPOUT)
+    {
+        out->dropoutRate=dropoutRate;
+        out->dropoutSeed=dropoutSeed;
+        out->dropoutPassCount=dropoutPassCount.load();
+    }
+    if(type==CNN_LAYER_TYPE_CONV)
+        out->setConvAlgorithm(convAlgorithm,convGrain);
+    out->setTensorLayout(tensorLayout);
+    out->channelsLastOutput=channelsLastOutput;
+    out->setSpecializedKernels(specializedKernels);
+    out->setStashPrecision(stashPrecision);
+    out->defaultContext.training=defaultContext.training;
+    return out;
+}
+
+void CNNLayer::copyParameters(CNNLayer *source)
+{
+    if(hasWeights())
+    {
+        memcpy(getWeightTypeArrayData(weights),getWeightTypeArrayData(source->weights),weightCount*sizeof(double));
+        memcpy(biasWeights,source->biasWeights,featureMapCount*sizeof(double));
+    }
+    if(type==CNN_LAYER_TYPE_BATCHNORM)
+    {
+        memcpy(runningMeans,source->runningMeans,featureMapCount*sizeof(double));
+        memcpy(runningVariances,source->runningVariances,featureMapCount*sizeof(double));
+    }
+    if(type==CNN_LAYER_TYPE_CONV)
+        invalidateWeightTransforms();
+}
+
+bool CNNLayer::hasWeights()
+{
+    return type==CNN_LAYER_TYPE_CONV||type==CNN_LAYER_TYPE_FC||type==CNN_LAYER_TYPE_BATCHNORM;
+}
+
+double ****CNNLayer::allocWeightDiffs()
+{
+    if(type==CNN_LAYER_TYPE_CONV)
+        return allocWeightTypeArray(previousLayerFeatureMapCount,featureMapCount,receptiveFieldHeight,receptiveFieldWidth);
+    else if(type==CNN_LAYER_TYPE_FC)
+        return allocWeightTypeArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth,featureMapCount);
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
+        return allocWeightTypeArray(featureMapCount,1,1,1);
+    else
+        throw;
+}
+
+void CNNLayer::freeWeightDiffs(double ****weightDiffs)
 {
     if(type==CNN_LAYER_TYPE_CONV)
+        freeWeightTypeArray(weightDiffs,previousLayerFeatureMapCount,featureMapCount,receptiveFieldHeight,receptiveFieldWidth);
+    else if(type==CNN_LAYER_TYPE_FC)
+        freeWeightTypeArray(weightDiffs,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth,featureMapCount);
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
+        freeWeightTypeArray(weightDiffs,featureMapCount,1,1,1);
+    else
+        throw;
+}
+
+void CNNLayer::setTraining(bool _training)
+{
+    defaultContext.training=_training;
+}
+
+void CNNLayer::setDropoutRate(double _dropoutRate)
+{
+    if(type!=CNN_LAYER_TYPE_DROPOUT||_dropoutRate<0.0||_dropoutRate>=1.0)
+        throw;
+    dropoutRate=_dropoutRate;
+}
+
+void CNNLayer::setDropoutSeed(uint64_t _seed)
+{
+    // Hashed, so that seeds that are close to each other (e.g. one per replica) don't lead to overlapping sequences of generator seeds
+    dropoutSeed=CNNRandom::splitMix64(_seed);
+    dropoutPassCount=0;
+}
+
+void CNNLayer::foldBatchnorm(CNNLayer *batchnormLayer)
+{
+    if(type!=CNN_LAYER_TYPE_CONV||batchnormLayer->type!=CNN_LAYER_TYPE_BATCHNORM||batchnormLayer->featureMapCount!=featureMapCount)
+        throw;
+
+    // batchnorm(conv(x))=scale*(conv(x)-runningMean)/sqrt(runningVariance+epsilon)+shift: multiply the weights of each feature map in this layer
+    // by scale/sqrt(runningVariance+epsilon) and adjust the bias weight accordingly.
+    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
     {
+        double factor=batchnormLayer->weights[featureMapInThisLayer][0][0][0]/sqrt(batchnormLayer->runningVariances[featureMapInThisLayer]+CNN_BATCHNORM_EPSILON);
+
         for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
         {
-            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+            for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
             {
-                for(int32_t y=0;y<receptiveFieldHeight;y++)
-                {
-                    free(weights[featureMapInPreviousLayer][featureMapInThisLayer][y]);
-                    free(previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer][y]);
-                }
-                free(weights[featureMapInPreviousLayer][featureMapInThisLayer]);
-                free(previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer]);
+                for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]*=factor;
             }
-            free(weights[featureMapInPreviousLayer]);
-            free(previousWeightDiffDeltas[featureMapInPreviousLayer]);
         }
-        free(weights);
-        free(previousWeightDiffDeltas);
-        free(biasWeights);
-        free(previousBiasWeightDiffDeltas);
+        biasWeights[featureMapInThisLayer]=(biasWeights[featureMapInThisLayer]-batchnormLayer->runningMeans[featureMapInThisLayer])*factor+batchnormLayer->biasWeights[featureMapInThisLayer];
     }
-    else if(type==CNN_LAYER_TYPE_MAXPOOL)
+    invalidateWeightTransforms();
+}
+
+CNNLayer **CNNLayer::createInferenceLayers(CNNLayer **_layers, uint32_t _layerCount, uint32_t &inferenceLayerCount)
+{
+    CNNLayer **out=(CNNLayer**)malloc(_layerCount*sizeof(CNNLayer*));
+    inferenceLayerCount=0;
+
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
     {
-        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+        CNNLayer *thisLayer=_layers[layerIndex];
+        CNNLayer *previousLayer=inferenceLayerCount>0?out[inferenceLayerCount-1]:0;
+
+        if(thisLayer->type==CNN_LAYER_TYPE_BATCHNORM&&previousLayer!=0&&previousLayer->type==CNN_LAYER_TYPE_CONV)
         {
-            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
-                free(maxPixelMatrix[featureMapInPreviousLayer][y]);
-            free(maxPixelMatrix[featureMapInPreviousLayer]);
+            previousLayer->foldBatchnorm(thisLayer);
+            continue;
         }
-        free(maxPixelMatrix);
+        if(thisLayer->type==CNN_LAYER_TYPE_DROPOUT)
+            continue; // Passes its input on unchanged when not training
+
+        out[inferenceLayerCount]=thisLayer->clone();
+        out[inferenceLayerCount]->setTraining(false);
+        inferenceLayerCount++;
     }
-    else if(type==CNN_LAYER_TYPE_FC)
+    // Dropping a layer may put two NHWC layers next to each other
+    linkTensorLayouts(out,inferenceLayerCount);
+    return out;
+}
+
+void CNNLayer::setThreadPool(CNNThreadPool *_threadPool)
+{
+    threadPool=_threadPool;
+}
+
+void CNNLayer::setConvAlgorithm(uint8_t _convAlgorithm, uint32_t _convGrain)
+{
+    if(type!=CNN_LAYER_TYPE_CONV||_convAlgorithm<1||_convAlgorithm>CNN_CONV_ALGORITHM_COUNT||_convGrain==0)
+        throw;
+    convAlgorithm=_convAlgorithm;
+    convGrain=_convGrain;
+
+    if(convAlgorithm==CNN_CONV_ALGORITHM_FFT&&fft==0)
     {
-        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+        // The tiles cut from the input (forward pass) and from the output diffs upsampled by the stride (backward pass) have the same size:
+        // at least CNN_CONV_FFT_MIN_TILE_SIZE pixels and the receptive field, but not more than the larger of the two feature maps
+        int32_t upsampledOutputWidth=(singleFeatureMapWidth-1)*strideX+1;
+        int32_t upsampledOutputHeight=(singleFeatureMapHeight-1)*strideY+1;
+        int32_t desiredTileWidth=__min(__max(CNN_CONV_FFT_MIN_TILE_SIZE,receptiveFieldWidth),__max(previousLayerSingleFeatureMapWidth,upsampledOutputWidth));
+        int32_t desiredTileHeight=__min(__max(CNN_CONV_FFT_MIN_TILE_SIZE,receptiveFieldHeight),__max(previousLayerSingleFeatureMapHeight,upsampledOutputHeight));
+        uint32_t fftWidth=CNNFFT::getNextPowerOfTwo(__max(2,desiredTileWidth+receptiveFieldWidth-1));
+        uint32_t fftHeight=CNNFFT::getNextPowerOfTwo(__max(2,desiredTileHeight+receptiveFieldHeight-1));
+        fftTileWidth=fftWidth-receptiveFieldWidth+1;
+        fftTileHeight=fftHeight-receptiveFieldHeight+1;
+        fft=new CNNRealFFT2D(fftWidth,fftHeight);
+        filterSpectra=(double*)malloc(previousLayerFeatureMapCount*featureMapCount*2*fft->spectrumSize*sizeof(double));
+    }
+    invalidateWeightTransforms();
+}
+
+void CNNLayer::invalidateWeightTransforms()
+{
+    filterSpectraValid=false;
+    packedWeightsValid=false;
+}
+
+void CNNLayer::setTensorLayout(uint8_t _tensorLayout)
+{
+    if(_tensorLayout<1||_tensorLayout>CNN_TENSOR_LAYOUT_COUNT)
+        throw;
+    tensorLayout=_tensorLayout;
+
+    if(type==CNN_LAYER_TYPE_CONV)
+    {
+        if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC&&packedWeights==0)
+            packedWeights=(double*)malloc(weightCount*sizeof(double));
+        invalidateWeightTransforms();
+    }
+}
+
+void CNNLayer::setNetworkTensorLayout(CNNLayer **_layers, uint32_t _layerCount, uint8_t _tensorLayout)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+        _layers[layerIndex]->setTensorLayout(_tensorLayout);
+    linkTensorLayouts(_layers,_layerCount);
+}
+
+void CNNLayer::linkTensorLayouts(CNNLayer **_layers, uint32_t _layerCount)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+        _layers[layerIndex]->channelsLastOutput=layerIndex+1<_layerCount&&_layers[layerIndex]->hasChannelsLastKernels()&&_layers[layerIndex+1]->hasChannelsLastKernels();
+}
+
+bool CNNLayer::hasChannelsLastKernels()
+{
+    return tensorLayout==CNN_TENSOR_LAYOUT_NHWC&&(type==CNN_LAYER_TYPE_CONV||type==CNN_LAYER_TYPE_FC||type==CNN_LAYER_TYPE_MAXPOOL||type==CNN_LAYER_TYPE_AVGPOOL);
+}
+
+const char *CNNLayer::getTensorLayoutName(uint8_t _tensorLayout)
+{
+    if(_tensorLayout==CNN_TENSOR_LAYOUT_NCHW)
+        return "NCHW";
+    else if(_tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+        return "NHWC";
+    return "unknown";
+}
+
+void CNNLayer::setStashPrecision(uint8_t _stashPrecision)
+{
+    if(_stashPrecision<1||_stashPrecision>CNN_STASH_PRECISION_COUNT)
+        throw;
+    // Contexts that stashed an input in the previous precision are still unstashed correctly (see unstashInput)
+    stashPrecision=_stashPrecision;
+}
+
+void CNNLayer::setNetworkStashPrecision(CNNLayer **_layers, uint32_t _layerCount, uint8_t _stashPrecision)
+{
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+        _layers[layerIndex]->setStashPrecision(_stashPrecision);
+}
+
+const char *CNNLayer::getStashPrecisionName(uint8_t _stashPrecision)
+{
+    if(_stashPrecision==CNN_STASH_PRECISION_DOUBLE)
+        return "double";
+    else if(_stashPrecision==CNN_STASH_PRECISION_BF16)
+        return "bfloat16";
+    else if(_stashPrecision==CNN_STASH_PRECISION_FP16)
+        return "fp16";
+    return "unknown";
+}
+
+void CNNLayer::setSpecializedKernels(bool _specializedKernels)
+{
+    specializedKernels=_specializedKernels;
+    selectKernels();
+}
+
+void CNNLayer::selectKernels()
+{
+    convFeatureMapsKernel=&CNNLayer::convFeatureMaps<0,0,0,0>;
+    convDiffsKernel=&CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps<0,0,0,0>;
+    maxpoolFeatureMapsKernel=&CNNLayer::maxpoolFeatureMaps<0,0,0,0>;
+    if(!specializedKernels)
+        return;
+
+    // Every specialization adds to the size of the binary, so only the geometries of common networks get one (the zero padding
+    // stays a runtime value, since it only moves the border between the interior and the clamped pixels)
+    if(type==CNN_LAYER_TYPE_CONV)
+    {
+        if(receptiveFieldWidth==5&&receptiveFieldHeight==5&&strideX==1&&strideY==1)
         {
-            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
-            {
-                for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
-                {
-                    free(weights[featureMapInPreviousLayer][y][x]);
-                    free(previousWeightDiffDeltas[featureMapInPreviousLayer][y][x]);
-                }
-                free(weights[featureMapInPreviousLayer][y]);
-                free(previousWeightDiffDeltas[featureMapInPreviousLayer][y]);
-            }
-            free(weights[featureMapInPreviousLayer]);
-            free(previousWeightDiffDeltas[featureMapInPreviousLayer]);
+            convFeatureMapsKernel=&CNNLayer::convFeatureMaps<5,5,1,1>;
+            convDiffsKernel=&CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps<5,5,1,1>;
         }
-        free(weights);
-        free(previousWeightDiffDeltas);
-        free(biasWeights);
-        free(previousBiasWeightDiffDeltas);
+        else if(receptiveFieldWidth==3&&receptiveFieldHeight==3&&strideX==1&&strideY==1)
+        {
+            convFeatureMapsKernel=&CNNLayer::convFeatureMaps<3,3,1,1>;
+            convDiffsKernel=&CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps<3,3,1,1>;
+        }
+        else if(receptiveFieldWidth==1&&receptiveFieldHeight==1&&strideX==1&&strideY==1)
+        {
+            convFeatureMapsKernel=&CNNLayer::convFeatureMaps<1,1,1,1>;
+            convDiffsKernel=&CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps<1,1,1,1>;
+        }
+        else if(receptiveFieldWidth==3&&receptiveFieldHeight==3&&strideX==2&&strideY==2)
+        {
+            convFeatureMapsKernel=&CNNLayer::convFeatureMaps<3,3,2,2>;
+            convDiffsKernel=&CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps<3,3,2,2>;
+        }
+    }
+    else if(type==CNN_LAYER_TYPE_MAXPOOL)
+    {
+        if(receptiveFieldWidth==2&&receptiveFieldHeight==2&&strideX==2&&strideY==2)
+            maxpoolFeatureMapsKernel=&CNNLayer::maxpoolFeatureMaps<2,2,2,2>;
     }
+}
+
+const char *CNNLayer::getConvAlgorithmName(uint8_t _convAlgorithm)
+{
+    if(_convAlgorithm==CNN_CONV_ALGORITHM_DIRECT)
+        return "direct";
+    else if(_convAlgorithm==CNN_CONV_ALGORITHM_ROWS)
+        return "rows";
+    else if(_convAlgorithm==CNN_CONV_ALGORITHM_FFT)
+        return "fft";
+    return "unknown";
+}
+
+uint64_t CNNLayer::getParameterChecksum(uint64_t checksum)
+{
+    if(!hasWeights())
+        return checksum;
+
+    // FNV-1a over the bytes of the weights, then the bias weights
+    uint8_t *bytes=(uint8_t*)getWeightTypeArrayData(weights);
+    uint64_t byteCount=weightCount*sizeof(double);
+    for(uint64_t byte=0;byte<byteCount;byte++)
+        checksum=(checksum^bytes[byte])*0x100000001B3ULL;
+    bytes=(uint8_t*)biasWeights;
+    byteCount=featureMapCount*sizeof(double);
+    for(uint64_t byte=0;byte<byteCount;byte++)
+        checksum=(checksum^bytes[byte])*0x100000001B3ULL;
+    return checksum;
+}
 
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+double ***CNNLayer::allocArray(uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    double ***out=(double***)malloc(zDimension*sizeof(double**));
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        out[z]=(double**)malloc(yDimension*sizeof(double*));
+        for(int32_t y=0;y<yDimension;y++)
+            out[z][y]=(double*)calloc(xDimension,sizeof(double));
+    }
+    return out;
 }
 
 void CNNLayer::freeArray(double ***_array, uint32_t zDimension, int32_t yDimension)
@@ -288,18 +678,45 @@ void CNNLayer::freeArray(double ***_array, uint32_t zDimension, int32_t yDimensi
     free(_array);
 }
 
+double ****CNNLayer::allocWeightTypeArray(uint32_t _dimension1, uint32_t _dimension2, int32_t _dimension3, int32_t _dimension4)
+{
+    // The pointer tables allow the usual [d1][d2][d3][d4] indexing, while the values themselves live in one contiguous block.
+    double *data=(double*)calloc(_dimension1*_dimension2*_dimension3*_dimension4,sizeof(double));
+    double *row=data;
+    double ****out=(double****)malloc(_dimension1*sizeof(double***));
+    for(uint32_t d1=0;d1<_dimension1;d1++)
+    {
+        out[d1]=(double***)malloc(_dimension2*sizeof(double**));
+        for(uint32_t d2=0;d2<_dimension2;d2++)
+        {
+            out[d1][d2]=(double**)malloc(_dimension3*sizeof(double*));
+            for(int32_t d3=0;d3<_dimension3;d3++)
+            {
+                out[d1][d2][d3]=row;
+                row+=_dimension4;
+            }
+        }
+    }
+    return out;
+}
+
+double *CNNLayer::getWeightTypeArrayData(double ****_array)
+{
+    // Only valid for arrays allocated by allocWeightTypeArray
+    return _array[0][0][0];
+}
+
 void CNNLayer::freeWeightTypeArray(double ****_array, uint32_t _dimension1, uint32_t _dimension2, int32_t _dimension3, int32_t _dimension4)
 {
     // Disable "unused" warning
     (void)_dimension4;
+    // All values are stored in one block (see allocWeightTypeArray)
+    if(_dimension1>0&&_dimension2>0&&_dimension3>0)
+        free(getWeightTypeArrayData(_array));
     for(uint32_t d1=0;d1<_dimension1;d1++)
     {
         for(uint32_t d2=0;d2<_dimension2;d2++)
-        {
-            for(int32_t d3=0;d3<_dimension3;d3++)
-                free(_array[d1][d2][d3]);
             free(_array[d1][d2]);
-        }
         free(_array[d1]);
     }
     free(_array);
@@ -312,6 +729,12 @@ void CNNLayer::freeBiasTypeArray(double *_array)
 
 double ***CNNLayer::cloneArray(double ***_array, uint32_t zDimension, int32_t yDimension, int32_t xDimension)
 {
+    if(isChannelsLastArray(_array,zDimension,yDimension))
+    {
+        double ***out=allocChannelsLastArray(zDimension,yDimension,xDimension);
+        memcpy(out[0][0],_array[0][0],zDimension*yDimension*xDimension*sizeof(double));
+        return out;
+    }
     double ***out=(double***)malloc(zDimension*sizeof(double**));
     uint32_t yDimensionDoublePointerArraySize=yDimension*sizeof(double*);
     uint32_t xDimensionDoubleArraySize=xDimension*sizeof(double);
@@ -349,31 +772,443 @@ int32_t CNNLayer::getRequiredZeroPaddingForDesiredSingleFeatureMapAndReceptiveFi
     return (int32_t)result;
 }
 
-double ***CNNLayer::conv(double ***_input)
+void CNNLayer::calculateInteriorRange(int32_t _previousLayerSingleFeatureMapSize, int32_t _singleFeatureMapSize, int32_t _receptiveFieldSize, int32_t _stride, int32_t _zeroPadding, int32_t &start, int32_t &end)
 {
-    // Modify "maxpool"/"relu"/"fc"/"softmax", too!
+    // The receptive field of output pixel i covers the input pixels [-_zeroPadding+_stride*i,-_zeroPadding+_stride*i+_receptiveFieldSize).
+    // It lies inside the input if -_zeroPadding+_stride*i>=0 and -_zeroPadding+_stride*i+_receptiveFieldSize<=_previousLayerSingleFeatureMapSize.
 
-    // Store for backpropagation
+    start=(_zeroPadding+_stride-1)/_stride; // ceil(_zeroPadding/_stride)
+    int32_t lastInputPixelStart=_previousLayerSingleFeatureMapSize+_zeroPadding-_receptiveFieldSize;
+    end=lastInputPixelStart<0?0:lastInputPixelStart/_stride+1;
 
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
-    input=cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+    if(end>_singleFeatureMapSize)
+        end=_singleFeatureMapSize;
+    if(start>end)
+        start=end; // No interior pixels at all; everything is border.
+}
 
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
-    output=(double***)malloc(featureMapCount*sizeof(double**));
+void CNNLayer::addRow(double *destination, const double *source, int32_t count)
+{
+    int32_t x=0;
 
-    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+#ifdef CNN_LAYER_USE_SSE2
+    for(;x+2<=count;x+=2)
+        _mm_storeu_pd(destination+x,_mm_add_pd(_mm_loadu_pd(destination+x),_mm_loadu_pd(source+x)));
+#endif
+
+    for(;x<count;x++)
+        destination[x]+=source[x];
+}
+
+void CNNLayer::addScaledRow(double *destination, const double *source, double factor, int32_t count)
+{
+    int32_t x=0;
+
+#ifdef CNN_LAYER_USE_SSE2
+    // Separate multiplication and addition, exactly like the scalar loop
+    __m128d factorVector=_mm_set1_pd(factor);
+    for(;x+2<=count;x+=2)
+        _mm_storeu_pd(destination+x,_mm_add_pd(_mm_loadu_pd(destination+x),_mm_mul_pd(_mm_loadu_pd(source+x),factorVector)));
+#endif
+
+    for(;x<count;x++)
+        destination[x]+=source[x]*factor;
+}
+
+double CNNLayer::sumRow(const double *source, int32_t count)
+{
+    int32_t x=0;
+    double sum=0.0;
+
+#ifdef CNN_LAYER_USE_SSE2
+    // Two partial sums (even and odd x), added up at the end
+    __m128d sumVector=_mm_setzero_pd();
+    for(;x+2<=count;x+=2)
+        sumVector=_mm_add_pd(sumVector,_mm_loadu_pd(source+x));
+    sum=_mm_cvtsd_f64(_mm_add_sd(sumVector,_mm_unpackhi_pd(sumVector,sumVector)));
+#endif
+
+    for(;x<count;x++)
+        sum+=source[x];
+    return sum;
+}
+
+void CNNLayer::fillRow(double *destination, double value, int32_t count)
+{
+    int32_t x=0;
+
+#ifdef CNN_LAYER_USE_SSE2
+    __m128d valueVector=_mm_set1_pd(value);
+    for(;x+2<=count;x+=2)
+        _mm_storeu_pd(destination+x,valueVector);
+#endif
+
+    for(;x<count;x++)
+        destination[x]=value;
+}
+
+double CNNLayer::dotRow(const double *source1, const double *source2, int32_t count)
+{
+    int32_t x=0;
+    double sum=0.0;
+
+#ifdef CNN_LAYER_USE_SSE2
+    // Two partial sums (even and odd x), added up at the end (like sumRow)
+    __m128d sumVector=_mm_setzero_pd();
+    for(;x+2<=count;x+=2)
+        sumVector=_mm_add_pd(sumVector,_mm_mul_pd(_mm_loadu_pd(source1+x),_mm_loadu_pd(source2+x)));
+    sum=_mm_cvtsd_f64(_mm_add_sd(sumVector,_mm_unpackhi_pd(sumVector,sumVector)));
+#endif
+
+    for(;x<count;x++)
+        sum+=source1[x]*source2[x];
+    return sum;
+}
+
+uint16_t CNNLayer::doubleToBf16(double value)
+{
+    float floatValue=(float)value;
+    uint32_t bits;
+    memcpy(&bits,&floatValue,sizeof(bits));
+    if((bits&0x7F800000)==0)
+        return (uint16_t)((bits>>16)&0x8000); // Zero or float denormal: signed zero
+    if((bits&0x7FFFFFFF)>0x7F800000)
+        return (uint16_t)((bits>>16)|0x0040); // NaN: the upper half, made quiet
+    // Round the lower half to nearest even (a carry into the exponent is correct, up to infinity)
+    return (uint16_t)((bits+0x7FFF+((bits>>16)&1))>>16);
+}
+
+double CNNLayer::bf16ToDouble(uint16_t value)
+{
+    uint32_t bits=((uint32_t)value)<<16;
+    float floatValue;
+    memcpy(&floatValue,&bits,sizeof(floatValue));
+    return (double)floatValue;
+}
+
+uint16_t CNNLayer::doubleToFp16(double value)
+{
+    float floatValue=(float)value;
+    uint32_t bits;
+    memcpy(&bits,&floatValue,sizeof(bits));
+    uint16_t sign=(uint16_t)((bits>>16)&0x8000);
+    uint32_t magnitude=bits&0x7FFFFFFF;
+
+    if(magnitude>=0x7F800000) // Infinity or NaN (made quiet, with the upper bits of the payload)
+        return sign|0x7C00|(magnitude>0x7F800000?0x0200|((magnitude>>13)&0x03FF):0);
+    if(magnitude>=0x47800000) // 2^16 and above: infinity (smaller values that round up to 2^16 carry into the exponent below)
+        return sign|0x7C00;
+    if(magnitude<0x38800000)
     {
-        output[featureMapInThisLayer]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+        // Below 2^-14 (fp16 denormals): adding 0.5 moves the lowest fp16 significand bit (2^-24) to the lowest float significand bit, so the
+        // addition itself rounds to nearest even; the significand bits of the sum are the fp16 value
+        float sum;
+        uint32_t sumBits;
+        memcpy(&sum,&magnitude,sizeof(sum));
+        sum+=0.5f;
+        memcpy(&sumBits,&sum,sizeof(sumBits));
+        return sign|(uint16_t)(sumBits-0x3F000000);
+    }
+    // Rebias the exponent (127 to 15) and round the 13 dropped significand bits to nearest even
+    return sign|(uint16_t)((magnitude-((127-15)<<23)+0x0FFF+((magnitude>>13)&1))>>13);
+}
 
-        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+double CNNLayer::fp16ToDouble(uint16_t value)
+{
+    double sign=(value&0x8000)?-1.0:1.0;
+    int32_t exponent=(value>>10)&0x1F;
+    int32_t significand=value&0x03FF;
+    if(exponent==0)
+        return sign*ldexp((double)significand,-24);
+    if(exponent==31)
+        return significand==0?sign*std::numeric_limits<double>::infinity():std::numeric_limits<double>::quiet_NaN();
+    return sign*ldexp((double)(significand|0x0400),exponent-25);
+}
+
+void CNNLayer::packReducedPrecisionRow(const double *source, uint16_t *destination, double scale, int32_t count, uint8_t _stashPrecision)
+{
+    int32_t x=0;
+    if(_stashPrecision==CNN_STASH_PRECISION_BF16)
+    {
+#ifdef CNN_LAYER_USE_AVX512_BF16
+        // The conversion to float rounds like the cast of the scalar code (MXCSR default), the one to bfloat16 always rounds to nearest even
+        __m512d scaleVector=_mm512_set1_pd(scale);
+        for(;x+8<=count;x+=8)
         {
-            // Initialize values with 0.0
-            output[featureMapInThisLayer][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
-            for(int32_t x=0;x<singleFeatureMapWidth;x++)
-                output[featureMapInThisLayer][y][x]=biasWeights[featureMapInThisLayer]; // Initialize output pixels with bias weights here to avoid having to add them later
+            __m256 floats=_mm512_cvtpd_ps(_mm512_mul_pd(_mm512_loadu_pd(source+x),scaleVector));
+            _mm_storeu_si128((__m128i*)(destination+x),(__m128i)_mm256_cvtneps_pbh(floats));
         }
+#endif
+        for(;x<count;x++)
+            destination[x]=doubleToBf16(source[x]*scale);
+    }
+    else if(_stashPrecision==CNN_STASH_PRECISION_FP16)
+    {
+#ifdef CNN_LAYER_USE_F16C
+        __m256d scaleVector=_mm256_set1_pd(scale);
+        for(;x+4<=count;x+=4)
+        {
+            __m128 floats=_mm256_cvtpd_ps(_mm256_mul_pd(_mm256_loadu_pd(source+x),scaleVector));
+            _mm_storel_epi64((__m128i*)(destination+x),_mm_cvtps_ph(floats,_MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+        for(;x<count;x++)
+            destination[x]=doubleToFp16(source[x]*scale);
+    }
+    else
+        throw;
+}
+
+void CNNLayer::unpackReducedPrecisionRow(const uint16_t *source, double *destination, double inverseScale, int32_t count, uint8_t _stashPrecision)
+{
+    int32_t x=0;
+    if(_stashPrecision==CNN_STASH_PRECISION_BF16)
+    {
+        for(;x<count;x++)
+            destination[x]=bf16ToDouble(source[x])*inverseScale;
+    }
+    else if(_stashPrecision==CNN_STASH_PRECISION_FP16)
+    {
+#ifdef CNN_LAYER_USE_F16C
+        __m256d inverseScaleVector=_mm256_set1_pd(inverseScale);
+        for(;x+4<=count;x+=4)
+            _mm256_storeu_pd(destination+x,_mm256_mul_pd(_mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(source+x)))),inverseScaleVector));
+#endif
+        for(;x<count;x++)
+            destination[x]=fp16ToDouble(source[x])*inverseScale;
+    }
+    else
+        throw;
+}
+
+void CNNLayer::beginForwardPass(double ***_input, CNNLayerContext &context, bool keepInput)
+{
+    if(context.input!=0)
+        freeArray(context.input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+    if(context.output!=0)
+        freeArray(context.output,featureMapCount,singleFeatureMapHeight);
+    context.output=0;
+
+    // The kernels only read context.input, so the caller's array can be used directly when nothing is stored for backpropagation
+    context.input=keepInput&&context.training?cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth):_input;
+}
+
+double ***CNNLayer::endForwardPass(CNNLayerContext &context, bool keepInput, bool keepOutput)
+{
+    if(!keepInput||!context.training)
+        context.input=0; // Belongs to the caller
+
+    // Return a copy of "output" to prevent changes from being made to "output" (only if it is kept, otherwise the output itself)
+    if(keepOutput&&context.training)
+        return cloneArray(context.output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+    double ***out=context.output;
+    context.output=0;
+    return out;
+}
+
+void CNNLayer::stashInput(CNNLayerContext &context)
+{
+    int32_t inputRowCount=previousLayerFeatureMapCount*previousLayerSingleFeatureMapHeight;
+    // Allocated once per context (like maxPixelMatrix); the input size of a layer doesn't change
+    if(context.stashedInput==0)
+        context.stashedInput=(uint16_t*)malloc(inputRowCount*previousLayerSingleFeatureMapWidth*sizeof(uint16_t));
+
+    // A channels-last input is stashed as one row in its own order
+    context.stashedChannelsLast=isChannelsLastArray(context.input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+    int32_t stashedRowCount=context.stashedChannelsLast?1:inputRowCount;
+    int32_t stashedRowLength=context.stashedChannelsLast?inputRowCount*previousLayerSingleFeatureMapWidth:previousLayerSingleFeatureMapWidth;
+
+    context.stashScale=1.0;
+    if(stashPrecision==CNN_STASH_PRECISION_FP16)
+    {
+        // A power of two that moves the largest magnitude into [2^(CNN_STASH_FP16_MAX_EXPONENT-1),2^CNN_STASH_FP16_MAX_EXPONENT): nothing overflows,
+        // and small values keep as many significand bits as the fp16 range allows
+        double maxAbsValue=0.0;
+        for(int32_t row=0;row<stashedRowCount;row++)
+        {
+            double *inputRow=context.input[row/previousLayerSingleFeatureMapHeight][row%previousLayerSingleFeatureMapHeight];
+            for(int32_t x=0;x<stashedRowLength;x++)
+                maxAbsValue=__max(maxAbsValue,fabs(inputRow[x]));
+        }
+        if(maxAbsValue>0.0&&maxAbsValue<=std::numeric_limits<double>::max())
+        {
+            int exponent;
+            frexp(maxAbsValue,&exponent);
+            context.stashScale=ldexp(1.0,CNN_STASH_FP16_MAX_EXPONENT-exponent);
+        }
+    }
+
+    for(int32_t row=0;row<stashedRowCount;row++)
+        packReducedPrecisionRow(context.input[row/previousLayerSingleFeatureMapHeight][row%previousLayerSingleFeatureMapHeight],context.stashedInput+row*stashedRowLength,context.stashScale,stashedRowLength,stashPrecision);
+    context.stashedPrecision=stashPrecision;
+    freeArray(context.input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+    context.input=0;
+}
+
+bool CNNLayer::unstashInput(CNNLayerContext &context)
+{
+    if(context.input!=0||context.stashedInput==0)
+        return false;
+
+    // The scale is a power of two, so its inverse is exact
+    double inverseScale=1.0/context.stashScale;
+    if(context.stashedChannelsLast)
+    {
+        context.input=allocChannelsLastArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+        unpackReducedPrecisionRow(context.stashedInput,context.input[0][0],inverseScale,previousLayerFeatureMapCount*previousLayerSingleFeatureMapHeight*previousLayerSingleFeatureMapWidth,context.stashedPrecision);
+        return true;
+    }
+    context.input=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
+    for(uint32_t previousLayerFeatureMap=0;previousLayerFeatureMap<previousLayerFeatureMapCount;previousLayerFeatureMap++)
+    {
+        context.input[previousLayerFeatureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
+        for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
+        {
+            double *inputRow=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
+            const uint16_t *stashedRow=context.stashedInput+(previousLayerFeatureMap*previousLayerSingleFeatureMapHeight+y)*previousLayerSingleFeatureMapWidth;
+            unpackReducedPrecisionRow(stashedRow,inputRow,inverseScale,previousLayerSingleFeatureMapWidth,context.stashedPrecision);
+            context.input[previousLayerFeatureMap][y]=inputRow;
+        }
+    }
+    return true;
+}
+
+void CNNLayer::packChannelsLast(double ***_array, uint32_t zDimension, int32_t yDimension, int32_t xDimension, double *packed)
+{
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            double *row=_array[z][y];
+            double *packedRow=packed+y*xDimension*zDimension+z;
+            for(int32_t x=0;x<xDimension;x++)
+                packedRow[x*zDimension]=row[x];
+        }
+    }
+}
+
+double ***CNNLayer::unpackChannelsLast(const double *packed, uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    double ***out=(double***)malloc(zDimension*sizeof(double**));
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        out[z]=(double**)malloc(yDimension*sizeof(double*));
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            double *row=(double*)malloc(xDimension*sizeof(double));
+            const double *packedRow=packed+y*xDimension*zDimension+z;
+            for(int32_t x=0;x<xDimension;x++)
+                row[x]=packedRow[x*zDimension];
+            out[z][y]=row;
+        }
+    }
+    return out;
+}
+
+double ***CNNLayer::allocChannelsLastArray(uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    double ***out=(double***)malloc(zDimension*sizeof(double**));
+    for(uint32_t z=0;z<zDimension;z++)
+        out[z]=(double**)calloc(yDimension,sizeof(double*));
+    out[0][0]=(double*)malloc(zDimension*yDimension*xDimension*sizeof(double));
+    return out;
+}
+
+bool CNNLayer::isChannelsLastArray(double ***_array, uint32_t zDimension, int32_t yDimension)
+{
+    return zDimension*yDimension>1&&_array[zDimension-1][yDimension-1]==0;
+}
+
+const double *CNNLayer::getChannelsLastInput(double ***_input, double *&packedCopy)
+{
+    if(isChannelsLastArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight))
+    {
+        packedCopy=0;
+        return _input[0][0];
+    }
+    packedCopy=(double*)malloc(previousLayerFeatureMapCount*previousLayerSingleFeatureMapHeight*previousLayerSingleFeatureMapWidth*sizeof(double));
+    packChannelsLast(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth,packedCopy);
+    return packedCopy;
+}
+
+double *CNNLayer::beginChannelsLastOutput(double ***&_output)
+{
+    if(channelsLastOutput)
+    {
+        _output=allocChannelsLastArray(featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+        return _output[0][0];
+    }
+    return (double*)malloc(featureMapCount*singleFeatureMapHeight*singleFeatureMapWidth*sizeof(double));
+}
+
+void CNNLayer::endChannelsLastOutput(double ***&_output, double *packedOutput)
+{
+    if(channelsLastOutput)
+        return; // _output owns packedOutput
+    _output=unpackChannelsLast(packedOutput,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+    free(packedOutput);
+}
+
+double ***CNNLayer::conv(double ***_input, CNNLayerContext &context)
+{
+    // Modify "maxpool"/"relu"/"fc"/"softmax", too!
+
+    // Store the input for backpropagation (the weight diffs need it)
+    beginForwardPass(_input,context,true);
+
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+    {
+        updatePackedWeights();
+        double *packedCopy;
+        const double *packedInput=getChannelsLastInput(context.input,packedCopy);
+        double *packedOutput=beginChannelsLastOutput(context.output);
+
+        // Every output row is one task
+        if(threadPool!=0)
+            threadPool->parallelFor(0,singleFeatureMapHeight,1,[this,packedInput,packedOutput](uint32_t first,uint32_t last){convRowsChannelsLast(packedInput,packedOutput,first,last);});
+        else
+            convRowsChannelsLast(packedInput,packedOutput,0,singleFeatureMapHeight);
+
+        endChannelsLastOutput(context.output,packedOutput);
+        free(packedCopy);
+        return endForwardPass(context,true,false);
+    }
+
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
+
+    // Every convGrain feature maps in this layer are one task
+    if(convAlgorithm==CNN_CONV_ALGORITHM_FFT)
+        convFFT(context);
+    else if(convAlgorithm==CNN_CONV_ALGORITHM_ROWS)
+    {
+        if(threadPool!=0)
+            threadPool->parallelFor(0,featureMapCount,convGrain,[this,&context](uint32_t first,uint32_t last){convFeatureMapsByRows(context,first,last);});
+        else
+            convFeatureMapsByRows(context,0,featureMapCount);
+    }
+    else
+    {
+        if(threadPool!=0)
+            threadPool->parallelFor(0,featureMapCount,convGrain,[this,&context](uint32_t first,uint32_t last){(this->*convFeatureMapsKernel)(context,first,last);});
+        else
+            (this->*convFeatureMapsKernel)(context,0,featureMapCount);
+    }
+
+    return endForwardPass(context,true,false);
+}
+
+template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+void CNNLayer::convFeatureMaps(CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    // Compile-time constants in the specialized kernels (see selectKernels), so that the loops over the receptive fields of the interior pixels unroll
+    const int32_t receptiveFieldWidth=fixedReceptiveFieldWidth>0?fixedReceptiveFieldWidth:this->receptiveFieldWidth;
+    const int32_t receptiveFieldHeight=fixedReceptiveFieldHeight>0?fixedReceptiveFieldHeight:this->receptiveFieldHeight;
+    const uint32_t strideX=fixedStrideX>0?fixedStrideX:this->strideX;
+    const uint32_t strideY=fixedStrideY>0?fixedStrideY:this->strideY;
+
+    for(uint32_t featureMapInThisLayer=first;featureMapInThisLayer<last;featureMapInThisLayer++)
+    {
+        context.output[featureMapInThisLayer]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
 
         // Store sums of pixel values in each feature map of the previous layer multiplied by their weights
         // in "output", then add bias.
@@ -381,145 +1216,479 @@ double ***CNNLayer::conv(double ***_input)
         // Fill pixels of current feature map in this layer with weight-multiplied pixels of feature maps in previous layer
         for(int32_t y=0;y<singleFeatureMapHeight;y++)
         {
+            context.output[featureMapInThisLayer][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+
+            int32_t offsetY=-zeroPaddingY+strideY*y;
+            bool interiorRow=y>=interiorStartY&&y<interiorEndY;
+
             for(int32_t x=0;x<singleFeatureMapWidth;x++)
             {
                 int32_t offsetX=-zeroPaddingX+strideX*x;
-                int32_t offsetY=-zeroPaddingY+strideY*y;
-                for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                double sum=biasWeights[featureMapInThisLayer]; // Start with the bias weight to avoid having to add it later
+
+                if(interiorRow&&x>=interiorStartX&&x<interiorEndX)
                 {
-                    for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                    // Interior pixel: the whole receptive field lies inside the feature maps of the previous layer, no bounds checks needed.
+                    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
                     {
-                        for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                        for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
                         {
-                            // Coordinates of pixel in feature map in previous layer:
-                            // (note that we check whether such a pixel exists below)
-                            int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
-                            int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                            double *inputRow=context.input[featureMapInPreviousLayer][offsetY+receptiveFieldY]+offsetX;
+                            double *weightRow=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                            for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                                sum+=inputRow[receptiveFieldX]*weightRow[receptiveFieldX];
+                        }
+                    }
+                }
+                else
+                {
+                    // Border pixel: clamp the receptive field to the part that overlaps the feature maps of the previous layer
+                    // (the rest lies in the zero padding and does not contribute anything).
+                    int32_t receptiveFieldStartX=__max(0,-offsetX);
+                    int32_t receptiveFieldStartY=__max(0,-offsetY);
+                    int32_t receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+                    int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+
+                    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                    {
+                        for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                        {
+                            double *inputRow=context.input[featureMapInPreviousLayer][offsetY+receptiveFieldY];
+                            double *weightRow=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                            for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                                sum+=inputRow[offsetX+receptiveFieldX]*weightRow[receptiveFieldX];
+                        }
+                    }
+                }
 
-                            bool inZeroPaddingField=pixelInFeatureMapInPreviousLayerX<0||pixelInFeatureMapInPreviousLayerY<0
-                                                    ||pixelInFeatureMapInPreviousLayerX>=previousLayerSingleFeatureMapWidth
-                                                    ||pixelInFeatureMapInPreviousLayerY>=previousLayerSingleFeatureMapHeight;
+                context.output[featureMapInThisLayer][y][x]=sum;
+            }
+        }
+
+        // Bias weights added during initialization
+    }
+}
+
+void CNNLayer::convFeatureMapsByRows(CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    // Every output pixel gets the bias weight plus the products in the order of convFeatureMaps (feature map in previous layer -> receptive field y -> receptive field x),
+    // but the loop over x is innermost, so that one weight is applied to a whole row of input pixels.
+    for(uint32_t featureMapInThisLayer=first;featureMapInThisLayer<last;featureMapInThisLayer++)
+    {
+        context.output[featureMapInThisLayer]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            double *outputRow=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+            context.output[featureMapInThisLayer][y]=outputRow;
+            fillRow(outputRow,biasWeights[featureMapInThisLayer],singleFeatureMapWidth);
 
-                            if(inZeroPaddingField)
-                                continue;
+            int32_t offsetY=-zeroPaddingY+strideY*y;
+            int32_t receptiveFieldStartY=__max(0,-offsetY);
+            int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
 
-                            output[featureMapInThisLayer][y][x]+=input[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]
-                                    *weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
+            for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+            {
+                for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                {
+                    double *inputRow=context.input[featureMapInPreviousLayer][offsetY+receptiveFieldY];
+                    double *weightRow=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                    for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    {
+                        // Output pixels x whose receptive field pixel receptiveFieldX lies inside the feature map: 0<=-zeroPaddingX+strideX*x+receptiveFieldX<previousLayerSingleFeatureMapWidth
+                        int32_t firstInputX=receptiveFieldX-zeroPaddingX;
+                        int32_t startX=firstInputX>=0?0:(-firstInputX+(int32_t)strideX-1)/(int32_t)strideX;
+                        int32_t endX=previousLayerSingleFeatureMapWidth-firstInputX<=0?0:__min(singleFeatureMapWidth,(previousLayerSingleFeatureMapWidth-firstInputX-1)/(int32_t)strideX+1);
+                        if(startX>=endX)
+                            continue;
+
+                        double weight=weightRow[receptiveFieldX];
+                        if(strideX==1)
+                            addScaledRow(outputRow+startX,inputRow+firstInputX+startX,weight,endX-startX);
+                        else
+                        {
+                            for(int32_t x=startX;x<endX;x++)
+                                outputRow[x]+=inputRow[firstInputX+(int32_t)strideX*x]*weight;
                         }
                     }
                 }
             }
         }
+    }
+}
 
-        // Bias weights added during initialization
+void CNNLayer::convRowsChannelsLast(const double *packedInput, double *packedOutput, int32_t first, int32_t last)
+{
+    for(int32_t y=first;y<last;y++)
+    {
+        int32_t offsetY=-zeroPaddingY+strideY*y;
+        int32_t receptiveFieldStartY=__max(0,-offsetY);
+        int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+
+        for(int32_t x=0;x<singleFeatureMapWidth;x++)
+        {
+            int32_t offsetX=-zeroPaddingX+strideX*x;
+            int32_t receptiveFieldStartX=__max(0,-offsetX);
+            int32_t receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+
+            double *outputPixel=packedOutput+(y*singleFeatureMapWidth+x)*featureMapCount;
+            memcpy(outputPixel,biasWeights,featureMapCount*sizeof(double));
+
+            for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+            {
+                for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                {
+                    const double *inputPixel=packedInput+((offsetY+receptiveFieldY)*previousLayerSingleFeatureMapWidth+offsetX+receptiveFieldX)*previousLayerFeatureMapCount;
+                    const double *weightRows=packedWeights+(receptiveFieldY*receptiveFieldWidth+receptiveFieldX)*previousLayerFeatureMapCount*featureMapCount;
+                    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                        addScaledRow(outputPixel,weightRows+featureMapInPreviousLayer*featureMapCount,inputPixel[featureMapInPreviousLayer],featureMapCount);
+                }
+            }
+        }
     }
+}
 
-    // Return a copy of "output" to prevent changes from being made to "output".
+void CNNLayer::updatePackedWeights()
+{
+    if(packedWeightsValid.load())
+        return;
+    std::lock_guard<std::mutex> lock(weightTransformsMutex);
+    if(packedWeightsValid.load())
+        return; // Packed by another pass in the meantime
 
-    return cloneArray(output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+    {
+        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+        {
+            for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+            {
+                for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                {
+                    packedWeights[((receptiveFieldY*receptiveFieldWidth+receptiveFieldX)*previousLayerFeatureMapCount+featureMapInPreviousLayer)*featureMapCount+featureMapInThisLayer]=
+                            weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
+                }
+            }
+        }
+    }
+
+    packedWeightsValid=true;
 }
 
-double ***CNNLayer::fc(double ***_input)
+void CNNLayer::convFFT(CNNLayerContext &context)
 {
-    // Modify "maxpool"/"relu"/"maxpool"/"softmax", too!
+    updateFilterSpectra();
+
+    int32_t tileCountX=(previousLayerSingleFeatureMapWidth+fftTileWidth-1)/fftTileWidth;
+    int32_t tileCountY=(previousLayerSingleFeatureMapHeight+fftTileHeight-1)/fftTileHeight;
+    uint32_t tileCount=tileCountX*tileCountY;
+    uint32_t spectrumSize=fft->spectrumSize;
+    uint32_t bufferSize=fft->width*fft->height;
+
+    // Spectra of the input tiles: feature map in previous layer -> tile -> spectrumSize real parts, then spectrumSize imaginary parts.
+    // Every feature map in the previous layer is one task.
+    double *inputSpectra=(double*)malloc(previousLayerFeatureMapCount*tileCount*2*spectrumSize*sizeof(double));
+    auto transformInput=[this,&context,inputSpectra,tileCountX,tileCount,spectrumSize,bufferSize](uint32_t first,uint32_t last){
+        double *buffer=(double*)malloc((bufferSize+fft->getScratchSize())*sizeof(double));
+        double *scratch=buffer+bufferSize;
+        for(uint32_t featureMapInPreviousLayer=first;featureMapInPreviousLayer<last;featureMapInPreviousLayer++)
+        {
+            for(uint32_t tile=0;tile<tileCount;tile++)
+            {
+                fillFFTBuffer(buffer,context.input[featureMapInPreviousLayer],previousLayerSingleFeatureMapWidth,previousLayerSingleFeatureMapHeight,
+                              (tile%tileCountX)*fftTileWidth,(tile/tileCountX)*fftTileHeight,fftTileWidth,fftTileHeight,1,1);
+                double *spectrum=inputSpectra+(featureMapInPreviousLayer*tileCount+tile)*2*spectrumSize;
+                fft->forward(buffer,spectrum,spectrum+spectrumSize,scratch);
+            }
+        }
+        free(buffer);
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerFeatureMapCount,1,transformInput);
+    else
+        transformInput(0,previousLayerFeatureMapCount);
+
+    // Every convGrain feature maps in this layer are one task
+    auto correlateTiles=[this,&context,inputSpectra,tileCountX,tileCount,spectrumSize,bufferSize](uint32_t first,uint32_t last){
+        double *buffer=(double*)malloc((bufferSize+fft->getScratchSize()+2*spectrumSize)*sizeof(double));
+        double *scratch=buffer+bufferSize;
+        double *accumulator=scratch+fft->getScratchSize();
+        for(uint32_t featureMapInThisLayer=first;featureMapInThisLayer<last;featureMapInThisLayer++)
+        {
+            context.output[featureMapInThisLayer]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+            for(int32_t y=0;y<singleFeatureMapHeight;y++)
+            {
+                context.output[featureMapInThisLayer][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+                fillRow(context.output[featureMapInThisLayer][y],biasWeights[featureMapInThisLayer],singleFeatureMapWidth);
+            }
+
+            for(uint32_t tile=0;tile<tileCount;tile++)
+            {
+                memset(accumulator,0,2*spectrumSize*sizeof(double));
+                for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                {
+                    double *inputSpectrum=inputSpectra+(featureMapInPreviousLayer*tileCount+tile)*2*spectrumSize;
+                    double *filterSpectrum=filterSpectra+(featureMapInPreviousLayer*featureMapCount+featureMapInThisLayer)*2*spectrumSize;
+                    fft->multiplyAccumulate(accumulator,accumulator+spectrumSize,inputSpectrum,inputSpectrum+spectrumSize,filterSpectrum,filterSpectrum+spectrumSize,true);
+                }
+                fft->inverse(accumulator,accumulator+spectrumSize,buffer,scratch);
+
+                // Value m of the correlation (m in [-(receptiveFieldSize-1),tileSize), stored at m modulo the transform size) is the part of the tile in the
+                // receptive field of the stride 1 output pixel m+zeroPadding+tileStart; the other output pixels are skipped by the stride
+                int32_t tileStartX=(tile%tileCountX)*fftTileWidth;
+                int32_t tileStartY=(tile/tileCountX)*fftTileHeight;
+                for(int32_t correlationY=1-receptiveFieldHeight;correlationY<fftTileHeight;correlationY++)
+                {
+                    int32_t outputY=correlationY+zeroPaddingY+tileStartY;
+                    if(outputY<0||outputY%strideY!=0||outputY/(int32_t)strideY>=singleFeatureMapHeight)
+                        continue;
+                    double *outputRow=context.output[featureMapInThisLayer][outputY/strideY];
+                    double *bufferRow=buffer+((correlationY+(int32_t)fft->height)%(int32_t)fft->height)*fft->width;
+                    for(int32_t correlationX=1-receptiveFieldWidth;correlationX<fftTileWidth;correlationX++)
+                    {
+                        int32_t outputX=correlationX+zeroPaddingX+tileStartX;
+                        if(outputX<0||outputX%strideX!=0||outputX/(int32_t)strideX>=singleFeatureMapWidth)
+                            continue;
+                        outputRow[outputX/strideX]+=bufferRow[(correlationX+(int32_t)fft->width)%(int32_t)fft->width];
+                    }
+                }
+            }
+        }
+        free(buffer);
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,convGrain,correlateTiles);
+    else
+        correlateTiles(0,featureMapCount);
 
-    // Store for backpropagation
+    free(inputSpectra);
+}
 
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
-    input=cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+void CNNLayer::updateFilterSpectra()
+{
+    if(filterSpectraValid.load())
+        return;
+    std::lock_guard<std::mutex> lock(weightTransformsMutex);
+    if(filterSpectraValid.load())
+        return; // Calculated by another pass in the meantime
+
+    // Every feature map in the previous layer is one task
+    auto transformFilters=[this](uint32_t first,uint32_t last){
+        uint32_t bufferSize=fft->width*fft->height;
+        double *buffer=(double*)malloc((bufferSize+fft->getScratchSize())*sizeof(double));
+        double *scratch=buffer+bufferSize;
+        for(uint32_t featureMapInPreviousLayer=first;featureMapInPreviousLayer<last;featureMapInPreviousLayer++)
+        {
+            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+            {
+                memset(buffer,0,bufferSize*sizeof(double));
+                for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                    memcpy(buffer+receptiveFieldY*fft->width,weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY],receptiveFieldWidth*sizeof(double));
+                double *spectrum=filterSpectra+(featureMapInPreviousLayer*featureMapCount+featureMapInThisLayer)*2*fft->spectrumSize;
+                fft->forward(buffer,spectrum,spectrum+fft->spectrumSize,scratch);
+            }
+        }
+        free(buffer);
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerFeatureMapCount,1,transformFilters);
+    else
+        transformFilters(0,previousLayerFeatureMapCount);
 
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
+    filterSpectraValid=true;
+}
 
+void CNNLayer::fillFFTBuffer(double *buffer, double **featureMap, int32_t featureMapWidth, int32_t featureMapHeight, int32_t startX, int32_t startY, int32_t width, int32_t height, int32_t upsamplingX, int32_t upsamplingY)
+{
+    memset(buffer,0,fft->width*fft->height*sizeof(double));
+    for(int32_t y=0;y<height;y++)
+    {
+        int32_t upsampledY=startY+y;
+        if(upsampledY<0||upsampledY%upsamplingY!=0||upsampledY/upsamplingY>=featureMapHeight)
+            continue;
+        double *row=featureMap[upsampledY/upsamplingY];
+        double *bufferRow=buffer+y*fft->width;
+        for(int32_t x=0;x<width;x++)
+        {
+            int32_t upsampledX=startX+x;
+            if(upsampledX<0||upsampledX%upsamplingX!=0||upsampledX/upsamplingX>=featureMapWidth)
+                continue;
+            bufferRow[x]=row[upsampledX/upsamplingX];
+        }
+    }
+}
 
-    // featureMapCount=neuronCount
-    output=(double***)malloc(featureMapCount*sizeof(double**));
+double ***CNNLayer::fc(double ***_input, CNNLayerContext &context)
+{
+    // Modify "maxpool"/"relu"/"maxpool"/"softmax", too!
+
+    // Store the input for backpropagation (the weight diffs need it)
+    beginForwardPass(_input,context,true);
+
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+    {
+        double *packedCopy;
+        const double *packedInput=getChannelsLastInput(context.input,packedCopy);
+        // The output has one pixel, so the sums are its values in channels-last order
+        double *sums=beginChannelsLastOutput(context.output);
+
+        // Every CNN_NHWC_FC_GRAIN neurons are one task
+        if(threadPool!=0)
+            threadPool->parallelFor(0,featureMapCount,CNN_NHWC_FC_GRAIN,[this,packedInput,sums](uint32_t first,uint32_t last){fcNeuronsChannelsLast(packedInput,sums,first,last);});
+        else
+            fcNeuronsChannelsLast(packedInput,sums,0,featureMapCount);
+
+        endChannelsLastOutput(context.output,sums);
+        free(packedCopy);
+        return endForwardPass(context,true,false);
+    }
 
-    // Initialize output values with bias weights here to avoid having to add them later (since no activation function is used, this is permissible)
+    // featureMapCount=neuronCount
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
 
     for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
     {
-        output[featureMapInThisLayer]=(double**)malloc(1*sizeof(double*));
-        output[featureMapInThisLayer][0]=(double*)malloc(1*sizeof(double));
-        output[featureMapInThisLayer][0][0]=biasWeights[featureMapInThisLayer];
+        context.output[featureMapInThisLayer]=(double**)malloc(1*sizeof(double*));
+        context.output[featureMapInThisLayer][0]=(double*)malloc(1*sizeof(double));
     }
 
-    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+    // Every neuron is one task
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,&context](uint32_t first,uint32_t last){fcNeurons(context,first,last);});
+    else
+        fcNeurons(context,0,featureMapCount);
+
+    return endForwardPass(context,true,false);
+}
+
+void CNNLayer::fcNeurons(CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    for(uint32_t featureMapInThisLayer=first;featureMapInThisLayer<last;featureMapInThisLayer++)
     {
-        for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
+        // Start with the bias weight to avoid having to add it later (since no activation function is used, this is permissible)
+        double sum=biasWeights[featureMapInThisLayer];
+
+        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
         {
-            for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
+            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
             {
-                for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-                    output[featureMapInThisLayer][0][0]+=
-                            input[featureMapInPreviousLayer][y][x]*
-                            weights[featureMapInPreviousLayer][y][x][featureMapInThisLayer];
+                for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
+                    sum+=context.input[featureMapInPreviousLayer][y][x]*weights[featureMapInPreviousLayer][y][x][featureMapInThisLayer];
             }
         }
+
+        context.output[featureMapInThisLayer][0][0]=sum;
     }
+}
 
-    // Return a copy of "output" to prevent changes from being made to "output".
+void CNNLayer::fcNeuronsChannelsLast(const double *packedInput, double *sums, uint32_t first, uint32_t last)
+{
+    uint32_t neuronCount=last-first;
+    memcpy(sums+first,biasWeights+first,neuronCount*sizeof(double));
 
-    return cloneArray(output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+    const double *inputValue=packedInput;
+    for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
+    {
+        for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
+        {
+            for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                addScaledRow(sums+first,weights[featureMapInPreviousLayer][y][x]+first,*inputValue++,neuronCount);
+        }
+    }
 }
 
-double ***CNNLayer::maxpool(double ***_input)
+double ***CNNLayer::maxpool(double ***_input, CNNLayerContext &context)
 {
     // Modify "conv"/"relu"/"fc"/"softmax", too!
 
     // A maxpool layer has the same depth as the layer preceding it
 
-    // Store for backpropagation
+    // Only maxPixelMatrix is stored for backpropagation
+    beginForwardPass(_input,context,false);
+
+    // Allocated once per context; the values are overwritten by every call
+    if(context.training&&context.maxPixelMatrix==0)
+        context.maxPixelMatrix=allocArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
 
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
-    input=cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+    {
+        double *packedCopy;
+        const double *packedInput=getChannelsLastInput(context.input,packedCopy);
+        double *packedOutput=beginChannelsLastOutput(context.output);
+        maxpoolChannelsLast(packedInput,packedOutput,context);
+        endChannelsLastOutput(context.output,packedOutput);
+        free(packedCopy);
+        return endForwardPass(context,false,false);
+    }
 
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
-    output=(double***)malloc(featureMapCount*sizeof(double**));
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
 
     // featureMapInPreviousLayer = featureMapInThisLayer (each depth slice is processed independently)
+    (this->*maxpoolFeatureMapsKernel)(context,0,featureMapCount);
 
-    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    return endForwardPass(context,false,false);
+}
+
+template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+void CNNLayer::maxpoolFeatureMaps(CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    // See convFeatureMaps
+    const int32_t receptiveFieldWidth=fixedReceptiveFieldWidth>0?fixedReceptiveFieldWidth:this->receptiveFieldWidth;
+    const int32_t receptiveFieldHeight=fixedReceptiveFieldHeight>0?fixedReceptiveFieldHeight:this->receptiveFieldHeight;
+    const uint32_t strideX=fixedStrideX>0?fixedStrideX:this->strideX;
+    const uint32_t strideY=fixedStrideY>0?fixedStrideY:this->strideY;
+    // Nothing is marked in inference mode (a stale matrix of an earlier training pass stays untouched)
+    double ***maxPixelMatrix=context.training?context.maxPixelMatrix:0;
+
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
     {
         // featureMapInPreviousLayer = featureMapInThisLayer (each depth slice is processed independently)
-        output[featureMap]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+        context.output[featureMap]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
 
         for(int32_t y=0;y<singleFeatureMapHeight;y++)
-            output[featureMap][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+            context.output[featureMap][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
 
         // Move over feature map in previous layer, map max pixels to pixels in feature map in this layer
 
         for(int32_t y=0;y<singleFeatureMapHeight;y++)
         {
+            int32_t offsetY=-zeroPaddingY+strideY*y;
+            bool interiorRow=y>=interiorStartY&&y<interiorEndY;
+
             for(int32_t x=0;x<singleFeatureMapWidth;x++)
             {
                 int32_t offsetX=-zeroPaddingX+strideX*x;
-                int32_t offsetY=-zeroPaddingY+strideY*y;
+
+                // Interior pixels use the whole receptive field; border pixels only use the part that overlaps the feature map in the previous layer
+                // (pixels in the zero padding don't exist, so there's nothing to be set in "maxPixelMatrix" for them).
+                int32_t receptiveFieldStartX=0;
+                int32_t receptiveFieldStartY=0;
+                int32_t receptiveFieldEndX=receptiveFieldWidth;
+                int32_t receptiveFieldEndY=receptiveFieldHeight;
+
+                if(!interiorRow||x<interiorStartX||x>=interiorEndX)
+                {
+                    receptiveFieldStartX=__max(0,-offsetX);
+                    receptiveFieldStartY=__max(0,-offsetY);
+                    receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+                    receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+                }
 
                 int32_t highestValueX=-1;
                 int32_t highestValueY=-1;
                 double highestValue=-std::numeric_limits<double>::max(); // Lowest possible value of type "sdouble"
 
-                for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
                 {
-                    for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    // Coordinates of pixel in feature map in previous layer:
+                    int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                    double *inputRow=context.input[featureMap][pixelInFeatureMapInPreviousLayerY];
+                    double *maxPixelRow=maxPixelMatrix!=0?maxPixelMatrix[featureMap][pixelInFeatureMapInPreviousLayerY]:0;
+
+                    for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
                     {
-                        // Coordinates of pixel in feature map in previous layer:
-                        // (note that we check whether such a pixel exists below)
                         int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
-                        int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
-
-                        bool inZeroPaddingField=pixelInFeatureMapInPreviousLayerX<0||pixelInFeatureMapInPreviousLayerY<0
-                                                ||pixelInFeatureMapInPreviousLayerX>=previousLayerSingleFeatureMapWidth
-                                                ||pixelInFeatureMapInPreviousLayerY>=previousLayerSingleFeatureMapHeight;
 
-                        if(inZeroPaddingField)
-                            continue; // This pixel doesn't exist, so there's nothing to be set in "maxPixelMatrix"
-
-                        double pixelValue=input[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX];
+                        double pixelValue=inputRow[pixelInFeatureMapInPreviousLayerX];
                         if(pixelValue>highestValue)
                         {
                             highestValue=pixelValue;
@@ -527,39 +1696,84 @@ double ***CNNLayer::maxpool(double ***_input)
                             highestValueX=pixelInFeatureMapInPreviousLayerX;
                         }
                         // We still don't know whether this will be the highest pixel, so we only set the highest pixel's maxPixelMatrix value once we're sure.
-                        maxPixelMatrix[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]=0.0;
+                        if(maxPixelRow!=0)
+                            maxPixelRow[pixelInFeatureMapInPreviousLayerX]=0.0;
                     }
                 }
 
                 // Store coordinates (for backpropagation):
 
-                maxPixelMatrix[featureMap][highestValueY][highestValueX]=1.0;
+                if(maxPixelMatrix!=0)
+                    maxPixelMatrix[featureMap][highestValueY][highestValueX]=1.0;
 
                 // Set value of pixel in this layer's feature map to the highest value found.
 
-                output[featureMap][y][x]=highestValue;
+                context.output[featureMap][y][x]=highestValue;
             }
         }
     }
+}
 
-    // Return a copy of "output" to prevent changes from being made to "output".
+void CNNLayer::maxpoolChannelsLast(const double *packedInput, double *packedOutput, CNNLayerContext &context)
+{
+    // Input pixel (y*previousLayerSingleFeatureMapWidth+x) of the highest value per feature map
+    int32_t *highestValuePixels=(int32_t*)malloc(featureMapCount*sizeof(int32_t));
+    double ***maxPixelMatrix=context.training?context.maxPixelMatrix:0; // See maxpoolFeatureMaps
+
+    for(int32_t y=0;y<singleFeatureMapHeight;y++)
+    {
+        int32_t offsetY=-zeroPaddingY+strideY*y;
+        int32_t receptiveFieldStartY=__max(0,-offsetY);
+        int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
 
-    return cloneArray(output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+        for(int32_t x=0;x<singleFeatureMapWidth;x++)
+        {
+            int32_t offsetX=-zeroPaddingX+strideX*x;
+            int32_t receptiveFieldStartX=__max(0,-offsetX);
+            int32_t receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+
+            double *outputPixel=packedOutput+(y*singleFeatureMapWidth+x)*featureMapCount;
+            fillRow(outputPixel,-std::numeric_limits<double>::max(),featureMapCount);
+
+            for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+            {
+                int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                {
+                    int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
+                    int32_t pixel=pixelInFeatureMapInPreviousLayerY*previousLayerSingleFeatureMapWidth+pixelInFeatureMapInPreviousLayerX;
+                    const double *inputPixel=packedInput+pixel*featureMapCount;
+                    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+                    {
+                        if(inputPixel[featureMap]>outputPixel[featureMap])
+                        {
+                            outputPixel[featureMap]=inputPixel[featureMap];
+                            highestValuePixels[featureMap]=pixel;
+                        }
+                        if(maxPixelMatrix!=0)
+                            maxPixelMatrix[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]=0.0;
+                    }
+                }
+            }
+
+            for(uint32_t featureMap=0;maxPixelMatrix!=0&&featureMap<featureMapCount;featureMap++)
+            {
+                int32_t pixel=highestValuePixels[featureMap];
+                maxPixelMatrix[featureMap][pixel/previousLayerSingleFeatureMapWidth][pixel%previousLayerSingleFeatureMapWidth]=1.0;
+            }
+        }
+    }
+
+    free(highestValuePixels);
 }
 
-double ***CNNLayer::relu(double ***_input)
+double ***CNNLayer::relu(double ***_input, CNNLayerContext &context)
 {
     // Modify "conv"/"maxpool"/"fc"/"softmax", too!
 
-    // Store for backpropagation
-
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
-    input=cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
-
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
-    output=(double***)malloc(featureMapCount*sizeof(double**));
+    // Store the output for backpropagation (the input diffs only depend on its sign)
+    beginForwardPass(_input,context,false);
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
 
 
     // Note that a relu layer has exactly the same dimensions as the layer preceding it,
@@ -567,37 +1781,29 @@ double ***CNNLayer::relu(double ***_input)
 
     for(uint32_t featureMap=0;featureMap<previousLayerFeatureMapCount;featureMap++)
     {
-        output[featureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*)); // See comment above for explanation.
+        context.output[featureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*)); // See comment above for explanation.
         for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
         {
-            output[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double)); // See comment above for explanation.
+            context.output[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double)); // See comment above for explanation.
             for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
             {
-                 output[featureMap][y][x]=__max(0.0,input[featureMap][y][x]); // See comment above for explanation.
+                 context.output[featureMap][y][x]=__max(0.0,context.input[featureMap][y][x]); // See comment above for explanation.
             }
         }
     }
 
-    // Return a copy of "output" to prevent changes from being made to "output".
-
-    return cloneArray(output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+    return endForwardPass(context,false,true);
 }
 
-double ***CNNLayer::softmax(double ***_input)
+double ***CNNLayer::softmax(double ***_input, CNNLayerContext &context)
 {
     // Modify "conv"/"maxpool"/"fc"/"relu", too!
 
     // A softmax layer has the same depth (feature count) as the layer preceding it (intended to be used after a FC layer)
 
-    // Store for backpropagation
-
-    if(input!=0)
-        freeArray(input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
-    input=cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
-
-    if(output!=0)
-        freeArray(output,featureMapCount,singleFeatureMapHeight);
-    output=(double***)malloc(featureMapCount*sizeof(double**));
+    // Store for backpropagation (the input for the loss, the output for the input diffs)
+    beginForwardPass(_input,context,true);
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
 
     // READ THIS:
     // A softmax layer has the same depth (feature count) as the layer preceding it (intended to be used after a FC layer)
@@ -609,7 +1815,7 @@ double ***CNNLayer::softmax(double ***_input)
 
     for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
     {
-        double value=input[featureMap][0][0];
+        double value=context.input[featureMap][0][0];
         if(value>highestValue)
             highestValue=value;
     }
@@ -618,35 +1824,363 @@ double ***CNNLayer::softmax(double ***_input)
 
     for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
     {
-        double value=input[featureMap][0][0];
+        double value=context.input[featureMap][0][0];
         ePowSum+=exp(value-highestValue);
     }
 
+    // Log-sum-exp: shifted by the highest activation, so exp can't overflow; stored for the loss (see calculateSoftmaxDiffs)
+    context.logSumExp=highestValue+log(ePowSum);
+
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        double value=context.input[featureMap][0][0];
+        context.output[featureMap]=(double**)malloc(1*sizeof(double*));
+        context.output[featureMap][0]=(double*)malloc(1*sizeof(double));
+        context.output[featureMap][0][0]=exp(value-context.logSumExp);
+    }
+
+    return endForwardPass(context,true,true);
+}
+
+double ***CNNLayer::batchnorm(double ***_input, CNNLayerContext &context)
+{
+    // Modify "conv"/"maxpool"/"fc"/"relu"/"softmax", too!
+
+    // Store the input for backpropagation (the diffs need the normalized input)
+    beginForwardPass(_input,context,true);
+    context.output=(double***)malloc(featureMapCount*sizeof(double**));
+
+    // Every feature map is one task (the feature maps are normalized independently)
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,&context](uint32_t first,uint32_t last){batchnormFeatureMaps(context,first,last);});
+    else
+        batchnormFeatureMaps(context,0,featureMapCount);
+
+    return endForwardPass(context,true,false);
+}
+
+void CNNLayer::getBatchnormStatistics(CNNLayerContext &context, uint32_t featureMap, double &mean, double &variance)
+{
+    if(!context.training)
+    {
+        mean=runningMeans[featureMap];
+        variance=runningVariances[featureMap];
+    }
+    else if(context.batchMeans!=0)
+    {
+        mean=context.batchMeans[featureMap];
+        variance=context.batchVariances[featureMap];
+    }
+    else
+        calculateBatchnormStatistics(&context.input,1,featureMap,mean,variance);
+}
+
+void CNNLayer::calculateBatchnormStatistics(double ****inputs, uint32_t exampleCount, uint32_t featureMap, double &mean, double &variance)
+{
+    double valueCount=(double)exampleCount*singleFeatureMapWidth*singleFeatureMapHeight;
+    double sum=0.0;
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+            sum+=sumRow(inputs[example][featureMap][y],singleFeatureMapWidth);
+    }
+    mean=sum/valueCount;
+
+    // Sum of the squared deviations from the mean (not the difference of the sums of the squares, which cancels)
+    double *deviationRow=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+    double squaredDeviationSum=0.0;
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            fillRow(deviationRow,-mean,singleFeatureMapWidth);
+            addRow(deviationRow,inputs[example][featureMap][y],singleFeatureMapWidth);
+            squaredDeviationSum+=dotRow(deviationRow,deviationRow,singleFeatureMapWidth);
+        }
+    }
+    free(deviationRow);
+    variance=squaredDeviationSum/valueCount;
+}
+
+void CNNLayer::calculateBatchnormBatchStatistics(double ****inputs, uint32_t exampleCount, double *means, double *variances)
+{
+    // Every feature map is one task
+    auto calculateFeatureMaps=[this,inputs,exampleCount,means,variances](uint32_t first,uint32_t last){
+        for(uint32_t featureMap=first;featureMap<last;featureMap++)
+            calculateBatchnormStatistics(inputs,exampleCount,featureMap,means[featureMap],variances[featureMap]);};
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,calculateFeatureMaps);
+    else
+        calculateFeatureMaps(0,featureMapCount);
+}
+
+void CNNLayer::updateBatchnormRunningStatistics(const double *means, const double *variances, uint32_t exampleCount)
+{
+    double valueCount=(double)exampleCount*singleFeatureMapWidth*singleFeatureMapHeight;
     for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+        updateBatchnormRunningStatistics(featureMap,means[featureMap],variances[featureMap],valueCount);
+}
+
+void CNNLayer::updateBatchnormRunningStatistics(uint32_t featureMap, double mean, double variance, double valueCount)
+{
+    // The running variance is unbiased (the normalization itself uses the biased variance)
+    double unbiasedVariance=valueCount>1.0?variance*valueCount/(valueCount-1.0):variance;
+    std::lock_guard<std::mutex> lock(runningStatisticsMutex);
+    runningMeans[featureMap]=(1.0-CNN_BATCHNORM_MOMENTUM)*runningMeans[featureMap]+CNN_BATCHNORM_MOMENTUM*mean;
+    runningVariances[featureMap]=(1.0-CNN_BATCHNORM_MOMENTUM)*runningVariances[featureMap]+CNN_BATCHNORM_MOMENTUM*unbiasedVariance;
+}
+
+void CNNLayer::batchnormFeatureMaps(CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
+    {
+        double mean;
+        double variance;
+        getBatchnormStatistics(context,featureMap,mean,variance);
+        double inverseStandardDeviation=1.0/sqrt(variance+CNN_BATCHNORM_EPSILON);
+
+        // A recomputation must not count the example twice, and the caller updates the statistics of a batch once for all of its examples
+        if(context.training&&!context.recomputation&&context.batchMeans==0)
+            updateBatchnormRunningStatistics(featureMap,mean,variance,(double)(singleFeatureMapWidth*singleFeatureMapHeight));
+
+        // output=scale*(input-mean)*inverseStandardDeviation+shift=factor*input+offset
+        double factor=weights[featureMap][0][0][0]*inverseStandardDeviation;
+        double offset=biasWeights[featureMap]-factor*mean;
+
+        context.output[featureMap]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            context.output[featureMap][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+            fillRow(context.output[featureMap][y],offset,singleFeatureMapWidth);
+            addScaledRow(context.output[featureMap][y],context.input[featureMap][y],factor,singleFeatureMapWidth);
+        }
+    }
+}
+
+double ***CNNLayer::avgpool(double ***_input)
+{
+    // Modify "maxpool", too!
+
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
     {
-        double value=input[featureMap][0][0];
-        output[featureMap]=(double**)malloc(1*sizeof(double*));
-        output[featureMap][0]=(double*)malloc(1*sizeof(double));
-        output[featureMap][0][0]=exp(value-highestValue)/ePowSum;
+        double *packedCopy;
+        const double *packedInput=getChannelsLastInput(_input,packedCopy);
+        double ***out;
+        double *packedOutput=beginChannelsLastOutput(out);
+
+        // Every output row is one task
+        if(threadPool!=0)
+            threadPool->parallelFor(0,singleFeatureMapHeight,1,[this,packedInput,packedOutput](uint32_t first,uint32_t last){avgpoolRowsChannelsLast(packedInput,packedOutput,first,last);});
+        else
+            avgpoolRowsChannelsLast(packedInput,packedOutput,0,singleFeatureMapHeight);
+
+        endChannelsLastOutput(out,packedOutput);
+        free(packedCopy);
+        return out;
     }
 
-    // Return a copy of "output" to prevent changes from being made to "output".
+    double ***out=(double***)malloc(featureMapCount*sizeof(double**));
+
+    // Every feature map is one task
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,_input,out](uint32_t first,uint32_t last){avgpoolFeatureMaps(_input,out,first,last);});
+    else
+        avgpoolFeatureMaps(_input,out,0,featureMapCount);
+
+    return out;
+}
+
+void CNNLayer::avgpoolFeatureMaps(double ***_input, double ***_output, uint32_t first, uint32_t last)
+{
+    // Each output row is calculated in two steps: the rows of the receptive fields are added up column by column (vectorized, over the whole width),
+    // then the column sums of each receptive field are added up. Column x of the previous layer is columnSums[zeroPaddingX+x]; the zero padding
+    // columns stay 0, so the receptive fields don't need to be clamped.
+    double factor=1.0/(double)totalReceptiveFieldSize;
+    int32_t paddedWidth=previousLayerSingleFeatureMapWidth+2*zeroPaddingX;
+    double *columnSums=(double*)malloc(paddedWidth*sizeof(double));
+
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
+    {
+        _output[featureMap]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            int32_t offsetY=-zeroPaddingY+strideY*y;
 
-    return cloneArray(output,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth);
+            memset(columnSums,0,paddedWidth*sizeof(double));
+            for(int32_t receptiveFieldY=__max(0,-offsetY);receptiveFieldY<__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);receptiveFieldY++)
+                addRow(columnSums+zeroPaddingX,_input[featureMap][offsetY+receptiveFieldY],previousLayerSingleFeatureMapWidth);
+
+            double *outputRow=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+            for(int32_t x=0;x<singleFeatureMapWidth;x++)
+            {
+                double *receptiveFieldColumnSums=columnSums+strideX*x;
+                double sum=0.0;
+                for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    sum+=receptiveFieldColumnSums[receptiveFieldX];
+                outputRow[x]=sum*factor;
+            }
+            _output[featureMap][y]=outputRow;
+        }
+    }
+    free(columnSums);
+}
+
+void CNNLayer::avgpoolRowsChannelsLast(const double *packedInput, double *packedOutput, int32_t first, int32_t last)
+{
+    // The zero padding counts as values of 0, so the clamped windows are still divided by the whole receptive field size
+    double factor=1.0/(double)totalReceptiveFieldSize;
+
+    for(int32_t y=first;y<last;y++)
+    {
+        int32_t offsetY=-zeroPaddingY+strideY*y;
+        int32_t receptiveFieldStartY=__max(0,-offsetY);
+        int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+
+        for(int32_t x=0;x<singleFeatureMapWidth;x++)
+        {
+            int32_t offsetX=-zeroPaddingX+strideX*x;
+            int32_t receptiveFieldStartX=__max(0,-offsetX);
+            int32_t receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+
+            double *outputPixel=packedOutput+(y*singleFeatureMapWidth+x)*featureMapCount;
+            fillRow(outputPixel,0.0,featureMapCount);
+            for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+            {
+                for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                    addRow(outputPixel,packedInput+((offsetY+receptiveFieldY)*previousLayerSingleFeatureMapWidth+offsetX+receptiveFieldX)*featureMapCount,featureMapCount);
+            }
+            for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+                outputPixel[featureMap]*=factor;
+        }
+    }
+}
+
+double ***CNNLayer::globalAvgpool(double ***_input)
+{
+    double factor=1.0/(double)(previousLayerSingleFeatureMapWidth*previousLayerSingleFeatureMapHeight);
+    double ***out=allocArray(featureMapCount,1,1);
+
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        double sum=0.0;
+        for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
+            sum+=sumRow(_input[featureMap][y],previousLayerSingleFeatureMapWidth);
+        out[featureMap][0][0]=sum*factor;
+    }
+    return out;
+}
+
+double ***CNNLayer::dropout(double ***_input, CNNLayerContext &context)
+{
+    // Unlike the other layer types, nothing but the mask is stored for backpropagation (the diffs don't depend on the input or output values)
+
+    if(!context.training)
+        return cloneArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+
+    if(context.dropoutMask==0)
+        context.dropoutMask=(uint64_t*)calloc(featureMapCount*dropoutMaskWordCount,sizeof(uint64_t));
+    // A recomputation redraws the mask of the original pass (the mask only depends on the seed and the number of the pass)
+    if(!context.recomputation)
+        context.dropoutPass=dropoutPassCount.fetch_add(1);
+
+    double ***out=(double***)malloc(featureMapCount*sizeof(double**));
+
+    // Every feature map is one task (and draws its mask with its own generator)
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,_input,out,&context](uint32_t first,uint32_t last){dropoutFeatureMaps(_input,out,context,first,last);});
+    else
+        dropoutFeatureMaps(_input,out,context,0,featureMapCount);
+
+    return out;
+}
+
+void CNNLayer::dropoutFeatureMaps(double ***_input, double ***_output, CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    uint64_t dropThreshold=(uint64_t)(dropoutRate*(double)(1<<CNN_DROPOUT_RANDOM_BITS_PER_PIXEL)+0.5);
+    double keptValueFactor=1.0/(1.0-dropoutRate); // Keeps the expected value of every output equal to its input, so inference needs no scaling
+    const uint32_t pixelsPerRandomValue=64/CNN_DROPOUT_RANDOM_BITS_PER_PIXEL;
+    const uint64_t pixelBitMask=(1ULL<<CNN_DROPOUT_RANDOM_BITS_PER_PIXEL)-1;
+    uint64_t randomValues[CNN_VECTOR_RANDOM_LANE_COUNT];
+
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
+    {
+        CNNVectorRandom random(dropoutSeed+context.dropoutPass*featureMapCount+featureMap);
+        uint64_t *mask=context.dropoutMask+featureMap*dropoutMaskWordCount;
+
+        // 64 pixels per mask word: every call of random.next yields the random bits of CNN_VECTOR_RANDOM_LANE_COUNT*pixelsPerRandomValue pixels
+        for(uint32_t word=0;word<dropoutMaskWordCount;word++)
+        {
+            uint64_t maskWord=0;
+            for(uint32_t bit=0;bit<64;bit+=CNN_VECTOR_RANDOM_LANE_COUNT*pixelsPerRandomValue)
+            {
+                random.next(randomValues);
+                for(uint32_t lane=0;lane<CNN_VECTOR_RANDOM_LANE_COUNT;lane++)
+                {
+                    for(uint32_t pixel=0;pixel<pixelsPerRandomValue;pixel++)
+                    {
+                        uint64_t pixelBits=(randomValues[lane]>>(pixel*CNN_DROPOUT_RANDOM_BITS_PER_PIXEL))&pixelBitMask;
+                        maskWord|=(uint64_t)(pixelBits>=dropThreshold)<<(bit+lane*pixelsPerRandomValue+pixel);
+                    }
+                }
+            }
+            mask[word]=maskWord;
+        }
+
+        _output[featureMap]=(double**)malloc(singleFeatureMapHeight*sizeof(double*));
+        uint32_t pixelIndex=0;
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            _output[featureMap][y]=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+            double *inputRow=_input[featureMap][y];
+            double *outputRow=_output[featureMap][y];
+            for(int32_t x=0;x<singleFeatureMapWidth;x++,pixelIndex++)
+                outputRow[x]=((mask[pixelIndex>>6]>>(pixelIndex&63))&1)?inputRow[x]*keptValueFactor:0.0;
+        }
+    }
+}
+
+void CNNLayer::calculateConvDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
+{
+    // Weight diffs are stored contiguously in the same order as "weights" (see applyDiffs), and are zero-initialized
+    weightDiffs=allocWeightTypeArray(previousLayerFeatureMapCount,featureMapCount,receptiveFieldHeight,receptiveFieldWidth);
+    biasWeightDiffs=(double*)calloc(featureMapCount,sizeof(double));
+    inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
+
+    // NHWC: every input row (input diffs) and every receptive field row (weight diffs) is one task. FFT and direct: every feature map
+    // in the previous layer is one task, since its weight diffs and input diffs only depend on that feature map.
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+        calculateConvDiffsChannelsLast(weightDiffs,outputDiffs,inputDiffs,context);
+    else if(convAlgorithm==CNN_CONV_ALGORITHM_FFT)
+        calculateConvDiffsFFT(weightDiffs,outputDiffs,inputDiffs,context);
+    else if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerFeatureMapCount,1,[this,weightDiffs,outputDiffs,inputDiffs,&context](uint32_t first,uint32_t last){
+            (this->*convDiffsKernel)(weightDiffs,outputDiffs,inputDiffs,context,first,last);});
+    else
+        (this->*convDiffsKernel)(weightDiffs,outputDiffs,inputDiffs,context,0,previousLayerFeatureMapCount);
+
+    // The bias is applied once to each output pixel (and does not depend on the feature maps in the previous layer)
+    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+    {
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            for(int32_t x=0;x<singleFeatureMapWidth;x++)
+                biasWeightDiffs[featureMapInThisLayer]+=outputDiffs[featureMapInThisLayer][y][x];
+        }
+    }
 }
 
-void CNNLayer::calculateConvDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs)
+template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+void CNNLayer::calculateConvDiffsForPreviousLayerFeatureMaps(double ****weightDiffs, double ***outputDiffs, double ***inputDiffs, CNNLayerContext &context, uint32_t first, uint32_t last)
 {
-    weightDiffs=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
-    biasWeightDiffs=(double*)malloc(featureMapCount*sizeof(double));
-    inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
-
-    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-        biasWeightDiffs[featureMapInThisLayer]=0.0;
+    // See convFeatureMaps
+    const int32_t receptiveFieldWidth=fixedReceptiveFieldWidth>0?fixedReceptiveFieldWidth:this->receptiveFieldWidth;
+    const int32_t receptiveFieldHeight=fixedReceptiveFieldHeight>0?fixedReceptiveFieldHeight:this->receptiveFieldHeight;
+    const uint32_t strideX=fixedStrideX>0?fixedStrideX:this->strideX;
+    const uint32_t strideY=fixedStrideY>0?fixedStrideY:this->strideY;
 
-    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+    for(uint32_t featureMapInPreviousLayer=first;featureMapInPreviousLayer<last;featureMapInPreviousLayer++)
     {
-        weightDiffs[featureMapInPreviousLayer]=(double***)malloc(featureMapCount*sizeof(double**));
         inputDiffs[featureMapInPreviousLayer]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
         // Initialize input diffs:
         for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
@@ -658,67 +2192,289 @@ void CNNLayer::calculateConvDiffs(double ****&weightDiffs, double *&biasWeightDi
 
         for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
         {
-            weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer]=(double**)malloc(receptiveFieldHeight*sizeof(double*));
-            // Initialize weight diffs:
-            for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
-            {
-                weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY]=(double*)malloc(receptiveFieldWidth*sizeof(double));
-                for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
-                    weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]=0.0;
-            }
-            // biasWeightDiffs already initialized above.
+            // weightDiffs already initialized in calculateConvDiffs.
             for(int32_t y=0;y<singleFeatureMapHeight;y++)
             {
+                int32_t offsetY=-zeroPaddingY+strideY*y;
+                bool interiorRow=y>=interiorStartY&&y<interiorEndY;
+
                 for(int32_t x=0;x<singleFeatureMapWidth;x++)
                 {
                     int32_t offsetX=-zeroPaddingX+strideX*x;
-                    int32_t offsetY=-zeroPaddingY+strideY*y;
                     //double outputValue=output[featureMapInThisLayer][y][x];
 
                     // Derivative of the loss function w.r.t. the value inside of the activation function call
 
                     double errorTerm=outputDiffs[featureMapInThisLayer][y][x]; //Derivative of the loss function w.r.t. the value of the pixel in the current feature map of this layer
 
-                    for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                    if(interiorRow&&x>=interiorStartX&&x<interiorEndX)
                     {
-                        for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                        // Interior pixel: the same updates as below for the whole receptive field, with loop bounds that are constants in the specialized kernels
+                        for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
                         {
-                            // Coordinates of pixel in feature map in previous layer:
-                            // (note that we check whether such a pixel exists below)
-                            int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
-                            int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                            double *inputRow=context.input[featureMapInPreviousLayer][offsetY+receptiveFieldY]+offsetX;
+                            double *inputDiffRow=inputDiffs[featureMapInPreviousLayer][offsetY+receptiveFieldY]+offsetX;
+                            double *weightRow=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                            double *weightDiffRow=weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                            for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                            {
+                                weightDiffRow[receptiveFieldX]+=errorTerm*inputRow[receptiveFieldX];
+                                inputDiffRow[receptiveFieldX]+=errorTerm*weightRow[receptiveFieldX];
+                            }
+                        }
+                        continue;
+                    }
+
+                    // Border pixel: only the part of the receptive field that overlaps the feature map in the previous layer (see "conv")
+                    int32_t receptiveFieldStartX=__max(0,-offsetX);
+                    int32_t receptiveFieldStartY=__max(0,-offsetY);
+                    int32_t receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+                    int32_t receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+
+                    for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                    {
+                        // Coordinates of pixel in feature map in previous layer:
+                        int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
 
-                            bool inZeroPaddingField=pixelInFeatureMapInPreviousLayerX<0||pixelInFeatureMapInPreviousLayerY<0
-                                                    ||pixelInFeatureMapInPreviousLayerX>=previousLayerSingleFeatureMapWidth
-                                                    ||pixelInFeatureMapInPreviousLayerY>=previousLayerSingleFeatureMapHeight;
+                        double *inputRow=context.input[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY];
+                        double *inputDiffRow=inputDiffs[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY];
+                        double *weightRow=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
+                        double *weightDiffRow=weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY];
 
-                            if(inZeroPaddingField)
-                                continue;
+                        for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                        {
+                            int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
 
                             // We compute the error term sum indirectly by looping over each calculation made to calculate the output of this layer:
 
                             // Derivative of the loss function w.r.t. this weight
-                            weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX] +=
-                                    errorTerm*input[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX];
-                            // Derivative of the loss function w.r.t. the bias of this layer
+                            weightDiffRow[receptiveFieldX]+=errorTerm*inputRow[pixelInFeatureMapInPreviousLayerX];
 
                             // Derivative of the loss function w.r.t. the value of the input pixel (in the current feature map of the previous layer)
+                            inputDiffRow[pixelInFeatureMapInPreviousLayerX]+=errorTerm*weightRow[receptiveFieldX];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void CNNLayer::calculateConvDiffsFFT(double ****weightDiffs, double ***outputDiffs, double ***inputDiffs, CNNLayerContext &context)
+{
+    updateFilterSpectra();
+
+    // Output diffs upsampled by the stride (zeros between the pixels), which makes them the diffs of the stride 1 output
+    int32_t upsampledWidth=(singleFeatureMapWidth-1)*strideX+1;
+    int32_t upsampledHeight=(singleFeatureMapHeight-1)*strideY+1;
+    int32_t tileCountX=(upsampledWidth+fftTileWidth-1)/fftTileWidth;
+    int32_t tileCountY=(upsampledHeight+fftTileHeight-1)/fftTileHeight;
+    uint32_t tileCount=tileCountX*tileCountY;
+    uint32_t spectrumSize=fft->spectrumSize;
+    uint32_t bufferSize=fft->width*fft->height;
+
+    // Spectra of the output diff tiles: feature map in this layer -> tile -> spectrumSize real parts, then spectrumSize imaginary parts.
+    // Every feature map in this layer is one task.
+    double *outputDiffSpectra=(double*)malloc(featureMapCount*tileCount*2*spectrumSize*sizeof(double));
+    auto transformOutputDiffs=[this,outputDiffs,outputDiffSpectra,tileCountX,tileCount,spectrumSize,bufferSize](uint32_t first,uint32_t last){
+        double *buffer=(double*)malloc((bufferSize+fft->getScratchSize())*sizeof(double));
+        double *scratch=buffer+bufferSize;
+        for(uint32_t featureMapInThisLayer=first;featureMapInThisLayer<last;featureMapInThisLayer++)
+        {
+            for(uint32_t tile=0;tile<tileCount;tile++)
+            {
+                fillFFTBuffer(buffer,outputDiffs[featureMapInThisLayer],singleFeatureMapWidth,singleFeatureMapHeight,
+                              (tile%tileCountX)*fftTileWidth,(tile/tileCountX)*fftTileHeight,fftTileWidth,fftTileHeight,strideX,strideY);
+                double *spectrum=outputDiffSpectra+(featureMapInThisLayer*tileCount+tile)*2*spectrumSize;
+                fft->forward(buffer,spectrum,spectrum+spectrumSize,scratch);
+            }
+        }
+        free(buffer);
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,transformOutputDiffs);
+    else
+        transformOutputDiffs(0,featureMapCount);
+
+    // Every feature map in the previous layer is one task: its weight diffs and input diffs only depend on that feature map
+    auto calculateDiffsOfTiles=[this,weightDiffs,inputDiffs,&context,outputDiffSpectra,tileCountX,tileCount,spectrumSize,bufferSize](uint32_t first,uint32_t last){
+        double *buffer=(double*)malloc((bufferSize+fft->getScratchSize()+4*spectrumSize+featureMapCount*2*spectrumSize)*sizeof(double));
+        double *scratch=buffer+bufferSize;
+        double *accumulator=scratch+fft->getScratchSize();
+        double *inputSpectrum=accumulator+2*spectrumSize;
+        double *weightDiffAccumulators=inputSpectrum+2*spectrumSize; // Feature map in this layer -> real parts, imaginary parts
+        for(uint32_t featureMapInPreviousLayer=first;featureMapInPreviousLayer<last;featureMapInPreviousLayer++)
+        {
+            inputDiffs[featureMapInPreviousLayer]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
+            for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
+                inputDiffs[featureMapInPreviousLayer][y]=(double*)calloc(previousLayerSingleFeatureMapWidth,sizeof(double));
+            memset(weightDiffAccumulators,0,featureMapCount*2*spectrumSize*sizeof(double));
 
-                            // Check this for errors again, then inspect layer structure.
+            for(uint32_t tile=0;tile<tileCount;tile++)
+            {
+                int32_t tileStartX=(tile%tileCountX)*fftTileWidth;
+                int32_t tileStartY=(tile/tileCountX)*fftTileHeight;
 
-                            inputDiffs[featureMapInPreviousLayer][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]+=
-                                    errorTerm*weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
-                        }
+                // Input diffs: value m of the convolution of the tile with the filters (m in [0,tileSize+receptiveFieldSize-1)) belongs to the pixel m+tileStart
+                // of the zero-padded input
+                memset(accumulator,0,2*spectrumSize*sizeof(double));
+                for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+                {
+                    double *outputDiffSpectrum=outputDiffSpectra+(featureMapInThisLayer*tileCount+tile)*2*spectrumSize;
+                    double *filterSpectrum=filterSpectra+(featureMapInPreviousLayer*featureMapCount+featureMapInThisLayer)*2*spectrumSize;
+                    fft->multiplyAccumulate(accumulator,accumulator+spectrumSize,outputDiffSpectrum,outputDiffSpectrum+spectrumSize,filterSpectrum,filterSpectrum+spectrumSize,false);
+                }
+                fft->inverse(accumulator,accumulator+spectrumSize,buffer,scratch);
+                for(int32_t convolutionY=0;convolutionY<fftTileHeight+receptiveFieldHeight-1;convolutionY++)
+                {
+                    int32_t inputY=convolutionY+tileStartY-zeroPaddingY;
+                    if(inputY<0||inputY>=previousLayerSingleFeatureMapHeight)
+                        continue;
+                    double *inputDiffRow=inputDiffs[featureMapInPreviousLayer][inputY];
+                    double *bufferRow=buffer+convolutionY*fft->width;
+                    for(int32_t convolutionX=0;convolutionX<fftTileWidth+receptiveFieldWidth-1;convolutionX++)
+                    {
+                        int32_t inputX=convolutionX+tileStartX-zeroPaddingX;
+                        if(inputX>=0&&inputX<previousLayerSingleFeatureMapWidth)
+                            inputDiffRow[inputX]+=bufferRow[convolutionX];
+                    }
+                }
+
+                // Weight diffs: the correlation of the tile with the zero-padded input from the tile position on (a whole transform of input pixels,
+                // since the receptive fields of the last pixels of the tile reach receptiveFieldSize-1 pixels further)
+                fillFFTBuffer(buffer,context.input[featureMapInPreviousLayer],previousLayerSingleFeatureMapWidth,previousLayerSingleFeatureMapHeight,
+                              tileStartX-zeroPaddingX,tileStartY-zeroPaddingY,fft->width,fft->height,1,1);
+                fft->forward(buffer,inputSpectrum,inputSpectrum+spectrumSize,scratch);
+                for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+                {
+                    double *outputDiffSpectrum=outputDiffSpectra+(featureMapInThisLayer*tileCount+tile)*2*spectrumSize;
+                    double *weightDiffAccumulator=weightDiffAccumulators+featureMapInThisLayer*2*spectrumSize;
+                    fft->multiplyAccumulate(weightDiffAccumulator,weightDiffAccumulator+spectrumSize,inputSpectrum,inputSpectrum+spectrumSize,
+                                            outputDiffSpectrum,outputDiffSpectrum+spectrumSize,true);
+                }
+            }
+
+            // Value (x,y) of the summed correlations is the diff of the weight of receptive field pixel (x,y)
+            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+            {
+                double *weightDiffAccumulator=weightDiffAccumulators+featureMapInThisLayer*2*spectrumSize;
+                fft->inverse(weightDiffAccumulator,weightDiffAccumulator+spectrumSize,buffer,scratch);
+                for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                    memcpy(weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY],buffer+receptiveFieldY*fft->width,receptiveFieldWidth*sizeof(double));
+            }
+        }
+        free(buffer);
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerFeatureMapCount,1,calculateDiffsOfTiles);
+    else
+        calculateDiffsOfTiles(0,previousLayerFeatureMapCount);
+
+    free(outputDiffSpectra);
+}
+
+void CNNLayer::calculateConvDiffsChannelsLast(double ****weightDiffs, double ***outputDiffs, double ***inputDiffs, CNNLayerContext &context)
+{
+    updatePackedWeights();
+
+    uint32_t previousLayerPixelCount=previousLayerSingleFeatureMapHeight*previousLayerSingleFeatureMapWidth;
+    double *packedCopy;
+    const double *packedInput=getChannelsLastInput(context.input,packedCopy);
+    double *packedInputDiffs=(double*)calloc(previousLayerFeatureMapCount*previousLayerPixelCount,sizeof(double));
+    double *packedOutputDiffs=(double*)malloc(featureMapCount*singleFeatureMapHeight*singleFeatureMapWidth*sizeof(double));
+    double *packedWeightDiffs=(double*)calloc(weightCount,sizeof(double)); // Same order as packedWeights
+    packChannelsLast(outputDiffs,featureMapCount,singleFeatureMapHeight,singleFeatureMapWidth,packedOutputDiffs);
+
+    // Input diffs: every input row is one task. Receptive field pixel (receptiveFieldX,receptiveFieldY) of output pixel (x,y) is input pixel
+    // (-zeroPaddingX+strideX*x+receptiveFieldX,-zeroPaddingY+strideY*y+receptiveFieldY), so every input pixel gathers the output pixels whose receptive fields contain it.
+    auto calculateInputDiffRows=[this,packedInputDiffs,packedOutputDiffs](uint32_t first,uint32_t last){
+        for(int32_t inputY=first;inputY<(int32_t)last;inputY++)
+        {
+            for(int32_t inputX=0;inputX<previousLayerSingleFeatureMapWidth;inputX++)
+            {
+                double *inputDiffPixel=packedInputDiffs+(inputY*previousLayerSingleFeatureMapWidth+inputX)*previousLayerFeatureMapCount;
+                for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                {
+                    int32_t strideOneY=inputY+zeroPaddingY-receptiveFieldY;
+                    if(strideOneY<0||strideOneY%strideY!=0||strideOneY/(int32_t)strideY>=singleFeatureMapHeight)
+                        continue;
+                    for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    {
+                        int32_t strideOneX=inputX+zeroPaddingX-receptiveFieldX;
+                        if(strideOneX<0||strideOneX%strideX!=0||strideOneX/(int32_t)strideX>=singleFeatureMapWidth)
+                            continue;
+                        const double *outputDiffPixel=packedOutputDiffs+((strideOneY/strideY)*singleFeatureMapWidth+strideOneX/strideX)*featureMapCount;
+                        const double *weightRows=packedWeights+(receptiveFieldY*receptiveFieldWidth+receptiveFieldX)*previousLayerFeatureMapCount*featureMapCount;
+                        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                            inputDiffPixel[featureMapInPreviousLayer]+=dotRow(outputDiffPixel,weightRows+featureMapInPreviousLayer*featureMapCount,featureMapCount);
+                    }
+                }
+            }
+        }
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerSingleFeatureMapHeight,1,calculateInputDiffRows);
+    else
+        calculateInputDiffRows(0,previousLayerSingleFeatureMapHeight);
+
+    // Weight diffs: every receptive field row is one task
+    auto calculateWeightDiffRows=[this,packedInput,packedOutputDiffs,packedWeightDiffs](uint32_t first,uint32_t last){
+        for(int32_t receptiveFieldY=first;receptiveFieldY<(int32_t)last;receptiveFieldY++)
+        {
+            for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+            {
+                double *weightDiffRows=packedWeightDiffs+(receptiveFieldY*receptiveFieldWidth+receptiveFieldX)*previousLayerFeatureMapCount*featureMapCount;
+                for(int32_t y=0;y<singleFeatureMapHeight;y++)
+                {
+                    int32_t inputY=-zeroPaddingY+strideY*y+receptiveFieldY;
+                    if(inputY<0||inputY>=previousLayerSingleFeatureMapHeight)
+                        continue; // Zero padding
+                    for(int32_t x=0;x<singleFeatureMapWidth;x++)
+                    {
+                        int32_t inputX=-zeroPaddingX+strideX*x+receptiveFieldX;
+                        if(inputX<0||inputX>=previousLayerSingleFeatureMapWidth)
+                            continue;
+                        const double *inputPixel=packedInput+(inputY*previousLayerSingleFeatureMapWidth+inputX)*previousLayerFeatureMapCount;
+                        const double *outputDiffPixel=packedOutputDiffs+(y*singleFeatureMapWidth+x)*featureMapCount;
+                        for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+                            addScaledRow(weightDiffRows+featureMapInPreviousLayer*featureMapCount,outputDiffPixel,inputPixel[featureMapInPreviousLayer],featureMapCount);
                     }
-                    // The bias is applied once to each output pixel
-                    biasWeightDiffs[featureMapInThisLayer]+=errorTerm;
+                }
+            }
+        }
+    };
+    if(threadPool!=0)
+        threadPool->parallelFor(0,receptiveFieldHeight,1,calculateWeightDiffRows);
+    else
+        calculateWeightDiffRows(0,receptiveFieldHeight);
+
+    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+    {
+        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+        {
+            for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+            {
+                for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                {
+                    weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]=
+                            packedWeightDiffs[((receptiveFieldY*receptiveFieldWidth+receptiveFieldX)*previousLayerFeatureMapCount+featureMapInPreviousLayer)*featureMapCount+featureMapInThisLayer];
                 }
             }
         }
     }
+
+    double ***unpackedInputDiffs=unpackChannelsLast(packedInputDiffs,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+        inputDiffs[featureMapInPreviousLayer]=unpackedInputDiffs[featureMapInPreviousLayer];
+    free(unpackedInputDiffs);
+
+    free(packedCopy);
+    free(packedInputDiffs);
+    free(packedOutputDiffs);
+    free(packedWeightDiffs);
 }
 
-void CNNLayer::calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs)
+void CNNLayer::calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
 {
     // featureMapCount=neuronCount
 
@@ -729,28 +2485,31 @@ void CNNLayer::calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiff
 
     // Initialize weightDiffs and inputDiffs
 
-    weightDiffs=(double****)malloc(previousLayerFeatureMapCount*sizeof(double***));
+    // Weight diffs are stored contiguously in the same order as "weights" (see applyDiffs)
+    weightDiffs=allocWeightTypeArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth,featureMapCount);
     inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
 
     for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
     {
-        weightDiffs[featureMapInPreviousLayer]=(double***)malloc(previousLayerSingleFeatureMapHeight*sizeof(double**));
         inputDiffs[featureMapInPreviousLayer]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
         for(int32_t previousLayerY=0;previousLayerY<previousLayerSingleFeatureMapHeight;previousLayerY++)
         {
-            weightDiffs[featureMapInPreviousLayer][previousLayerY]=(double**)malloc(previousLayerSingleFeatureMapWidth*sizeof(double*));
             inputDiffs[featureMapInPreviousLayer][previousLayerY]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
             for(int32_t previousLayerX=0;previousLayerX<previousLayerSingleFeatureMapWidth;previousLayerX++)
-            {
-                weightDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX]=(double*)malloc(featureMapCount*sizeof(double));
                 inputDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX]=0.0;
-                // "weightDiffs" does not need to be zero-initialized.
-            }
         }
     }
 
     // Calculate diffs
 
+    if(tensorLayout==CNN_TENSOR_LAYOUT_NHWC)
+    {
+        calculateFcDiffsChannelsLast(weightDiffs,outputDiffs,inputDiffs,context);
+        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+            biasWeightDiffs[featureMapInThisLayer]=outputDiffs[featureMapInThisLayer][0][0];
+        return;
+    }
+
     for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
     {
         double errorTerm=outputDiffs[featureMapInThisLayer][0][0];
@@ -760,7 +2519,7 @@ void CNNLayer::calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiff
             {
                 for(int32_t previousLayerX=0;previousLayerX<previousLayerSingleFeatureMapWidth;previousLayerX++)
                 {
-                    double inputValue=input[featureMapInPreviousLayer][previousLayerY][previousLayerX];
+                    double inputValue=context.input[featureMapInPreviousLayer][previousLayerY][previousLayerX];
 
                     weightDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX][featureMapInThisLayer]=errorTerm*inputValue;
                     inputDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX]+=errorTerm*weights[featureMapInPreviousLayer][previousLayerY][previousLayerX][featureMapInThisLayer];
@@ -772,7 +2531,41 @@ void CNNLayer::calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiff
     }
 }
 
-void CNNLayer::calculateMaxpoolDiffs(double ***outputDiffs, double ***&inputDiffs)
+void CNNLayer::calculateFcDiffsChannelsLast(double ****weightDiffs, double ***outputDiffs, double ***inputDiffs, CNNLayerContext &context)
+{
+    double *errorTerms=(double*)malloc(featureMapCount*sizeof(double));
+    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+        errorTerms[featureMapInThisLayer]=outputDiffs[featureMapInThisLayer][0][0];
+
+    double *packedCopy;
+    const double *packedInput=getChannelsLastInput(context.input,packedCopy);
+
+    // Every input pixel is one task: it has its own weight diffs and input diffs. The weight diffs are zero-initialized, so adding the scaled
+    // error terms stores their products.
+    auto calculatePixelDiffs=[this,weightDiffs,inputDiffs,errorTerms,packedInput](uint32_t first,uint32_t last){
+        for(uint32_t pixel=first;pixel<last;pixel++)
+        {
+            int32_t previousLayerY=pixel/previousLayerSingleFeatureMapWidth;
+            int32_t previousLayerX=pixel%previousLayerSingleFeatureMapWidth;
+            const double *inputPixel=packedInput+pixel*previousLayerFeatureMapCount;
+            for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+            {
+                addScaledRow(weightDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX],errorTerms,inputPixel[featureMapInPreviousLayer],featureMapCount);
+                inputDiffs[featureMapInPreviousLayer][previousLayerY][previousLayerX]=dotRow(errorTerms,weights[featureMapInPreviousLayer][previousLayerY][previousLayerX],featureMapCount);
+            }
+        }
+    };
+    uint32_t previousLayerPixelCount=previousLayerSingleFeatureMapHeight*previousLayerSingleFeatureMapWidth;
+    if(threadPool!=0)
+        threadPool->parallelFor(0,previousLayerPixelCount,1,calculatePixelDiffs);
+    else
+        calculatePixelDiffs(0,previousLayerPixelCount);
+
+    free(packedCopy);
+    free(errorTerms);
+}
+
+void CNNLayer::calculateMaxpoolDiffs(double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
 {
     // A maxpool layer has no weight/bias diffs; it only re-routes the gradients from outputDiffs to the pixels with the highest values (into inputDiffs) during backpropagation.
 
@@ -792,31 +2585,41 @@ void CNNLayer::calculateMaxpoolDiffs(double ***outputDiffs, double ***&inputDiff
         }
         for(int32_t y=0;y<singleFeatureMapHeight;y++)
         {
+            int32_t offsetY=-zeroPaddingY+strideY*y;
+            bool interiorRow=y>=interiorStartY&&y<interiorEndY;
+
             for(int32_t x=0;x<singleFeatureMapWidth;x++)
             {
                 int32_t offsetX=-zeroPaddingX+strideX*x;
-                int32_t offsetY=-zeroPaddingY+strideY*y;
 
-                for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+                // Interior pixels use the whole receptive field; border pixels only use the part that overlaps the feature map in the previous layer
+                // (see "maxpool").
+                int32_t receptiveFieldStartX=0;
+                int32_t receptiveFieldStartY=0;
+                int32_t receptiveFieldEndX=receptiveFieldWidth;
+                int32_t receptiveFieldEndY=receptiveFieldHeight;
+
+                if(!interiorRow||x<interiorStartX||x>=interiorEndX)
                 {
-                    for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
-                    {
-                        // Coordinates of pixel in feature map in previous layer:
-                        // (note that we check whether such a pixel exists below)
-                        int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
-                        int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                    receptiveFieldStartX=__max(0,-offsetX);
+                    receptiveFieldStartY=__max(0,-offsetY);
+                    receptiveFieldEndX=__min(receptiveFieldWidth,previousLayerSingleFeatureMapWidth-offsetX);
+                    receptiveFieldEndY=__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);
+                }
 
-                        bool inZeroPaddingField=pixelInFeatureMapInPreviousLayerX<0||pixelInFeatureMapInPreviousLayerY<0
-                                                ||pixelInFeatureMapInPreviousLayerX>=previousLayerSingleFeatureMapWidth
-                                                ||pixelInFeatureMapInPreviousLayerY>=previousLayerSingleFeatureMapHeight;
+                for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                {
+                    // Coordinates of pixel in feature map in previous layer:
+                    int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
 
-                        if(inZeroPaddingField)
-                            continue;
+                    for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                    {
+                        int32_t pixelInFeatureMapInPreviousLayerX=offsetX+receptiveFieldX;
 
                         // maxPixelMatrix[...][...][...] contains 1.0 if this was the pixel with the highest value, or else 0.0
 
                         // The values of isMaxPixel determines whether the gradient of this feature map's [x,y] pixel is routed to the pixel at [pixelInFeatureMapInPreviousLayerX,pixelInFeatureMapInPreviousLayerY] or not.
-                        double isMaxPixel=maxPixelMatrix[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX];
+                        double isMaxPixel=context.maxPixelMatrix[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX];
                         inputDiffs[featureMap][pixelInFeatureMapInPreviousLayerY][pixelInFeatureMapInPreviousLayerX]+=
                                 isMaxPixel*outputDiffs[featureMap][y][x];
                         if(isMaxPixel>0.0)
@@ -830,7 +2633,7 @@ void CNNLayer::calculateMaxpoolDiffs(double ***outputDiffs, double ***&inputDiff
     }
 }
 
-void CNNLayer::calculateReluDiffs(double ***outputDiffs, double ***&inputDiffs)
+void CNNLayer::calculateReluDiffs(double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
 {
     // Just pass on the gradients of all output pixels that received a value higher than 0.0.
     // Also note that a relu layer has exactly the same dimensions as the layer preceding it,
@@ -845,18 +2648,25 @@ void CNNLayer::calculateReluDiffs(double ***outputDiffs, double ***&inputDiffs)
             inputDiffs[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
             for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
             {
-                inputDiffs[featureMap][y][x]=(output[featureMap][y][x]>0.0/*featureMapInPreviousLayer=featureMapInThisLayer (see comment above)*/?1.0:0.0)*outputDiffs[featureMap][y][x];
+                inputDiffs[featureMap][y][x]=(context.output[featureMap][y][x]>0.0/*featureMapInPreviousLayer=featureMapInThisLayer (see comment above)*/?1.0:0.0)*outputDiffs[featureMap][y][x];
             }
         }
     }
 }
 
-void CNNLayer::calculateSoftmaxDiffs(double ***&inputDiffs, uint32_t desiredLabel)
+void CNNLayer::calculateSoftmaxDiffs(double ***&inputDiffs, uint32_t desiredLabel, CNNLayerContext &context)
 {
     // Note that a softmax layer has exactly the same depth as the layer preceding it,
     // and the depth is always equal to the amount of classes.
     // The dimension of a softmax layer is always equal to 1 x 1 x featureMapCount.
 
+    // Cross-entropy loss L=-log(output[desiredLabel])=logSumExp-input[desiredLabel]; dL/dinput[featureMap]=output[featureMap]-(featureMap==desiredLabel)
+
+    if(desiredLabel>=featureMapCount)
+        throw;
+
+    context.loss=context.logSumExp-context.input[desiredLabel][0][0];
+
     inputDiffs=(double***)malloc(featureMapCount*sizeof(double**));
 
     for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
@@ -864,133 +2674,339 @@ void CNNLayer::calculateSoftmaxDiffs(double ***&inputDiffs, uint32_t desiredLabe
         inputDiffs[featureMap]=(double**)malloc(1*sizeof(double*));
         inputDiffs[featureMap][0]=(double*)malloc(1*sizeof(double));
 
-        inputDiffs[featureMap][0][0]=-((featureMap==desiredLabel?1.0:0.0)-output[featureMap][0][0]);
+        inputDiffs[featureMap][0][0]=context.output[featureMap][0][0];
     }
+    inputDiffs[desiredLabel][0][0]-=1.0;
 }
 
-void CNNLayer::applyConvDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay)
+void CNNLayer::calculateBatchnormDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
 {
-    if(type!=CNN_LAYER_TYPE_CONV)
-        throw;
+    // Note that a batchnorm layer has exactly the same dimensions as the layer preceding it.
 
-    // Adjust bias weight of each feature map
-    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+    weightDiffs=allocWeightDiffs();
+    biasWeightDiffs=(double*)calloc(featureMapCount,sizeof(double));
+    inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
+
+    // Every feature map is one task
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,&context](uint32_t first,uint32_t last){
+            calculateBatchnormDiffsForFeatureMaps(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,context,first,last);});
+    else
+        calculateBatchnormDiffsForFeatureMaps(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,context,0,featureMapCount);
+}
+
+void CNNLayer::calculateBatchnormDiffsForFeatureMaps(double ****weightDiffs, double *biasWeightDiffs, double ***outputDiffs, double ***inputDiffs, CNNLayerContext &context, uint32_t first, uint32_t last)
+{
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
     {
-        double previousDelta=previousBiasWeightDiffDeltas[featureMapInThisLayer];
-        double currentWeight=biasWeights[featureMapInThisLayer];
-        double weightDiff=biasWeightDiffs[featureMapInThisLayer];
-        double thisDelta=(1.0-momentum)*-learningRate*weightDiff+momentum*previousDelta-weightDecay*currentWeight;
-        biasWeights[featureMapInThisLayer]+=thisDelta;
-        previousBiasWeightDiffDeltas[featureMapInThisLayer]=thisDelta;
+        double mean;
+        double variance;
+        getBatchnormStatistics(context,featureMap,mean,variance);
+        double inverseStandardDeviation=1.0/sqrt(variance+CNN_BATCHNORM_EPSILON);
+
+        // Diffs of the shift (sum of the output diffs) and of the scale (sum of the output diffs multiplied by the normalized inputs)
+        double outputDiffSum;
+        double normalizedOutputDiffSum;
+        getBatchnormDiffSums(outputDiffs,context,featureMap,mean,inverseStandardDeviation,outputDiffSum,normalizedOutputDiffSum);
+        weightDiffs[featureMap][0][0][0]=normalizedOutputDiffSum;
+        biasWeightDiffs[featureMap]=outputDiffSum;
+
+        // Mean and variance are those of the batch, so they depend on every input pixel of every example in it:
+        // inputDiff=scale*inverseStandardDeviation*(outputDiff-mean(outputDiffs)-normalizedInput*mean(outputDiffs*normalizedInputs))
+        double meanOutputDiff;
+        double meanNormalizedOutputDiff;
+        if(context.batchMeans!=0)
+        {
+            meanOutputDiff=context.batchOutputDiffMeans[featureMap];
+            meanNormalizedOutputDiff=context.batchNormalizedOutputDiffMeans[featureMap];
+        }
+        else
+        {
+            double pixelCount=(double)(singleFeatureMapWidth*singleFeatureMapHeight);
+            meanOutputDiff=outputDiffSum/pixelCount;
+            meanNormalizedOutputDiff=normalizedOutputDiffSum/pixelCount;
+        }
+
+        // inputDiff=factor*outputDiff+inputFactor*input+offset
+        double factor=weights[featureMap][0][0][0]*inverseStandardDeviation;
+        double inputFactor=-factor*inverseStandardDeviation*meanNormalizedOutputDiff;
+        double offset=-factor*meanOutputDiff-inputFactor*mean;
+
+        inputDiffs[featureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            inputDiffs[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
+            double *inputDiffRow=inputDiffs[featureMap][y];
+            fillRow(inputDiffRow,offset,singleFeatureMapWidth);
+            addScaledRow(inputDiffRow,outputDiffs[featureMap][y],factor,singleFeatureMapWidth);
+            addScaledRow(inputDiffRow,context.input[featureMap][y],inputFactor,singleFeatureMapWidth);
+        }
     }
-    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+}
+
+void CNNLayer::getBatchnormDiffSums(double ***outputDiffs, CNNLayerContext &context, uint32_t featureMap, double mean, double inverseStandardDeviation,
+                                    double &outputDiffSum, double &normalizedOutputDiffSum)
+{
+    double *deviationRow=(double*)malloc(singleFeatureMapWidth*sizeof(double));
+    outputDiffSum=0.0;
+    double deviationOutputDiffSum=0.0;
+    for(int32_t y=0;y<singleFeatureMapHeight;y++)
     {
-        for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+        outputDiffSum+=sumRow(outputDiffs[featureMap][y],singleFeatureMapWidth);
+        fillRow(deviationRow,-mean,singleFeatureMapWidth);
+        addRow(deviationRow,context.input[featureMap][y],singleFeatureMapWidth);
+        deviationOutputDiffSum+=dotRow(deviationRow,outputDiffs[featureMap][y],singleFeatureMapWidth);
+    }
+    free(deviationRow);
+    normalizedOutputDiffSum=deviationOutputDiffSum*inverseStandardDeviation;
+}
+
+void CNNLayer::addBatchnormDiffSums(double ***outputDiffs, CNNLayerContext &context, double *outputDiffSums, double *normalizedOutputDiffSums)
+{
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        double mean;
+        double variance;
+        getBatchnormStatistics(context,featureMap,mean,variance);
+        double outputDiffSum;
+        double normalizedOutputDiffSum;
+        getBatchnormDiffSums(outputDiffs,context,featureMap,mean,1.0/sqrt(variance+CNN_BATCHNORM_EPSILON),outputDiffSum,normalizedOutputDiffSum);
+        outputDiffSums[featureMap]+=outputDiffSum;
+        normalizedOutputDiffSums[featureMap]+=normalizedOutputDiffSum;
+    }
+}
+
+void CNNLayer::calculateAvgpoolDiffs(double ***outputDiffs, double ***&inputDiffs)
+{
+    // Every input pixel gets the diffs of all output pixels whose receptive fields contain it, divided by the receptive field size
+    inputDiffs=allocArray(previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight,previousLayerSingleFeatureMapWidth);
+
+    // Every feature map is one task
+    if(threadPool!=0)
+        threadPool->parallelFor(0,featureMapCount,1,[this,outputDiffs,inputDiffs](uint32_t first,uint32_t last){calculateAvgpoolDiffsForFeatureMaps(outputDiffs,inputDiffs,first,last);});
+    else
+        calculateAvgpoolDiffsForFeatureMaps(outputDiffs,inputDiffs,0,featureMapCount);
+}
+
+void CNNLayer::calculateAvgpoolDiffsForFeatureMaps(double ***outputDiffs, double ***inputDiffs, uint32_t first, uint32_t last)
+{
+    // The reverse of "avgpoolFeatureMaps": the diffs of an output row are spread over the columns of their receptive fields,
+    // then the column diffs are added to every row of the receptive fields (vectorized, over the whole width).
+    double factor=1.0/(double)totalReceptiveFieldSize;
+    int32_t paddedWidth=previousLayerSingleFeatureMapWidth+2*zeroPaddingX;
+    double *columnDiffs=(double*)malloc(paddedWidth*sizeof(double));
+
+    for(uint32_t featureMap=first;featureMap<last;featureMap++)
+    {
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
         {
-            for(int32_t receptiveFieldY=0;receptiveFieldY<receptiveFieldHeight;receptiveFieldY++)
+            int32_t offsetY=-zeroPaddingY+strideY*y;
+
+            memset(columnDiffs,0,paddedWidth*sizeof(double));
+            for(int32_t x=0;x<singleFeatureMapWidth;x++)
             {
+                double *receptiveFieldColumnDiffs=columnDiffs+strideX*x;
+                double diff=outputDiffs[featureMap][y][x]*factor;
                 for(int32_t receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
-                {
-                    double previousDelta=previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
-                    double currentWeight=weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
-                    double weightDiff=weightDiffs[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX];
-                    double thisDelta=(1.0-momentum)*-learningRate*weightDiff+momentum*previousDelta-weightDecay*currentWeight;
-
-                    weights[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]+=thisDelta;
-                    previousWeightDiffDeltas[featureMapInPreviousLayer][featureMapInThisLayer][receptiveFieldY][receptiveFieldX]=thisDelta;
-                }
+                    receptiveFieldColumnDiffs[receptiveFieldX]+=diff;
             }
+
+            for(int32_t receptiveFieldY=__max(0,-offsetY);receptiveFieldY<__min(receptiveFieldHeight,previousLayerSingleFeatureMapHeight-offsetY);receptiveFieldY++)
+                addRow(inputDiffs[featureMap][offsetY+receptiveFieldY],columnDiffs+zeroPaddingX,previousLayerSingleFeatureMapWidth);
         }
     }
+    free(columnDiffs);
 }
 
-void CNNLayer::applyFcDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay)
+void CNNLayer::calculateGlobalAvgpoolDiffs(double ***outputDiffs, double ***&inputDiffs)
 {
-    if(type!=CNN_LAYER_TYPE_FC)
-        throw;
-
-    // Adjust bias weight of each neuron
-    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-    {
-        double previousDelta=previousBiasWeightDiffDeltas[featureMapInThisLayer];
-        double currentWeight=biasWeights[featureMapInThisLayer];
-        double weightDiff=biasWeightDiffs[featureMapInThisLayer];
-        double thisDelta=(1.0-momentum)*-learningRate*weightDiff+momentum*previousDelta-weightDecay*currentWeight;
+    // Every input pixel contributes equally to the mean of its feature map
+    double factor=1.0/(double)(previousLayerSingleFeatureMapWidth*previousLayerSingleFeatureMapHeight);
+    inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
 
-        biasWeights[featureMapInThisLayer]+=thisDelta;
-        previousBiasWeightDiffDeltas[featureMapInThisLayer]=thisDelta;
-    }
-    for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+    for(uint32_t featureMap=0;featureMap<previousLayerFeatureMapCount;featureMap++)
     {
+        double diff=outputDiffs[featureMap][0][0]*factor;
+        inputDiffs[featureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
         for(int32_t y=0;y<previousLayerSingleFeatureMapHeight;y++)
         {
-            for(int32_t x=0;x<previousLayerSingleFeatureMapWidth;x++)
-            {
-                for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
-                {
-                    double previousDelta=previousWeightDiffDeltas[featureMapInPreviousLayer][y][x][featureMapInThisLayer];
-                    double currentWeight=weights[featureMapInPreviousLayer][y][x][featureMapInThisLayer];
-                    double weightDiff=weightDiffs[featureMapInPreviousLayer][y][x][featureMapInThisLayer];
-                    double thisDelta=(1.0-momentum)*-learningRate*weightDiff+momentum*previousDelta-weightDecay*currentWeight;
+            inputDiffs[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
+            fillRow(inputDiffs[featureMap][y],diff,previousLayerSingleFeatureMapWidth);
+        }
+    }
+}
 
-                    weights[featureMapInPreviousLayer][y][x][featureMapInThisLayer]+=thisDelta;
-                    previousWeightDiffDeltas[featureMapInPreviousLayer][y][x][featureMapInThisLayer]=thisDelta;
-                }
-            }
+void CNNLayer::calculateDropoutDiffs(double ***outputDiffs, double ***&inputDiffs, CNNLayerContext &context)
+{
+    // Note that a dropout layer has exactly the same dimensions as the layer preceding it.
+    // The diffs of the kept pixels are scaled like their values; the dropped pixels get no diffs.
+
+    double keptValueFactor=1.0/(1.0-dropoutRate);
+    inputDiffs=(double***)malloc(previousLayerFeatureMapCount*sizeof(double**));
+    for(uint32_t featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        uint64_t *mask=context.dropoutMask+featureMap*dropoutMaskWordCount;
+        uint32_t pixelIndex=0;
+        inputDiffs[featureMap]=(double**)malloc(previousLayerSingleFeatureMapHeight*sizeof(double*));
+        for(int32_t y=0;y<singleFeatureMapHeight;y++)
+        {
+            inputDiffs[featureMap][y]=(double*)malloc(previousLayerSingleFeatureMapWidth*sizeof(double));
+            double *outputDiffRow=outputDiffs[featureMap][y];
+            double *inputDiffRow=inputDiffs[featureMap][y];
+            for(int32_t x=0;x<singleFeatureMapWidth;x++,pixelIndex++)
+                inputDiffRow[x]=((mask[pixelIndex>>6]>>(pixelIndex&63))&1)?outputDiffRow[x]*keptValueFactor:0.0;
         }
     }
 }
 
-double ***CNNLayer::forwardPass(double ***_input)
+double ***CNNLayer::forwardPass(double ***_input, CNNLayerContext &context)
 {
-    if(type==CNN_LAYER_TYPE_CONV)
-        return conv(_input);
+    // Only the NHWC kernels read channels-last arrays (see linkTensorLayouts)
+    if(!hasChannelsLastKernels()&&isChannelsLastArray(_input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight))
+        throw;
+    if(type==CNN_LAYER_TYPE_CONV||type==CNN_LAYER_TYPE_FC)
+    {
+        double ***out=type==CNN_LAYER_TYPE_CONV?conv(_input,context):fc(_input,context);
+        // Only the weight diffs need the input, so it is kept in the stash precision until the backward pass (if there is one)
+        if(stashPrecision!=CNN_STASH_PRECISION_DOUBLE&&context.training)
+            stashInput(context);
+        return out;
+    }
     else if(type==CNN_LAYER_TYPE_MAXPOOL)
-        return maxpool(_input);
+        return maxpool(_input,context);
     else if(type==CNN_LAYER_TYPE_RELU)
-        return relu(_input);
-    else if(type==CNN_LAYER_TYPE_FC)
-        return fc(_input);
+        return relu(_input,context);
     else if(type==CNN_LAYER_TYPE_SOFTMAX)
-        return softmax(_input);
+        return softmax(_input,context);
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
+        return batchnorm(_input,context);
+    else if(type==CNN_LAYER_TYPE_DROPOUT)
+        return dropout(_input,context);
+    else if(type==CNN_LAYER_TYPE_AVGPOOL)
+        return avgpool(_input);
+    else if(type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
+        return globalAvgpool(_input);
     else
         return 0;
 }
 
-void CNNLayer::calculateDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, uint32_t desiredLabel)
+double ***CNNLayer::forwardPass(double ***_input)
 {
-    if(type==CNN_LAYER_TYPE_CONV)
+    return forwardPass(_input,defaultContext);
+}
+
+void CNNLayer::calculateDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, uint32_t desiredLabel, CNNLayerContext &context)
+{
+    // An inference pass stored nothing to calculate the diffs from
+    if(!context.training)
+        throw;
+
+    if(type==CNN_LAYER_TYPE_CONV||type==CNN_LAYER_TYPE_FC)
     {
-        calculateConvDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs);
+        // A stashed input only exists during the backward pass
+        bool unstashed=unstashInput(context);
+        if(type==CNN_LAYER_TYPE_CONV)
+            calculateConvDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,context);
+        else
+            calculateFcDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,context);
+        if(unstashed)
+        {
+            freeArray(context.input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+            context.input=0;
+        }
     }
     else if(type==CNN_LAYER_TYPE_MAXPOOL)
     {
-        calculateMaxpoolDiffs(outputDiffs,inputDiffs);
+        calculateMaxpoolDiffs(outputDiffs,inputDiffs,context);
         weightDiffs=0;
         biasWeightDiffs=0;
     }
     else if(type==CNN_LAYER_TYPE_RELU)
     {
-        calculateReluDiffs(outputDiffs,inputDiffs);
+        calculateReluDiffs(outputDiffs,inputDiffs,context);
         weightDiffs=0;
         biasWeightDiffs=0;
     }
-    else if(type==CNN_LAYER_TYPE_FC)
+    else if(type==CNN_LAYER_TYPE_SOFTMAX)
+    {
+        calculateSoftmaxDiffs(inputDiffs,desiredLabel,context);
+        weightDiffs=0;
+        biasWeightDiffs=0;
+    }
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
     {
-        calculateFcDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs);
+        calculateBatchnormDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,context);
     }
-    else if(type==CNN_LAYER_TYPE_SOFTMAX)
+    else if(type==CNN_LAYER_TYPE_DROPOUT)
+    {
+        calculateDropoutDiffs(outputDiffs,inputDiffs,context);
+        weightDiffs=0;
+        biasWeightDiffs=0;
+    }
+    else if(type==CNN_LAYER_TYPE_AVGPOOL)
+    {
+        calculateAvgpoolDiffs(outputDiffs,inputDiffs);
+        weightDiffs=0;
+        biasWeightDiffs=0;
+    }
+    else if(type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
     {
-        calculateSoftmaxDiffs(inputDiffs,desiredLabel);
+        calculateGlobalAvgpoolDiffs(outputDiffs,inputDiffs);
         weightDiffs=0;
         biasWeightDiffs=0;
     }
 }
 
-void CNNLayer::applyDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay)
+void CNNLayer::calculateDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs, uint32_t desiredLabel)
+{
+    calculateDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,desiredLabel,defaultContext);
+}
+
+void CNNLayer::applyDiffs(double ****weightDiffs, double *biasWeightDiffs, CNNOptimizer *optimizer)
 {
+    if(!hasWeights())
+        return;
+
+    // Both weight arrays are stored contiguously in the same order (see allocWeightTypeArray), so they can be updated as flat buffers.
+    double *weightData=getWeightTypeArrayData(weights);
+    double *weightDiffData=getWeightTypeArrayData(weightDiffs);
+    if(threadPool!=0)
+    {
+        // The update of each weight only depends on the weight itself, so ranges of weights can be updated independently
+        threadPool->parallelFor(0,weightCount,CNN_THREAD_POOL_UPDATE_GRAIN,[this,weightData,weightDiffData,optimizer](uint32_t first,uint32_t last){
+            optimizer->update(weightData+first,weightDiffData+first,weightOptimizerState1+first,weightOptimizerState2+first,last-first);});
+    }
+    else
+        optimizer->update(weightData,weightDiffData,weightOptimizerState1,weightOptimizerState2,weightCount);
+    optimizer->update(biasWeights,biasWeightDiffs,biasWeightOptimizerState1,biasWeightOptimizerState2,featureMapCount);
     if(type==CNN_LAYER_TYPE_CONV)
-        applyConvDiffs(weightDiffs,biasWeightDiffs,learningRate,momentum,weightDecay);
-    else if(type==CNN_LAYER_TYPE_FC)
-        applyFcDiffs(weightDiffs,biasWeightDiffs,learningRate,momentum,weightDecay);
+        invalidateWeightTransforms();
+}
+
+void CNNLayer::freeContext(CNNLayerContext &context)
+{
+    if(context.input!=0)
+        freeArray(context.input,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+    if(context.output!=0)
+        freeArray(context.output,featureMapCount,singleFeatureMapHeight);
+    if(context.maxPixelMatrix!=0)
+        freeArray(context.maxPixelMatrix,previousLayerFeatureMapCount,previousLayerSingleFeatureMapHeight);
+    free(context.dropoutMask);
+    free(context.stashedInput);
+    context.input=0;
+    context.output=0;
+    context.maxPixelMatrix=0;
+    context.dropoutMask=0;
+    context.stashedInput=0;
+}
+
+void CNNLayer::resetOptimizerState()
+{
+    if(!hasWeights())
+        return;
+
+    memset(weightOptimizerState1,0,weightCount*sizeof(double));
+    memset(weightOptimizerState2,0,weightCount*sizeof(double));
+    memset(biasWeightOptimizerState1,0,featureMapCount*sizeof(double));
+    memset(biasWeightOptimizerState2,0,featureMapCount*sizeof(double));
 }
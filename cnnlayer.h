@@ -10,6 +10,54 @@
 #define CNN_LAYER_TYPE_RELU 3
 #define CNN_LAYER_TYPE_FC 4 // Fully connected layer, just like a feedforward neural network layer. The input to the first fully connected layer is the set of all features maps at the layer below. Must be of dimension 1x1xneuronCount
 #define CNN_LAYER_TYPE_SOFTMAX 5 // Softmax layer; can only follow a FC layer. Must be of dimension 1x1xclassCount, where classCount=previousLayerNeuronCount=previousLayerFeatureMapCount
+#define CNN_LAYER_TYPE_BATCHNORM 6 // Batch normalization layer: normalizes each feature map, then scales it by its weight and shifts it by its bias weight. Has exactly the same dimensions as the layer preceding it (see CNNLayerContext::training)
+#define CNN_LAYER_TYPE_DROPOUT 7 // Dropout layer: while training, sets every value to 0 with probability dropoutRate and scales the other ones by 1/(1-dropoutRate); passes the values on unchanged otherwise. Has exactly the same dimensions as the layer preceding it (see CNNLayerContext::training)
+#define CNN_LAYER_TYPE_AVGPOOL 8 // Average pooling layer; same geometry as a maxpool layer, but the windows may overlap. Zero padding counts as values of 0 (every sum is divided by the whole receptive field size)
+#define CNN_LAYER_TYPE_GLOBAL_AVGPOOL 9 // Global average pooling layer: the mean of every feature map of the layer preceding it. Must be of dimension 1x1xfeatureMapCount, where featureMapCount=previousLayerFeatureMapCount
+
+// Algorithms of the CONV layers (see setConvAlgorithm). DIRECT and ROWS add up the products of every output pixel in the same order, so their results are bit-identical.
+#define CNN_CONV_ALGORITHM_DIRECT 1 // One dot product over the receptive field per output pixel
+#define CNN_CONV_ALGORITHM_ROWS 2 // Whole output rows at once: every weight is multiplied with a row of input pixels and added to the row (SSE2 for stride 1)
+// Tiled overlap-add with FFTs (see convFFT); the cost per pixel hardly grows with the receptive field, so it pays off for large ones.
+// Also used for the diffs. Differs from the other algorithms by the rounding errors of the transforms (relative error around 1e-14).
+#define CNN_CONV_ALGORITHM_FFT 3
+#define CNN_CONV_ALGORITHM_COUNT 3
+#define CNN_CONV_FFT_MIN_TILE_SIZE 8 // FFT tiles cover at least this many pixels per dimension (or the whole feature map); larger receptive fields get larger tiles
+
+// Layouts of the kernels of CONV, FC, MAXPOOL and AVGPOOL layers (see setTensorLayout)
+#define CNN_TENSOR_LAYOUT_NCHW 1 // Feature map -> row -> pixel: the kernels run along the rows of a feature map
+// Row -> pixel -> feature map, packed: the kernels run across the feature maps of a pixel, which vectorizes well for many feature maps of few pixels.
+// The arrays passed from one NHWC layer to the next one stay packed (see CNNLayer::channelsLastOutput); the other arrays are NCHW, so the layout is
+// only converted where it changes (an NHWC layer packs an NCHW input and unpacks its output for a layer without NHWC kernels). The diffs are always NCHW.
+#define CNN_TENSOR_LAYOUT_NHWC 2
+#define CNN_TENSOR_LAYOUT_COUNT 2
+#define CNN_NHWC_FC_GRAIN 16 // Neurons per task of NHWC FC layers (the neurons of a task are calculated together, vectorized)
+
+// Precision of the input that CONV and FC layers keep in their context for the backward pass (see setStashPrecision). The stashed input is only used
+// for the weight diffs; the weights, the outputs, the input diffs and all arithmetic stay in double precision.
+#define CNN_STASH_PRECISION_DOUBLE 1 // The input itself (8 bytes per value)
+#define CNN_STASH_PRECISION_BF16 2 // bfloat16 (2 bytes per value): the range of float with 8 significand bits (relative rounding error up to 2^-9)
+// IEEE half precision (2 bytes per value): 11 significand bits, but a range of only about 6e-8 to 65504, so every stash is scaled by a power of two
+// that moves its largest magnitude into [2^(CNN_STASH_FP16_MAX_EXPONENT-1),2^CNN_STASH_FP16_MAX_EXPONENT) (see CNNLayerContext::stashScale)
+#define CNN_STASH_PRECISION_FP16 3
+#define CNN_STASH_PRECISION_COUNT 3
+#define CNN_STASH_FP16_MAX_EXPONENT 15
+
+#define CNN_BATCHNORM_EPSILON 1e-5 // Added to the variances to avoid divisions by 0
+#define CNN_BATCHNORM_MOMENTUM 0.01 // Weight of the statistics of the current input when updating the running statistics
+
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+#define CNN_LAYER_USE_SSE2 // Used by the row kernels (see addRow)
+#endif
+#if defined(__AVX512F__)&&defined(__AVX512BF16__)&&defined(__AVX512VL__)
+#define CNN_LAYER_USE_AVX512_BF16 // Used by packReducedPrecisionRow
+#endif
+#if defined(__AVX__)&&defined(__F16C__)
+#define CNN_LAYER_USE_F16C // Used by packReducedPrecisionRow and unpackReducedPrecisionRow
+#endif
+
+#define CNN_DROPOUT_DEFAULT_RATE 0.5
+#define CNN_DROPOUT_RANDOM_BITS_PER_PIXEL 16 // A pixel is dropped if its random bits are below dropoutRate*2^16 (so the rate is rounded to a multiple of 2^-16)
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -19,9 +67,74 @@
 #include <ctime>
 #include <limits>
 #include <iostream>
+#include <atomic>
+#include <mutex>
 
 #include "../_DefaultLibrary/text.h"
 
+#include "cnnoptimizer.h"
+#include "cnnsampler.h"
+#include "cnnthreadpool.h"
+#include "cnnfft.h"
+
+// Execution context of a layer: the mode of a pass and everything forwardPass stores for the backward pass of one example.
+// The layer itself only holds the parameters, so any number of threads can run forwardPass and calculateDiffs on the same layer
+// at the same time, as long as every thread uses its own contexts. Zero-initialize a new context (an inference context);
+// the arrays are allocated by forwardPass and freed by CNNLayer::freeContext (or replaced by the next forwardPass with the context).
+struct CNNLayerContext
+{
+    // true: calculateDiffs follows, so forwardPass stores the state listed below; false: inference, forwardPass stores nothing
+    // (calculateDiffs must not be called with the context).
+    // BATCHNORM: true: normalize with the statistics of the batch (see batchMeans) and update the running statistics of the layer;
+    // false: normalize with the running statistics
+    // DROPOUT: true: drop values; false: pass the input on unchanged
+    bool training;
+    // true: forwardPass repeats the training pass of the same example to restore the state the backward pass needs (see CNNActivationCheckpointing),
+    // so BATCHNORM layers don't update their running statistics again and DROPOUT layers apply the mask of dropoutPass again instead of drawing a new one
+    bool recomputation;
+
+    // Dimensions: feature map -> row of pixels in feature map -> value of pixel at x coordinate. Only what the backward pass reads is kept:
+    // "input" by CONV, FC (see stashedInput), SOFTMAX and BATCHNORM, "output" by RELU and SOFTMAX. During forwardPass they also hold
+    // the arrays the kernels read and write; the output is handed to the caller instead of being copied.
+    // Between NHWC layers they are channels-last arrays (see CNNLayer::channelsLastOutput).
+    double ***input;
+    double ***output;
+
+    // CONV and FC with a reduced stash precision only (see CNNLayer::setStashPrecision): "input" multiplied by stashScale and rounded to 16 bits per value
+    // (feature map -> row -> pixel, contiguous). Stored by forwardPass instead of "input", which only exists during the passes.
+    uint16_t *stashedInput;
+    double stashScale; // A power of two (1 for bfloat16), so the scaling itself is exact
+    uint8_t stashedPrecision; // Of stashedInput (the layer's setting may change between the passes)
+    bool stashedChannelsLast; // "input" was a channels-last array (see CNNLayer::allocChannelsLastArray), so stashedInput is in channels-last order
+
+    // MAXPOOL only: feature map in previous layer -> row of pixels -> value of pixel at x coordinate; marks the pixels with the highest values
+    // for use in backpropagation (1.0 for highest pixel, else 0.0). Stored instead of "input" and "output".
+    double ***maxPixelMatrix;
+
+    // DROPOUT only: one bit per pixel (1: kept) for the mask drawn by the last forward pass; feature map -> dropoutMaskWordCount words.
+    // Pixel (x,y) is bit p%64 of word p/64 with p=y*singleFeatureMapWidth+x. Stored instead of "input" and "output", which the backward pass doesn't need.
+    uint64_t *dropoutMask;
+    uint64_t dropoutPass; // Number of the forward pass of the layer that drew the mask (see CNNLayer::dropoutSeed)
+
+    // BATCHNORM only, training: statistics of a batch of several examples that are normalized together (see CNNPipeline); feature map -> value.
+    // Set by the caller, not owned by the context (freeContext leaves them alone). 0 (zero-initialized): the batch is this example alone, so the
+    // statistics are those of its own pixels and forwardPass updates the running statistics (the trainers that process one example per pass).
+    // batchMeans/batchVariances: of the inputs of all examples (see CNNLayer::calculateBatchnormBatchStatistics), read by both passes;
+    // the caller updates the running statistics once per batch (see CNNLayer::updateBatchnormRunningStatistics).
+    // batchOutputDiffMeans/batchNormalizedOutputDiffMeans: of the output diffs of all examples (see CNNLayer::addBatchnormDiffSums), read by
+    // calculateDiffs; required if batchMeans is set.
+    double *batchMeans;
+    double *batchVariances;
+    double *batchOutputDiffMeans;
+    double *batchNormalizedOutputDiffMeans;
+
+    // SOFTMAX only: log of the sum of the exponentials of the input values (stored by the forward pass; output=exp(input-logSumExp))
+    double logSumExp;
+    // SOFTMAX only: cross-entropy loss of the desired label, -log(output[desiredLabel])=logSumExp-input[desiredLabel], calculated by the
+    // backward pass together with the input diffs. Unlike -log(output[desiredLabel]) it doesn't overflow when the probability underflows to 0.
+    double loss;
+};
+
 class CNNLayer
 {
 public:
@@ -42,34 +155,96 @@ public:
     int32_t zeroPaddingX; // Horizontal zero padding to be used in the output
     int32_t zeroPaddingY; // Vertical zero padding to be used with the input
 
+    // Output pixels in [interiorStartX,interiorEndX) x [interiorStartY,interiorEndY) have receptive fields that lie completely inside the previous layer's feature maps.
+    // Only the pixels outside of this rectangle (the border) touch the zero padding and need their receptive fields clamped.
+    int32_t interiorStartX;
+    int32_t interiorEndX;
+    int32_t interiorStartY;
+    int32_t interiorEndY;
+
     uint32_t layerId;
 
     uint8_t type; // Type of this layer
 
-    // Dimensions: feature map in previous layer -> row of pixels -> value of pixel at x coordinate (1.0)
-    double ***maxPixelMatrix; // Store the coordinates of the pixels with the highest values for use in backpropagation (1.0 for highest pixel, else 0.0).
-
     // Dimensions for CONV: feature map in previous layer -> feature map in this layer -> row of receptive field pixel -> weight of receptive field pixel at x coordinate
     // ("receptive field pixel to pixel in this layer"-weights)
 
     // Dimensions for FC: feature map in previous layer -> row of pixel in feature map in previous layer -> pixel in feature map in previous layer -> weight of connection of pixel in feature map in previous layer to neuron in this layer
+
+    // Dimensions for BATCHNORM: feature map -> 0 -> 0 -> scale of the normalized feature map
+    // The values of all weights are stored in one contiguous block (see allocWeightTypeArray), so they can be processed as a flat buffer, too.
     double ****weights;
+    uint32_t weightCount; // Total amount of weights (CONV, FC and BATCHNORM)
 
     // Dimensions for CONV: feature map in this layer (bias of receptive field)
     // ("pixel in this layer"-bias weights)
     // Dimensions for FC: feature map in this layer (1 neuron = 1 feature map)
+    // Dimensions for BATCHNORM: feature map (shift of the normalized and scaled feature map)
     double *biasWeights;
 
-    double ****previousWeightDiffDeltas;
-    double *previousBiasWeightDiffDeltas;
+    // BATCHNORM only: exponential moving averages (see CNN_BATCHNORM_MOMENTUM) of the means and variances of the feature maps seen during training
+    double *runningMeans;
+    double *runningVariances;
+    std::mutex runningStatisticsMutex; // Training passes with different contexts may update the running statistics at the same time
 
-    // Store for backpropagation:
+    // DROPOUT only: probability of dropping a value while training (see setDropoutRate)
+    double dropoutRate;
+    uint32_t dropoutMaskWordCount; // Per feature map (see CNNLayerContext::dropoutMask)
+    // DROPOUT only: the mask of feature map f in forward pass n is drawn from a CNNVectorRandom seeded with dropoutSeed+n*featureMapCount+f,
+    // so the masks neither depend on the thread pool nor on the threads that draw them (every task uses its own generator).
+    // Every training pass (with any context) claims the next pass number.
+    uint64_t dropoutSeed;
+    std::atomic<uint64_t> dropoutPassCount;
 
-    // Dimensions:
-    // Feature map -> row of pixels in feature map -> value of pixel at x coordinate
+    // Optimizer state (see CNNOptimizer); flat, zero-initialized buffers with one value per weight/bias weight.
+    double *weightOptimizerState1;
+    double *weightOptimizerState2;
+    double *biasWeightOptimizerState1;
+    double *biasWeightOptimizerState2;
 
-    double ***input;
-    double ***output;
+    // CONV only: algorithm of the forward pass and feature maps per task when the work is split across the thread pool (see CNNConvTuner)
+    uint8_t convAlgorithm;
+    uint32_t convGrain;
+
+    // CONV with CNN_CONV_ALGORITHM_FFT only: transforms of fftTileWidth+receptiveFieldWidth-1 x fftTileHeight+receptiveFieldHeight-1 pixels (rounded up to powers of two),
+    // so that the linear convolution of a tile with a filter doesn't wrap around
+    CNNRealFFT2D *fft;
+    int32_t fftTileWidth;
+    int32_t fftTileHeight;
+    // Spectra of the filters (zero-padded to the transform size): feature map in previous layer -> feature map in this layer -> fft->spectrumSize real parts,
+    // then fft->spectrumSize imaginary parts. Calculated by the first pass after the weights were changed (see invalidateWeightTransforms).
+    double *filterSpectra;
+    std::atomic<bool> filterSpectraValid;
+
+    // Kernel layout of CONV, FC, MAXPOOL and AVGPOOL layers (see CNN_TENSOR_LAYOUT_NCHW); NHWC CONV layers ignore convAlgorithm
+    uint8_t tensorLayout;
+    // NHWC layers only: the output is a channels-last array (see allocChannelsLastArray), since the next layer is an NHWC layer, too (set by
+    // linkTensorLayouts; clone copies it). The NHWC layers accept both kinds of input arrays; the other layers throw on a channels-last one.
+    bool channelsLastOutput;
+    // NHWC CONV only: the weights in channels-last order, receptive field row -> receptive field pixel -> feature map in previous layer -> feature map in this layer.
+    // Calculated by the first pass after the weights were changed, like filterSpectra.
+    double *packedWeights;
+    std::atomic<bool> packedWeightsValid;
+
+    // CONV and MAXPOOL only: kernels of the NCHW passes, selected by selectKernels for the geometry of the layer
+    typedef void (CNNLayer::*FeatureMapsKernel)(CNNLayerContext &context,uint32_t first,uint32_t last);
+    typedef void (CNNLayer::*ConvDiffsKernel)(double ****weightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context,uint32_t first,uint32_t last);
+    bool specializedKernels; // See setSpecializedKernels
+    FeatureMapsKernel convFeatureMapsKernel; // CNN_CONV_ALGORITHM_DIRECT
+    ConvDiffsKernel convDiffsKernel; // CNN_CONV_ALGORITHM_DIRECT and CNN_CONV_ALGORITHM_ROWS
+    FeatureMapsKernel maxpoolFeatureMapsKernel;
+
+    // CONV and FC only: see CNN_STASH_PRECISION_DOUBLE
+    uint8_t stashPrecision;
+
+    std::mutex weightTransformsMutex; // Passes with different contexts may find the filter spectra or packed weights invalid at the same time
+
+    // Context of forwardPass and calculateDiffs without a context argument (for callers that run one pass at a time, e.g. TrainingThread)
+    CNNLayerContext defaultContext;
+
+    // Pool for splitting conv, fc, calculateConvDiffs and applyDiffs into tasks (0: everything runs on the calling thread; see setThreadPool).
+    // The results are bit-identical either way, since every task writes its own part of the results and sums are always added up in the same order.
+    CNNThreadPool *threadPool;
 
     static double sig(double input); // sigmoid function
     static double tanh(double input); // tanh function
@@ -77,13 +252,76 @@ public:
     // Single feature map width/height calculated from receptiveFieldWidth/receptiveFieldHeight.
 
     // Note that a relu layer has exactly the same dimensions as the layer preceding it.
-    // Note that a maxpool layer has exactly the same _depth_ as the layer preceding it.
+    // Note that a maxpool/avgpool layer has exactly the same _depth_ as the layer preceding it.
 
     // For constructing FC layers: use _featureMapCount=1
-    CNNLayer(uint32_t _layerId,uint8_t _type,uint32_t _featureMapCount,int32_t _receptiveFieldWidth,int32_t _receptiveFieldHeight,uint32_t _strideX /*Default: 1*/,uint32_t _strideY /*Default: 1*/,uint32_t _zeroPaddingX,uint32_t _zeroPaddingY,uint32_t _previousLayerFeatureMapCount,int32_t _previousLayerSingleFeatureMapWidth,int32_t _previousLayerSingleFeatureMapHeight);
+    // The initial weights only depend on _seed and _layerId (the same seed can be used for all layers of a network).
+    CNNLayer(uint32_t _layerId,uint8_t _type,uint32_t _featureMapCount,int32_t _receptiveFieldWidth,int32_t _receptiveFieldHeight,uint32_t _strideX /*Default: 1*/,uint32_t _strideY /*Default: 1*/,uint32_t _zeroPaddingX,uint32_t _zeroPaddingY,uint32_t _previousLayerFeatureMapCount,int32_t _previousLayerSingleFeatureMapWidth,int32_t _previousLayerSingleFeatureMapHeight,uint64_t _seed);
     ~CNNLayer();
+    // Whether the constructor accepts these parameters (it throws otherwise); for geometry that comes from outside the program, e.g. a checkpoint file
+    static bool isValidGeometry(uint8_t _type,uint32_t _featureMapCount,int32_t _receptiveFieldWidth,int32_t _receptiveFieldHeight,uint32_t _strideX,uint32_t _strideY,uint32_t _zeroPaddingX,uint32_t _zeroPaddingY,uint32_t _previousLayerFeatureMapCount,int32_t _previousLayerSingleFeatureMapWidth,int32_t _previousLayerSingleFeatureMapHeight);
+
+    // Creates a layer with the same geometry, weights and bias weights (the optimizer state and the state stored by forwardPass are not copied,
+    // but the mode of the default context is).
+    // A DROPOUT clone draws the same masks as the original (see setDropoutSeed).
+    // The memory of the new layer is first touched by the calling thread, so it is placed on that thread's NUMA node.
+    CNNLayer *clone();
+    // Overwrites the weights, bias weights and BATCHNORM running statistics with those of a layer with the same geometry
+    void copyParameters(CNNLayer *source);
+
+    // CONV, FC and BATCHNORM layers have weights and bias weights (and get weight diffs from calculateDiffs)
+    bool hasWeights();
+    // Zero-initialized weight diffs with the same dimensions as "weights" (CONV, FC and BATCHNORM only)
+    double ****allocWeightDiffs();
+    void freeWeightDiffs(double ****weightDiffs);
+    // Sets the mode of the default context (see CNNLayerContext::training)
+    void setTraining(bool _training);
+    // DROPOUT only: the rate must be in [0,1)
+    void setDropoutRate(double _dropoutRate);
+    // DROPOUT only: restarts the sequence of masks with a new seed (replicas of a layer that train on different examples should use different seeds)
+    void setDropoutSeed(uint64_t _seed);
 
+    // Folds a BATCHNORM layer in inference mode into this CONV layer, so that conv calculates what the two layers calculated before
+    void foldBatchnorm(CNNLayer *batchnormLayer);
+    // Copies the layers for inference: BATCHNORM layers that follow a CONV layer are folded into it (and thus cost nothing), other BATCHNORM layers use
+    // their running statistics. DROPOUT layers are left out. The returned array has inferenceLayerCount entries; free it like CNNCheckpoint::freeLayers does.
+    static CNNLayer **createInferenceLayers(CNNLayer **_layers,uint32_t _layerCount,uint32_t &inferenceLayerCount);
+
+    // The pool is not owned by the layer and may be shared by several layers and threads (clone does not copy it).
+    void setThreadPool(CNNThreadPool *_threadPool);
+    // CONV only: _grain must be at least 1 (clone copies the settings)
+    void setConvAlgorithm(uint8_t _convAlgorithm,uint32_t _convGrain);
+    // CONV only: must be called after changing the weights directly (applyDiffs, copyParameters and foldBatchnorm do it themselves), else the FFT algorithm
+    // and the NHWC kernels keep using the spectra and packed weights of the old weights
+    void invalidateWeightTransforms();
+    static const char *getConvAlgorithmName(uint8_t _convAlgorithm);
+    // Any layer type (clone copies the setting); only CONV, FC, MAXPOOL and AVGPOOL layers have NHWC kernels, the others are elementwise or per feature map anyway
+    void setTensorLayout(uint8_t _tensorLayout);
+    // Selects the layout for all layers of a network (and links them, see linkTensorLayouts)
+    static void setNetworkTensorLayout(CNNLayer **_layers,uint32_t _layerCount,uint8_t _tensorLayout);
+    // Sets channelsLastOutput of every NHWC layer whose next layer is an NHWC layer, too; call it again after changing the layout of a single layer
+    static void linkTensorLayouts(CNNLayer **_layers,uint32_t _layerCount);
+    bool hasChannelsLastKernels(); // CONV, FC, MAXPOOL and AVGPOOL layers with the NHWC layout
+    static const char *getTensorLayoutName(uint8_t _tensorLayout);
+    // Any layer type (clone copies the setting); only CONV and FC layers stash their input, the others store what their backward passes need in double precision
+    void setStashPrecision(uint8_t _stashPrecision);
+    // Selects the stash precision for all layers of a network
+    static void setNetworkStashPrecision(CNNLayer **_layers,uint32_t _layerCount,uint8_t _stashPrecision);
+    static const char *getStashPrecisionName(uint8_t _stashPrecision);
+    // true (the default): common geometries (CONV 5x5, 3x3 and 1x1 with stride 1, CONV 3x3 with stride 2, MAXPOOL 2x2 with stride 2) use kernels
+    // compiled for their receptive field and stride; false: all layers use the generic kernels. Both add up the same values in the same order, so the
+    // results are bit-identical (clone copies the setting).
+    void setSpecializedKernels(bool _specializedKernels);
+    void selectKernels();
+
+    // Hash (FNV-1a) of the bits of all weights and bias weights; two runs produced bit-identical parameters if their checksums match.
+    uint64_t getParameterChecksum(uint64_t checksum);
+
+    static double ***allocArray(uint32_t zDimension,int32_t yDimension,int32_t xDimension); // Zero-initialized
     static void freeArray(double ***_array,uint32_t zDimension,int32_t yDimension);
+    // Allocates a zero-initialized weight type array; the values are stored in one contiguous block that starts at getWeightTypeArrayData(_array).
+    static double ****allocWeightTypeArray(uint32_t _dimension1, uint32_t _dimension2, int32_t _dimension3, int32_t _dimension4);
+    static double *getWeightTypeArrayData(double ****_array);
     static void freeWeightTypeArray(double ****_array, uint32_t _dimension1, uint32_t _dimension2, int32_t _dimension3, int32_t _dimension4);
     static void freeBiasTypeArray(double *_array);
     double ***cloneArray(double ***_array,uint32_t zDimension,int32_t yDimension,int32_t xDimension);
@@ -94,15 +332,107 @@ public:
     static int32_t getRequiredReceptiveFieldSizeForDesiredSingleFeatureMapSize(int32_t _previousLayerSingleFeatureMapSize,int32_t _desiredSingleFeatureMapSize,int32_t _stride,int32_t _zeroPadding);
     // WARNING: The zero padding returned must be used in the _previous_ layer, not in this layer!
     static int32_t getRequiredZeroPaddingForDesiredSingleFeatureMapAndReceptiveFieldSize(int32_t _previousLayerSingleFeatureMapSize,int32_t _desiredSingleFeatureMapSize,int32_t _desiredReceptiveFieldSize,int32_t _stride);
+    // Calculates the range [start,end) of output pixels (in one dimension) whose receptive fields do not reach into the zero padding.
+    static void calculateInteriorRange(int32_t _previousLayerSingleFeatureMapSize,int32_t _singleFeatureMapSize,int32_t _receptiveFieldSize,int32_t _stride,int32_t _zeroPadding,int32_t &start,int32_t &end);
+
+    // Row kernels of the pooling layers and the ROWS conv algorithm (SSE2 where available)
+    static void addRow(double *destination,const double *source,int32_t count); // destination[x]+=source[x]
+    static void addScaledRow(double *destination,const double *source,double factor,int32_t count); // destination[x]+=source[x]*factor
+    static double sumRow(const double *source,int32_t count);
+    static void fillRow(double *destination,double value,int32_t count);
+    static double dotRow(const double *source1,const double *source2,int32_t count); // Sum of source1[x]*source2[x]
+    // Conversions to the reduced stash precisions and back. Values are rounded to float first, then to 16 bits (to nearest even both times), like the
+    // conversion instructions do; float denormals become zeros in bfloat16 (like the AVX-512 BF16 instructions). NaNs stay NaNs.
+    static uint16_t doubleToBf16(double value);
+    static double bf16ToDouble(uint16_t value);
+    static uint16_t doubleToFp16(double value);
+    static double fp16ToDouble(uint16_t value);
+    // destination[x]=source[x]*scale converted to _stashPrecision, and back (destination[x]=source[x] converted to double*inverseScale);
+    // AVX-512 BF16 and F16C where available, with results bit-identical to the scalar conversions
+    static void packReducedPrecisionRow(const double *source,uint16_t *destination,double scale,int32_t count,uint8_t _stashPrecision);
+    static void unpackReducedPrecisionRow(const uint16_t *source,double *destination,double inverseScale,int32_t count,uint8_t _stashPrecision);
+    // Sets context.input to the input of a forward pass: a copy if the backward pass reads it (keepInput and training), else _input itself
+    void beginForwardPass(double ***_input,CNNLayerContext &context,bool keepInput);
+    // Drops context.input again unless it is a kept copy, and returns context.output, or a copy of it if the backward pass reads it (keepOutput and training)
+    double ***endForwardPass(CNNLayerContext &context,bool keepInput,bool keepOutput);
+    void stashInput(CNNLayerContext &context); // Replaces context.input with context.stashedInput
+    // Allocates context.input from context.stashedInput if the forward pass stashed it, and returns true if it did (the caller frees it again)
+    bool unstashInput(CNNLayerContext &context);
+    // packed[(y*xDimension+x)*zDimension+z]=_array[z][y][x] (NCHW to NHWC) and back; unpackChannelsLast allocates the array
+    static void packChannelsLast(double ***_array,uint32_t zDimension,int32_t yDimension,int32_t xDimension,double *packed);
+    static double ***unpackChannelsLast(const double *packed,uint32_t zDimension,int32_t yDimension,int32_t xDimension);
+    // Channels-last arrays have the pointer tables of an NCHW array (so freeArray and cloneArray work on them), but all values are packed
+    // into _array[0][0] and the other rows are 0. With a single row the two layouts are the same, and the array is an NCHW array.
+    static double ***allocChannelsLastArray(uint32_t zDimension,int32_t yDimension,int32_t xDimension); // Values uninitialized
+    static bool isChannelsLastArray(double ***_array,uint32_t zDimension,int32_t yDimension);
+    // NHWC kernels: the input in channels-last order: the values of a channels-last array themselves, else packed into packedCopy (to be freed by the caller, 0 otherwise)
+    const double *getChannelsLastInput(double ***_input,double *&packedCopy);
+    // NHWC kernels: the buffer for the output in channels-last order; endChannelsLastOutput makes _output from it (if channelsLastOutput,
+    // _output is already the channels-last array that holds the buffer)
+    double *beginChannelsLastOutput(double ***&_output);
+    void endChannelsLastOutput(double ***&_output,double *packedOutput);
 
-    double ***conv(double ***_input);
-    double ***fc(double ***_input);
+    // The kernels read and write the per-call state in "context" (see CNNLayerContext)
+    double ***conv(double ***_input,CNNLayerContext &context);
+    double ***fc(double ***_input,CNNLayerContext &context);
+    // Calculate output[featureMapInThisLayer] for featureMapInThisLayer in [first,last) (the tasks of conv and fc).
+    // The template arguments of the geometry kernels (convFeatureMaps, calculateConvDiffsForPreviousLayerFeatureMaps and maxpoolFeatureMaps) fix the receptive
+    // field and stride at compile time; 0 reads the value from the layer (the generic kernel). They are only instantiated by selectKernels.
+    template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+    void convFeatureMaps(CNNLayerContext &context,uint32_t first,uint32_t last);
+    void convFeatureMapsByRows(CNNLayerContext &context,uint32_t first,uint32_t last); // CNN_CONV_ALGORITHM_ROWS
+    // CNN_CONV_ALGORITHM_FFT: the input is cut into tiles; the correlation of every tile with every filter (the product of the tile spectrum and the conjugate
+    // filter spectrum, summed over the feature maps in the previous layer) is added to the output at the position of the tile (overlap-add)
+    void convFFT(CNNLayerContext &context);
+    void updateFilterSpectra(); // Calculates the filter spectra if they are not valid
+    // Zero-fills "buffer" (fft->width x fft->height) and copies the pixels [startX,startX+width) x [startY,startY+height) of a feature map into it,
+    // where pixel (x,y) of an upsampled feature map is featureMap[y/upsamplingY][x/upsamplingX] if both are divisible, else 0 (like the zero padding)
+    void fillFFTBuffer(double *buffer,double **featureMap,int32_t featureMapWidth,int32_t featureMapHeight,int32_t startX,int32_t startY,int32_t width,int32_t height,
+                       int32_t upsamplingX,int32_t upsamplingY);
+    void fcNeurons(CNNLayerContext &context,uint32_t first,uint32_t last);
+    // NHWC kernels: "packedInput" and "packedOutput" are the input and output in channels-last order
+    // CONV: every output pixel starts with the bias weights, then the packed weights of every input value are scaled by it and added (across the feature maps in this layer).
+    // Calculates the output rows [first,last).
+    void convRowsChannelsLast(const double *packedInput,double *packedOutput,int32_t first,int32_t last);
+    void updatePackedWeights(); // Calculates the packed weights if they are not valid
+    // FC: the weights of an input value are contiguous across the neurons anyway (see "weights"), so the input is read in channels-last order and
+    // every value updates the sums of neurons [first,last) at once
+    void fcNeuronsChannelsLast(const double *packedInput,double *sums,uint32_t first,uint32_t last);
+    // MAXPOOL and AVGPOOL: every window pixel updates the maxima/sums of all feature maps of an output pixel at once.
+    // MAXPOOL scans the windows in the order of maxpool and marks the same pixels in context.maxPixelMatrix (the backward passes of the pooling layers
+    // don't depend on the layout); like maxpool, it runs on the calling thread. avgpoolRowsChannelsLast calculates the output rows [first,last).
+    void maxpoolChannelsLast(const double *packedInput,double *packedOutput,CNNLayerContext &context);
+    void avgpoolRowsChannelsLast(const double *packedInput,double *packedOutput,int32_t first,int32_t last);
     // A maxpool layer has the same depth as the layer preceding it
-    double ***maxpool(double ***_input);
-    double ***relu(double ***_input);
-    // Note that all input values have to be positive in order for the softmax layer to work
+    double ***maxpool(double ***_input,CNNLayerContext &context);
+    // Calculates output[featureMap] and the marks of maxPixelMatrix for featureMap in [first,last)
+    template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+    void maxpoolFeatureMaps(CNNLayerContext &context,uint32_t first,uint32_t last);
+    double ***relu(double ***_input,CNNLayerContext &context);
     // A softmax layer has the same depth (feature count) as the layer preceding it (intended to be used after a FC layer)
-    double ***softmax(double ***_input);
+    double ***softmax(double ***_input,CNNLayerContext &context);
+    double ***batchnorm(double ***_input,CNNLayerContext &context);
+    // Normalizes output[featureMap] for featureMap in [first,last) (the tasks of batchnorm)
+    void batchnormFeatureMaps(CNNLayerContext &context,uint32_t first,uint32_t last);
+    // Mean and (biased) variance used by batchnorm for a feature map: the running statistics in inference mode, else those of the batch
+    // (context.batchMeans and batchVariances if set, else those of "input")
+    void getBatchnormStatistics(CNNLayerContext &context,uint32_t featureMap,double &mean,double &variance);
+    // Mean and (biased) variance of a feature map over all pixels of inputs[0..exampleCount)
+    void calculateBatchnormStatistics(double ****inputs,uint32_t exampleCount,uint32_t featureMap,double &mean,double &variance);
+    // Statistics of a batch for CNNLayerContext::batchMeans and batchVariances (means and variances: feature map -> value)
+    void calculateBatchnormBatchStatistics(double ****inputs,uint32_t exampleCount,double *means,double *variances);
+    // Adds the statistics of a batch of exampleCount examples to the running statistics (forwardPass does it itself if context.batchMeans is 0)
+    void updateBatchnormRunningStatistics(const double *means,const double *variances,uint32_t exampleCount);
+    // valueCount: pixels the statistics were calculated from (for the unbiased variance)
+    void updateBatchnormRunningStatistics(uint32_t featureMap,double mean,double variance,double valueCount);
+    // Unlike the other pooling/activation layers, the average pooling layers store nothing for backpropagation (their diffs don't depend on the values)
+    double ***avgpool(double ***_input);
+    // Calculates _output[featureMap] for featureMap in [first,last) (the tasks of avgpool)
+    void avgpoolFeatureMaps(double ***_input,double ***_output,uint32_t first,uint32_t last);
+    double ***globalAvgpool(double ***_input);
+    double ***dropout(double ***_input,CNNLayerContext &context);
+    // Draws the masks of the feature maps in [first,last) and calculates their output (the tasks of dropout)
+    void dropoutFeatureMaps(double ***_input,double ***_output,CNNLayerContext &context,uint32_t first,uint32_t last);
 
     // Learning functions:
 
@@ -110,23 +440,56 @@ public:
     // Bias diff dimensions: feature map in previous layer -> diff of bias weight of feature map in this layer
     // Output diff dimensions: feature map in this layer -> row of pixels -> diff of pixel at x coordinate
     // outputDiffs: diffs of pixels; inputDiffs: diffs of pixels in previous layer (to be passed as outputDiffs to the next layer)
-    void calculateConvDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs);
-    void calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs);
-    void calculateMaxpoolDiffs(double ***outputDiffs,double ***&inputDiffs);
-    void calculateReluDiffs(double ***outputDiffs,double ***&inputDiffs);
-    // The softmax diff calculation function needs the desired values to compute the input diffs (remember that the feature map count of a softmax layer is always 1)
-    void calculateSoftmaxDiffs(double ***&inputDiffs,  uint32_t desiredLabel);
-    void applyConvDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay);
-    void applyFcDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay);
+    void calculateConvDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs,CNNLayerContext &context);
+    // Calculates weightDiffs[featureMapInPreviousLayer] and inputDiffs[featureMapInPreviousLayer] for featureMapInPreviousLayer in [first,last) (the tasks of calculateConvDiffs)
+    template<int32_t fixedReceptiveFieldWidth,int32_t fixedReceptiveFieldHeight,uint32_t fixedStrideX,uint32_t fixedStrideY>
+    void calculateConvDiffsForPreviousLayerFeatureMaps(double ****weightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context,uint32_t first,uint32_t last);
+    // CNN_CONV_ALGORITHM_FFT: the output diffs, upsampled by the stride, are cut into tiles. Input diffs: overlap-add of the convolutions of the tiles with the filters.
+    // Weight diffs: sum of the correlations of the tiles with the zero-padded input at their positions (the first receptiveFieldWidth x receptiveFieldHeight values).
+    void calculateConvDiffsFFT(double ****weightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context);
+    // NHWC: input diffs gathered per input pixel (dot products of the output diffs with the packed weights, parallel over input rows), weight diffs
+    // accumulated per receptive field pixel (the output diffs of an output pixel scaled by every input value, parallel over receptive field rows)
+    void calculateConvDiffsChannelsLast(double ****weightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context);
+    void calculateFcDiffs(double ****&weightDiffs, double *&biasWeightDiffs, double ***outputDiffs, double ***&inputDiffs,CNNLayerContext &context);
+    // NHWC: the weight diffs of an input value are the output diffs scaled by it, its input diff is their dot product with its weights (parallel over input pixels)
+    void calculateFcDiffsChannelsLast(double ****weightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context);
+    void calculateMaxpoolDiffs(double ***outputDiffs,double ***&inputDiffs,CNNLayerContext &context);
+    void calculateReluDiffs(double ***outputDiffs,double ***&inputDiffs,CNNLayerContext &context);
+    void calculateBatchnormDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs,CNNLayerContext &context);
+    void calculateBatchnormDiffsForFeatureMaps(double ****weightDiffs,double *biasWeightDiffs,double ***outputDiffs,double ***inputDiffs,CNNLayerContext &context,uint32_t first,uint32_t last);
+    // Sum of the output diffs of a feature map and sum of the output diffs multiplied by the normalized inputs (the diffs of the shift and the scale)
+    void getBatchnormDiffSums(double ***outputDiffs,CNNLayerContext &context,uint32_t featureMap,double mean,double inverseStandardDeviation,
+                              double &outputDiffSum,double &normalizedOutputDiffSum);
+    // Adds the sums of getBatchnormDiffSums of one example of a batch (after its forward pass with "context") to outputDiffSums and
+    // normalizedOutputDiffSums; divided by the pixels of all examples, they become context.batchOutputDiffMeans and batchNormalizedOutputDiffMeans
+    void addBatchnormDiffSums(double ***outputDiffs,CNNLayerContext &context,double *outputDiffSums,double *normalizedOutputDiffSums);
+    void calculateDropoutDiffs(double ***outputDiffs,double ***&inputDiffs,CNNLayerContext &context);
+    void calculateAvgpoolDiffs(double ***outputDiffs,double ***&inputDiffs);
+    // Calculates inputDiffs[featureMap] for featureMap in [first,last) (the tasks of calculateAvgpoolDiffs)
+    void calculateAvgpoolDiffsForFeatureMaps(double ***outputDiffs,double ***inputDiffs,uint32_t first,uint32_t last);
+    void calculateGlobalAvgpoolDiffs(double ***outputDiffs,double ***&inputDiffs);
+    // The softmax layer is the loss layer, too: it calculates the diffs of the cross-entropy loss of desiredLabel w.r.t. its input (output-onehot,
+    // so no one-hot vector of desired values is needed) and stores the loss in context.loss
+    void calculateSoftmaxDiffs(double ***&inputDiffs,  uint32_t desiredLabel,CNNLayerContext &context);
 
     // Universal functions:
 
     // Input dimensions:  feature maps of previous layer -> rows (y) -> columns (x)
     // Output dimensions: feature maps of this layer -> rows (y) -> columns (x)
-    double ***forwardPass(double ***_input);
+    // Only reads the parameters (except for the running statistics of BATCHNORM layers in training mode that isn't a recomputation) and stores its state in "context",
+    // which calculateDiffs needs for the backward pass of the same example (nothing in inference mode, see CNNLayerContext::training).
+    double ***forwardPass(double ***_input,CNNLayerContext &context);
+    double ***forwardPass(double ***_input); // With defaultContext
 
-    void calculateDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs,uint32_t desiredLabel);
-    void applyDiffs(double ****weightDiffs, double *biasWeightDiffs, double learningRate, double momentum, double weightDecay);
+    void calculateDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs,uint32_t desiredLabel,CNNLayerContext &context);
+    void calculateDiffs(double ****&weightDiffs,double *&biasWeightDiffs,double ***outputDiffs,double ***&inputDiffs,uint32_t desiredLabel); // With defaultContext
+    // Applies the diffs to the weights and bias weights of CONV, FC and BATCHNORM layers (does nothing for other layer types).
+    // Not safe while other threads run passes on the layer (they would read partly updated weights).
+    void applyDiffs(double ****weightDiffs, double *biasWeightDiffs, CNNOptimizer *optimizer);
+    // Frees the arrays of a context (its mode is kept)
+    void freeContext(CNNLayerContext &context);
+    // Must be called when switching to a different optimizer type, since the optimizer state buffers mean different things for different types.
+    void resetOptimizerState();
 };
 
 #endif // CNNLAYER_H
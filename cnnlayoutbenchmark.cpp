@@ -0,0 +1,111 @@
+#include "cnnlayoutbenchmark.h"
+
+// The CONV, MAXPOOL and FC layers of MainWindow's network (32x32 RGB input), then layers with more feature maps of few pixels
+static const CNNLayoutBenchmarkShape layoutBenchmarkShapes[]=
+{
+    {"CONV 16@5x5 on 3x32x32 (layer1)",CNN_LAYER_TYPE_CONV,16,5,5,1,1,2,2,3,32,32},
+    {"MAXPOOL 2x2 on 16x32x32 (layer4)",CNN_LAYER_TYPE_MAXPOOL,16,2,2,2,2,0,0,16,32,32},
+    {"CONV 20@5x5 on 16x16x16 (layer5)",CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,16,16,16},
+    {"MAXPOOL 2x2 on 20x16x16 (layer8)",CNN_LAYER_TYPE_MAXPOOL,20,2,2,2,2,0,0,20,16,16},
+    {"CONV 20@5x5 on 20x8x8 (layer9)",CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,20,8,8},
+    {"MAXPOOL 2x2 on 20x8x8 (layer12)",CNN_LAYER_TYPE_MAXPOOL,20,2,2,2,2,0,0,20,8,8},
+    {"FC 10 on 20x4x4 (layer14)",CNN_LAYER_TYPE_FC,10,0,0,1,1,0,0,20,4,4},
+    {"CONV 64@3x3 on 64x4x4",CNN_LAYER_TYPE_CONV,64,3,3,1,1,1,1,64,4,4},
+    {"CONV 128@3x3 on 128x2x2",CNN_LAYER_TYPE_CONV,128,3,3,1,1,1,1,128,2,2},
+    {"AVGPOOL 2x2 on 64x8x8",CNN_LAYER_TYPE_AVGPOOL,64,2,2,2,2,0,0,64,8,8},
+    {"FC 64 on 128x2x2",CNN_LAYER_TYPE_FC,64,0,0,1,1,0,0,128,2,2}
+};
+
+CNNLayoutBenchmark::CNNLayoutBenchmark(std::ostream &_out, CNNThreadPool *_threadPool) : out(_out)
+{
+    threadPool=_threadPool;
+}
+
+void CNNLayoutBenchmark::run()
+{
+    uint32_t shapeCount=sizeof(layoutBenchmarkShapes)/sizeof(layoutBenchmarkShapes[0]);
+
+    out<<"Fastest of "<<CNN_LAYOUT_BENCHMARK_REPETITION_COUNT<<" passes in microseconds (forward / backward), "
+       <<(threadPool!=0?threadPool->getWorkerCount():0)<<" pool workers"<<std::endl;
+    out<<std::fixed<<std::setprecision(1);
+    for(uint32_t shape=0;shape<shapeCount;shape++)
+    {
+        double microseconds[CNN_TENSOR_LAYOUT_COUNT+1][2];
+        for(uint8_t tensorLayout=1;tensorLayout<=CNN_TENSOR_LAYOUT_COUNT;tensorLayout++)
+            benchmark(layoutBenchmarkShapes[shape],tensorLayout,false,microseconds[tensorLayout][0],microseconds[tensorLayout][1]);
+        double chainedMicroseconds[2];
+        benchmark(layoutBenchmarkShapes[shape],CNN_TENSOR_LAYOUT_NHWC,true,chainedMicroseconds[0],chainedMicroseconds[1]);
+
+        double nchwMicroseconds=microseconds[CNN_TENSOR_LAYOUT_NCHW][0]+microseconds[CNN_TENSOR_LAYOUT_NCHW][1];
+        double nhwcMicroseconds=chainedMicroseconds[0]+chainedMicroseconds[1];
+        out<<layoutBenchmarkShapes[shape].description<<": NCHW "<<microseconds[CNN_TENSOR_LAYOUT_NCHW][0]<<" / "<<microseconds[CNN_TENSOR_LAYOUT_NCHW][1]
+           <<", NHWC "<<microseconds[CNN_TENSOR_LAYOUT_NHWC][0]<<" / "<<microseconds[CNN_TENSOR_LAYOUT_NHWC][1]
+           <<", NHWC chained "<<chainedMicroseconds[0]<<" / "<<chainedMicroseconds[1]
+           <<" -> "<<CNNLayer::getTensorLayoutName(nhwcMicroseconds<nchwMicroseconds?CNN_TENSOR_LAYOUT_NHWC:CNN_TENSOR_LAYOUT_NCHW)
+           <<" ("<<(nchwMicroseconds/nhwcMicroseconds)<<"x)"<<std::endl;
+    }
+}
+
+void CNNLayoutBenchmark::benchmark(const CNNLayoutBenchmarkShape &shape, uint8_t tensorLayout, bool chained, double &forwardMicroseconds, double &backwardMicroseconds)
+{
+    CNNLayer *layer=new CNNLayer(1,shape.type,shape.featureMapCount,shape.receptiveFieldWidth,shape.receptiveFieldHeight,shape.strideX,shape.strideY,
+                                 shape.zeroPaddingX,shape.zeroPaddingY,shape.previousLayerFeatureMapCount,shape.previousLayerSingleFeatureMapWidth,
+                                 shape.previousLayerSingleFeatureMapHeight,1);
+    layer->setThreadPool(threadPool);
+    layer->setTraining(true); // The backward pass needs what a training pass stores
+    layer->setTensorLayout(tensorLayout);
+    layer->channelsLastOutput=chained;
+
+    // Distinct values, so that the maxima of the MAXPOOL windows are unique
+    double ***input=CNNLayer::allocArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth);
+    for(uint32_t featureMap=0;featureMap<layer->previousLayerFeatureMapCount;featureMap++)
+    {
+        for(int32_t y=0;y<layer->previousLayerSingleFeatureMapHeight;y++)
+        {
+            for(int32_t x=0;x<layer->previousLayerSingleFeatureMapWidth;x++)
+                input[featureMap][y][x]=sin(featureMap*1000.0+y*100.0+x);
+        }
+    }
+    if(chained)
+    {
+        double ***channelsLastInput=CNNLayer::allocChannelsLastArray(layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth);
+        CNNLayer::packChannelsLast(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,channelsLastInput[0][0]);
+        CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+        input=channelsLastInput;
+    }
+    double ***outputDiffs=CNNLayer::allocArray(layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth);
+
+    // The first pass warms up the caches (and packs the weights of NHWC CONV layers, which training does once per update)
+    forwardMicroseconds=std::numeric_limits<double>::max();
+    backwardMicroseconds=std::numeric_limits<double>::max();
+    for(uint32_t repetition=0;repetition<=CNN_LAYOUT_BENCHMARK_REPETITION_COUNT;repetition++)
+    {
+        std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+        double ***output=layer->forwardPass(input);
+        std::chrono::steady_clock::time_point forwardEnd=std::chrono::steady_clock::now();
+        double ****weightDiffs=0;
+        double *biasWeightDiffs=0;
+        double ***inputDiffs=0;
+        layer->calculateDiffs(weightDiffs,biasWeightDiffs,outputDiffs,inputDiffs,0);
+        std::chrono::steady_clock::time_point backwardEnd=std::chrono::steady_clock::now();
+
+        double repetitionForwardMicroseconds=std::chrono::duration<double,std::micro>(forwardEnd-start).count();
+        double repetitionBackwardMicroseconds=std::chrono::duration<double,std::micro>(backwardEnd-forwardEnd).count();
+        if(repetition>0)
+        {
+            forwardMicroseconds=__min(forwardMicroseconds,repetitionForwardMicroseconds);
+            backwardMicroseconds=__min(backwardMicroseconds,repetitionBackwardMicroseconds);
+        }
+
+        CNNLayer::freeArray(output,layer->featureMapCount,layer->singleFeatureMapHeight);
+        CNNLayer::freeArray(inputDiffs,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+        if(weightDiffs!=0)
+            layer->freeWeightDiffs(weightDiffs);
+        if(biasWeightDiffs!=0)
+            CNNLayer::freeBiasTypeArray(biasWeightDiffs);
+    }
+
+    CNNLayer::freeArray(outputDiffs,layer->featureMapCount,layer->singleFeatureMapHeight);
+    CNNLayer::freeArray(input,layer->previousLayerFeatureMapCount,layer->previousLayerSingleFeatureMapHeight);
+    delete layer;
+}
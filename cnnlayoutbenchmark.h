@@ -0,0 +1,51 @@
+#ifndef CNNLAYOUTBENCHMARK_H
+#define CNNLAYOUTBENCHMARK_H
+
+#define CNN_LAYOUT_BENCHMARK_REPETITION_COUNT 20 // Timed passes per layer and layout (the fastest one counts, like in CNNConvTuner)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <chrono>
+
+#include "cnnlayer.h"
+#include "cnnthreadpool.h"
+
+// Constructor arguments of a benchmarked layer
+struct CNNLayoutBenchmarkShape
+{
+    const char *description;
+    uint8_t type;
+    uint32_t featureMapCount;
+    int32_t receptiveFieldWidth;
+    int32_t receptiveFieldHeight;
+    uint32_t strideX;
+    uint32_t strideY;
+    uint32_t zeroPaddingX;
+    uint32_t zeroPaddingY;
+    uint32_t previousLayerFeatureMapCount;
+    int32_t previousLayerSingleFeatureMapWidth;
+    int32_t previousLayerSingleFeatureMapHeight;
+};
+
+// Times the forward pass and the backward pass of the layers of the demo network (and a few wider ones) with both tensor layouts
+// (run with --benchmark-layouts, see main.cpp) and prints one line per layer with the faster layout. NHWC is timed twice: with the
+// conversions at both layer boundaries (a layer between layers without NHWC kernels), and chained (channels-last input and output, a layer
+// between NHWC layers, see CNNLayer::channelsLastOutput). The chained times decide, since they show which layout to select for the whole network (see TENSOR_LAYOUT).
+
+class CNNLayoutBenchmark
+{
+public:
+    std::ostream &out;
+    CNNThreadPool *threadPool; // 0: the passes run on the calling thread
+
+    CNNLayoutBenchmark(std::ostream &_out,CNNThreadPool *_threadPool);
+
+    void run();
+    // Fastest forward pass and fastest backward pass (in microseconds) of a layer with a layout; chained: NHWC only, channels-last input and output
+    void benchmark(const CNNLayoutBenchmarkShape &shape,uint8_t tensorLayout,bool chained,double &forwardMicroseconds,double &backwardMicroseconds);
+};
+
+#endif // CNNLAYOUTBENCHMARK_H
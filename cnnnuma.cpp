@@ -0,0 +1,114 @@
+#include "cnnnuma.h"
+
+CNNNumaTopology::CNNNumaTopology()
+{
+#ifdef __linux__
+    for(uint32_t node=0;node<CNN_NUMA_MAX_NODES;node++)
+    {
+        char fileName[256];
+        snprintf(fileName,sizeof(fileName),CNN_NUMA_SYSFS_NODE_DIR "node%u/cpulist",node);
+        FILE *f=fopen(fileName,"r");
+        if(f==0)
+            continue; // Node ids don't have to be contiguous
+
+        char cpuList[4096];
+        if(fgets(cpuList,sizeof(cpuList),f)!=0)
+        {
+            std::vector<uint32_t> cores=parseCpuList(cpuList);
+            if(!cores.empty()) // Nodes without CPUs (memory only) can't run workers
+                nodeCores.push_back(cores);
+        }
+        fclose(f);
+    }
+#endif
+
+    if(nodeCores.empty())
+    {
+        nodeCores.push_back(std::vector<uint32_t>());
+        uint32_t coreCount=__max(1u,std::thread::hardware_concurrency());
+        for(uint32_t core=0;core<coreCount;core++)
+            nodeCores[0].push_back(core);
+    }
+}
+
+uint32_t CNNNumaTopology::getNodeCount()
+{
+    return nodeCores.size();
+}
+
+uint32_t CNNNumaTopology::getCoreCount()
+{
+    uint32_t coreCount=0;
+    for(uint32_t node=0;node<nodeCores.size();node++)
+        coreCount+=nodeCores[node].size();
+    return coreCount;
+}
+
+std::vector<uint32_t> CNNNumaTopology::parseCpuList(const char *cpuList)
+{
+    std::vector<uint32_t> cores;
+    const char *position=cpuList;
+    while(*position>='0'&&*position<='9')
+    {
+        char *end;
+        uint32_t first=(uint32_t)strtoul(position,&end,10);
+        uint32_t last=first;
+        if(*end=='-')
+            last=(uint32_t)strtoul(end+1,&end,10);
+        for(uint32_t core=first;core<=last;core++)
+            cores.push_back(core);
+        if(*end!=',')
+            break;
+        position=end+1;
+    }
+    return cores;
+}
+
+bool CNNNumaTopology::pinCurrentThreadToCore(uint32_t core)
+{
+#ifdef __linux__
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(core,&cpuSet);
+    return pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&cpuSet)==0;
+#else
+    (void)core;
+    return false;
+#endif
+}
+
+uint32_t CNNNumaTopology::getPageSize()
+{
+#ifdef __linux__
+    return (uint32_t)sysconf(_SC_PAGESIZE);
+#else
+    return 4096;
+#endif
+}
+
+bool CNNNumaTopology::moveToNode(std::vector<void*> &addresses, uint32_t node)
+{
+#if defined(__linux__)&&defined(SYS_move_pages)
+    if(addresses.empty())
+        return true;
+
+    // One entry per page
+    uintptr_t pageMask=~((uintptr_t)getPageSize()-1);
+    std::vector<void*> pages;
+    pages.reserve(addresses.size());
+    for(uint32_t address=0;address<addresses.size();address++)
+        pages.push_back((void*)(((uintptr_t)addresses[address])&pageMask));
+    std::sort(pages.begin(),pages.end());
+    pages.erase(std::unique(pages.begin(),pages.end()),pages.end());
+
+    std::vector<int> nodes(pages.size(),(int)node);
+    std::vector<int> status(pages.size(),0);
+    // move_pages(pid 0 = this process, ..., MPOL_MF_MOVE=2: only pages used by this process only); called directly to avoid depending on libnuma
+    long result=syscall(SYS_move_pages,0,(unsigned long)pages.size(),&pages[0],&nodes[0],&status[0],2);
+    return result==0;
+#else
+    (void)addresses;
+    (void)node;
+    return false;
+#endif
+}
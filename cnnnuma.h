@@ -0,0 +1,47 @@
+#ifndef CNNNUMA_H
+#define CNNNUMA_H
+
+#define CNN_NUMA_SYSFS_NODE_DIR "/sys/devices/system/node/"
+#define CNN_NUMA_MAX_NODES 64
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "../_DefaultLibrary/text.h"
+
+// NUMA topology of the machine: which cores belong to which memory node.
+// Read from sysfs on Linux; elsewhere (or if sysfs is not available) all cores are treated as one node.
+// Memory is placed with the kernel's default first-touch policy: a page ends up on the node of the thread that writes it first,
+// so data that a pinned thread allocates and initializes itself is local to it. Existing data can be migrated with moveToNode.
+
+class CNNNumaTopology
+{
+public:
+    std::vector<std::vector<uint32_t> > nodeCores; // Dimensions: node -> cores (logical CPUs) of the node
+
+    CNNNumaTopology();
+
+    uint32_t getNodeCount();
+    uint32_t getCoreCount();
+
+    // Parses a sysfs CPU list such as "0-3,8-11"
+    static std::vector<uint32_t> parseCpuList(const char *cpuList);
+
+    static bool pinCurrentThreadToCore(uint32_t core);
+    static uint32_t getPageSize();
+    // Migrates the pages containing the given addresses to a node (Linux only; returns false if not supported or not all pages could be moved)
+    static bool moveToNode(std::vector<void*> &addresses,uint32_t node);
+};
+
+#endif // CNNNUMA_H
@@ -0,0 +1,198 @@
+#include "cnnoptimizer.h"
+
+#ifdef CNN_OPTIMIZER_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+CNNOptimizer::CNNOptimizer(uint8_t _type, double _learningRate, double _momentum, double _weightDecay)
+{
+    if(_type<1||_type>CNN_OPTIMIZER_TYPE_COUNT)
+        throw;
+
+    type=_type;
+    learningRate=_learningRate;
+    momentum=_momentum;
+    weightDecay=_weightDecay;
+    beta1=CNN_OPTIMIZER_DEFAULT_BETA1;
+    beta2=CNN_OPTIMIZER_DEFAULT_BETA2;
+    rmsPropDecay=CNN_OPTIMIZER_DEFAULT_RMSPROP_DECAY;
+    epsilon=CNN_OPTIMIZER_DEFAULT_EPSILON;
+
+    stepCount=0;
+    firstMomentCorrection=1.0;
+    secondMomentCorrection=1.0;
+}
+
+const char *CNNOptimizer::getTypeName(uint8_t _type)
+{
+    if(_type==CNN_OPTIMIZER_TYPE_SGD_MOMENTUM)
+        return "SGD + momentum";
+    else if(_type==CNN_OPTIMIZER_TYPE_NESTEROV)
+        return "Nesterov";
+    else if(_type==CNN_OPTIMIZER_TYPE_ADAM)
+        return "Adam";
+    else if(_type==CNN_OPTIMIZER_TYPE_ADAMW)
+        return "AdamW";
+    else if(_type==CNN_OPTIMIZER_TYPE_RMSPROP)
+        return "RMSprop";
+    return "unknown";
+}
+
+void CNNOptimizer::beginStep()
+{
+    stepCount++;
+
+    // Adam's moments are initialized with 0 and therefore biased towards 0 during the first steps; the corrections undo this.
+    firstMomentCorrection=1.0/(1.0-pow(beta1,(double)stepCount));
+    secondMomentCorrection=1.0/(1.0-pow(beta2,(double)stepCount));
+}
+
+void CNNOptimizer::update(double *parameters, double *diffs, double *state1, double *state2, uint32_t count)
+{
+    if(type==CNN_OPTIMIZER_TYPE_SGD_MOMENTUM)
+        updateSgdMomentum(parameters,diffs,state1,count);
+    else if(type==CNN_OPTIMIZER_TYPE_NESTEROV)
+        updateNesterov(parameters,diffs,state1,count);
+    else if(type==CNN_OPTIMIZER_TYPE_ADAM)
+        updateAdam(parameters,diffs,state1,state2,count,false);
+    else if(type==CNN_OPTIMIZER_TYPE_ADAMW)
+        updateAdam(parameters,diffs,state1,state2,count,true);
+    else if(type==CNN_OPTIMIZER_TYPE_RMSPROP)
+        updateRmsProp(parameters,diffs,state2,count);
+    else
+        throw;
+}
+
+void CNNOptimizer::updateSgdMomentum(double *parameters, double *diffs, double *state1, uint32_t count)
+{
+    // thisDelta=(1.0-momentum)*-learningRate*weightDiff+momentum*previousDelta-weightDecay*currentWeight
+    double diffFactor=(1.0-momentum)*-learningRate;
+    uint32_t i=0;
+
+#ifdef CNN_OPTIMIZER_USE_SSE2
+    __m128d diffFactorVector=_mm_set1_pd(diffFactor);
+    __m128d momentumVector=_mm_set1_pd(momentum);
+    __m128d weightDecayVector=_mm_set1_pd(weightDecay);
+    for(;i+2<=count;i+=2)
+    {
+        __m128d weight=_mm_loadu_pd(parameters+i);
+        __m128d delta=_mm_sub_pd(_mm_add_pd(_mm_mul_pd(diffFactorVector,_mm_loadu_pd(diffs+i)),_mm_mul_pd(momentumVector,_mm_loadu_pd(state1+i))),_mm_mul_pd(weightDecayVector,weight));
+        _mm_storeu_pd(parameters+i,_mm_add_pd(weight,delta));
+        _mm_storeu_pd(state1+i,delta);
+    }
+#endif
+
+    for(;i<count;i++)
+    {
+        double delta=diffFactor*diffs[i]+momentum*state1[i]-weightDecay*parameters[i];
+        parameters[i]+=delta;
+        state1[i]=delta;
+    }
+}
+
+void CNNOptimizer::updateNesterov(double *parameters, double *diffs, double *state1, uint32_t count)
+{
+    // velocity=momentum*velocity+diff; weight-=learningRate*(diff+momentum*velocity)
+    uint32_t i=0;
+
+#ifdef CNN_OPTIMIZER_USE_SSE2
+    __m128d learningRateVector=_mm_set1_pd(learningRate);
+    __m128d momentumVector=_mm_set1_pd(momentum);
+    __m128d weightDecayVector=_mm_set1_pd(weightDecay);
+    for(;i+2<=count;i+=2)
+    {
+        __m128d weight=_mm_loadu_pd(parameters+i);
+        __m128d diff=_mm_add_pd(_mm_loadu_pd(diffs+i),_mm_mul_pd(weightDecayVector,weight));
+        __m128d velocity=_mm_add_pd(_mm_mul_pd(momentumVector,_mm_loadu_pd(state1+i)),diff);
+        __m128d step=_mm_add_pd(diff,_mm_mul_pd(momentumVector,velocity));
+        _mm_storeu_pd(parameters+i,_mm_sub_pd(weight,_mm_mul_pd(learningRateVector,step)));
+        _mm_storeu_pd(state1+i,velocity);
+    }
+#endif
+
+    for(;i<count;i++)
+    {
+        double diff=diffs[i]+weightDecay*parameters[i];
+        double velocity=momentum*state1[i]+diff;
+        parameters[i]-=learningRate*(diff+momentum*velocity);
+        state1[i]=velocity;
+    }
+}
+
+void CNNOptimizer::updateAdam(double *parameters, double *diffs, double *state1, double *state2, uint32_t count, bool decoupledWeightDecay)
+{
+    // firstMoment=beta1*firstMoment+(1-beta1)*diff; secondMoment=beta2*secondMoment+(1-beta2)*diff^2
+    // weight-=learningRate*(firstMoment*firstMomentCorrection)/(sqrt(secondMoment*secondMomentCorrection)+epsilon)
+    // Adam adds the weight decay to the diff, AdamW subtracts learningRate*weightDecay*weight from the weight directly.
+    double l2WeightDecay=decoupledWeightDecay?0.0:weightDecay;
+    double decoupledWeightDecayFactor=decoupledWeightDecay?learningRate*weightDecay:0.0;
+    uint32_t i=0;
+
+#ifdef CNN_OPTIMIZER_USE_SSE2
+    __m128d learningRateVector=_mm_set1_pd(learningRate);
+    __m128d l2WeightDecayVector=_mm_set1_pd(l2WeightDecay);
+    __m128d decoupledWeightDecayFactorVector=_mm_set1_pd(decoupledWeightDecayFactor);
+    __m128d beta1Vector=_mm_set1_pd(beta1);
+    __m128d beta2Vector=_mm_set1_pd(beta2);
+    __m128d oneMinusBeta1Vector=_mm_set1_pd(1.0-beta1);
+    __m128d oneMinusBeta2Vector=_mm_set1_pd(1.0-beta2);
+    __m128d firstMomentCorrectionVector=_mm_set1_pd(firstMomentCorrection);
+    __m128d secondMomentCorrectionVector=_mm_set1_pd(secondMomentCorrection);
+    __m128d epsilonVector=_mm_set1_pd(epsilon);
+    for(;i+2<=count;i+=2)
+    {
+        __m128d weight=_mm_loadu_pd(parameters+i);
+        __m128d diff=_mm_add_pd(_mm_loadu_pd(diffs+i),_mm_mul_pd(l2WeightDecayVector,weight));
+        __m128d firstMoment=_mm_add_pd(_mm_mul_pd(beta1Vector,_mm_loadu_pd(state1+i)),_mm_mul_pd(oneMinusBeta1Vector,diff));
+        __m128d secondMoment=_mm_add_pd(_mm_mul_pd(beta2Vector,_mm_loadu_pd(state2+i)),_mm_mul_pd(oneMinusBeta2Vector,_mm_mul_pd(diff,diff)));
+        __m128d step=_mm_div_pd(_mm_mul_pd(firstMoment,firstMomentCorrectionVector),_mm_add_pd(_mm_sqrt_pd(_mm_mul_pd(secondMoment,secondMomentCorrectionVector)),epsilonVector));
+        weight=_mm_sub_pd(weight,_mm_add_pd(_mm_mul_pd(learningRateVector,step),_mm_mul_pd(decoupledWeightDecayFactorVector,weight)));
+        _mm_storeu_pd(parameters+i,weight);
+        _mm_storeu_pd(state1+i,firstMoment);
+        _mm_storeu_pd(state2+i,secondMoment);
+    }
+#endif
+
+    for(;i<count;i++)
+    {
+        double weight=parameters[i];
+        double diff=diffs[i]+l2WeightDecay*weight;
+        double firstMoment=beta1*state1[i]+(1.0-beta1)*diff;
+        double secondMoment=beta2*state2[i]+(1.0-beta2)*(diff*diff);
+        double step=(firstMoment*firstMomentCorrection)/(sqrt(secondMoment*secondMomentCorrection)+epsilon);
+        parameters[i]=weight-(learningRate*step+decoupledWeightDecayFactor*weight);
+        state1[i]=firstMoment;
+        state2[i]=secondMoment;
+    }
+}
+
+void CNNOptimizer::updateRmsProp(double *parameters, double *diffs, double *state2, uint32_t count)
+{
+    // meanSquare=rmsPropDecay*meanSquare+(1-rmsPropDecay)*diff^2; weight-=learningRate*diff/(sqrt(meanSquare)+epsilon)
+    uint32_t i=0;
+
+#ifdef CNN_OPTIMIZER_USE_SSE2
+    __m128d learningRateVector=_mm_set1_pd(learningRate);
+    __m128d weightDecayVector=_mm_set1_pd(weightDecay);
+    __m128d decayVector=_mm_set1_pd(rmsPropDecay);
+    __m128d oneMinusDecayVector=_mm_set1_pd(1.0-rmsPropDecay);
+    __m128d epsilonVector=_mm_set1_pd(epsilon);
+    for(;i+2<=count;i+=2)
+    {
+        __m128d weight=_mm_loadu_pd(parameters+i);
+        __m128d diff=_mm_add_pd(_mm_loadu_pd(diffs+i),_mm_mul_pd(weightDecayVector,weight));
+        __m128d meanSquare=_mm_add_pd(_mm_mul_pd(decayVector,_mm_loadu_pd(state2+i)),_mm_mul_pd(oneMinusDecayVector,_mm_mul_pd(diff,diff)));
+        __m128d step=_mm_div_pd(diff,_mm_add_pd(_mm_sqrt_pd(meanSquare),epsilonVector));
+        _mm_storeu_pd(parameters+i,_mm_sub_pd(weight,_mm_mul_pd(learningRateVector,step)));
+        _mm_storeu_pd(state2+i,meanSquare);
+    }
+#endif
+
+    for(;i<count;i++)
+    {
+        double diff=diffs[i]+weightDecay*parameters[i];
+        double meanSquare=rmsPropDecay*state2[i]+(1.0-rmsPropDecay)*(diff*diff);
+        parameters[i]-=learningRate*diff/(sqrt(meanSquare)+epsilon);
+        state2[i]=meanSquare;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CNNOPTIMIZER_H
+#define CNNOPTIMIZER_H
+
+#define CNN_OPTIMIZER_TYPE_SGD_MOMENTUM 1 // SGD with dampened momentum and weight decay (the original update rule): delta=(1-momentum)*-learningRate*diff+momentum*previousDelta-weightDecay*weight
+#define CNN_OPTIMIZER_TYPE_NESTEROV 2 // SGD with Nesterov momentum; weight decay is added to the diffs (L2 regularization)
+#define CNN_OPTIMIZER_TYPE_ADAM 3 // Adam; weight decay is added to the diffs (L2 regularization)
+#define CNN_OPTIMIZER_TYPE_ADAMW 4 // Adam with decoupled weight decay
+#define CNN_OPTIMIZER_TYPE_RMSPROP 5 // RMSprop; weight decay is added to the diffs (L2 regularization)
+
+#define CNN_OPTIMIZER_TYPE_COUNT 5
+
+#define CNN_OPTIMIZER_DEFAULT_BETA1 0.9
+#define CNN_OPTIMIZER_DEFAULT_BETA2 0.999
+#define CNN_OPTIMIZER_DEFAULT_RMSPROP_DECAY 0.99
+#define CNN_OPTIMIZER_DEFAULT_EPSILON 1e-8
+
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+#define CNN_OPTIMIZER_USE_SSE2
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+// Applies the diffs calculated by CNNLayer::calculateDiffs to the parameters of a layer.
+// All parameters are processed as flat buffers in one fused pass per parameter tensor (weights and bias weights).
+// Every parameter tensor comes with two zero-initialized state buffers of the same size (see CNNLayer::weightOptimizerState1, etc.):
+// SGD/Nesterov: state1=previous delta/velocity; Adam/AdamW: state1=first moment, state2=second moment; RMSprop: state2=mean square.
+
+class CNNOptimizer
+{
+public:
+    uint8_t type;
+
+    double learningRate;
+    double momentum; // Only used by CNN_OPTIMIZER_TYPE_SGD_MOMENTUM and CNN_OPTIMIZER_TYPE_NESTEROV
+    double weightDecay;
+    double beta1; // Decay rate of the first moment (Adam/AdamW)
+    double beta2; // Decay rate of the second moment (Adam/AdamW)
+    double rmsPropDecay; // Decay rate of the mean square (RMSprop)
+    double epsilon;
+
+    uint64_t stepCount; // Amount of steps begun so far (needed for Adam's bias correction)
+
+    // Bias corrections of the current step (Adam/AdamW), calculated by beginStep
+    double firstMomentCorrection;
+    double secondMomentCorrection;
+
+    CNNOptimizer(uint8_t _type,double _learningRate,double _momentum,double _weightDecay);
+
+    static const char *getTypeName(uint8_t _type);
+
+    // Must be called once per training iteration, before the diffs of the first layer are applied.
+    void beginStep();
+    void update(double *parameters,double *diffs,double *state1,double *state2,uint32_t count);
+
+    void updateSgdMomentum(double *parameters,double *diffs,double *state1,uint32_t count);
+    void updateNesterov(double *parameters,double *diffs,double *state1,uint32_t count);
+    void updateAdam(double *parameters,double *diffs,double *state1,double *state2,uint32_t count,bool decoupledWeightDecay);
+    void updateRmsProp(double *parameters,double *diffs,double *state2,uint32_t count);
+};
+
+#endif // CNNOPTIMIZER_H
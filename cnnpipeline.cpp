@@ -0,0 +1,450 @@
+#include "cnnpipeline.h"
+
+CNNSpscQueue::CNNSpscQueue()
+{
+    head.store(0);
+    tail.store(0);
+}
+
+bool CNNSpscQueue::tryPush(const CNNPipelineMessage &message)
+{
+    uint32_t currentTail=tail.load(std::memory_order_relaxed);
+    if(currentTail-head.load(std::memory_order_acquire)==CNN_PIPELINE_QUEUE_CAPACITY)
+        return false; // Full
+    messages[currentTail&(CNN_PIPELINE_QUEUE_CAPACITY-1)]=message;
+    tail.store(currentTail+1,std::memory_order_release);
+    return true;
+}
+
+bool CNNSpscQueue::tryPop(CNNPipelineMessage &message)
+{
+    uint32_t currentHead=head.load(std::memory_order_relaxed);
+    if(currentHead==tail.load(std::memory_order_acquire))
+        return false; // Empty
+    message=messages[currentHead&(CNN_PIPELINE_QUEUE_CAPACITY-1)];
+    head.store(currentHead+1,std::memory_order_release);
+    return true;
+}
+
+void CNNSpscQueue::push(const CNNPipelineMessage &message)
+{
+    while(!tryPush(message))
+        std::this_thread::yield();
+}
+
+CNNPipeline::CNNPipeline(CNNLayer **_layers, uint32_t _layerCount, uint32_t _batchCapacity, uint32_t firstCore)
+{
+    if(!isValidConfiguration(_layerCount,_batchCapacity))
+        throw;
+
+    layers=_layers;
+    layerCount=_layerCount;
+    batchCapacity=_batchCapacity;
+
+    training=false;
+    exampleCount=0;
+    labels=0;
+    outputs=0;
+    losses=0;
+    optimizer=0;
+    finishedExampleCount.store(0);
+    finishedStageCount.store(0);
+
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        if(layerIndex==0||thisLayer->type==CNN_LAYER_TYPE_CONV||thisLayer->type==CNN_LAYER_TYPE_FC||thisLayer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            CNNPipelineStage *stage=new CNNPipelineStage();
+            stage->firstLayer=layerIndex;
+            stage->layerCount=0;
+            stages.push_back(stage);
+        }
+        stages.back()->layerCount++;
+    }
+
+    for(uint32_t stageIndex=0;stageIndex<stages.size();stageIndex++)
+    {
+        CNNPipelineStage *stage=stages[stageIndex];
+
+        stage->contexts=(CNNLayerContext**)malloc(batchCapacity*sizeof(CNNLayerContext*));
+        for(uint32_t example=0;example<batchCapacity;example++)
+            stage->contexts[example]=(CNNLayerContext*)calloc(stage->layerCount,sizeof(CNNLayerContext));
+
+        stage->weightDiffSums=(double*****)calloc(stage->layerCount,sizeof(double****));
+        stage->biasWeightDiffSums=(double**)calloc(stage->layerCount,sizeof(double*));
+        for(uint32_t layerInStage=0;layerInStage<stage->layerCount;layerInStage++)
+        {
+            CNNLayer *thisLayer=layers[stage->firstLayer+layerInStage];
+            if(thisLayer->hasWeights())
+            {
+                stage->weightDiffSums[layerInStage]=thisLayer->allocWeightDiffs();
+                stage->biasWeightDiffSums[layerInStage]=(double*)calloc(thisLayer->featureMapCount,sizeof(double));
+            }
+        }
+        stage->backwardCount=0;
+
+        stage->batchnormInputs=0;
+        stage->batchnormOutputDiffs=0;
+        stage->batchnormInputCount=0;
+        stage->batchnormOutputDiffCount=0;
+        stage->batchnormMeans=0;
+        stage->batchnormVariances=0;
+        stage->batchnormOutputDiffMeans=0;
+        stage->batchnormNormalizedOutputDiffMeans=0;
+        if(isBatchnormStage(stageIndex))
+        {
+            uint32_t featureMapCount=layers[stage->firstLayer]->featureMapCount;
+            stage->batchnormInputs=(double****)malloc(batchCapacity*sizeof(double***));
+            stage->batchnormOutputDiffs=(double****)malloc(batchCapacity*sizeof(double***));
+            stage->batchnormMeans=(double*)malloc(featureMapCount*sizeof(double));
+            stage->batchnormVariances=(double*)malloc(featureMapCount*sizeof(double));
+            stage->batchnormOutputDiffMeans=(double*)calloc(featureMapCount,sizeof(double));
+            stage->batchnormNormalizedOutputDiffMeans=(double*)calloc(featureMapCount,sizeof(double));
+        }
+    }
+
+    uint32_t coreCount=__max(1u,std::thread::hardware_concurrency());
+    for(uint32_t stageIndex=0;stageIndex<stages.size();stageIndex++)
+        stages[stageIndex]->thread=std::thread(&CNNPipeline::stageMain,this,stageIndex,(firstCore+stageIndex)%coreCount);
+}
+
+CNNPipeline::~CNNPipeline()
+{
+    CNNPipelineMessage message;
+    message.type=CNN_PIPELINE_MESSAGE_STOP;
+    message.example=0;
+    message.data=0;
+    for(uint32_t stageIndex=0;stageIndex<stages.size();stageIndex++)
+    {
+        stages[stageIndex]->forwardQueue.push(message);
+        stages[stageIndex]->thread.join();
+    }
+
+    for(uint32_t stageIndex=0;stageIndex<stages.size();stageIndex++)
+    {
+        CNNPipelineStage *stage=stages[stageIndex];
+        for(uint32_t example=0;example<batchCapacity;example++)
+            free(stage->contexts[example]); // The arrays of every context have been freed by its last pass
+        free(stage->contexts);
+
+        for(uint32_t layerInStage=0;layerInStage<stage->layerCount;layerInStage++)
+        {
+            CNNLayer *thisLayer=layers[stage->firstLayer+layerInStage];
+            if(thisLayer->hasWeights())
+                thisLayer->freeWeightDiffs(stage->weightDiffSums[layerInStage]);
+            free(stage->biasWeightDiffSums[layerInStage]);
+        }
+        free(stage->weightDiffSums);
+        free(stage->biasWeightDiffSums);
+
+        free(stage->batchnormInputs);
+        free(stage->batchnormOutputDiffs);
+        free(stage->batchnormMeans);
+        free(stage->batchnormVariances);
+        free(stage->batchnormOutputDiffMeans);
+        free(stage->batchnormNormalizedOutputDiffMeans);
+        delete stage;
+    }
+}
+
+void CNNPipeline::classify(double ****images, uint32_t imageCount, double ****_outputs)
+{
+    training=false;
+    labels=0;
+    optimizer=0;
+    outputs=_outputs;
+    losses=0;
+    run(images,imageCount);
+}
+
+void CNNPipeline::train(double ****images, uint8_t *_labels, uint32_t imageCount, CNNOptimizer *_optimizer, double ****_outputs, double *_losses)
+{
+    training=true;
+    labels=_labels;
+    optimizer=_optimizer;
+    outputs=_outputs;
+    losses=_losses;
+    run(images,imageCount);
+}
+
+bool CNNPipeline::isValidConfiguration(uint32_t _layerCount, uint32_t _batchCapacity)
+{
+    return _layerCount>0&&_batchCapacity>0&&_batchCapacity<=CNN_PIPELINE_QUEUE_CAPACITY;
+}
+
+void CNNPipeline::run(double ****images, uint32_t imageCount)
+{
+    if(imageCount==0)
+        return;
+    if(imageCount>batchCapacity)
+        throw;
+
+    exampleCount=imageCount;
+    finishedExampleCount.store(0,std::memory_order_relaxed);
+    finishedStageCount.store(0,std::memory_order_relaxed);
+
+    // The batch members written above become visible to the stages through the release of the queue
+    for(uint32_t example=0;example<imageCount;example++)
+    {
+        CNNPipelineMessage message;
+        message.type=CNN_PIPELINE_MESSAGE_FORWARD;
+        message.example=example;
+        message.data=images[example];
+        stages[0]->forwardQueue.push(message);
+    }
+
+    if(training)
+    {
+        while(finishedStageCount.load(std::memory_order_acquire)<stages.size())
+            std::this_thread::yield();
+    }
+    else
+    {
+        while(finishedExampleCount.load(std::memory_order_acquire)<imageCount)
+            std::this_thread::yield();
+    }
+}
+
+void CNNPipeline::stageMain(uint32_t stageIndex, uint32_t core)
+{
+    CNNNumaTopology::pinCurrentThreadToCore(core);
+
+    CNNPipelineStage *stage=stages[stageIndex];
+    uint32_t idleCount=0;
+
+    for(;;)
+    {
+        CNNPipelineMessage message;
+
+        // Backward messages first: they finish examples and free their contexts
+        if(stage->backwardQueue.tryPop(message))
+        {
+            backward(stageIndex,message.example,message.data);
+            idleCount=0;
+        }
+        else if(stage->forwardQueue.tryPop(message))
+        {
+            if(message.type==CNN_PIPELINE_MESSAGE_STOP)
+                return;
+            forward(stageIndex,message);
+            idleCount=0;
+        }
+        else if(++idleCount<1000)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100)); // Between batches (e.g. training was stopped)
+    }
+}
+
+bool CNNPipeline::isBatchnormStage(uint32_t stageIndex)
+{
+    return layers[stages[stageIndex]->firstLayer]->type==CNN_LAYER_TYPE_BATCHNORM;
+}
+
+void CNNPipeline::forward(uint32_t stageIndex, CNNPipelineMessage &message)
+{
+    if(!training||!isBatchnormStage(stageIndex))
+    {
+        forwardExample(stageIndex,message);
+        return;
+    }
+
+    // The statistics of the batch depend on the inputs of all examples
+    CNNPipelineStage *stage=stages[stageIndex];
+    stage->batchnormInputs[message.example]=message.data;
+    stage->batchnormInputCount++;
+    if(stage->batchnormInputCount<exampleCount)
+        return;
+    stage->batchnormInputCount=0;
+
+    CNNLayer *batchnormLayer=layers[stage->firstLayer];
+    batchnormLayer->calculateBatchnormBatchStatistics(stage->batchnormInputs,exampleCount,stage->batchnormMeans,stage->batchnormVariances);
+    batchnormLayer->updateBatchnormRunningStatistics(stage->batchnormMeans,stage->batchnormVariances,exampleCount);
+
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        CNNPipelineMessage exampleMessage;
+        exampleMessage.type=CNN_PIPELINE_MESSAGE_FORWARD;
+        exampleMessage.example=example;
+        exampleMessage.data=stage->batchnormInputs[example];
+        forwardExample(stageIndex,exampleMessage);
+    }
+}
+
+void CNNPipeline::forwardExample(uint32_t stageIndex, CNNPipelineMessage &message)
+{
+    CNNPipelineStage *stage=stages[stageIndex];
+    double ***previousLayerOutput=message.data;
+
+    for(uint32_t layerInStage=0;layerInStage<stage->layerCount;layerInStage++)
+    {
+        CNNLayer *thisLayer=layers[stage->firstLayer+layerInStage];
+        CNNLayerContext &context=stage->contexts[message.example][layerInStage];
+        context.training=training;
+        if(layerInStage==0&&training&&isBatchnormStage(stageIndex))
+        {
+            context.batchMeans=stage->batchnormMeans;
+            context.batchVariances=stage->batchnormVariances;
+            context.batchOutputDiffMeans=stage->batchnormOutputDiffMeans;
+            context.batchNormalizedOutputDiffMeans=stage->batchnormNormalizedOutputDiffMeans;
+        }
+        double ***output=thisLayer->forwardPass(previousLayerOutput,context);
+
+        // The input of the first stage belongs to the caller
+        if(layerInStage>0||stageIndex>0)
+            CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+        previousLayerOutput=output;
+
+        // The backward pass frees the context when training
+        if(!training)
+            thisLayer->freeContext(context);
+    }
+
+    if(stageIndex<stages.size()-1)
+    {
+        message.data=previousLayerOutput;
+        stages[stageIndex+1]->forwardQueue.push(message);
+        return;
+    }
+
+    // Counted before the backward pass: its last example can let train return, and a later increment would count towards the next batch.
+    // The increment can let classify return, so "training" is read before it
+    outputs[message.example]=previousLayerOutput;
+    bool batchTraining=training;
+    finishedExampleCount.fetch_add(1,std::memory_order_release);
+    if(batchTraining)
+        backward(stageIndex,message.example,0); // The last stage doesn't have to wait for anything
+}
+
+void CNNPipeline::backward(uint32_t stageIndex, uint32_t example, double ***outputDiffs)
+{
+    CNNPipelineStage *stage=stages[stageIndex];
+    if(!isBatchnormStage(stageIndex))
+    {
+        finishBackward(stageIndex,example,backwardLayers(stageIndex,example,outputDiffs,0,stage->layerCount-1));
+        return;
+    }
+
+    // The input diffs of the BATCHNORM layer depend on the output diffs of all examples (through the statistics of the batch)
+    CNNLayer *batchnormLayer=layers[stage->firstLayer];
+    double ***batchnormOutputDiffs=stage->layerCount>1?backwardLayers(stageIndex,example,outputDiffs,1,stage->layerCount-1):outputDiffs;
+    batchnormLayer->addBatchnormDiffSums(batchnormOutputDiffs,stage->contexts[example][0],stage->batchnormOutputDiffMeans,stage->batchnormNormalizedOutputDiffMeans);
+    stage->batchnormOutputDiffs[example]=batchnormOutputDiffs;
+    stage->batchnormOutputDiffCount++;
+    if(stage->batchnormOutputDiffCount<exampleCount)
+        return;
+    stage->batchnormOutputDiffCount=0;
+
+    double valueCount=(double)exampleCount*batchnormLayer->singleFeatureMapWidth*batchnormLayer->singleFeatureMapHeight;
+    for(uint32_t featureMap=0;featureMap<batchnormLayer->featureMapCount;featureMap++)
+    {
+        stage->batchnormOutputDiffMeans[featureMap]/=valueCount;
+        stage->batchnormNormalizedOutputDiffMeans[featureMap]/=valueCount;
+    }
+
+    // The last finishBackward can let train return and the caller start the next batch, so nothing of the batch may be touched after it
+    uint32_t batchExampleCount=exampleCount;
+    for(uint32_t batchExample=0;batchExample<batchExampleCount;batchExample++)
+    {
+        double ***inputDiffs=backwardLayers(stageIndex,batchExample,stage->batchnormOutputDiffs[batchExample],0,0);
+        if(batchExample==batchExampleCount-1)
+        {
+            memset(stage->batchnormOutputDiffMeans,0,batchnormLayer->featureMapCount*sizeof(double));
+            memset(stage->batchnormNormalizedOutputDiffMeans,0,batchnormLayer->featureMapCount*sizeof(double));
+        }
+        finishBackward(stageIndex,batchExample,inputDiffs);
+    }
+}
+
+double ***CNNPipeline::backwardLayers(uint32_t stageIndex, uint32_t example, double ***outputDiffs, uint32_t firstLayerInStage, uint32_t lastLayerInStage)
+{
+    CNNPipelineStage *stage=stages[stageIndex];
+    double ***higherLayerInputDiffs=outputDiffs;
+
+    for(uint32_t _layerInStage=lastLayerInStage+1;_layerInStage>firstLayerInStage;_layerInStage--)
+    {
+        uint32_t layerInStage=_layerInStage-1;
+        CNNLayer *thisLayer=layers[stage->firstLayer+layerInStage];
+        CNNLayerContext &context=stage->contexts[example][layerInStage];
+
+        double ***inputDiffs=0;
+        double ****weightDiffs=0;
+        double *biasDiffs=0;
+        thisLayer->calculateDiffs(weightDiffs,biasDiffs,higherLayerInputDiffs,inputDiffs,labels[example],context);
+        if(thisLayer->type==CNN_LAYER_TYPE_SOFTMAX)
+            losses[example]=context.loss;
+        thisLayer->freeContext(context);
+
+        // Accumulate (in example order, since the queues are FIFO and the BATCHNORM stages go through their buffers in order)
+        if(weightDiffs!=0)
+        {
+            double *weightDiffSumData=CNNLayer::getWeightTypeArrayData(stage->weightDiffSums[layerInStage]);
+            double *weightDiffData=CNNLayer::getWeightTypeArrayData(weightDiffs);
+            for(uint32_t weight=0;weight<thisLayer->weightCount;weight++)
+                weightDiffSumData[weight]+=weightDiffData[weight];
+            for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+                stage->biasWeightDiffSums[layerInStage][featureMap]+=biasDiffs[featureMap];
+
+            thisLayer->freeWeightDiffs(weightDiffs);
+            CNNLayer::freeBiasTypeArray(biasDiffs);
+        }
+
+        if(higherLayerInputDiffs!=0)
+            CNNLayer::freeArray(higherLayerInputDiffs,thisLayer->featureMapCount,thisLayer->singleFeatureMapHeight);
+        higherLayerInputDiffs=inputDiffs;
+    }
+
+    return higherLayerInputDiffs;
+}
+
+void CNNPipeline::finishBackward(uint32_t stageIndex, uint32_t example, double ***inputDiffs)
+{
+    CNNPipelineStage *stage=stages[stageIndex];
+
+    if(stageIndex>0)
+    {
+        CNNPipelineMessage message;
+        message.type=CNN_PIPELINE_MESSAGE_BACKWARD;
+        message.example=example;
+        message.data=inputDiffs;
+        stages[stageIndex-1]->backwardQueue.push(message);
+    }
+    else
+        CNNLayer::freeArray(inputDiffs,layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+
+    stage->backwardCount++;
+    if(stage->backwardCount==exampleCount)
+    {
+        applyDiffs(stageIndex);
+        stage->backwardCount=0;
+        finishedStageCount.fetch_add(1,std::memory_order_release);
+    }
+}
+
+void CNNPipeline::applyDiffs(uint32_t stageIndex)
+{
+    CNNPipelineStage *stage=stages[stageIndex];
+    double scale=1.0/exampleCount;
+
+    for(uint32_t layerInStage=0;layerInStage<stage->layerCount;layerInStage++)
+    {
+        if(stage->weightDiffSums[layerInStage]==0)
+            continue;
+
+        CNNLayer *thisLayer=layers[stage->firstLayer+layerInStage];
+        double *weightDiffSumData=CNNLayer::getWeightTypeArrayData(stage->weightDiffSums[layerInStage]);
+        double *biasWeightDiffSums=stage->biasWeightDiffSums[layerInStage];
+
+        // Average over the batch
+        for(uint32_t weight=0;weight<thisLayer->weightCount;weight++)
+            weightDiffSumData[weight]*=scale;
+        for(uint32_t featureMap=0;featureMap<thisLayer->featureMapCount;featureMap++)
+            biasWeightDiffSums[featureMap]*=scale;
+
+        thisLayer->applyDiffs(stage->weightDiffSums[layerInStage],biasWeightDiffSums,optimizer);
+
+        memset(weightDiffSumData,0,thisLayer->weightCount*sizeof(double));
+        memset(biasWeightDiffSums,0,thisLayer->featureMapCount*sizeof(double));
+    }
+}
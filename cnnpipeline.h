@@ -0,0 +1,126 @@
+#ifndef CNNPIPELINE_H
+#define CNNPIPELINE_H
+
+#define CNN_PIPELINE_MESSAGE_FORWARD 1 // data: input of the stage's first layer
+#define CNN_PIPELINE_MESSAGE_BACKWARD 2 // data: diffs of the output of the stage's last layer
+#define CNN_PIPELINE_MESSAGE_STOP 3
+
+#define CNN_PIPELINE_QUEUE_CAPACITY 256 // Must be a power of 2
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnnnuma.h"
+
+struct CNNPipelineMessage
+{
+    uint8_t type;
+    uint32_t example; // Index of the example in the current batch
+    double ***data;
+};
+
+// Lock-free ring buffer for exactly one producer thread and one consumer thread.
+// The producer only writes "tail", the consumer only writes "head"; the acquire/release pairs make the message visible before the index.
+class CNNSpscQueue
+{
+public:
+    CNNPipelineMessage messages[CNN_PIPELINE_QUEUE_CAPACITY];
+    std::atomic<uint32_t> head; // Next message to be read
+    std::atomic<uint32_t> tail; // Next free slot
+
+    CNNSpscQueue();
+
+    bool tryPush(const CNNPipelineMessage &message);
+    bool tryPop(CNNPipelineMessage &message);
+    void push(const CNNPipelineMessage &message); // Spins while the queue is full
+};
+
+// A group of consecutive layers that runs on its own thread
+struct CNNPipelineStage
+{
+    uint32_t firstLayer;
+    uint32_t layerCount;
+    CNNSpscQueue forwardQueue; // From the previous stage (or the caller for the first stage)
+    CNNSpscQueue backwardQueue; // From the next stage
+    std::thread thread;
+
+    CNNLayerContext **contexts; // Dimensions: example -> layer in stage; the context of the forward and backward pass of each example
+    // Training only:
+    double *****weightDiffSums; // Dimensions: layer in stage -> weight type array (0 for layers without weights)
+    double **biasWeightDiffSums;
+    uint32_t backwardCount; // Examples of the current batch whose backward pass is complete
+
+    // Stages that start with a BATCHNORM layer, training only: the layer normalizes with the statistics of the whole batch, so the stage buffers
+    // the inputs of the examples until all of them have arrived (and the output diffs of its first layer during the backward pass).
+    double ****batchnormInputs; // Dimensions: example (0 for other stages)
+    double ****batchnormOutputDiffs; // Dimensions: example
+    uint32_t batchnormInputCount;
+    uint32_t batchnormOutputDiffCount;
+    double *batchnormMeans; // Dimensions: feature map (see CNNLayerContext::batchMeans)
+    double *batchnormVariances;
+    double *batchnormOutputDiffMeans; // Sums until the output diffs of all examples have arrived
+    double *batchnormNormalizedOutputDiffMeans;
+};
+
+// Pipeline-parallel execution of a network: consecutive groups of layers (stages) run on different threads, and examples stream through them.
+// While stage 2 processes example 1, stage 1 already processes example 2, and so on.
+// Training follows GPipe: all examples of a batch (each example is a micro-batch, since the layers process one example per call) run forward,
+// their backward passes follow, and the diffs are accumulated per stage; after the last backward pass each stage applies the average diffs to
+// its own layers. The weights therefore don't change within a batch, and the result is the same as training on the batch on one thread.
+// BATCHNORM layers normalize with the statistics of the whole batch and update their running statistics once per batch; every BATCHNORM
+// layer starts a stage, which waits for all examples of the batch in both passes.
+
+class CNNPipeline
+{
+public:
+    CNNLayer **layers;
+    uint32_t layerCount;
+    uint32_t batchCapacity; // Maximum amount of examples per call
+    std::vector<CNNPipelineStage*> stages;
+
+    // Current batch (written before the first message is sent)
+    bool training;
+    uint32_t exampleCount;
+    uint8_t *labels;
+    double ****outputs;
+    double *losses; // Dimensions: example; written by the backward pass of the SOFTMAX layer (training only)
+    CNNOptimizer *optimizer;
+    std::atomic<uint32_t> finishedExampleCount; // Examples that left the last stage (forward pass)
+    std::atomic<uint32_t> finishedStageCount; // Stages that have applied their diffs (training)
+
+    // Starts a new stage at each CONV, each FC and each BATCHNORM layer (for the demo network: conv1, batchnorm1 block, conv2,
+    // batchnorm2 block, conv3, batchnorm3 block with dropout, FC+softmax).
+    // Stage i is pinned to core (firstCore+i) modulo the amount of cores (Linux only).
+    // The configuration must be valid (see isValidConfiguration)
+    CNNPipeline(CNNLayer **_layers,uint32_t _layerCount,uint32_t _batchCapacity,uint32_t firstCore);
+    // A batch must fit into the queues, otherwise two neighbouring stages could block each other (one pushing forward messages, the other pushing backward messages)
+    static bool isValidConfiguration(uint32_t _layerCount,uint32_t _batchCapacity);
+    ~CNNPipeline();
+
+    // outputs[example] receives a copy of the output of the last layer (to be freed by the caller)
+    void classify(double ****images,uint32_t imageCount,double ****_outputs);
+    // One training step on a batch; optimizer->beginStep() must have been called.
+    // _losses[example] receives the cross-entropy loss of the example (see CNNLayer::loss) if the last layer is a SOFTMAX layer.
+    void train(double ****images,uint8_t *_labels,uint32_t imageCount,CNNOptimizer *_optimizer,double ****_outputs,double *_losses);
+
+    void run(double ****images,uint32_t imageCount);
+    void stageMain(uint32_t stageIndex,uint32_t core);
+    // Buffers the examples of a BATCHNORM stage (training) until the batch is complete, then runs forwardExample for each of them
+    void forward(uint32_t stageIndex,CNNPipelineMessage &message);
+    void forwardExample(uint32_t stageIndex,CNNPipelineMessage &message);
+    // Buffers the output diffs of the BATCHNORM layer of a BATCHNORM stage until the batch is complete, then runs its backward pass for each example
+    void backward(uint32_t stageIndex,uint32_t example,double ***outputDiffs);
+    // Backward passes of the layers in stage from lastLayerInStage down to firstLayerInStage; returns the input diffs of firstLayerInStage
+    double ***backwardLayers(uint32_t stageIndex,uint32_t example,double ***outputDiffs,uint32_t firstLayerInStage,uint32_t lastLayerInStage);
+    // Passes the input diffs of the stage on to the previous one and applies the diffs after the last example
+    void finishBackward(uint32_t stageIndex,uint32_t example,double ***inputDiffs);
+    bool isBatchnormStage(uint32_t stageIndex);
+    void applyDiffs(uint32_t stageIndex);
+};
+
+#endif // CNNPIPELINE_H
@@ -0,0 +1,386 @@
+#include "cnnquantizedmodel.h"
+
+#if defined(CNN_QUANTIZED_USE_AVX512_VNNI)||defined(CNN_QUANTIZED_USE_AVX2)
+#include <immintrin.h>
+#endif
+
+CNNQuantizedModel::CNNQuantizedModel(CNNLayer **_layers, uint32_t _layerCount, double ****calibrationImages, uint32_t calibrationImageCount)
+{
+    if(_layerCount==0||calibrationImageCount==0)
+        throw;
+
+    inputFeatureMapCount=_layers[0]->previousLayerFeatureMapCount;
+    inputSingleFeatureMapWidth=_layers[0]->previousLayerSingleFeatureMapWidth;
+    inputSingleFeatureMapHeight=_layers[0]->previousLayerSingleFeatureMapHeight;
+    classCount=_layers[_layerCount-1]->featureMapCount;
+
+    // Calibration: find the largest activation of the input and of the output of each layer
+
+    double inputMax=0.0;
+    std::vector<double> outputMax(_layerCount,0.0);
+
+    for(uint32_t image=0;image<calibrationImageCount;image++)
+    {
+        double ***previousLayerOutput=calibrationImages[image];
+        inputMax=__max(inputMax,getMaxAbsValue(previousLayerOutput,inputFeatureMapCount,inputSingleFeatureMapHeight,inputSingleFeatureMapWidth));
+
+        for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+        {
+            CNNLayer *thisLayer=_layers[layerIndex];
+            double ***output=thisLayer->forwardPass(previousLayerOutput);
+            outputMax[layerIndex]=__max(outputMax[layerIndex],getMaxAbsValue(output,thisLayer->featureMapCount,thisLayer->singleFeatureMapHeight,thisLayer->singleFeatureMapWidth));
+
+            if(layerIndex>0)
+                CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+            previousLayerOutput=output;
+        }
+        CNNLayer::freeArray(previousLayerOutput,_layers[_layerCount-1]->featureMapCount,_layers[_layerCount-1]->singleFeatureMapHeight);
+    }
+
+    // Build the quantized layers
+
+    double scale=inputMax>0.0?inputMax/255.0:1.0/255.0;
+    uint32_t largestActivationSize=inputFeatureMapCount*inputSingleFeatureMapWidth*inputSingleFeatureMapHeight;
+    uint32_t largestPaddedReductionSize=0;
+
+    for(uint32_t layerIndex=0;layerIndex<_layerCount;)
+    {
+        CNNLayer *thisLayer=_layers[layerIndex];
+
+        CNNQuantizedLayer layer;
+        layer.featureMapCount=thisLayer->featureMapCount;
+        layer.singleFeatureMapWidth=thisLayer->singleFeatureMapWidth;
+        layer.singleFeatureMapHeight=thisLayer->singleFeatureMapHeight;
+        layer.receptiveFieldWidth=thisLayer->receptiveFieldWidth;
+        layer.receptiveFieldHeight=thisLayer->receptiveFieldHeight;
+        layer.strideX=thisLayer->strideX;
+        layer.strideY=thisLayer->strideY;
+        layer.zeroPaddingX=thisLayer->zeroPaddingX;
+        layer.zeroPaddingY=thisLayer->zeroPaddingY;
+        layer.previousLayerFeatureMapCount=thisLayer->previousLayerFeatureMapCount;
+        layer.previousLayerSingleFeatureMapWidth=thisLayer->previousLayerSingleFeatureMapWidth;
+        layer.previousLayerSingleFeatureMapHeight=thisLayer->previousLayerSingleFeatureMapHeight;
+        layer.inputScale=scale;
+        layer.outputScale=scale;
+        layer.reductionSize=0;
+        layer.paddedReductionSize=0;
+        layer.weights=0;
+        layer.weightScales=0;
+        layer.outputMultipliers=0;
+        layer.biases=0;
+
+        if(thisLayer->type==CNN_LAYER_TYPE_CONV||thisLayer->type==CNN_LAYER_TYPE_FC)
+        {
+            bool conv=thisLayer->type==CNN_LAYER_TYPE_CONV;
+            CNNLayer *nextLayer=layerIndex+1<_layerCount?_layers[layerIndex+1]:0;
+            if(nextLayer==0||nextLayer->type!=(conv?CNN_LAYER_TYPE_RELU:CNN_LAYER_TYPE_SOFTMAX))
+                throw; // Unsupported layer sequence
+
+            layer.type=conv?CNN_QUANTIZED_LAYER_TYPE_CONV_RELU:CNN_QUANTIZED_LAYER_TYPE_FC;
+            if(conv)
+            {
+                // The RELU output is the output of the fused layer
+                layer.outputScale=outputMax[layerIndex+1]>0.0?outputMax[layerIndex+1]/255.0:1.0/255.0;
+                layer.reductionSize=thisLayer->previousLayerFeatureMapCount*thisLayer->receptiveFieldHeight*thisLayer->receptiveFieldWidth;
+            }
+            else
+                layer.reductionSize=thisLayer->previousLayerFeatureMapCount*thisLayer->previousLayerSingleFeatureMapHeight*thisLayer->previousLayerSingleFeatureMapWidth;
+            layer.paddedReductionSize=(layer.reductionSize+CNN_QUANTIZED_WEIGHT_ALIGNMENT-1)/CNN_QUANTIZED_WEIGHT_ALIGNMENT*CNN_QUANTIZED_WEIGHT_ALIGNMENT;
+            largestPaddedReductionSize=__max(largestPaddedReductionSize,layer.paddedReductionSize);
+
+            layer.weights=(int8_t*)calloc(layer.featureMapCount*layer.paddedReductionSize,sizeof(int8_t));
+            layer.weightScales=(double*)malloc(layer.featureMapCount*sizeof(double));
+            layer.outputMultipliers=(double*)malloc(layer.featureMapCount*sizeof(double));
+            layer.biases=(double*)malloc(layer.featureMapCount*sizeof(double));
+
+            // The layer's weights are stored as feature map in previous layer -> feature map in this layer -> y -> x (CONV)
+            // or feature map in previous layer -> y -> x -> neuron in this layer (FC); "weightStride" and "featureMapStride" locate
+            // the weight of feature map (neuron) "featureMapInThisLayer" and reduction index "k" in the flat buffer.
+            double *weightData=CNNLayer::getWeightTypeArrayData(thisLayer->weights);
+            uint32_t receptiveFieldSize=conv?thisLayer->receptiveFieldHeight*thisLayer->receptiveFieldWidth:0;
+
+            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<layer.featureMapCount;featureMapInThisLayer++)
+            {
+                double maxAbsWeight=0.0;
+                for(uint32_t k=0;k<layer.reductionSize;k++)
+                {
+                    double weight=conv?weightData[((k/receptiveFieldSize)*layer.featureMapCount+featureMapInThisLayer)*receptiveFieldSize+k%receptiveFieldSize]
+                                     :weightData[k*layer.featureMapCount+featureMapInThisLayer];
+                    maxAbsWeight=__max(maxAbsWeight,fabs(weight));
+                }
+                double weightScale=maxAbsWeight>0.0?maxAbsWeight/127.0:1.0;
+                layer.weightScales[featureMapInThisLayer]=weightScale;
+
+                int8_t *packedWeights=layer.weights+featureMapInThisLayer*layer.paddedReductionSize;
+                for(uint32_t k=0;k<layer.reductionSize;k++)
+                {
+                    double weight=conv?weightData[((k/receptiveFieldSize)*layer.featureMapCount+featureMapInThisLayer)*receptiveFieldSize+k%receptiveFieldSize]
+                                     :weightData[k*layer.featureMapCount+featureMapInThisLayer];
+                    double quantizedWeight=floor(weight/weightScale+0.5);
+                    packedWeights[k]=(int8_t)__max(-127.0,__min(127.0,quantizedWeight));
+                }
+
+                if(conv)
+                {
+                    layer.outputMultipliers[featureMapInThisLayer]=layer.inputScale*weightScale/layer.outputScale;
+                    layer.biases[featureMapInThisLayer]=thisLayer->biasWeights[featureMapInThisLayer]/layer.outputScale;
+                }
+                else
+                {
+                    layer.outputMultipliers[featureMapInThisLayer]=layer.inputScale*weightScale;
+                    layer.biases[featureMapInThisLayer]=thisLayer->biasWeights[featureMapInThisLayer];
+                }
+            }
+
+            layerIndex+=2; // Skip the fused RELU/SOFTMAX layer
+        }
+        else if(thisLayer->type==CNN_LAYER_TYPE_MAXPOOL)
+        {
+            // The maximum of quantized values is the quantized maximum, so the scale stays the same
+            layer.type=CNN_QUANTIZED_LAYER_TYPE_MAXPOOL;
+            layerIndex++;
+        }
+        else
+            throw; // Unsupported layer sequence
+
+        scale=layer.outputScale;
+        largestActivationSize=__max(largestActivationSize,layer.featureMapCount*layer.singleFeatureMapWidth*layer.singleFeatureMapHeight);
+        layers.push_back(layer);
+    }
+
+    if(layers.back().type!=CNN_QUANTIZED_LAYER_TYPE_FC)
+        throw;
+
+    activationBuffer1=(uint8_t*)malloc(largestActivationSize*sizeof(uint8_t));
+    activationBuffer2=(uint8_t*)malloc(largestActivationSize*sizeof(uint8_t));
+    patchBuffer=(uint8_t*)calloc(largestPaddedReductionSize,sizeof(uint8_t));
+    logits=(double*)malloc(classCount*sizeof(double));
+}
+
+CNNQuantizedModel::~CNNQuantizedModel()
+{
+    for(uint32_t layerIndex=0;layerIndex<layers.size();layerIndex++)
+    {
+        free(layers[layerIndex].weights);
+        free(layers[layerIndex].weightScales);
+        free(layers[layerIndex].outputMultipliers);
+        free(layers[layerIndex].biases);
+    }
+    free(activationBuffer1);
+    free(activationBuffer2);
+    free(patchBuffer);
+    free(logits);
+}
+
+double CNNQuantizedModel::getMaxAbsValue(double ***_array, uint32_t zDimension, int32_t yDimension, int32_t xDimension)
+{
+    double maxAbsValue=0.0;
+    // The outputs of NHWC layers followed by NHWC layers are channels-last arrays (all values in one row); the maximum doesn't depend on the order
+    if(CNNLayer::isChannelsLastArray(_array,zDimension,yDimension))
+    {
+        for(int32_t index=0;index<(int32_t)zDimension*yDimension*xDimension;index++)
+            maxAbsValue=__max(maxAbsValue,fabs(_array[0][0][index]));
+        return maxAbsValue;
+    }
+    for(uint32_t z=0;z<zDimension;z++)
+    {
+        for(int32_t y=0;y<yDimension;y++)
+        {
+            for(int32_t x=0;x<xDimension;x++)
+                maxAbsValue=__max(maxAbsValue,fabs(_array[z][y][x]));
+        }
+    }
+    return maxAbsValue;
+}
+
+uint8_t CNNQuantizedModel::saturate(double value)
+{
+    if(value<=0.0)
+        return 0;
+    if(value>=255.0)
+        return 255;
+    return (uint8_t)(value+0.5);
+}
+
+int32_t CNNQuantizedModel::dot(uint8_t *activations, int8_t *weights, uint32_t paddedCount)
+{
+    // paddedCount is a multiple of CNN_QUANTIZED_WEIGHT_ALIGNMENT
+
+#if defined(CNN_QUANTIZED_USE_AVX512_VNNI)
+    // vpdpbusd: unsigned 8 bit x signed 8 bit, 4 products summed into each 32 bit lane (no intermediate saturation)
+    __m256i sum=_mm256_setzero_si256();
+    for(uint32_t i=0;i<paddedCount;i+=32)
+        sum=_mm256_dpbusd_epi32(sum,_mm256_loadu_si256((__m256i*)(activations+i)),_mm256_loadu_si256((__m256i*)(weights+i)));
+    __m128i sum128=_mm_add_epi32(_mm256_castsi256_si128(sum),_mm256_extracti128_si256(sum,1));
+    sum128=_mm_hadd_epi32(sum128,sum128);
+    sum128=_mm_hadd_epi32(sum128,sum128);
+    return _mm_cvtsi128_si32(sum128);
+#elif defined(CNN_QUANTIZED_USE_AVX2)
+    // Widen to 16 bit before multiplying (vpmaddubsw would saturate 255*127+255*127)
+    __m256i sum=_mm256_setzero_si256();
+    for(uint32_t i=0;i<paddedCount;i+=16)
+    {
+        __m256i activations16=_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(activations+i)));
+        __m256i weights16=_mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i*)(weights+i)));
+        sum=_mm256_add_epi32(sum,_mm256_madd_epi16(activations16,weights16));
+    }
+    __m128i sum128=_mm_add_epi32(_mm256_castsi256_si128(sum),_mm256_extracti128_si256(sum,1));
+    sum128=_mm_hadd_epi32(sum128,sum128);
+    sum128=_mm_hadd_epi32(sum128,sum128);
+    return _mm_cvtsi128_si32(sum128);
+#else
+    int32_t sum=0;
+    for(uint32_t i=0;i<paddedCount;i++)
+        sum+=((int32_t)activations[i])*((int32_t)weights[i]);
+    return sum;
+#endif
+}
+
+void CNNQuantizedModel::quantizeInput(double ***image, uint8_t *out)
+{
+    double inverseScale=1.0/layers[0].inputScale;
+    for(uint32_t featureMap=0;featureMap<inputFeatureMapCount;featureMap++)
+    {
+        for(int32_t y=0;y<inputSingleFeatureMapHeight;y++)
+        {
+            for(int32_t x=0;x<inputSingleFeatureMapWidth;x++)
+                *(out++)=saturate(image[featureMap][y][x]*inverseScale);
+        }
+    }
+}
+
+void CNNQuantizedModel::convRelu(CNNQuantizedLayer &layer, uint8_t *in, uint8_t *out)
+{
+    int32_t inputPlaneSize=layer.previousLayerSingleFeatureMapWidth*layer.previousLayerSingleFeatureMapHeight;
+    int32_t outputPlaneSize=layer.singleFeatureMapWidth*layer.singleFeatureMapHeight;
+
+    // The padding at the end of the patch must be 0, since the dot product runs over the padded length.
+    memset(patchBuffer+layer.reductionSize,0,layer.paddedReductionSize-layer.reductionSize);
+
+    for(int32_t y=0;y<layer.singleFeatureMapHeight;y++)
+    {
+        int32_t offsetY=-layer.zeroPaddingY+layer.strideY*y;
+        for(int32_t x=0;x<layer.singleFeatureMapWidth;x++)
+        {
+            int32_t offsetX=-layer.zeroPaddingX+layer.strideX*x;
+
+            // Gather the receptive field of this output pixel (all feature maps of the previous layer) into the patch buffer,
+            // in the same order as the packed weights. Pixels in the zero padding become 0.
+            int32_t receptiveFieldStartX=__max(0,-offsetX);
+            int32_t receptiveFieldEndX=__min(layer.receptiveFieldWidth,layer.previousLayerSingleFeatureMapWidth-offsetX);
+            uint8_t *patchRow=patchBuffer;
+            for(uint32_t featureMapInPreviousLayer=0;featureMapInPreviousLayer<layer.previousLayerFeatureMapCount;featureMapInPreviousLayer++)
+            {
+                for(int32_t receptiveFieldY=0;receptiveFieldY<layer.receptiveFieldHeight;receptiveFieldY++,patchRow+=layer.receptiveFieldWidth)
+                {
+                    int32_t pixelInFeatureMapInPreviousLayerY=offsetY+receptiveFieldY;
+                    if(pixelInFeatureMapInPreviousLayerY<0||pixelInFeatureMapInPreviousLayerY>=layer.previousLayerSingleFeatureMapHeight||receptiveFieldStartX>=receptiveFieldEndX)
+                    {
+                        memset(patchRow,0,layer.receptiveFieldWidth);
+                        continue;
+                    }
+                    uint8_t *inputRow=in+featureMapInPreviousLayer*inputPlaneSize+pixelInFeatureMapInPreviousLayerY*layer.previousLayerSingleFeatureMapWidth;
+                    memset(patchRow,0,receptiveFieldStartX);
+                    memcpy(patchRow+receptiveFieldStartX,inputRow+offsetX+receptiveFieldStartX,receptiveFieldEndX-receptiveFieldStartX);
+                    memset(patchRow+receptiveFieldEndX,0,layer.receptiveFieldWidth-receptiveFieldEndX);
+                }
+            }
+
+            uint8_t *outputPixel=out+y*layer.singleFeatureMapWidth+x;
+            for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<layer.featureMapCount;featureMapInThisLayer++)
+            {
+                int32_t sum=dot(patchBuffer,layer.weights+featureMapInThisLayer*layer.paddedReductionSize,layer.paddedReductionSize);
+                outputPixel[featureMapInThisLayer*outputPlaneSize]=saturate(sum*layer.outputMultipliers[featureMapInThisLayer]+layer.biases[featureMapInThisLayer]);
+            }
+        }
+    }
+}
+
+void CNNQuantizedModel::maxpool(CNNQuantizedLayer &layer, uint8_t *in, uint8_t *out)
+{
+    for(uint32_t featureMap=0;featureMap<layer.featureMapCount;featureMap++)
+    {
+        uint8_t *inputMap=in+featureMap*layer.previousLayerSingleFeatureMapWidth*layer.previousLayerSingleFeatureMapHeight;
+        for(int32_t y=0;y<layer.singleFeatureMapHeight;y++)
+        {
+            int32_t offsetY=-layer.zeroPaddingY+layer.strideY*y;
+            int32_t receptiveFieldStartY=__max(0,-offsetY);
+            int32_t receptiveFieldEndY=__min(layer.receptiveFieldHeight,layer.previousLayerSingleFeatureMapHeight-offsetY);
+            for(int32_t x=0;x<layer.singleFeatureMapWidth;x++)
+            {
+                int32_t offsetX=-layer.zeroPaddingX+layer.strideX*x;
+                int32_t receptiveFieldStartX=__max(0,-offsetX);
+                int32_t receptiveFieldEndX=__min(layer.receptiveFieldWidth,layer.previousLayerSingleFeatureMapWidth-offsetX);
+
+                uint8_t highestValue=0; // All values are >=0
+                for(int32_t receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                {
+                    uint8_t *inputRow=inputMap+(offsetY+receptiveFieldY)*layer.previousLayerSingleFeatureMapWidth+offsetX;
+                    for(int32_t receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                        highestValue=__max(highestValue,inputRow[receptiveFieldX]);
+                }
+                *(out++)=highestValue;
+            }
+        }
+    }
+}
+
+void CNNQuantizedModel::fc(CNNQuantizedLayer &layer, uint8_t *in, double *out)
+{
+    // The input is already stored in reduction order (feature map -> y -> x); copy it so that the padding is 0.
+    memcpy(patchBuffer,in,layer.reductionSize);
+    memset(patchBuffer+layer.reductionSize,0,layer.paddedReductionSize-layer.reductionSize);
+
+    for(uint32_t featureMapInThisLayer=0;featureMapInThisLayer<layer.featureMapCount;featureMapInThisLayer++)
+    {
+        int32_t sum=dot(patchBuffer,layer.weights+featureMapInThisLayer*layer.paddedReductionSize,layer.paddedReductionSize);
+        out[featureMapInThisLayer]=sum*layer.outputMultipliers[featureMapInThisLayer]+layer.biases[featureMapInThisLayer];
+    }
+}
+
+uint32_t CNNQuantizedModel::classify(double ***image, double *probabilities)
+{
+    uint8_t *in=activationBuffer1;
+    uint8_t *out=activationBuffer2;
+
+    quantizeInput(image,in);
+
+    for(uint32_t layerIndex=0;layerIndex<layers.size();layerIndex++)
+    {
+        CNNQuantizedLayer &layer=layers[layerIndex];
+        if(layer.type==CNN_QUANTIZED_LAYER_TYPE_CONV_RELU)
+            convRelu(layer,in,out);
+        else if(layer.type==CNN_QUANTIZED_LAYER_TYPE_MAXPOOL)
+            maxpool(layer,in,out);
+        else if(layer.type==CNN_QUANTIZED_LAYER_TYPE_FC)
+            fc(layer,in,logits);
+
+        uint8_t *swap=in;
+        in=out;
+        out=swap;
+    }
+
+    // Softmax (in floating point, see CNNLayer::softmax)
+
+    double highestValue=-std::numeric_limits<double>::max();
+    uint32_t highestIndex=0;
+    for(uint32_t featureMap=0;featureMap<classCount;featureMap++)
+    {
+        if(logits[featureMap]>highestValue)
+        {
+            highestValue=logits[featureMap];
+            highestIndex=featureMap;
+        }
+    }
+
+    double ePowSum=0.0;
+    for(uint32_t featureMap=0;featureMap<classCount;featureMap++)
+    {
+        probabilities[featureMap]=exp(logits[featureMap]-highestValue);
+        ePowSum+=probabilities[featureMap];
+    }
+    for(uint32_t featureMap=0;featureMap<classCount;featureMap++)
+        probabilities[featureMap]/=ePowSum;
+
+    return highestIndex;
+}
@@ -0,0 +1,97 @@
+#ifndef CNNQUANTIZEDMODEL_H
+#define CNNQUANTIZEDMODEL_H
+
+#define CNN_QUANTIZED_LAYER_TYPE_CONV_RELU 1 // CONV layer with the following RELU layer fused into it
+#define CNN_QUANTIZED_LAYER_TYPE_MAXPOOL 2
+#define CNN_QUANTIZED_LAYER_TYPE_FC 3 // Produces (dequantized) floating point values for the final softmax
+
+// The reduction dimension of the packed weights is padded to a multiple of this value, so that the dot product kernels
+// never need a remainder loop (32 bytes = one AVX2/AVX-512 VNNI register of 8 bit values).
+#define CNN_QUANTIZED_WEIGHT_ALIGNMENT 32
+
+#if defined(__AVX512VNNI__)&&defined(__AVX512VL__)
+#define CNN_QUANTIZED_USE_AVX512_VNNI
+#elif defined(__AVX2__)
+#define CNN_QUANTIZED_USE_AVX2
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+#include "cnnlayer.h"
+
+// One layer of a CNNQuantizedModel.
+// Activations are stored as unsigned 8 bit values (value=scale*quantizedValue): all activations that are quantized are either image pixels,
+// RELU outputs or maxpool outputs of RELU outputs, and therefore never negative. Weights are signed 8 bit values with one scale per output feature map.
+struct CNNQuantizedLayer
+{
+    uint8_t type;
+
+    uint32_t featureMapCount;
+    int32_t singleFeatureMapWidth;
+    int32_t singleFeatureMapHeight;
+    int32_t receptiveFieldWidth;
+    int32_t receptiveFieldHeight;
+    int32_t strideX;
+    int32_t strideY;
+    int32_t zeroPaddingX;
+    int32_t zeroPaddingY;
+    uint32_t previousLayerFeatureMapCount;
+    int32_t previousLayerSingleFeatureMapWidth;
+    int32_t previousLayerSingleFeatureMapHeight;
+
+    double inputScale;
+    double outputScale; // CONV/MAXPOOL only
+
+    // CONV/FC only:
+    // Packed weights: feature map (neuron) in this layer -> reduction index (padded to paddedReductionSize with zeros)
+    // The reduction index enumerates feature map in previous layer -> y -> x (the same order for CONV receptive fields and FC inputs).
+    uint32_t reductionSize;
+    uint32_t paddedReductionSize;
+    int8_t *weights;
+    double *weightScales; // Per feature map in this layer
+    double *outputMultipliers; // inputScale*weightScale/outputScale (CONV), inputScale*weightScale (FC)
+    double *biases; // Bias weights divided by outputScale (CONV), unchanged (FC)
+};
+
+// Int8 copy of a trained network for classification (post-training quantization).
+// Supported layer sequences: CONV followed by RELU, MAXPOOL, and a final FC layer followed by SOFTMAX.
+// Not thread-safe: classify uses buffers owned by the model.
+
+class CNNQuantizedModel
+{
+public:
+    std::vector<CNNQuantizedLayer> layers;
+    uint32_t inputFeatureMapCount;
+    int32_t inputSingleFeatureMapWidth;
+    int32_t inputSingleFeatureMapHeight;
+    uint32_t classCount;
+
+    // Scratch buffers
+    uint8_t *activationBuffer1;
+    uint8_t *activationBuffer2;
+    uint8_t *patchBuffer;
+    double *logits;
+
+    // Calibrates the activation scales by running the double precision network on the calibration images
+    // (dimensions: image -> feature map -> row -> value of pixel in column), then quantizes the weights.
+    CNNQuantizedModel(CNNLayer **_layers,uint32_t _layerCount,double ****calibrationImages,uint32_t calibrationImageCount);
+    ~CNNQuantizedModel();
+
+    static double getMaxAbsValue(double ***_array,uint32_t zDimension,int32_t yDimension,int32_t xDimension);
+    // Rounds to the nearest unsigned 8 bit value; negative values become 0 (which also applies the fused RELU)
+    static uint8_t saturate(double value);
+    static int32_t dot(uint8_t *activations,int8_t *weights,uint32_t paddedCount);
+
+    void quantizeInput(double ***image,uint8_t *out);
+    void convRelu(CNNQuantizedLayer &layer,uint8_t *in,uint8_t *out);
+    void maxpool(CNNQuantizedLayer &layer,uint8_t *in,uint8_t *out);
+    void fc(CNNQuantizedLayer &layer,uint8_t *in,double *out);
+
+    // Writes the softmax output (classCount values) to probabilities and returns the index of the most probable class
+    uint32_t classify(double ***image,double *probabilities);
+};
+
+#endif // CNNQUANTIZEDMODEL_H
@@ -0,0 +1,190 @@
+#include "cnnsampler.h"
+
+#ifdef CNN_VECTOR_RANDOM_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+CNNRandom::CNNRandom(uint64_t seed)
+{
+    this->seed(seed);
+}
+
+uint64_t CNNRandom::splitMix64(uint64_t &seed)
+{
+    uint64_t z=(seed+=0x9E3779B97F4A7C15ULL);
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return z^(z>>31);
+}
+
+void CNNRandom::seed(uint64_t seed)
+{
+    // The state must not be all zeros, which splitMix64 guarantees.
+    for(uint32_t i=0;i<4;i++)
+        state[i]=splitMix64(seed);
+}
+
+uint64_t CNNRandom::next()
+{
+    uint64_t result=state[1]*5;
+    result=((result<<7)|(result>>57))*9;
+    uint64_t t=state[1]<<17;
+
+    state[2]^=state[0];
+    state[3]^=state[1];
+    state[1]^=state[2];
+    state[0]^=state[3];
+    state[2]^=t;
+    state[3]=(state[3]<<45)|(state[3]>>19);
+
+    return result;
+}
+
+uint32_t CNNRandom::nextBelow(uint32_t bound)
+{
+    // Multiply-and-shift (Lemire); rejecting the few biased values makes the result exactly uniform.
+    uint64_t product=(next()>>32)*bound;
+    uint32_t low=(uint32_t)product;
+    if(low<bound)
+    {
+        uint32_t threshold=(0u-bound)%bound;
+        while(low<threshold)
+        {
+            product=(next()>>32)*bound;
+            low=(uint32_t)product;
+        }
+    }
+    return (uint32_t)(product>>32);
+}
+
+double CNNRandom::nextDouble()
+{
+    // 53 random bits -> [0.0,1.0)
+    return ((double)(next()>>11))*(1.0/9007199254740992.0);
+}
+
+CNNVectorRandom::CNNVectorRandom(uint64_t seed)
+{
+    this->seed(seed);
+}
+
+void CNNVectorRandom::seed(uint64_t seed)
+{
+    // One splitMix64 sequence for all lanes, so the lanes are seeded differently (and no lane's state is all zeros)
+    for(uint32_t lane=0;lane<CNN_VECTOR_RANDOM_LANE_COUNT;lane++)
+    {
+        for(uint32_t i=0;i<4;i++)
+            state[i][lane]=CNNRandom::splitMix64(seed);
+    }
+}
+
+void CNNVectorRandom::next(uint64_t *values)
+{
+#ifdef CNN_VECTOR_RANDOM_USE_SSE2
+    // Same steps as CNNRandom::next for two lanes at once. SSE2 has no 64 bit multiplication, but *5 and *9 are a shift and an addition each.
+    for(uint32_t lane=0;lane<CNN_VECTOR_RANDOM_LANE_COUNT;lane+=2)
+    {
+        __m128i state0=_mm_loadu_si128((__m128i*)&state[0][lane]);
+        __m128i state1=_mm_loadu_si128((__m128i*)&state[1][lane]);
+        __m128i state2=_mm_loadu_si128((__m128i*)&state[2][lane]);
+        __m128i state3=_mm_loadu_si128((__m128i*)&state[3][lane]);
+
+        __m128i result=_mm_add_epi64(_mm_slli_epi64(state1,2),state1);
+        result=_mm_or_si128(_mm_slli_epi64(result,7),_mm_srli_epi64(result,57));
+        result=_mm_add_epi64(_mm_slli_epi64(result,3),result);
+        __m128i t=_mm_slli_epi64(state1,17);
+
+        state2=_mm_xor_si128(state2,state0);
+        state3=_mm_xor_si128(state3,state1);
+        state1=_mm_xor_si128(state1,state2);
+        state0=_mm_xor_si128(state0,state3);
+        state2=_mm_xor_si128(state2,t);
+        state3=_mm_or_si128(_mm_slli_epi64(state3,45),_mm_srli_epi64(state3,19));
+
+        _mm_storeu_si128((__m128i*)&state[0][lane],state0);
+        _mm_storeu_si128((__m128i*)&state[1][lane],state1);
+        _mm_storeu_si128((__m128i*)&state[2][lane],state2);
+        _mm_storeu_si128((__m128i*)&state[3][lane],state3);
+        _mm_storeu_si128((__m128i*)(values+lane),result);
+    }
+#else
+    nextScalar(values);
+#endif
+}
+
+void CNNVectorRandom::nextScalar(uint64_t *values)
+{
+    for(uint32_t lane=0;lane<CNN_VECTOR_RANDOM_LANE_COUNT;lane++)
+    {
+        uint64_t result=state[1][lane]*5;
+        result=((result<<7)|(result>>57))*9;
+        uint64_t t=state[1][lane]<<17;
+
+        state[2][lane]^=state[0][lane];
+        state[3][lane]^=state[1][lane];
+        state[1][lane]^=state[2][lane];
+        state[0][lane]^=state[3][lane];
+        state[2][lane]^=t;
+        state[3][lane]=(state[3][lane]<<45)|(state[3][lane]>>19);
+
+        values[lane]=result;
+    }
+}
+
+CNNSampler::CNNSampler(uint32_t _firstIndex, uint32_t _indexCount, uint64_t _seed)
+{
+    if(_indexCount==0)
+        throw;
+
+    firstIndex=_firstIndex;
+    indexCount=_indexCount;
+    seed=_seed;
+
+    epoch=0;
+    position=0;
+    permutation=(uint32_t*)malloc(indexCount*sizeof(uint32_t));
+    shuffle();
+}
+
+CNNSampler::~CNNSampler()
+{
+    free(permutation);
+}
+
+void CNNSampler::getShard(uint32_t totalIndexCount, uint32_t shardIndex, uint32_t shardCount, uint32_t &shardFirstIndex, uint32_t &shardIndexCount)
+{
+    uint32_t baseCount=totalIndexCount/shardCount;
+    uint32_t remainder=totalIndexCount%shardCount;
+    shardIndexCount=baseCount+(shardIndex<remainder?1:0);
+    shardFirstIndex=shardIndex*baseCount+(shardIndex<remainder?shardIndex:remainder);
+}
+
+uint32_t CNNSampler::next()
+{
+    if(position==indexCount)
+    {
+        epoch++;
+        shuffle();
+    }
+    return permutation[position++];
+}
+
+void CNNSampler::shuffle()
+{
+    // The order of each epoch is derived from the seed and the epoch number only.
+    CNNRandom random(seed^(epoch*0xD1B54A32D192ED03ULL));
+
+    for(uint32_t i=0;i<indexCount;i++)
+        permutation[i]=firstIndex+i;
+
+    // Fisher-Yates shuffle
+    for(uint32_t i=indexCount-1;i>0;i--)
+    {
+        uint32_t j=random.nextBelow(i+1);
+        uint32_t swap=permutation[i];
+        permutation[i]=permutation[j];
+        permutation[j]=swap;
+    }
+
+    position=0;
+}
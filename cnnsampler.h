@@ -0,0 +1,76 @@
+#ifndef CNNSAMPLER_H
+#define CNNSAMPLER_H
+
+#define CNN_VECTOR_RANDOM_LANE_COUNT 4 // Must be even (two lanes per SSE2 register)
+
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+#define CNN_VECTOR_RANDOM_USE_SSE2
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Small, fast pseudo-random number generator (xoshiro256**) with its own state, so that every thread can use its own instance
+// (unlike rand(), which uses a global state that is not thread-safe).
+
+class CNNRandom
+{
+public:
+    uint64_t state[4];
+
+    CNNRandom(uint64_t seed);
+
+    // Expands a 64 bit seed into well-distributed values (used to seed the state)
+    static uint64_t splitMix64(uint64_t &seed);
+
+    void seed(uint64_t seed);
+    uint64_t next();
+    // Uniformly distributed in [0,bound)
+    uint32_t nextBelow(uint32_t bound);
+    // Uniformly distributed in [0.0,1.0)
+    double nextDouble();
+};
+
+// CNN_VECTOR_RANDOM_LANE_COUNT independent xoshiro256** generators that are advanced together, for producing many random bits at once
+// (e.g. dropout masks). Like CNNRandom, every instance has its own state, so every thread can use its own instance.
+// next uses SSE2 where available, nextScalar never does; both return exactly the same values.
+
+class CNNVectorRandom
+{
+public:
+    uint64_t state[4][CNN_VECTOR_RANDOM_LANE_COUNT]; // Dimensions: state word -> lane
+
+    CNNVectorRandom(uint64_t seed);
+
+    void seed(uint64_t seed);
+    // Writes the next value of every lane to values[0..CNN_VECTOR_RANDOM_LANE_COUNT-1]
+    void next(uint64_t *values);
+    void nextScalar(uint64_t *values);
+};
+
+// Draws every index of a range exactly once per epoch, in an order that is reshuffled at the beginning of each epoch
+// (sampling without replacement). The order only depends on the seed, so runs can be reproduced.
+// Parallel workers use disjoint shards of the data set (see getShard).
+
+class CNNSampler
+{
+public:
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint64_t seed;
+
+    uint64_t epoch; // Current epoch (starting at 0)
+    uint32_t position; // Position of the next index in "permutation"
+    uint32_t *permutation;
+
+    CNNSampler(uint32_t _firstIndex,uint32_t _indexCount,uint64_t _seed);
+    ~CNNSampler();
+
+    // Calculates the range of indices assigned to shard "shardIndex" of "shardCount" (the first shards get one index more if the count can't be divided evenly)
+    static void getShard(uint32_t totalIndexCount,uint32_t shardIndex,uint32_t shardCount,uint32_t &shardFirstIndex,uint32_t &shardIndexCount);
+
+    uint32_t next();
+    void shuffle();
+};
+
+#endif // CNNSAMPLER_H
@@ -0,0 +1,114 @@
+#include "cnnschedule.h"
+
+CNNLearningRateSchedule::CNNLearningRateSchedule(uint8_t _type, uint64_t _iterationsPerEpoch)
+{
+    if(_type<1||_type>CNN_SCHEDULE_TYPE_COUNT||_iterationsPerEpoch==0)
+        throw;
+
+    type=_type;
+    iterationsPerEpoch=_iterationsPerEpoch;
+
+    stepEpochs=CNN_SCHEDULE_DEFAULT_STEP_EPOCHS;
+    stepFactor=CNN_SCHEDULE_DEFAULT_STEP_FACTOR;
+    totalEpochs=CNN_SCHEDULE_DEFAULT_TOTAL_EPOCHS;
+    warmupEpochs=CNN_SCHEDULE_DEFAULT_WARMUP_EPOCHS;
+    minimumLearningRateFactor=CNN_SCHEDULE_DEFAULT_MINIMUM_LEARNING_RATE_FACTOR;
+    oneCycleWarmupFraction=CNN_SCHEDULE_DEFAULT_ONE_CYCLE_WARMUP_FRACTION;
+    oneCycleDivFactor=CNN_SCHEDULE_DEFAULT_ONE_CYCLE_DIV_FACTOR;
+    oneCycleMinimumMomentumFactor=CNN_SCHEDULE_DEFAULT_ONE_CYCLE_MINIMUM_MOMENTUM_FACTOR;
+    plateauThreshold=CNN_SCHEDULE_DEFAULT_PLATEAU_THRESHOLD;
+
+    epochLossSum=0.0;
+    epochLossCount=0;
+    lastEpochLoss=-1.0;
+    bestEpochLoss=-1.0;
+    plateauFactor=1.0;
+}
+
+const char *CNNLearningRateSchedule::getTypeName(uint8_t _type)
+{
+    if(_type==CNN_SCHEDULE_TYPE_CONSTANT)
+        return "Constant";
+    else if(_type==CNN_SCHEDULE_TYPE_STEP)
+        return "Step";
+    else if(_type==CNN_SCHEDULE_TYPE_COSINE)
+        return "Cosine";
+    else if(_type==CNN_SCHEDULE_TYPE_WARMUP)
+        return "Warmup";
+    else if(_type==CNN_SCHEDULE_TYPE_ONE_CYCLE)
+        return "One-cycle";
+    else if(_type==CNN_SCHEDULE_TYPE_PLATEAU)
+        return "Plateau";
+    return "unknown";
+}
+
+double CNNLearningRateSchedule::cosineInterpolate(double start, double end, double progress)
+{
+    if(progress>1.0)
+        progress=1.0;
+    return end+(start-end)*0.5*(1.0+cos(M_PI*progress));
+}
+
+double CNNLearningRateSchedule::getLearningRate(double baseLearningRate, uint64_t iteration)
+{
+    double epoch=((double)iteration)/((double)iterationsPerEpoch);
+
+    if(type==CNN_SCHEDULE_TYPE_CONSTANT)
+        return baseLearningRate;
+    else if(type==CNN_SCHEDULE_TYPE_STEP)
+        return baseLearningRate*pow(stepFactor,floor(epoch/stepEpochs));
+    else if(type==CNN_SCHEDULE_TYPE_COSINE)
+        return cosineInterpolate(baseLearningRate,minimumLearningRateFactor*baseLearningRate,epoch/totalEpochs);
+    else if(type==CNN_SCHEDULE_TYPE_WARMUP)
+    {
+        // Start at 1/warmupIterations instead of 0 so that the first iteration is not wasted
+        double warmupIterations=warmupEpochs*iterationsPerEpoch;
+        if(iteration+1>=warmupIterations)
+            return baseLearningRate;
+        return baseLearningRate*((double)(iteration+1))/warmupIterations;
+    }
+    else if(type==CNN_SCHEDULE_TYPE_ONE_CYCLE)
+    {
+        // The base learning rate is the peak of the cycle
+        double progress=epoch/totalEpochs;
+        double initialLearningRate=baseLearningRate/oneCycleDivFactor;
+        if(progress<oneCycleWarmupFraction)
+            return cosineInterpolate(initialLearningRate,baseLearningRate,progress/oneCycleWarmupFraction);
+        return cosineInterpolate(baseLearningRate,minimumLearningRateFactor*baseLearningRate,(progress-oneCycleWarmupFraction)/(1.0-oneCycleWarmupFraction));
+    }
+    else if(type==CNN_SCHEDULE_TYPE_PLATEAU)
+        return baseLearningRate*plateauFactor;
+    else
+        throw;
+}
+
+double CNNLearningRateSchedule::getMomentum(double baseMomentum, uint64_t iteration)
+{
+    if(type!=CNN_SCHEDULE_TYPE_ONE_CYCLE)
+        return baseMomentum;
+
+    // While the learning rate rises, the momentum falls (and vice versa), so that the effective step size doesn't explode
+    double progress=(((double)iteration)/((double)iterationsPerEpoch))/totalEpochs;
+    double minimumMomentum=oneCycleMinimumMomentumFactor*baseMomentum;
+    if(progress<oneCycleWarmupFraction)
+        return cosineInterpolate(baseMomentum,minimumMomentum,progress/oneCycleWarmupFraction);
+    return cosineInterpolate(minimumMomentum,baseMomentum,(progress-oneCycleWarmupFraction)/(1.0-oneCycleWarmupFraction));
+}
+
+void CNNLearningRateSchedule::reportLoss(double loss)
+{
+    epochLossSum+=loss;
+    epochLossCount++;
+    if(epochLossCount<iterationsPerEpoch)
+        return;
+
+    lastEpochLoss=epochLossSum/((double)epochLossCount);
+    epochLossSum=0.0;
+    epochLossCount=0;
+
+    // Reduce unless the loss improved by more than the threshold (a loss that improves only slowly has reached a plateau, too)
+    if(bestEpochLoss>=0.0&&lastEpochLoss>=plateauThreshold*bestEpochLoss)
+        plateauFactor*=stepFactor;
+    if(bestEpochLoss<0.0||lastEpochLoss<bestEpochLoss)
+        bestEpochLoss=lastEpochLoss;
+}
@@ -0,0 +1,70 @@
+#ifndef CNNSCHEDULE_H
+#define CNNSCHEDULE_H
+
+#ifndef _USE_MATH_DEFINES
+#define _USE_MATH_DEFINES
+#endif
+
+#define CNN_SCHEDULE_TYPE_CONSTANT 1 // Always use the base learning rate
+#define CNN_SCHEDULE_TYPE_STEP 2 // Multiply the learning rate by stepFactor every stepEpochs epochs
+#define CNN_SCHEDULE_TYPE_COSINE 3 // Anneal from the base learning rate to minimumLearningRateFactor*base along a half cosine over totalEpochs epochs
+#define CNN_SCHEDULE_TYPE_WARMUP 4 // Linearly increase the learning rate from 0 to the base learning rate over warmupEpochs epochs, then keep it constant
+#define CNN_SCHEDULE_TYPE_ONE_CYCLE 5 // Increase from base/oneCycleDivFactor to the base learning rate over the first oneCycleWarmupFraction of totalEpochs epochs, then anneal to minimumLearningRateFactor*base; momentum moves in the opposite direction
+#define CNN_SCHEDULE_TYPE_PLATEAU 6 // Multiply the learning rate by stepFactor after every epoch whose mean training loss (see reportLoss) is not below plateauThreshold times the best mean loss of the previous epochs
+
+#define CNN_SCHEDULE_TYPE_COUNT 6
+
+#define CNN_SCHEDULE_DEFAULT_STEP_EPOCHS 5.0
+#define CNN_SCHEDULE_DEFAULT_STEP_FACTOR 0.5
+#define CNN_SCHEDULE_DEFAULT_TOTAL_EPOCHS 30.0
+#define CNN_SCHEDULE_DEFAULT_WARMUP_EPOCHS 1.0
+#define CNN_SCHEDULE_DEFAULT_MINIMUM_LEARNING_RATE_FACTOR 0.01
+#define CNN_SCHEDULE_DEFAULT_ONE_CYCLE_WARMUP_FRACTION 0.3
+#define CNN_SCHEDULE_DEFAULT_ONE_CYCLE_DIV_FACTOR 25.0
+#define CNN_SCHEDULE_DEFAULT_ONE_CYCLE_MINIMUM_MOMENTUM_FACTOR 0.85
+#define CNN_SCHEDULE_DEFAULT_PLATEAU_THRESHOLD 0.99
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+// Derives the learning rate (and, for one-cycle, the momentum) of an iteration from the base values set in the GUI.
+// All lengths are given in epochs; one epoch is iterationsPerEpoch training iterations (one example per iteration).
+
+class CNNLearningRateSchedule
+{
+public:
+    uint8_t type;
+    uint64_t iterationsPerEpoch;
+
+    double stepEpochs;
+    double stepFactor;
+    double totalEpochs; // Length of the cosine and one-cycle schedules; the learning rate stays at its final value afterwards
+    double warmupEpochs;
+    double minimumLearningRateFactor;
+    double oneCycleWarmupFraction;
+    double oneCycleDivFactor;
+    double oneCycleMinimumMomentumFactor;
+    double plateauThreshold;
+
+    // Training loss (see reportLoss); only PLATEAU schedules depend on it
+    double epochLossSum; // Of the current epoch
+    uint64_t epochLossCount;
+    double lastEpochLoss; // Mean loss of the last complete epoch (-1.0: none yet)
+    double bestEpochLoss; // Lowest mean loss of a complete epoch (-1.0: none yet)
+    double plateauFactor; // Product of the stepFactor reductions so far
+
+    CNNLearningRateSchedule(uint8_t _type,uint64_t _iterationsPerEpoch);
+
+    static const char *getTypeName(uint8_t _type);
+
+    double getLearningRate(double baseLearningRate,uint64_t iteration);
+    double getMomentum(double baseMomentum,uint64_t iteration);
+    // To be called with the loss of every training example (see CNNLayer::loss), in iteration order; every iterationsPerEpoch losses complete an epoch
+    void reportLoss(double loss);
+
+    // Interpolates from start (at progress 0.0) to end (at progress 1.0) along a half cosine
+    static double cosineInterpolate(double start,double end,double progress);
+};
+
+#endif // CNNSCHEDULE_H
@@ -0,0 +1,119 @@
+#include "cnnsnapshot.h"
+
+CNNSnapshotPublisher::CNNSnapshotPublisher(CNNLayer **_layers, uint32_t _layerCount, CNNThreadPool *_threadPool)
+{
+    threadPool=_threadPool;
+    epoch=0;
+    for(uint32_t reader=0;reader<CNN_SNAPSHOT_MAX_READER_COUNT;reader++)
+    {
+        readerEpochs[reader]=CNN_SNAPSHOT_READER_IDLE;
+        readerSlotsUsed[reader]=false;
+    }
+    current=0;
+    publish(_layers,_layerCount,0);
+}
+
+CNNSnapshotPublisher::~CNNSnapshotPublisher()
+{
+    freeSnapshot(current.load());
+    for(uint32_t snapshot=0;snapshot<retiredSnapshots.size();snapshot++)
+        freeSnapshot(retiredSnapshots[snapshot]);
+    for(uint32_t snapshot=0;snapshot<freeSnapshots.size();snapshot++)
+        freeSnapshot(freeSnapshots[snapshot]);
+}
+
+void CNNSnapshotPublisher::publish(CNNLayer **_layers, uint32_t _layerCount, uint64_t _iteration)
+{
+    reclaim();
+
+    CNNWeightSnapshot *snapshot;
+    if(!freeSnapshots.empty())
+    {
+        snapshot=freeSnapshots.back();
+        freeSnapshots.pop_back();
+        if(snapshot->layerCount!=_layerCount)
+            throw;
+        for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+            snapshot->layers[layerIndex]->copyParameters(_layers[layerIndex]);
+    }
+    else
+    {
+        snapshot=new CNNWeightSnapshot();
+        snapshot->layerCount=_layerCount;
+        snapshot->layers=(CNNLayer**)malloc(_layerCount*sizeof(CNNLayer*));
+        for(uint32_t layerIndex=0;layerIndex<_layerCount;layerIndex++)
+        {
+            snapshot->layers[layerIndex]=_layers[layerIndex]->clone();
+            snapshot->layers[layerIndex]->setThreadPool(threadPool);
+        }
+    }
+    snapshot->iteration=_iteration;
+
+    // Readers that announce a later epoch than the one returned by fetch_add can only load the new snapshot (or a newer one)
+    CNNWeightSnapshot *previousSnapshot=current.exchange(snapshot);
+    if(previousSnapshot!=0)
+    {
+        previousSnapshot->retireEpoch=epoch.fetch_add(1);
+        retiredSnapshots.push_back(previousSnapshot);
+    }
+}
+
+void CNNSnapshotPublisher::reclaim()
+{
+    uint64_t oldestReaderEpoch=CNN_SNAPSHOT_READER_IDLE;
+    for(uint32_t reader=0;reader<CNN_SNAPSHOT_MAX_READER_COUNT;reader++)
+    {
+        uint64_t readerEpoch=readerEpochs[reader].load();
+        if(readerEpoch<oldestReaderEpoch)
+            oldestReaderEpoch=readerEpoch;
+    }
+
+    // A reader that announced epoch e may hold any snapshot retired in epoch e or later
+    uint32_t keptSnapshotCount=0;
+    for(uint32_t snapshot=0;snapshot<retiredSnapshots.size();snapshot++)
+    {
+        if(retiredSnapshots[snapshot]->retireEpoch<oldestReaderEpoch)
+            freeSnapshots.push_back(retiredSnapshots[snapshot]);
+        else
+            retiredSnapshots[keptSnapshotCount++]=retiredSnapshots[snapshot];
+    }
+    retiredSnapshots.resize(keptSnapshotCount);
+}
+
+uint32_t CNNSnapshotPublisher::registerReader()
+{
+    for(uint32_t reader=0;reader<CNN_SNAPSHOT_MAX_READER_COUNT;reader++)
+    {
+        bool used=false;
+        if(readerSlotsUsed[reader].compare_exchange_strong(used,true))
+            return reader;
+    }
+    throw;
+}
+
+void CNNSnapshotPublisher::unregisterReader(uint32_t reader)
+{
+    readerEpochs[reader]=CNN_SNAPSHOT_READER_IDLE;
+    readerSlotsUsed[reader]=false;
+}
+
+CNNWeightSnapshot *CNNSnapshotPublisher::acquire(uint32_t reader)
+{
+    // The announcement must become visible before the snapshot is loaded (both are sequentially consistent), so that reclaim sees
+    // the announcement of every reader that loaded a snapshot before it was retired
+    readerEpochs[reader].store(epoch.load());
+    return current.load();
+}
+
+void CNNSnapshotPublisher::release(uint32_t reader)
+{
+    readerEpochs[reader].store(CNN_SNAPSHOT_READER_IDLE);
+}
+
+void CNNSnapshotPublisher::freeSnapshot(CNNWeightSnapshot *snapshot)
+{
+    for(uint32_t layerIndex=0;layerIndex<snapshot->layerCount;layerIndex++)
+        delete snapshot->layers[layerIndex];
+    free(snapshot->layers);
+    delete snapshot;
+}
@@ -0,0 +1,66 @@
+#ifndef CNNSNAPSHOT_H
+#define CNNSNAPSHOT_H
+
+#define CNN_SNAPSHOT_MAX_READER_COUNT 16 // Threads that can be registered as readers at the same time
+#define CNN_SNAPSHOT_READER_IDLE 0xFFFFFFFFFFFFFFFFULL // Epoch of a reader that holds no snapshot
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include "cnnlayer.h"
+#include "cnnthreadpool.h"
+
+// Immutable copy of the parameters of a network (weights, bias weights and BATCHNORM running statistics)
+struct CNNWeightSnapshot
+{
+    CNNLayer **layers; // Clones of the published layers; run them with own contexts (see CNNLayerContext), never with their default contexts
+    uint32_t layerCount;
+    uint64_t iteration; // Passed to publish, e.g. the training examples seen when the snapshot was taken
+    uint64_t retireEpoch; // Publisher only: the epoch in which the snapshot was replaced by a newer one
+};
+
+// Publishes weight snapshots of the layers of a training thread, so that other threads can classify and evaluate while training runs
+// without locks: the trainer copies its layers into a snapshot every few steps (between two updates, when they are consistent) and swaps it in
+// with one atomic exchange; readers take the current snapshot with two atomic operations and never block the trainer or each other.
+// Replaced snapshots are reclaimed epoch-based (like RCU): a reader announces the epoch in which it started reading, and a snapshot replaced
+// in epoch e is only reused once no reader announced an epoch <=e. Reclaimed snapshots are recycled by the next publish (double buffering),
+// so after a few publishes the trainer only copies parameters and doesn't allocate any more.
+// publish must not be called by several threads at the same time (there is one trainer); the reader functions may be called by any
+// registered thread at any time.
+
+class CNNSnapshotPublisher
+{
+public:
+    std::atomic<CNNWeightSnapshot*> current;
+    std::atomic<uint64_t> epoch;
+    std::atomic<uint64_t> readerEpochs[CNN_SNAPSHOT_MAX_READER_COUNT]; // Epoch in which the reader acquired its snapshot, or CNN_SNAPSHOT_READER_IDLE
+    std::atomic<bool> readerSlotsUsed[CNN_SNAPSHOT_MAX_READER_COUNT];
+    CNNThreadPool *threadPool; // Set on the layers of every snapshot (see CNNLayer::setThreadPool)
+
+    // Publisher only
+    std::vector<CNNWeightSnapshot*> retiredSnapshots; // Replaced, but possibly still read
+    std::vector<CNNWeightSnapshot*> freeSnapshots; // Reclaimed, reused by publish
+
+    // Publishes a first snapshot of the layers, so that acquire never returns 0
+    CNNSnapshotPublisher(CNNLayer **_layers,uint32_t _layerCount,CNNThreadPool *_threadPool);
+    // There must be no registered readers left
+    ~CNNSnapshotPublisher();
+
+    // Copies the layers into a new snapshot and makes it the current one. The layers must not be changed while publish runs.
+    void publish(CNNLayer **_layers,uint32_t _layerCount,uint64_t _iteration);
+    // Moves the retired snapshots that no reader can still hold to freeSnapshots
+    void reclaim();
+
+    // Returns the slot of a new reader (throws if all CNN_SNAPSHOT_MAX_READER_COUNT slots are used)
+    uint32_t registerReader();
+    void unregisterReader(uint32_t reader);
+    // Returns the current snapshot, which stays valid until release is called with the same slot. A reader holds at most one snapshot at a time.
+    CNNWeightSnapshot *acquire(uint32_t reader);
+    void release(uint32_t reader);
+
+    static void freeSnapshot(CNNWeightSnapshot *snapshot);
+};
+
+#endif // CNNSNAPSHOT_H
@@ -0,0 +1,396 @@
+#include "cnnsourcegenerator.h"
+
+// Kernels of the generated code. The template arguments are the shapes of a layer (feature maps, height and width of its input and output, receptive field,
+// stride, zero padding); the arrays are flat, in the order of the CNNLayer arrays (feature map -> row -> pixel, see CNNLayer::weights for the weights).
+// Every kernel adds up in the order of the corresponding CNNLayer kernel (see CNNSourceGenerator).
+static const char *generatedKernels=R"(template<int inputFeatureMapCount,int inputHeight,int inputWidth,int featureMapCount,int height,int width,int receptiveFieldWidth,int receptiveFieldHeight,
+         int strideX,int strideY,int zeroPaddingX,int zeroPaddingY>
+inline void conv(const double *input,const double *weights,const double *biasWeights,double *output)
+{
+    // Like CNN_CONV_ALGORITHM_ROWS: the products of every output pixel are added in the order feature map in previous layer -> receptive field y -> receptive field x,
+    // but every weight is applied to a whole output row at once (the pixels whose receptive field pixel lies in the zero padding are left out)
+    for(int featureMapInThisLayer=0;featureMapInThisLayer<featureMapCount;featureMapInThisLayer++)
+    {
+        for(int y=0;y<height;y++)
+        {
+            double *__restrict outputRow=output+(featureMapInThisLayer*height+y)*width;
+            for(int x=0;x<width;x++)
+                outputRow[x]=biasWeights[featureMapInThisLayer];
+
+            const int offsetY=-zeroPaddingY+strideY*y;
+            const int receptiveFieldStartY=offsetY<0?-offsetY:0;
+            const int receptiveFieldEndY=inputHeight-offsetY<receptiveFieldHeight?inputHeight-offsetY:receptiveFieldHeight;
+            for(int featureMapInPreviousLayer=0;featureMapInPreviousLayer<inputFeatureMapCount;featureMapInPreviousLayer++)
+            {
+                for(int receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                {
+                    const double *__restrict inputRow=input+(featureMapInPreviousLayer*inputHeight+offsetY+receptiveFieldY)*inputWidth;
+                    const double *weightRow=weights+((featureMapInPreviousLayer*featureMapCount+featureMapInThisLayer)*receptiveFieldHeight+receptiveFieldY)*receptiveFieldWidth;
+                    for(int receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                    {
+                        // Output pixels x with 0<=-zeroPaddingX+strideX*x+receptiveFieldX<inputWidth (constants after unrolling)
+                        const int firstInputX=receptiveFieldX-zeroPaddingX;
+                        const int startX=firstInputX>=0?0:(-firstInputX+strideX-1)/strideX;
+                        const int endX=inputWidth-firstInputX<=0?0:(inputWidth-firstInputX-1)/strideX+1<width?(inputWidth-firstInputX-1)/strideX+1:width;
+                        const double weight=weightRow[receptiveFieldX];
+                        for(int x=startX;x<endX;x++)
+                            outputRow[x]+=inputRow[firstInputX+strideX*x]*weight;
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<int featureMapCount,int inputHeight,int inputWidth,int height,int width,int receptiveFieldWidth,int receptiveFieldHeight,int strideX,int strideY,int zeroPaddingX,int zeroPaddingY>
+inline void maxpool(const double *input,double *output)
+{
+    for(int featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        for(int y=0;y<height;y++)
+        {
+            const int offsetY=-zeroPaddingY+strideY*y;
+            const int receptiveFieldStartY=offsetY<0?-offsetY:0;
+            const int receptiveFieldEndY=inputHeight-offsetY<receptiveFieldHeight?inputHeight-offsetY:receptiveFieldHeight;
+            for(int x=0;x<width;x++)
+            {
+                const int offsetX=-zeroPaddingX+strideX*x;
+                const int receptiveFieldStartX=offsetX<0?-offsetX:0;
+                const int receptiveFieldEndX=inputWidth-offsetX<receptiveFieldWidth?inputWidth-offsetX:receptiveFieldWidth;
+                double highestValue=-DBL_MAX;
+                for(int receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                {
+                    const double *inputRow=input+(featureMap*inputHeight+offsetY+receptiveFieldY)*inputWidth;
+                    for(int receptiveFieldX=receptiveFieldStartX;receptiveFieldX<receptiveFieldEndX;receptiveFieldX++)
+                    {
+                        if(inputRow[offsetX+receptiveFieldX]>highestValue)
+                            highestValue=inputRow[offsetX+receptiveFieldX];
+                    }
+                }
+                output[(featureMap*height+y)*width+x]=highestValue;
+            }
+        }
+    }
+}
+
+// Zero padding counts as values of 0; the sums of the receptive field columns are added up from left to right
+template<int featureMapCount,int inputHeight,int inputWidth,int height,int width,int receptiveFieldWidth,int receptiveFieldHeight,int strideX,int strideY,int zeroPaddingX,int zeroPaddingY>
+inline void avgpool(const double *input,double *output)
+{
+    const double factor=1.0/(double)(receptiveFieldWidth*receptiveFieldHeight);
+    for(int featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        for(int y=0;y<height;y++)
+        {
+            const int offsetY=-zeroPaddingY+strideY*y;
+            const int receptiveFieldStartY=offsetY<0?-offsetY:0;
+            const int receptiveFieldEndY=inputHeight-offsetY<receptiveFieldHeight?inputHeight-offsetY:receptiveFieldHeight;
+            for(int x=0;x<width;x++)
+            {
+                const int offsetX=-zeroPaddingX+strideX*x;
+                double sum=0.0;
+                for(int receptiveFieldX=0;receptiveFieldX<receptiveFieldWidth;receptiveFieldX++)
+                {
+                    double columnSum=0.0;
+                    if(offsetX+receptiveFieldX>=0&&offsetX+receptiveFieldX<inputWidth)
+                    {
+                        for(int receptiveFieldY=receptiveFieldStartY;receptiveFieldY<receptiveFieldEndY;receptiveFieldY++)
+                            columnSum+=input[(featureMap*inputHeight+offsetY+receptiveFieldY)*inputWidth+offsetX+receptiveFieldX];
+                    }
+                    sum+=columnSum;
+                }
+                output[(featureMap*height+y)*width+x]=sum*factor;
+            }
+        }
+    }
+}
+
+// Like CNNLayer::sumRow: two partial sums (even and odd x) where CNNLayer uses SSE2
+inline double sumRow(const double *source,int count)
+{
+    int x=0;
+    double sum=0.0;
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&_M_IX86_FP>=2)
+    double evenSum=0.0;
+    double oddSum=0.0;
+    for(;x+2<=count;x+=2)
+    {
+        evenSum+=source[x];
+        oddSum+=source[x+1];
+    }
+    sum=evenSum+oddSum;
+#endif
+    for(;x<count;x++)
+        sum+=source[x];
+    return sum;
+}
+
+template<int featureMapCount,int inputHeight,int inputWidth>
+inline void globalAvgpool(const double *input,double *output)
+{
+    const double factor=1.0/(double)(inputWidth*inputHeight);
+    for(int featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        double sum=0.0;
+        for(int y=0;y<inputHeight;y++)
+            sum+=sumRow(input+(featureMap*inputHeight+y)*inputWidth,inputWidth);
+        output[featureMap]=sum*factor;
+    }
+}
+
+template<int count>
+inline void relu(const double *input,double *output)
+{
+    for(int index=0;index<count;index++)
+        output[index]=0.0>input[index]?0.0:input[index];
+}
+
+// BATCHNORM in inference mode: output=factor*input+offset per feature map
+template<int featureMapCount,int pixelCount>
+inline void batchnorm(const double *input,const double *factors,const double *offsets,double *output)
+{
+    for(int featureMap=0;featureMap<featureMapCount;featureMap++)
+    {
+        for(int pixel=0;pixel<pixelCount;pixel++)
+            output[featureMap*pixelCount+pixel]=factors[featureMap]*input[featureMap*pixelCount+pixel]+offsets[featureMap];
+    }
+}
+
+// Weights: input value -> neuron
+template<int inputCount,int neuronCount>
+inline void fc(const double *input,const double *weights,const double *biasWeights,double *output)
+{
+    for(int neuron=0;neuron<neuronCount;neuron++)
+    {
+        double sum=biasWeights[neuron];
+        for(int index=0;index<inputCount;index++)
+            sum+=input[index]*weights[index*neuronCount+neuron];
+        output[neuron]=sum;
+    }
+}
+
+template<int count>
+inline void softmax(const double *input,double *output)
+{
+    double highestValue=-DBL_MAX;
+    for(int index=0;index<count;index++)
+    {
+        if(input[index]>highestValue)
+            highestValue=input[index];
+    }
+    double ePowSum=0.0;
+    for(int index=0;index<count;index++)
+        ePowSum+=exp(input[index]-highestValue);
+    const double logSumExp=highestValue+log(ePowSum);
+    for(int index=0;index<count;index++)
+        output[index]=exp(input[index]-logSumExp);
+}
+)";
+
+bool CNNSourceGenerator::generate(const char *fileName, CNNLayer **_layers, uint32_t _layerCount, const char *_namespaceName)
+{
+    uint32_t inferenceLayerCount;
+    CNNLayer **inferenceLayers=CNNLayer::createInferenceLayers(_layers,_layerCount,inferenceLayerCount);
+
+    std::string temporaryFileName=std::string(fileName)+".tmp";
+    FILE *f=fopen(temporaryFileName.c_str(),"w");
+    bool ok=f!=0&&writeSource(f,inferenceLayers,inferenceLayerCount,_namespaceName);
+    if(f!=0)
+        ok=fclose(f)==0&&ok;
+
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        delete inferenceLayers[layerIndex];
+    free(inferenceLayers);
+
+    if(!ok)
+    {
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(fileName); // rename doesn't replace existing files on Windows
+#endif
+    return rename(temporaryFileName.c_str(),fileName)==0;
+}
+
+bool CNNSourceGenerator::writeSource(FILE *f, CNNLayer **inferenceLayers, uint32_t inferenceLayerCount, const char *_namespaceName)
+{
+    if(inferenceLayerCount==0)
+        return false;
+    CNNLayer *firstLayer=inferenceLayers[0];
+    CNNLayer *lastLayer=inferenceLayers[inferenceLayerCount-1];
+    uint32_t inputCount=firstLayer->previousLayerFeatureMapCount*firstLayer->previousLayerSingleFeatureMapHeight*firstLayer->previousLayerSingleFeatureMapWidth;
+    uint32_t outputCount=lastLayer->featureMapCount*lastLayer->singleFeatureMapHeight*lastLayer->singleFeatureMapWidth;
+
+    // The outputs of all layers but the last one alternate between the two workspace buffers
+    uint32_t workspaceBufferSize=1;
+    for(uint32_t layerIndex=0;layerIndex+1<inferenceLayerCount;layerIndex++)
+    {
+        CNNLayer *layer=inferenceLayers[layerIndex];
+        workspaceBufferSize=__max(workspaceBufferSize,layer->featureMapCount*layer->singleFeatureMapHeight*layer->singleFeatureMapWidth);
+    }
+
+    bool ok=fprintf(f,"// Generated by ConvolutionalNeuralNetwork --generate-source; do not edit.\n"
+                      "// Inference of a trained network; needs nothing but the C math library (see CNNSourceGenerator). All loop bounds are constants,\n"
+                      "// so compile with full optimization (e.g. -O3); add -ffp-contract=off on targets with FMA to keep the outputs bit-identical to the network's.\n"
+                      "// Layers:\n")>0;
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount&&ok;layerIndex++)
+    {
+        CNNLayer *layer=inferenceLayers[layerIndex];
+        ok=fprintf(f,"//   %u: %s %ux%dx%d",layerIndex+1,getLayerTypeName(layer->type),layer->featureMapCount,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth)>0;
+        if(ok&&(layer->type==CNN_LAYER_TYPE_CONV||layer->type==CNN_LAYER_TYPE_MAXPOOL||layer->type==CNN_LAYER_TYPE_AVGPOOL))
+        {
+            ok=fprintf(f," (receptive field %dx%d, stride %ux%u, zero padding %dx%d)",layer->receptiveFieldWidth,layer->receptiveFieldHeight,
+                       layer->strideX,layer->strideY,layer->zeroPaddingX,layer->zeroPaddingY)>0;
+        }
+        ok=ok&&fprintf(f,"\n")>0;
+    }
+
+    ok=ok&&fprintf(f,"\n#include <stdint.h>\n#include <float.h>\n#include <math.h>\n\nnamespace %s\n{\n\n",_namespaceName)>0;
+    ok=ok&&fprintf(f,"// Input: feature map -> row -> pixel (%ux%dx%d values, scaled like the training images)\n"
+                     "constexpr uint32_t inputCount=%u;\n"
+                     "// Values of the last layer (%s)\n"
+                     "constexpr uint32_t outputCount=%u;\n"
+                     "constexpr uint32_t workspaceBufferSize=%u;\n\n",
+                   firstLayer->previousLayerFeatureMapCount,firstLayer->previousLayerSingleFeatureMapHeight,firstLayer->previousLayerSingleFeatureMapWidth,inputCount,
+                   lastLayer->type==CNN_LAYER_TYPE_SOFTMAX?"the class probabilities":getLayerTypeName(lastLayer->type),outputCount,workspaceBufferSize)>0;
+    ok=ok&&fprintf(f,"// Intermediate values of one classification; every thread that classifies at the same time needs its own workspace\n"
+                     "struct Workspace\n{\n"
+                     "    alignas(%d) double buffer1[workspaceBufferSize];\n"
+                     "    alignas(%d) double buffer2[workspaceBufferSize];\n"
+                     "};\n\n",CNN_SOURCE_GENERATOR_ALIGNMENT,CNN_SOURCE_GENERATOR_ALIGNMENT)>0;
+    ok=ok&&fputs(generatedKernels,f)>=0;
+
+    // Parameters
+    char name[64];
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount&&ok;layerIndex++)
+    {
+        CNNLayer *layer=inferenceLayers[layerIndex];
+        if(layer->type==CNN_LAYER_TYPE_CONV||layer->type==CNN_LAYER_TYPE_FC)
+        {
+            ok=fprintf(f,"\n")>0;
+            snprintf(name,sizeof(name),"layer%uWeights",layerIndex+1);
+            ok=ok&&writeArray(f,name,CNNLayer::getWeightTypeArrayData(layer->weights),layer->weightCount);
+            snprintf(name,sizeof(name),"layer%uBiasWeights",layerIndex+1);
+            ok=ok&&writeArray(f,name,layer->biasWeights,layer->featureMapCount);
+        }
+        else if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            // Calculated like CNNLayer::batchnormFeatureMaps calculates them
+            double *factors=(double*)malloc(layer->featureMapCount*sizeof(double));
+            double *offsets=(double*)malloc(layer->featureMapCount*sizeof(double));
+            for(uint32_t featureMap=0;featureMap<layer->featureMapCount;featureMap++)
+            {
+                double inverseStandardDeviation=1.0/sqrt(layer->runningVariances[featureMap]+CNN_BATCHNORM_EPSILON);
+                factors[featureMap]=layer->weights[featureMap][0][0][0]*inverseStandardDeviation;
+                offsets[featureMap]=layer->biasWeights[featureMap]-factors[featureMap]*layer->runningMeans[featureMap];
+            }
+            ok=fprintf(f,"\n")>0;
+            snprintf(name,sizeof(name),"layer%uFactors",layerIndex+1);
+            ok=ok&&writeArray(f,name,factors,layer->featureMapCount);
+            snprintf(name,sizeof(name),"layer%uOffsets",layerIndex+1);
+            ok=ok&&writeArray(f,name,offsets,layer->featureMapCount);
+            free(factors);
+            free(offsets);
+        }
+    }
+
+    ok=ok&&fprintf(f,"\n// Writes the outputCount values of the last layer to \"outputs\" and returns the index of the highest one (the class for a SOFTMAX layer)\n"
+                     "inline uint32_t classify(const double *input,double *outputs,Workspace &workspace)\n{\n")>0;
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount&&ok;layerIndex++)
+    {
+        CNNLayer *layer=inferenceLayers[layerIndex];
+        const char *layerInput=layerIndex==0?"input":layerIndex%2==1?"workspace.buffer1":"workspace.buffer2";
+        const char *layerOutput=layerIndex+1==inferenceLayerCount?"outputs":layerIndex%2==0?"workspace.buffer1":"workspace.buffer2";
+        uint32_t layerInputCount=layer->previousLayerFeatureMapCount*layer->previousLayerSingleFeatureMapHeight*layer->previousLayerSingleFeatureMapWidth;
+
+        if(layer->type==CNN_LAYER_TYPE_CONV)
+        {
+            ok=fprintf(f,"    conv<%u,%d,%d,%u,%d,%d,%d,%d,%u,%u,%d,%d>(%s,layer%uWeights,layer%uBiasWeights,%s);\n",layer->previousLayerFeatureMapCount,
+                       layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,layer->featureMapCount,layer->singleFeatureMapHeight,
+                       layer->singleFeatureMapWidth,layer->receptiveFieldWidth,layer->receptiveFieldHeight,layer->strideX,layer->strideY,layer->zeroPaddingX,
+                       layer->zeroPaddingY,layerInput,layerIndex+1,layerIndex+1,layerOutput)>0;
+        }
+        else if(layer->type==CNN_LAYER_TYPE_MAXPOOL||layer->type==CNN_LAYER_TYPE_AVGPOOL)
+        {
+            ok=fprintf(f,"    %s<%u,%d,%d,%d,%d,%d,%d,%u,%u,%d,%d>(%s,%s);\n",layer->type==CNN_LAYER_TYPE_MAXPOOL?"maxpool":"avgpool",layer->featureMapCount,
+                       layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,layer->singleFeatureMapHeight,layer->singleFeatureMapWidth,
+                       layer->receptiveFieldWidth,layer->receptiveFieldHeight,layer->strideX,layer->strideY,layer->zeroPaddingX,layer->zeroPaddingY,layerInput,layerOutput)>0;
+        }
+        else if(layer->type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
+        {
+            ok=fprintf(f,"    globalAvgpool<%u,%d,%d>(%s,%s);\n",layer->featureMapCount,layer->previousLayerSingleFeatureMapHeight,layer->previousLayerSingleFeatureMapWidth,
+                       layerInput,layerOutput)>0;
+        }
+        else if(layer->type==CNN_LAYER_TYPE_RELU)
+            ok=fprintf(f,"    relu<%u>(%s,%s);\n",layerInputCount,layerInput,layerOutput)>0;
+        else if(layer->type==CNN_LAYER_TYPE_BATCHNORM)
+        {
+            ok=fprintf(f,"    batchnorm<%u,%d>(%s,layer%uFactors,layer%uOffsets,%s);\n",layer->featureMapCount,layer->singleFeatureMapHeight*layer->singleFeatureMapWidth,
+                       layerInput,layerIndex+1,layerIndex+1,layerOutput)>0;
+        }
+        else if(layer->type==CNN_LAYER_TYPE_FC)
+            ok=fprintf(f,"    fc<%u,%u>(%s,layer%uWeights,layer%uBiasWeights,%s);\n",layerInputCount,layer->featureMapCount,layerInput,layerIndex+1,layerIndex+1,layerOutput)>0;
+        else if(layer->type==CNN_LAYER_TYPE_SOFTMAX)
+            ok=fprintf(f,"    softmax<%u>(%s,%s);\n",layer->featureMapCount,layerInput,layerOutput)>0;
+        else
+            return false; // DROPOUT layers are left out by createInferenceLayers
+    }
+    ok=ok&&fprintf(f,"\n    uint32_t highestOutput=0;\n"
+                     "    for(uint32_t output=1;output<outputCount;output++)\n"
+                     "    {\n"
+                     "        if(outputs[output]>outputs[highestOutput])\n"
+                     "            highestOutput=output;\n"
+                     "    }\n"
+                     "    return highestOutput;\n"
+                     "}\n\n"
+                     "} // namespace %s\n",_namespaceName)>0;
+    return ok;
+}
+
+bool CNNSourceGenerator::writeArray(FILE *f, const char *name, const double *values, uint32_t count)
+{
+    bool ok=fprintf(f,"alignas(%d) static const double %s[%u]=\n{",CNN_SOURCE_GENERATOR_ALIGNMENT,name,count)>0;
+    char text[64];
+    for(uint32_t index=0;index<count&&ok;index++)
+    {
+        if(!std::isfinite(values[index]))
+            return false;
+        formatDouble(values[index],text,sizeof(text));
+        const char *separator=index==0?"\n    ":index%CNN_SOURCE_GENERATOR_VALUES_PER_LINE==0?",\n    ":",";
+        ok=fprintf(f,"%s%s",separator,text)>0;
+    }
+    return ok&&fprintf(f,"\n};\n")>0;
+}
+
+void CNNSourceGenerator::formatDouble(double value, char *text, uint32_t textSize)
+{
+    // 17 significant digits identify every double; "1" would be an int literal, and -0 would lose its sign
+    snprintf(text,textSize,"%.17g",value);
+    if(strpbrk(text,".e")==0&&strlen(text)+2<textSize)
+        strcat(text,".0");
+}
+
+const char *CNNSourceGenerator::getLayerTypeName(uint8_t type)
+{
+    if(type==CNN_LAYER_TYPE_CONV)
+        return "CONV";
+    else if(type==CNN_LAYER_TYPE_MAXPOOL)
+        return "MAXPOOL";
+    else if(type==CNN_LAYER_TYPE_RELU)
+        return "RELU";
+    else if(type==CNN_LAYER_TYPE_FC)
+        return "FC";
+    else if(type==CNN_LAYER_TYPE_SOFTMAX)
+        return "SOFTMAX";
+    else if(type==CNN_LAYER_TYPE_BATCHNORM)
+        return "BATCHNORM";
+    else if(type==CNN_LAYER_TYPE_DROPOUT)
+        return "DROPOUT";
+    else if(type==CNN_LAYER_TYPE_AVGPOOL)
+        return "AVGPOOL";
+    else if(type==CNN_LAYER_TYPE_GLOBAL_AVGPOOL)
+        return "GLOBAL_AVGPOOL";
+    return "unknown";
+}
@@ -0,0 +1,42 @@
+#ifndef CNNSOURCEGENERATOR_H
+#define CNNSOURCEGENERATOR_H
+
+#define CNN_SOURCE_GENERATOR_ALIGNMENT 64 // Bytes; alignment of the weight arrays and workspace buffers of the generated code (one cache line)
+#define CNN_SOURCE_GENERATOR_VALUES_PER_LINE 6 // Of the weight arrays
+#define CNN_SOURCE_GENERATOR_DEFAULT_NAMESPACE "cnnmodel"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <string>
+
+#include "cnnlayer.h"
+
+// Ahead-of-time code generation: writes the inference layers of a trained network (see CNNLayer::createInferenceLayers) as one self-contained
+// C++11 source file that only needs the C math library. In the generated code
+// - every layer is an instantiation of a kernel template whose arguments are the layer's shapes, so all loop bounds and strides are constants,
+// - the weights are aligned static const arrays (BATCHNORM layers that are not folded into a CONV layer are stored as a factor and an offset per feature map),
+// - the intermediate values are stored in two buffers of a workspace struct whose size is fixed at compile time (the caller decides whether it lives on
+//   the stack, in static memory or per thread), so a classification allocates nothing and can run on any number of threads with their own workspaces.
+// The kernels add up the same values in the same order as the NCHW kernels of CNNLayer with CNN_CONV_ALGORITHM_DIRECT, so the generated classifier
+// produces bit-identical outputs when both are compiled with the same floating point settings (e.g. no contraction into fused multiply-adds).
+// Everything is placed in a namespace, so the file can be compiled on its own or included into one translation unit of a service.
+
+class CNNSourceGenerator
+{
+public:
+    // Writes to a temporary file that replaces fileName when complete (like CNNCheckpoint::save). _namespaceName must be a valid C++ identifier.
+    // Returns false if the file can't be written or a weight isn't finite.
+    static bool generate(const char *fileName,CNNLayer **_layers,uint32_t _layerCount,const char *_namespaceName);
+    static bool writeSource(FILE *f,CNNLayer **inferenceLayers,uint32_t inferenceLayerCount,const char *_namespaceName);
+    // alignas(CNN_SOURCE_GENERATOR_ALIGNMENT) static const double name[count]={...};
+    static bool writeArray(FILE *f,const char *name,const double *values,uint32_t count);
+    // Text that is read back as the same double ("%.17g", with a decimal point, so that -0.0 keeps its sign)
+    static void formatDouble(double value,char *text,uint32_t textSize);
+    static const char *getLayerTypeName(uint8_t type);
+};
+
+#endif // CNNSOURCEGENERATOR_H
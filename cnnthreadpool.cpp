@@ -0,0 +1,139 @@
+#include "cnnthreadpool.h"
+
+CNNThreadPool::CNNThreadPool(uint32_t _workerCount)
+{
+    uint32_t workerCount=_workerCount;
+    if(workerCount==0)
+    {
+        uint32_t coreCount=std::thread::hardware_concurrency();
+        workerCount=coreCount>1?coreCount-1:1;
+    }
+
+    nextQueue.store(0);
+    queuedTaskCount=0;
+    stopRequested=false;
+
+    queues.resize(workerCount);
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+        queueMutexes.push_back(new std::mutex());
+    for(uint32_t workerIndex=0;workerIndex<workerCount;workerIndex++)
+        threads.push_back(std::thread(&CNNThreadPool::workerMain,this,workerIndex));
+}
+
+CNNThreadPool::~CNNThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        stopRequested=true;
+    }
+    workAvailable.notify_all();
+    for(uint32_t workerIndex=0;workerIndex<threads.size();workerIndex++)
+        threads[workerIndex].join();
+    for(uint32_t workerIndex=0;workerIndex<queueMutexes.size();workerIndex++)
+        delete queueMutexes[workerIndex];
+}
+
+uint32_t CNNThreadPool::getWorkerCount()
+{
+    return threads.size();
+}
+
+void CNNThreadPool::parallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const std::function<void(uint32_t,uint32_t)> &body)
+{
+    if(end<=begin)
+        return;
+    if(grainSize==0)
+        grainSize=1;
+
+    uint32_t taskCount=(end-begin+grainSize-1)/grainSize;
+    if(taskCount==1)
+    {
+        body(begin,end);
+        return;
+    }
+
+    std::atomic<uint32_t> remainingTaskCount(taskCount);
+    uint32_t queueCount=queues.size();
+    uint32_t firstQueue=nextQueue.fetch_add(1)%queueCount;
+
+    // Counted before the tasks are visible: a worker may take a task (and decrement the count) as soon as it is pushed
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queuedTaskCount+=taskCount;
+    }
+    for(uint32_t task=0;task<taskCount;task++)
+    {
+        CNNThreadPoolTask t;
+        t.body=&body;
+        t.first=begin+task*grainSize;
+        t.last=__min(end,t.first+grainSize);
+        t.remainingTaskCount=&remainingTaskCount;
+
+        uint32_t queue=(firstQueue+task)%queueCount;
+        std::lock_guard<std::mutex> lock(*queueMutexes[queue]);
+        queues[queue].push_back(t);
+    }
+    workAvailable.notify_all();
+
+    // Help instead of waiting (this also runs tasks of other callers, which only makes them finish sooner)
+    while(remainingTaskCount.load(std::memory_order_acquire)>0)
+    {
+        if(!tryRunTask(firstQueue))
+            std::this_thread::yield(); // The remaining tasks are being executed by the workers
+    }
+}
+
+bool CNNThreadPool::tryRunTask(uint32_t preferredQueue)
+{
+    uint32_t queueCount=queues.size();
+    CNNThreadPoolTask task;
+    bool found=false;
+
+    for(uint32_t i=0;i<queueCount&&!found;i++)
+    {
+        uint32_t queue=(preferredQueue+i)%queueCount;
+        std::lock_guard<std::mutex> lock(*queueMutexes[queue]);
+        if(queues[queue].empty())
+            continue;
+        if(i==0)
+        {
+            // Own queue: newest task first (its data is most likely still in the cache)
+            task=queues[queue].back();
+            queues[queue].pop_back();
+        }
+        else
+        {
+            // Steal the oldest task
+            task=queues[queue].front();
+            queues[queue].pop_front();
+        }
+        found=true;
+    }
+
+    if(!found)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queuedTaskCount--;
+    }
+
+    (*task.body)(task.first,task.last);
+    task.remainingTaskCount->fetch_sub(1,std::memory_order_release);
+    return true;
+}
+
+void CNNThreadPool::workerMain(uint32_t workerIndex)
+{
+    for(;;)
+    {
+        if(tryRunTask(workerIndex))
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        while(queuedTaskCount==0&&!stopRequested)
+            workAvailable.wait(lock);
+        if(stopRequested)
+            return;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef CNNTHREADPOOL_H
+#define CNNTHREADPOOL_H
+
+#define CNN_THREAD_POOL_UPDATE_GRAIN 4096 // Parameters per task when the optimizer update of a layer is split (see CNNLayer::applyDiffs)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+#include "../_DefaultLibrary/text.h"
+
+// A range [first,last) of a parallelFor call
+struct CNNThreadPoolTask
+{
+    const std::function<void(uint32_t,uint32_t)> *body;
+    uint32_t first;
+    uint32_t last;
+    std::atomic<uint32_t> *remainingTaskCount; // Of the parallelFor call the task belongs to
+};
+
+// Work-stealing thread pool for splitting the work of one layer call across cores (intra-layer parallelism).
+// Every worker has its own deque: it takes tasks from the back of its own deque and steals from the front of the others' when it runs out.
+// The thread calling parallelFor distributes the tasks over the deques and then helps to execute tasks until its own tasks are done,
+// so several threads may call parallelFor at the same time (e.g. the GUI thread and the pipeline stages).
+
+class CNNThreadPool
+{
+public:
+    std::vector<std::thread> threads;
+    std::vector<std::deque<CNNThreadPoolTask> > queues; // One per worker
+    std::vector<std::mutex*> queueMutexes;
+    std::atomic<uint32_t> nextQueue; // Round-robin start for distributing tasks
+
+    // Sleeping workers
+    std::mutex sleepMutex;
+    std::condition_variable workAvailable;
+    uint32_t queuedTaskCount; // Protected by sleepMutex; counted before the tasks are pushed, so it can briefly exceed the queued tasks but never underflow
+    bool stopRequested;
+
+    // _workerCount=0: one worker less than the amount of cores (the calling thread works, too)
+    CNNThreadPool(uint32_t _workerCount);
+    ~CNNThreadPool();
+
+    uint32_t getWorkerCount();
+
+    // Calls body(first,last) for consecutive ranges of at most grainSize indices that together cover [begin,end), and returns when all calls are done.
+    // The ranges may run concurrently and in any order, so body must only write data that belongs to its own range.
+    void parallelFor(uint32_t begin,uint32_t end,uint32_t grainSize,const std::function<void(uint32_t,uint32_t)> &body);
+
+    void workerMain(uint32_t workerIndex);
+    // Runs one task from queue "preferredQueue" (from the back) or stolen from another queue (from the front); returns false if all queues are empty.
+    bool tryRunTask(uint32_t preferredQueue);
+};
+
+#endif // CNNTHREADPOOL_H
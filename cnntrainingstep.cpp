@@ -0,0 +1,67 @@
+#include "cnntrainingstep.h"
+
+CNNTrainingStep::CNNTrainingStep(CNNLayer **_layers, uint32_t _layerCount)
+{
+    layers=_layers;
+    layerCount=_layerCount;
+}
+
+double ***CNNTrainingStep::run(double ***image, uint8_t label, CNNOptimizer *optimizer, double &loss)
+{
+    // Forward pass
+    // MODIFY IN MAINWINDOW.CPP, TOO!
+
+    loss=0.0;
+    double ***previousLayerOutput=image; // Input for first layer: Image data
+    for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+    {
+        CNNLayer *thisLayer=layers[layerIndex];
+        double ***output=thisLayer->forwardPass(previousLayerOutput);
+
+        bool inputKept=forwardFinished&&forwardFinished(layerIndex,previousLayerOutput);
+        if(layerIndex>0&&!inputKept)
+            CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+        previousLayerOutput=output;
+    }
+
+    // Backward pass
+
+    double ***higherLayerInputDiffs=0;
+    for(uint32_t _layerIndex=layerCount;_layerIndex>0;_layerIndex--) // _layerIndex is of type uint32_t and cannot be <0, therefore we have to artificially increment it by 1
+    {
+        uint32_t layerIndex=_layerIndex-1; // The actual index of this layer
+        CNNLayer *thisLayer=layers[layerIndex];
+
+        if(backwardStarting)
+            backwardStarting(layerIndex);
+
+        double ***inputDiffs=0;
+        double ****weightDiffs=0;
+        double *biasDiffs=0;
+
+        // The diffs of every layer type are checked against numerical gradients by --gradient-check (see CNNGradientCheck)
+
+        thisLayer->calculateDiffs(weightDiffs,biasDiffs,higherLayerInputDiffs,inputDiffs,label);
+        if(thisLayer->type==CNN_LAYER_TYPE_SOFTMAX)
+            loss=thisLayer->defaultContext.loss;
+
+        if(!(diffsCalculated&&diffsCalculated(layerIndex,weightDiffs,biasDiffs)))
+        {
+            thisLayer->applyDiffs(weightDiffs,biasDiffs,optimizer);
+            if(weightDiffs!=0)
+                thisLayer->freeWeightDiffs(weightDiffs);
+            if(biasDiffs!=0)
+                CNNLayer::freeBiasTypeArray(biasDiffs);
+        }
+
+        if(higherLayerInputDiffs!=0)
+            CNNLayer::freeArray(higherLayerInputDiffs,thisLayer->featureMapCount,thisLayer->singleFeatureMapHeight);
+        higherLayerInputDiffs=inputDiffs; // Will be freed when processing the next layer
+
+        if(backwardFinished)
+            backwardFinished(layerIndex);
+    }
+    CNNLayer::freeArray(higherLayerInputDiffs,layers[0]->previousLayerFeatureMapCount,layers[0]->previousLayerSingleFeatureMapHeight);
+
+    return previousLayerOutput;
+}
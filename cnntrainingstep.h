@@ -0,0 +1,40 @@
+#ifndef CNNTRAININGSTEP_H
+#define CNNTRAININGSTEP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <functional>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+
+// Forward pass, backward pass and update of a stack of layers for one example with the default contexts of the layers: the training loop of
+// TrainingThread, CNNDataParallelTrainer, CNNDistributedTrainer and CNNActivationCheckpointing. The diffs of a layer are applied as soon as
+// they are calculated (the layers below don't depend on its weights any more).
+// The trainers that do more than that (keep activations, recompute them, all-reduce the diffs before the update) set the hooks; all of them are optional.
+
+class CNNTrainingStep
+{
+public:
+    CNNLayer **layers;
+    uint32_t layerCount;
+
+    // After the forward pass of a layer, with the array it got as input; returning true keeps the input (the caller frees it then), else it is freed
+    // (except for the image, which belongs to the caller anyway)
+    std::function<bool(uint32_t layerIndex,double ***input)> forwardFinished;
+    // Before calculateDiffs of a layer
+    std::function<void(uint32_t layerIndex)> backwardStarting;
+    // With the diffs of a layer (0 for layers without weights); returning true takes them over (the caller applies and frees them then),
+    // else they are applied and freed right away
+    std::function<bool(uint32_t layerIndex,double ****weightDiffs,double *biasDiffs)> diffsCalculated;
+    // After the diffs of a layer were handled and the input diffs of the layer above were freed
+    std::function<void(uint32_t layerIndex)> backwardFinished;
+
+    CNNTrainingStep(CNNLayer **_layers,uint32_t _layerCount);
+
+    // Returns the output of the last layer (calculated before the update, to be freed by the caller) and stores the cross-entropy loss of the example
+    // in "loss" (0 if the last layer isn't a SOFTMAX layer)
+    double ***run(double ***image,uint8_t label,CNNOptimizer *optimizer,double &loss);
+};
+
+#endif // CNNTRAININGSTEP_H
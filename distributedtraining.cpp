@@ -0,0 +1,103 @@
+#include "distributedtraining.h"
+
+int DistributedTraining::run(uint32_t rank, uint32_t worldSize, uint64_t stepCount, uint16_t basePort, const std::vector<std::string> &hosts, const QString &checkpointFileName)
+{
+    uint32_t imageCount=IMAGES_PER_BATCH*BATCH_COUNT;
+    uint8_t *imageLabels=(uint8_t*)malloc(imageCount*sizeof(uint8_t));
+    double ****imageInputData=(double****)malloc(imageCount*sizeof(double***));
+    QString dir=QString(IMAGE_DATA_DIR).replace("%APP_DIR%",QCoreApplication::applicationDirPath());
+    if(!MainWindow::loadDataset(dir,0,imageLabels,imageInputData))
+    {
+        std::cerr<<"CIFAR-10 dataset not found in \""<<dir.toStdString()<<"\"."<<std::endl;
+        free(imageLabels);
+        free(imageInputData);
+        return 1;
+    }
+
+    // The ranks may seed differently (RANDOM_SEED 0); synchronizeParameters gives all of them the initial weights of rank 0
+    uint64_t seed=RANDOM_SEED!=0?RANDOM_SEED:(uint64_t)time(0);
+    CNNLayer **layers=MainWindow::createLayers(seed);
+    for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        layers[layerIndex]->setTraining(true);
+
+    int exitCode=0;
+    CNNRingAllReduce ring(rank,worldSize);
+    CNNDistributedTrainer *trainer=0;
+    if(!ring.connect(hosts,basePort,CNN_DISTRIBUTED_CONNECT_TIMEOUT_MS))
+    {
+        std::cerr<<"Rank "<<rank<<": could not connect the ring (port "<<basePort+rank<<")."<<std::endl;
+        exitCode=1;
+    }
+    else
+    {
+        trainer=new CNNDistributedTrainer(layers,LAYER_COUNT,imageInputData,imageLabels,imageCount,&ring,seed);
+        if(!trainer->synchronizeParameters())
+            exitCode=1;
+    }
+
+    // One iteration of the schedule is one step (worldSize examples), so an epoch covers every shard once
+    CNNOptimizer optimizer(DEFAULT_OPTIMIZER_TYPE,DEFAULT_LEARNING_RATE,DEFAULT_MOMENTUM,DEFAULT_WEIGHT_DECAY);
+    CNNLearningRateSchedule schedule(DEFAULT_SCHEDULE_TYPE,(imageCount+worldSize-1)/worldSize);
+    QElapsedTimer timer;
+    timer.start();
+    double intervalLossSum=0.0;
+    uint32_t intervalCorrectCount=0;
+    for(uint64_t step=0;step<stepCount&&exitCode==0;step++)
+    {
+        optimizer.learningRate=schedule.getLearningRate(DEFAULT_LEARNING_RATE,step);
+        optimizer.momentum=schedule.getMomentum(DEFAULT_MOMENTUM,step);
+        optimizer.beginStep();
+
+        uint32_t imageId;
+        double ***output;
+        double loss;
+        if(!trainer->trainStep(&optimizer,imageId,output,loss))
+        {
+            std::cerr<<"Rank "<<rank<<": the ring broke in step "<<step<<"."<<std::endl;
+            exitCode=1;
+            break;
+        }
+        uint32_t predictedLabel=0;
+        for(uint32_t label=1;label<LABEL_COUNT;label++)
+        {
+            if(output[label][0][0]>output[predictedLabel][0][0])
+                predictedLabel=label;
+        }
+        intervalCorrectCount+=predictedLabel==imageLabels[imageId]?1:0;
+        CNNLayer::freeArray(output,LABEL_COUNT,1);
+
+        schedule.reportLoss(trainer->meanLoss);
+        intervalLossSum+=trainer->meanLoss;
+        if((step+1)%DISTRIBUTED_REPORT_INTERVAL==0)
+        {
+            if(rank==0)
+                std::cout<<"step "<<step+1<<": mean loss "<<intervalLossSum/DISTRIBUTED_REPORT_INTERVAL<<", accuracy (rank 0) "
+                         <<((double)intervalCorrectCount)/DISTRIBUTED_REPORT_INTERVAL<<", "<<((double)(step+1)*worldSize)/(timer.elapsed()/1000.0)
+                         <<" examples/s"<<std::endl;
+            intervalLossSum=0.0;
+            intervalCorrectCount=0;
+        }
+    }
+
+    // The replicas only differ in their BATCHNORM running statistics
+    if(exitCode==0&&!trainer->averageRunningStatistics())
+        exitCode=1;
+    if(exitCode==0&&rank==0)
+    {
+        for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+            layers[layerIndex]->setTraining(false);
+        if(!CNNCheckpoint::save(checkpointFileName.toLocal8Bit().constData(),layers,LAYER_COUNT))
+        {
+            std::cerr<<"Could not write \""<<checkpointFileName.toStdString()<<"\"."<<std::endl;
+            exitCode=1;
+        }
+    }
+
+    delete trainer;
+    ring.disconnect();
+    CNNCheckpoint::freeLayers(layers,LAYER_COUNT);
+    MainWindow::freeDataset(0,imageInputData,BATCH_COUNT);
+    free(imageLabels);
+    free(imageInputData);
+    return exitCode;
+}
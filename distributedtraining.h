@@ -0,0 +1,32 @@
+#ifndef DISTRIBUTEDTRAINING_H
+#define DISTRIBUTEDTRAINING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <QString>
+#include <QElapsedTimer>
+#include <QCoreApplication>
+
+#include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnnschedule.h"
+#include "cnncheckpoint.h"
+#include "cnndistributed.h"
+#include "mainwindow.h"
+
+// Headless training process of a ring (see main.cpp: --distributed-train and CNNDistributedTrainer). Every rank loads the dataset and trains on
+// its own shard; rank 0 prints the progress and saves the checkpoint at the end, which the GUI and --serve pick up.
+// Every rank trains on one thread (plus the communication thread), so on one machine it makes sense to start up to one rank per core.
+class DistributedTraining
+{
+public:
+    // Returns the exit code of the process (0: all steps were trained and rank 0 saved the checkpoint)
+    static int run(uint32_t rank,uint32_t worldSize,uint64_t stepCount,uint16_t basePort,const std::vector<std::string> &hosts,const QString &checkpointFileName);
+};
+
+#endif // DISTRIBUTEDTRAINING_H
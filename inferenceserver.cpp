@@ -0,0 +1,300 @@
+#include "inferenceserver.h"
+
+void InferenceBatchJob::run()
+{
+    for(uint32_t request=0;request<requestCount;request++)
+    {
+        double ***previousLayerOutput=requests[request]->image;
+        for(uint32_t layerIndex=0;layerIndex<layerCount;layerIndex++)
+        {
+            CNNLayer *thisLayer=layers[layerIndex];
+            double ***output=thisLayer->forwardPass(previousLayerOutput,context);
+            thisLayer->freeContext(context); // No backward pass
+
+            if(layerIndex>0)
+                CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+            previousLayerOutput=output;
+        }
+
+        CNNLayer *lastLayer=layers[layerCount-1];
+        for(uint32_t label=0;label<lastLayer->featureMapCount;label++)
+            requests[request]->probabilities[label]=previousLayerOutput[label][0][0];
+        CNNLayer::freeArray(previousLayerOutput,lastLayer->featureMapCount,lastLayer->singleFeatureMapHeight);
+    }
+}
+
+InferenceServer::InferenceServer()
+{
+    server=new QLocalServer(this);
+    batchTimer=new QTimer(this);
+    batchTimer->setSingleShot(true);
+    threadPool=new QThreadPool(this);
+    workerCount=0;
+    layers=0;
+    layerCount=0;
+    classCount=0;
+
+    firstRequestNanoseconds=-1;
+    lastResponseNanoseconds=0;
+    answeredRequestCount=0;
+    batchCount=0;
+    latencies.reserve(SERVER_LATENCY_WINDOW);
+    latencyPosition=0;
+
+    connect(server,SIGNAL(newConnection()),this,SLOT(newConnection()));
+    connect(batchTimer,SIGNAL(timeout()),this,SLOT(processBatch()));
+}
+
+InferenceServer::~InferenceServer()
+{
+    threadPool->waitForDone();
+    if(layers!=0)
+        CNNCheckpoint::freeLayers(layers,layerCount);
+
+    for(uint32_t request=0;request<pendingRequests.size();request++)
+    {
+        InferenceRequest *r=pendingRequests[request];
+        if(r->image!=0)
+            CNNLayer::freeArray(r->image,3,IMAGE_HEIGHT);
+        free(r->probabilities);
+        delete r;
+    }
+}
+
+bool InferenceServer::start(QString checkpointFileName, QString socketName)
+{
+    workerCount=__max(1,QThread::idealThreadCount());
+    threadPool->setMaxThreadCount(workerCount);
+    QString convTuningCacheFileName=QString(CONV_TUNING_CACHE_FILE).replace("%APP_DIR%",QCoreApplication::applicationDirPath());
+    CNNConvTuner convTuner(convTuningCacheFileName.toLocal8Bit().constData(),true);
+
+    uint32_t checkpointLayerCount;
+    CNNLayer **checkpointLayers=CNNCheckpoint::load(checkpointFileName.toLocal8Bit().constData(),checkpointLayerCount);
+    if(checkpointLayers==0)
+    {
+        std::cerr<<"Could not load checkpoint \""<<checkpointFileName.toStdString()<<"\"."<<std::endl;
+        return false;
+    }
+
+    // BATCHNORM layers are folded into the CONV layers before them and DROPOUT layers are left out, so they cost nothing when serving
+    layers=CNNLayer::createInferenceLayers(checkpointLayers,checkpointLayerCount,layerCount);
+    CNNCheckpoint::freeLayers(checkpointLayers,checkpointLayerCount);
+    CNNLayer::setNetworkTensorLayout(layers,layerCount,TENSOR_LAYOUT);
+    convTuner.tune(layers,layerCount);
+
+    CNNLayer *firstLayer=layers[0];
+    CNNLayer *lastLayer=layers[layerCount-1];
+    if(firstLayer->previousLayerFeatureMapCount!=3||firstLayer->previousLayerSingleFeatureMapWidth!=IMAGE_WIDTH||firstLayer->previousLayerSingleFeatureMapHeight!=IMAGE_HEIGHT
+            ||lastLayer->type!=CNN_LAYER_TYPE_SOFTMAX)
+    {
+        std::cerr<<"The network in the checkpoint doesn't classify "<<IMAGE_WIDTH<<"x"<<IMAGE_HEIGHT<<" RGB images."<<std::endl;
+        return false;
+    }
+    classCount=lastLayer->featureMapCount;
+
+    QLocalServer::removeServer(socketName); // Left behind if a previous server crashed
+    if(!server->listen(socketName))
+    {
+        std::cerr<<"Could not listen on \""<<socketName.toStdString()<<"\": "<<server->errorString().toStdString()<<std::endl;
+        return false;
+    }
+
+    clock.start();
+    std::cerr<<"Serving \""<<checkpointFileName.toStdString()<<"\" on \""<<server->fullServerName().toStdString()<<"\" with "<<workerCount<<" worker threads."<<std::endl;
+    return true;
+}
+
+void InferenceServer::newConnection()
+{
+    while(server->hasPendingConnections())
+    {
+        QLocalSocket *socket=server->nextPendingConnection();
+        receiveBuffers.insert(socket,QByteArray());
+        connect(socket,SIGNAL(readyRead()),this,SLOT(socketReadyRead()));
+        connect(socket,SIGNAL(disconnected()),this,SLOT(socketDisconnected()));
+    }
+}
+
+void InferenceServer::socketDisconnected()
+{
+    QLocalSocket *socket=(QLocalSocket*)sender();
+    receiveBuffers.remove(socket);
+    socket->deleteLater();
+}
+
+void InferenceServer::socketReadyRead()
+{
+    QLocalSocket *socket=(QLocalSocket*)sender();
+    QByteArray &buffer=receiveBuffers[socket];
+    buffer.append(socket->readAll());
+
+    int position=0;
+    while(position<buffer.size())
+    {
+        char type=buffer.at(position);
+        if(type!=SERVER_REQUEST_CLASSIFY&&type!=SERVER_REQUEST_STATS)
+        {
+            // The stream can't be resynchronized
+            socket->abort();
+            return;
+        }
+        if(type==SERVER_REQUEST_CLASSIFY&&buffer.size()-position<SERVER_CLASSIFY_REQUEST_SIZE)
+            break; // Wait for the rest of the image
+
+        InferenceRequest *request=new InferenceRequest();
+        request->socket=socket;
+        request->type=type;
+        request->k=0;
+        request->image=0;
+        request->probabilities=0;
+        request->receivedNanoseconds=clock.nsecsElapsed();
+        if(firstRequestNanoseconds<0)
+            firstRequestNanoseconds=request->receivedNanoseconds;
+
+        if(type==SERVER_REQUEST_CLASSIFY)
+        {
+            const uint8_t *data=(const uint8_t*)buffer.constData()+position;
+            request->k=(uint8_t)__min((uint32_t)data[1],classCount);
+            request->probabilities=(double*)malloc(classCount*sizeof(double));
+
+            // Same conversion as for the training images (see MainWindow::MainWindow)
+            const uint8_t *pixels=data+2;
+            request->image=(double***)malloc(3*sizeof(double**));
+            for(uint32_t channel=0;channel<3;channel++)
+            {
+                request->image[channel]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*));
+                for(uint32_t y=0;y<IMAGE_HEIGHT;y++)
+                {
+                    request->image[channel][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double));
+                    for(uint32_t x=0;x<IMAGE_WIDTH;x++)
+                        request->image[channel][y][x]=((double)pixels[channel*IMAGE_WIDTH*IMAGE_HEIGHT+y*IMAGE_WIDTH+x])/255.0;
+                }
+            }
+            position+=SERVER_CLASSIFY_REQUEST_SIZE;
+        }
+        else
+            position++;
+
+        pendingRequests.push_back(request);
+    }
+    buffer.remove(0,position);
+
+    if(pendingRequests.size()>=SERVER_MAX_BATCH_SIZE)
+        processBatch();
+    else if(!pendingRequests.empty()&&!batchTimer->isActive())
+        batchTimer->start(SERVER_BATCH_LATENCY_BUDGET_MS);
+}
+
+void InferenceServer::processBatch()
+{
+    batchTimer->stop();
+
+    uint32_t batchSize=__min((uint32_t)pendingRequests.size(),(uint32_t)SERVER_MAX_BATCH_SIZE);
+    if(batchSize==0)
+        return;
+
+    std::vector<InferenceRequest*> batch(pendingRequests.begin(),pendingRequests.begin()+batchSize);
+    pendingRequests.erase(pendingRequests.begin(),pendingRequests.begin()+batchSize);
+
+    std::vector<InferenceRequest*> classifyRequests;
+    for(uint32_t request=0;request<batchSize;request++)
+    {
+        if(batch[request]->type==SERVER_REQUEST_CLASSIFY)
+            classifyRequests.push_back(batch[request]);
+    }
+
+    // Split the batch into contiguous ranges, one per worker.
+    // This blocks the event loop; requests that arrive in the meantime are buffered by the sockets and form the next batch.
+    if(!classifyRequests.empty())
+    {
+        uint32_t classifyRequestCount=classifyRequests.size();
+        uint32_t usedWorkerCount=__min(workerCount,classifyRequestCount);
+        InferenceBatchJob *jobs=new InferenceBatchJob[usedWorkerCount];
+        for(uint32_t worker=0;worker<usedWorkerCount;worker++)
+        {
+            uint32_t firstRequest,requestCount;
+            CNNSampler::getShard(classifyRequestCount,worker,usedWorkerCount,firstRequest,requestCount);
+            jobs[worker].setAutoDelete(false);
+            jobs[worker].layers=layers;
+            jobs[worker].layerCount=layerCount;
+            jobs[worker].context=CNNLayerContext();
+            jobs[worker].requests=&classifyRequests[firstRequest];
+            jobs[worker].requestCount=requestCount;
+            threadPool->start(&jobs[worker]);
+        }
+        threadPool->waitForDone();
+        delete[] jobs;
+        batchCount++;
+    }
+
+    // Answer in request order
+
+    for(uint32_t request=0;request<batchSize;request++)
+    {
+        InferenceRequest *r=batch[request];
+        QByteArray response;
+
+        if(r->type==SERVER_REQUEST_CLASSIFY)
+        {
+            std::vector<std::pair<uint8_t,double> > resultVector;
+            for(uint32_t label=0;label<classCount;label++)
+                resultVector.push_back(std::pair<uint8_t,double>(label,r->probabilities[label]));
+            std::sort(resultVector.begin(),resultVector.end(),ResultVectorLessThanKey());
+
+            for(uint32_t result=0;result<r->k;result++)
+            {
+                response+=(result>0?" ":"")+MainWindow::getLabelName(resultVector.at(result).first).toUtf8()+" "
+                        +QByteArray::number(resultVector.at(result).second,'g',6);
+            }
+
+            CNNLayer::freeArray(r->image,3,IMAGE_HEIGHT);
+            free(r->probabilities);
+        }
+        else
+            response=getStats();
+        response+="\n";
+
+        if(!r->socket.isNull())
+            r->socket->write(response);
+
+        if(r->type==SERVER_REQUEST_CLASSIFY)
+        {
+            lastResponseNanoseconds=clock.nsecsElapsed();
+            qint64 latency=lastResponseNanoseconds-r->receivedNanoseconds;
+            if(latencies.size()<SERVER_LATENCY_WINDOW)
+                latencies.push_back(latency);
+            else
+                latencies[latencyPosition]=latency;
+            latencyPosition=(latencyPosition+1)%SERVER_LATENCY_WINDOW;
+            answeredRequestCount++;
+        }
+        delete r;
+    }
+
+    // Requests that arrived while the batch was running
+    if(pendingRequests.size()>=SERVER_MAX_BATCH_SIZE)
+        QTimer::singleShot(0,this,SLOT(processBatch()));
+    else if(!pendingRequests.empty())
+        batchTimer->start(SERVER_BATCH_LATENCY_BUDGET_MS);
+}
+
+double InferenceServer::getLatencyPercentile(double percentile)
+{
+    if(latencies.empty())
+        return 0.0;
+    std::vector<qint64> sortedLatencies(latencies);
+    uint32_t index=(uint32_t)__min(percentile*sortedLatencies.size(),(double)(sortedLatencies.size()-1));
+    std::nth_element(sortedLatencies.begin(),sortedLatencies.begin()+index,sortedLatencies.end());
+    return sortedLatencies[index]/1e6;
+}
+
+QByteArray InferenceServer::getStats()
+{
+    double seconds=firstRequestNanoseconds>=0?(lastResponseNanoseconds-firstRequestNanoseconds)/1e9:0.0;
+    return QByteArray("requests ")+QByteArray::number((qulonglong)answeredRequestCount)
+            +" batches "+QByteArray::number((qulonglong)batchCount)
+            +" average_batch_size "+QByteArray::number(batchCount>0?((double)answeredRequestCount)/batchCount:0.0,'f',2)
+            +" qps "+QByteArray::number(seconds>0.0?answeredRequestCount/seconds:0.0,'f',1)
+            +" p50_ms "+QByteArray::number(getLatencyPercentile(0.5),'f',3)
+            +" p99_ms "+QByteArray::number(getLatencyPercentile(0.99),'f',3);
+}
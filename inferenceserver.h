@@ -0,0 +1,107 @@
+#ifndef INFERENCESERVER_H
+#define INFERENCESERVER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iostream>
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QTimer>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QCoreApplication>
+
+#include "cnnlayer.h"
+#include "cnncheckpoint.h"
+#include "cnnconvtuner.h"
+#include "mainwindow.h"
+
+#define SERVER_DEFAULT_SOCKET_NAME "cnn-inference" // Unix domain socket (created in the temp directory unless a full path is given)
+#define SERVER_MAX_BATCH_SIZE 64 // A batch is started immediately when this many requests are waiting
+#define SERVER_BATCH_LATENCY_BUDGET_MS 2 // Otherwise the first request of a batch waits at most this long for others to join it
+#define SERVER_LATENCY_WINDOW 10000 // Latency percentiles are calculated over the last SERVER_LATENCY_WINDOW requests
+
+// Protocol (all requests of a connection are answered in order, one text line per request):
+// 'C' (1 byte), k (uint8_t), 3072 image bytes in the CIFAR-10 file layout (1024 R, 1024 G, 1024 B values, row by row)
+//     -> "<label name> <probability> ..." for the k most probable labels
+// 'S' (1 byte)
+//     -> "requests <n> batches <n> average_batch_size <x> qps <x> p50_ms <x> p99_ms <x>"
+#define SERVER_REQUEST_CLASSIFY 'C'
+#define SERVER_REQUEST_STATS 'S'
+#define SERVER_CLASSIFY_REQUEST_SIZE (2+3*IMAGE_WIDTH*IMAGE_HEIGHT)
+
+struct InferenceRequest
+{
+    QPointer<QLocalSocket> socket; // Becomes 0 if the client disconnects before the answer is ready
+    char type;
+    uint8_t k;
+    double ***image; // Classify requests only
+    double *probabilities; // Set by the worker
+    qint64 receivedNanoseconds;
+};
+
+// Classifies a range of the requests of a batch. The jobs share the layers; the state of a pass is kept in the context of the job.
+class InferenceBatchJob : public QRunnable
+{
+public:
+    CNNLayer **layers;
+    uint32_t layerCount;
+    CNNLayerContext context; // In inference mode
+    InferenceRequest **requests;
+    uint32_t requestCount;
+
+    void run();
+};
+
+// Headless server (see main.cpp: --serve) that classifies images sent by other processes with the network stored in a checkpoint.
+// Requests that arrive close together are classified as one batch, which is split among the worker threads.
+class InferenceServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    QLocalServer *server;
+    QTimer *batchTimer;
+    QThreadPool *threadPool;
+    uint32_t workerCount;
+    CNNLayer **layers; // Used by all workers at the same time
+    uint32_t layerCount;
+    uint32_t classCount;
+
+    std::deque<InferenceRequest*> pendingRequests;
+    QMap<QLocalSocket*,QByteArray> receiveBuffers;
+
+    // Metrics
+    QElapsedTimer clock;
+    qint64 firstRequestNanoseconds;
+    qint64 lastResponseNanoseconds;
+    uint64_t answeredRequestCount;
+    uint64_t batchCount;
+    std::vector<qint64> latencies; // Ring buffer (nanoseconds)
+    uint32_t latencyPosition;
+
+    InferenceServer();
+    ~InferenceServer();
+
+    bool start(QString checkpointFileName,QString socketName);
+    // value in [0.0,1.0]; returns the latency in milliseconds
+    double getLatencyPercentile(double percentile);
+    QByteArray getStats();
+
+public slots:
+    void newConnection();
+    void socketReadyRead();
+    void socketDisconnected();
+    void processBatch();
+};
+
+#endif // INFERENCESERVER_H
@@ -2,10 +2,105 @@
 // For suggestions, please contact int01@outlook.com
 
 #include "mainwindow.h"
+#include "inferenceserver.h"
+#include "cnngradientcheck.h"
+#include "cnnlayoutbenchmark.h"
+#include "cnnsourcegenerator.h"
+#include "cnncheckpoint.h"
+#include "distributedtraining.h"
 #include <QApplication>
+#include <QCoreApplication>
 
 int main(int argc, char *argv[])
 {
+    if(argc>=2&&QString(argv[1])=="--gradient-check")
+    {
+        // Kernel correctness checks: --gradient-check [seed (default: RANDOM_SEED)]; the exit code is 0 if all checks passed
+        uint64_t seed=argc>=3?QString(argv[2]).toULongLong():RANDOM_SEED;
+        CNNGradientCheck gradientCheck(seed,std::cout);
+        return gradientCheck.run()?0:1;
+    }
+
+    if(argc>=2&&QString(argv[1])=="--benchmark-layouts")
+    {
+        // Times the layers with both tensor layouts: --benchmark-layouts [pool workers (default: 0, every pass runs on the calling thread)]
+        uint32_t workerCount=argc>=3?QString(argv[2]).toUInt():0;
+        CNNThreadPool *threadPool=workerCount>0?new CNNThreadPool(workerCount):0;
+        CNNLayoutBenchmark layoutBenchmark(std::cout,threadPool);
+        layoutBenchmark.run();
+        delete threadPool;
+        return 0;
+    }
+
+    if(argc>=2&&QString(argv[1])=="--generate-source")
+    {
+        // Writes a standalone C++ classifier for a trained network: --generate-source [checkpoint file (default: CHECKPOINT_FILE)]
+        // [output file (default: cnnmodel.cpp)] [namespace (default: CNN_SOURCE_GENERATOR_DEFAULT_NAMESPACE)]
+        QCoreApplication a(argc, argv);
+        QString checkpointFileName=argc>=3?QString(argv[2]):QString(CHECKPOINT_FILE).replace("%APP_DIR%",QCoreApplication::applicationDirPath());
+        QString sourceFileName=argc>=4?QString(argv[3]):QString("cnnmodel.cpp");
+        QString namespaceName=argc>=5?QString(argv[4]):QString(CNN_SOURCE_GENERATOR_DEFAULT_NAMESPACE);
+
+        uint32_t layerCount;
+        CNNLayer **layers=CNNCheckpoint::load(checkpointFileName.toLocal8Bit().constData(),layerCount);
+        if(layers==0)
+        {
+            std::cerr<<"Could not load checkpoint \""<<checkpointFileName.toStdString()<<"\"."<<std::endl;
+            return 1;
+        }
+        bool ok=CNNSourceGenerator::generate(sourceFileName.toLocal8Bit().constData(),layers,layerCount,namespaceName.toLocal8Bit().constData());
+        CNNCheckpoint::freeLayers(layers,layerCount);
+        if(!ok)
+        {
+            std::cerr<<"Could not write \""<<sourceFileName.toStdString()<<"\"."<<std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if(argc>=4&&QString(argv[1])=="--distributed-train")
+    {
+        // One process of a training ring (see CNNDistributedTrainer): --distributed-train <rank> <world size> [steps (default: DISTRIBUTED_DEFAULT_STEP_COUNT)]
+        // [base port (default: CNN_DISTRIBUTED_DEFAULT_BASE_PORT)] [hosts of all ranks, comma-separated (default: 127.0.0.1 for every rank)].
+        // Start one process per rank (e.g. ranks 0-3 with world size 4 on one machine); rank 0 writes CHECKPOINT_FILE at the end.
+        QCoreApplication a(argc, argv);
+        uint32_t rank=QString(argv[2]).toUInt();
+        uint32_t worldSize=QString(argv[3]).toUInt();
+        uint64_t stepCount=argc>=5?QString(argv[4]).toULongLong():DISTRIBUTED_DEFAULT_STEP_COUNT;
+        uint16_t basePort=argc>=6?(uint16_t)QString(argv[5]).toUInt():CNN_DISTRIBUTED_DEFAULT_BASE_PORT;
+        std::vector<std::string> hosts(worldSize,"127.0.0.1");
+        if(argc>=7)
+        {
+            QStringList hostList=QString(argv[6]).split(',');
+            for(uint32_t hostIndex=0;hostIndex<(uint32_t)hostList.size()&&hostIndex<worldSize;hostIndex++)
+                hosts[hostIndex]=hostList[hostIndex].toStdString();
+            if((uint32_t)hostList.size()!=worldSize)
+            {
+                std::cerr<<"Expected "<<worldSize<<" hosts."<<std::endl;
+                return 1;
+            }
+        }
+        if(worldSize==0||rank>=worldSize)
+        {
+            std::cerr<<"The rank must be below the world size."<<std::endl;
+            return 1;
+        }
+        QString checkpointFileName=QString(CHECKPOINT_FILE).replace("%APP_DIR%",QCoreApplication::applicationDirPath());
+        return DistributedTraining::run(rank,worldSize,stepCount,basePort,hosts,checkpointFileName);
+    }
+
+    if(argc>=2&&QString(argv[1])=="--serve")
+    {
+        // Headless inference server: --serve [checkpoint file (default: CHECKPOINT_FILE)] [socket name (default: SERVER_DEFAULT_SOCKET_NAME)]
+        QCoreApplication a(argc, argv);
+        QString checkpointFileName=argc>=3?QString(argv[2]):QString(CHECKPOINT_FILE).replace("%APP_DIR%",QCoreApplication::applicationDirPath());
+        QString socketName=argc>=4?QString(argv[3]):QString(SERVER_DEFAULT_SOCKET_NAME);
+        InferenceServer server;
+        if(!server.start(checkpointFileName,socketName))
+            return 1;
+        return a.exec();
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
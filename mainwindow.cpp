@@ -5,12 +5,13 @@ MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
 {
-    srand(time(0));
+    seed=RANDOM_SEED!=0?RANDOM_SEED:(uint64_t)time(0);
 
     examplesSeen=0;
     training=false;
     classified=false;
     currentImageId=0xFFFFFFFF;
+    random=new CNNRandom(seed);
 
     ui->setupUi(this);
     scene=new GraphicsSceneEx();
@@ -23,39 +24,142 @@ MainWindow::MainWindow(QWidget *parent) :
     imageInputData=(double****)malloc(IMAGES_PER_BATCH*BATCH_COUNT*sizeof(double***));
 
     QString dir=QString(IMAGE_DATA_DIR).replace("%APP_DIR%",QApplication::applicationDirPath());
-
-    for(uint32_t batch=0;batch<BATCH_COUNT;batch++)
+    if(!loadDataset(dir,imageData,imageLabels,imageInputData))
     {
-        QFile f(dir+QString("data_batch_")+QString::number(batch+1)+".bin");
-        if(!f.exists()||!f.open(QFile::ReadOnly))
-        {
-            int m=QMessageBox::critical(this,"Error",QString("CIFAR-10 dataset not found in directory specified by IMAGE_DATA_DIR.\n\
+        int m=QMessageBox::critical(this,"Error",QString("CIFAR-10 dataset not found in directory specified by IMAGE_DATA_DIR.\n\
 \n\
 Please download the CIFAR-10 dataset archive and extract it into the directory.\n\
 If you have already downloaded the dataset, copy the files into IMAGE_DATA_DIR (currently \"%DIR%\").\n\
 \n\
 Would you like to download the archive now?").replace("%DIR%",dir),QMessageBox::Yes|QMessageBox::No);
-            if(m==QMessageBox::Yes)
-                QDesktopServices::openUrl(QUrl("https://www.cs.toronto.edu/~kriz/cifar-10-binary.tar.gz"));
-            QApplication::exit();
+        if(m==QMessageBox::Yes)
+            QDesktopServices::openUrl(QUrl("https://www.cs.toronto.edu/~kriz/cifar-10-binary.tar.gz"));
+        exit(1); // QApplication::exit has no effect before the event loop runs, and the window can't work without the images
+    }
+
+    connect(ui->nextBtn,SIGNAL(clicked(bool)),this,SLOT(nextBtnClicked()));
+    connect(ui->classifyBtn,SIGNAL(clicked(bool)),this,SLOT(classifyBtnClicked()));
+    connect(ui->trainBtn,SIGNAL(clicked(bool)),this,SLOT(trainBtnClicked()));
+    connect(ui->quantizeBtn,SIGNAL(clicked(bool)),this,SLOT(quantizeBtnClicked()));
+
+    nextBtnClicked();
+
+
+    // The actual convolutional neural network (see createLayers):
+    layers=createLayers(seed);
+
+    // Splits the work of single layer calls across cores, which lowers the latency of classifying or training on one image
+    threadPool=new CNNThreadPool(THREAD_POOL_WORKER_COUNT);
+    for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        layers[layerIndex]->setThreadPool(threadPool);
+
+    // Benchmarks the conv algorithms the first time a layer shape is seen on this CPU; the snapshots and replicas (clones) inherit the settings.
+    // FFT is left out of runs with a fixed seed, which must stay bit-identical.
+    QString convTuningCacheFileName=QString(CONV_TUNING_CACHE_FILE).replace("%APP_DIR%",QApplication::applicationDirPath());
+    CNNConvTuner convTuner(convTuningCacheFileName.toLocal8Bit().constData(),RANDOM_SEED==0);
+    convTuner.tune(layers,LAYER_COUNT);
+
+    snapshotPublisher=new CNNSnapshotPublisher(layers,LAYER_COUNT,threadPool);
+    snapshotReader=snapshotPublisher->registerReader();
+
+    trainingThread=new TrainingThread(this,DEFAULT_LEARNING_RATE,DEFAULT_MOMENTUM,DEFAULT_WEIGHT_DECAY,DEFAULT_OPTIMIZER_TYPE,DEFAULT_SCHEDULE_TYPE,DEFAULT_TARGET_ACCURACY,seed);
+    // Use Qt::QueuedConnection to indicate that the slot is to be executed in the receiving QObject's thread.
+    connect(trainingThread,SIGNAL(iterationFinished(unsigned int,double***,double,unsigned int)),this,SLOT(trainingThreadIterationFinished(unsigned int,double***,double,unsigned int)),Qt::QueuedConnection);
+    connect(trainingThread,SIGNAL(configurationError(QString)),this,SLOT(trainingThreadConfigurationError(QString)),Qt::QueuedConnection);
+    connect(trainingThread,SIGNAL(finished()),this,SLOT(trainingThreadFinishedWorking()),Qt::QueuedConnection);
+    connect(trainingThread,SIGNAL(targetAccuracyReached(double,unsigned int)),this,SLOT(trainingThreadTargetAccuracyReached(double,unsigned int)),Qt::QueuedConnection);
+
+    quantizationThread=new QuantizationThread(this);
+    connect(quantizationThread,SIGNAL(statusChanged(QString)),this,SLOT(quantizationThreadStatusChanged(QString)),Qt::QueuedConnection);
+    connect(quantizationThread,SIGNAL(quantizationFinished(QString)),this,SLOT(quantizationThreadFinished(QString)),Qt::QueuedConnection);
+
+    accuracyVector=new std::vector<double>();
+    ui->accuracyLbl->setText(QString("<b>0.0</b> - accuracy of last ")+QString::number(ACCURACY_VECTOR_MAX_SIZE)+QString(" classifications"));
+    ui->lossLbl->setText(QString("<b>-</b> - mean loss of last ")+QString::number(ACCURACY_VECTOR_MAX_SIZE)+QString(" training examples"));
+
+    ui->learningRateBox->setValue(DEFAULT_LEARNING_RATE);
+    ui->momentumBox->setValue(DEFAULT_MOMENTUM);
+    ui->weightDecayBox->setValue(DEFAULT_WEIGHT_DECAY);
+    for(uint8_t optimizerType=1;optimizerType<=CNN_OPTIMIZER_TYPE_COUNT;optimizerType++)
+        ui->optimizerBox->addItem(CNNOptimizer::getTypeName(optimizerType),optimizerType);
+    ui->optimizerBox->setCurrentIndex(DEFAULT_OPTIMIZER_TYPE-1);
+    for(uint8_t scheduleType=1;scheduleType<=CNN_SCHEDULE_TYPE_COUNT;scheduleType++)
+        ui->scheduleBox->addItem(CNNLearningRateSchedule::getTypeName(scheduleType),scheduleType);
+    ui->scheduleBox->setCurrentIndex(DEFAULT_SCHEDULE_TYPE-1);
+    ui->timeToAccuracyLbl->setText(QString("<b>-</b> - time to ")+QString::number(DEFAULT_TARGET_ACCURACY,'g',3)+QString(" accuracy"));
+
+    connect(ui->learningRateBox,SIGNAL(valueChanged(double)),this,SLOT(learningRateBoxValueChanged(double)));
+    connect(ui->momentumBox,SIGNAL(valueChanged(double)),this,SLOT(momentumBoxValueChanged(double)));
+    connect(ui->weightDecayBox,SIGNAL(valueChanged(double)),this,SLOT(weightDecayBoxValueChanged(double)));
+    connect(ui->optimizerBox,SIGNAL(currentIndexChanged(int)),this,SLOT(optimizerBoxIndexChanged(int)));
+    connect(ui->scheduleBox,SIGNAL(currentIndexChanged(int)),this,SLOT(scheduleBoxIndexChanged(int)));
+    connect(ui->pipelineBox,SIGNAL(toggled(bool)),this,SLOT(pipelineBoxToggled(bool)));
+    connect(ui->dataParallelBox,SIGNAL(toggled(bool)),this,SLOT(dataParallelBoxToggled(bool)));
+}
+
+MainWindow::~MainWindow()
+{
+    delete quantizationThread; // Waits for it, as it reads the dataset and uses the thread pool
+    freeDataset(imageData,imageInputData,BATCH_COUNT);
+    free(imageData);
+    free(imageLabels);
+    free(imageInputData);
+    delete ui;
+    delete pixmapItem;
+    delete scene;
+
+    snapshotPublisher->unregisterReader(snapshotReader);
+    delete snapshotPublisher;
+    for(uint32_t layer=0;layer<LAYER_COUNT;layer++)
+        delete layers[layer];
+    free(layers);
+    delete threadPool;
+
+    delete accuracyVector;
+    delete random;
+}
+
+bool MainWindow::loadDataset(const QString &dir, uint32_t **_imageData, uint8_t *_imageLabels, double ****_imageInputData)
+{
+    // Checked first, so that nothing is allocated if the dataset is incomplete
+    for(uint32_t batch=0;batch<BATCH_COUNT;batch++)
+    {
+        QFile f(dir+QString("data_batch_")+QString::number(batch+1)+".bin");
+        if(!f.exists()||f.size()<IMAGES_PER_BATCH*BYTES_PER_IMAGE_IN_FILE)
+            return false;
+    }
+
+    for(uint32_t batch=0;batch<BATCH_COUNT;batch++)
+    {
+        QFile f(dir+QString("data_batch_")+QString::number(batch+1)+".bin");
+        if(!f.open(QFile::ReadOnly))
+        {
+            freeDataset(_imageData,_imageInputData,batch); // The batches loaded so far
+            return false;
         }
         uint64_t size=f.size();
         char *fileData=(char*)malloc(size);
-        f.read(fileData,size);
+        if(f.read(fileData,size)!=(qint64)size)
+        {
+            free(fileData);
+            freeDataset(_imageData,_imageInputData,batch);
+            return false;
+        }
         for(uint32_t image=0;image<IMAGES_PER_BATCH;image++)
         {
             uint32_t pos=batch*IMAGES_PER_BATCH+image;
-            imageData[pos]=(uint32_t*)malloc(IMAGE_HEIGHT*IMAGE_WIDTH*sizeof(uint32_t)); // Desired format: 0xAARRGGBB
-            imageLabels[pos]=fileData[image*BYTES_PER_IMAGE_IN_FILE];
-            imageInputData[pos]=(double***)malloc(3/*Feature maps/color channels*/*sizeof(double**));
-            imageInputData[pos][0]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // R channel
-            imageInputData[pos][1]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // G channel
-            imageInputData[pos][2]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // B channel
+            if(_imageData!=0)
+                _imageData[pos]=(uint32_t*)malloc(IMAGE_HEIGHT*IMAGE_WIDTH*sizeof(uint32_t)); // Desired format: 0xAARRGGBB
+            _imageLabels[pos]=fileData[image*BYTES_PER_IMAGE_IN_FILE];
+            _imageInputData[pos]=(double***)malloc(3/*Feature maps/color channels*/*sizeof(double**));
+            _imageInputData[pos][0]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // R channel
+            _imageInputData[pos][1]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // G channel
+            _imageInputData[pos][2]=(double**)malloc(IMAGE_HEIGHT*sizeof(double*)); // B channel
             for(uint32_t y=0;y<IMAGE_HEIGHT;y++)
             {
-                imageInputData[pos][0][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // R channel
-                imageInputData[pos][1][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // G channel
-                imageInputData[pos][2][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // B channel
+                _imageInputData[pos][0][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // R channel
+                _imageInputData[pos][1][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // G channel
+                _imageInputData[pos][2][y]=(double*)malloc(IMAGE_WIDTH*sizeof(double)); // B channel
                 for(uint32_t x=0;x<IMAGE_WIDTH;x++)
                 {
                     // The first 1024 bytes of the image in the file (after the label bit) are the red channel values, the next 1024 the green, and the final 1024 the blue.
@@ -64,67 +168,84 @@ Would you like to download the archive now?").replace("%DIR%",dir),QMessageBox::
                     uint8_t r=(uint8_t)fileData[image*BYTES_PER_IMAGE_IN_FILE+1/*Label bit*/+y*IMAGE_WIDTH+x]; // R
                     uint8_t g=(uint8_t)fileData[image*BYTES_PER_IMAGE_IN_FILE+1/*Label bit*/+1024+y*IMAGE_WIDTH+x]; // G
                     uint8_t b=(uint8_t)fileData[image*BYTES_PER_IMAGE_IN_FILE+1/*Label bit*/+2*1024+y*IMAGE_WIDTH+x]; // B
-                    imageData[pos][y*IMAGE_WIDTH+x]=(a<<24)|(r<<16)|(g<<8)|b;
+                    if(_imageData!=0)
+                        _imageData[pos][y*IMAGE_WIDTH+x]=(a<<24)|(r<<16)|(g<<8)|b;
 
-                    imageInputData[pos][0][y][x]=((double)r)/255.0; // R channel
-                    imageInputData[pos][1][y][x]=((double)g)/255.0; // G channel
-                    imageInputData[pos][2][y][x]=((double)b)/255.0; // B channel
+                    _imageInputData[pos][0][y][x]=((double)r)/255.0; // R channel
+                    _imageInputData[pos][1][y][x]=((double)g)/255.0; // G channel
+                    _imageInputData[pos][2][y][x]=((double)b)/255.0; // B channel
                 }
             }
         }
         free(fileData);
         f.close();
     }
+    return true;
+}
 
-    desiredOutputValueCache=(double****)malloc(LABEL_COUNT*sizeof(double***));
-    for(uint32_t label=0;label<LABEL_COUNT;label++)
+void MainWindow::freeDataset(uint32_t **_imageData, double ****_imageInputData, uint32_t _batchCount)
+{
+    for(uint32_t batch=0;batch<_batchCount;batch++)
     {
-        desiredOutputValueCache[label]=(double***)malloc(LABEL_COUNT*sizeof(double**));
-        for(uint32_t labelInLabelCacheEntry=0;labelInLabelCacheEntry<LABEL_COUNT;labelInLabelCacheEntry++)
+        for(uint32_t image=0;image<IMAGES_PER_BATCH;image++)
         {
-            desiredOutputValueCache[label][labelInLabelCacheEntry]=(double**)malloc(1*sizeof(double*));
-            desiredOutputValueCache[label][labelInLabelCacheEntry][0]=(double*)malloc(1*sizeof(double));
-            desiredOutputValueCache[label][labelInLabelCacheEntry][0][0]=(labelInLabelCacheEntry==label?1.0:0.0);
+            uint32_t pos=batch*IMAGES_PER_BATCH+image;
+            if(_imageData!=0)
+                free(_imageData[pos]);
+            for(int32_t y=0;y<IMAGE_HEIGHT;y++)
+            {
+                free(_imageInputData[pos][0][y]); // R channel
+                free(_imageInputData[pos][1][y]); // G channel
+                free(_imageInputData[pos][2][y]); // B channel
+            }
+            free(_imageInputData[pos][0]); // R channel
+            free(_imageInputData[pos][1]); // G channel
+            free(_imageInputData[pos][2]); // B channel
+            free(_imageInputData[pos]);
         }
     }
+}
 
-    connect(ui->nextBtn,SIGNAL(clicked(bool)),this,SLOT(nextBtnClicked()));
-    connect(ui->classifyBtn,SIGNAL(clicked(bool)),this,SLOT(classifyBtnClicked()));
-    connect(ui->trainBtn,SIGNAL(clicked(bool)),this,SLOT(trainBtnClicked()));
-
-    nextBtnClicked();
-
-
-    // The actual convolutional neural network:
-
+CNNLayer **MainWindow::createLayers(uint64_t _seed)
+{
     CNNLayer *layer1; // Type: CONV
-    CNNLayer *layer2; // Type: RELU
-    CNNLayer *layer3; // Type: MAXPOOL
-    CNNLayer *layer4; // Type: CONV
-    CNNLayer *layer5; // Type: RELU
-    CNNLayer *layer6; // Type: MAXPOOL
-    CNNLayer *layer7; // Type: CONV
-    CNNLayer *layer8; // Type: RELU
-    CNNLayer *layer9; // Type: MAXPOOL
-    CNNLayer *layer10; // Type: FC
-    CNNLayer *layer11; // Type: SOFTMAX
-
-    layer1=new CNNLayer(1,CNN_LAYER_TYPE_CONV,16,5,5,1,1,2,2,3,IMAGE_WIDTH,IMAGE_HEIGHT);
-    layer2=new CNNLayer(2,CNN_LAYER_TYPE_RELU,layer1->featureMapCount,1,1,1,1,2,2,layer1->featureMapCount,layer1->singleFeatureMapWidth,layer1->singleFeatureMapHeight);
-    layer3=new CNNLayer(3,CNN_LAYER_TYPE_MAXPOOL,layer2->featureMapCount,2,2,2,2,0,0,layer2->featureMapCount,layer2->singleFeatureMapWidth,layer2->singleFeatureMapHeight);
-    layer4=new CNNLayer(4,CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,layer3->featureMapCount,layer3->singleFeatureMapWidth,layer3->singleFeatureMapHeight);
-    layer5=new CNNLayer(5,CNN_LAYER_TYPE_RELU,layer4->featureMapCount,1,1,1,1,2,2,layer4->featureMapCount,layer4->singleFeatureMapWidth,layer4->singleFeatureMapHeight);
-    layer6=new CNNLayer(6,CNN_LAYER_TYPE_MAXPOOL,layer5->featureMapCount,2,2,2,2,0,0,layer5->featureMapCount,layer5->singleFeatureMapWidth,layer5->singleFeatureMapHeight);
-    layer7=new CNNLayer(7,CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,layer6->featureMapCount,layer6->singleFeatureMapWidth,layer6->singleFeatureMapHeight);
-    layer8=new CNNLayer(8,CNN_LAYER_TYPE_RELU,layer7->featureMapCount,1,1,1,1,2,2,layer7->featureMapCount,layer7->singleFeatureMapWidth,layer7->singleFeatureMapHeight);
-    layer9=new CNNLayer(9,CNN_LAYER_TYPE_MAXPOOL,layer8->featureMapCount,2,2,2,2,0,0,layer8->featureMapCount,layer8->singleFeatureMapWidth,layer8->singleFeatureMapHeight);
-
-    layer10=new CNNLayer(10,CNN_LAYER_TYPE_FC,10,0,0,1,1,0,0,layer9->featureMapCount,layer9->singleFeatureMapWidth,layer9->singleFeatureMapHeight);
-    layer11=new CNNLayer(11,CNN_LAYER_TYPE_SOFTMAX,10,0,0,1,1,0,0,layer10->featureMapCount,layer10->singleFeatureMapWidth,layer10->singleFeatureMapHeight);
+    CNNLayer *layer2; // Type: BATCHNORM
+    CNNLayer *layer3; // Type: RELU
+    CNNLayer *layer4; // Type: MAXPOOL
+    CNNLayer *layer5; // Type: CONV
+    CNNLayer *layer6; // Type: BATCHNORM
+    CNNLayer *layer7; // Type: RELU
+    CNNLayer *layer8; // Type: MAXPOOL
+    CNNLayer *layer9; // Type: CONV
+    CNNLayer *layer10; // Type: BATCHNORM
+    CNNLayer *layer11; // Type: RELU
+    CNNLayer *layer12; // Type: MAXPOOL
+    CNNLayer *layer13; // Type: DROPOUT
+    CNNLayer *layer14; // Type: FC
+    CNNLayer *layer15; // Type: SOFTMAX
+
+    // The BATCHNORM layers are folded into the CONV layers before them and the DROPOUT layer is left out for inference (see CNNLayer::createInferenceLayers)
+    layer1=new CNNLayer(1,CNN_LAYER_TYPE_CONV,16,5,5,1,1,2,2,3,IMAGE_WIDTH,IMAGE_HEIGHT,_seed);
+    layer2=new CNNLayer(2,CNN_LAYER_TYPE_BATCHNORM,layer1->featureMapCount,1,1,1,1,0,0,layer1->featureMapCount,layer1->singleFeatureMapWidth,layer1->singleFeatureMapHeight,_seed);
+    layer3=new CNNLayer(3,CNN_LAYER_TYPE_RELU,layer2->featureMapCount,1,1,1,1,2,2,layer2->featureMapCount,layer2->singleFeatureMapWidth,layer2->singleFeatureMapHeight,_seed);
+    layer4=new CNNLayer(4,CNN_LAYER_TYPE_MAXPOOL,layer3->featureMapCount,2,2,2,2,0,0,layer3->featureMapCount,layer3->singleFeatureMapWidth,layer3->singleFeatureMapHeight,_seed);
+    layer5=new CNNLayer(5,CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,layer4->featureMapCount,layer4->singleFeatureMapWidth,layer4->singleFeatureMapHeight,_seed);
+    layer6=new CNNLayer(6,CNN_LAYER_TYPE_BATCHNORM,layer5->featureMapCount,1,1,1,1,0,0,layer5->featureMapCount,layer5->singleFeatureMapWidth,layer5->singleFeatureMapHeight,_seed);
+    layer7=new CNNLayer(7,CNN_LAYER_TYPE_RELU,layer6->featureMapCount,1,1,1,1,2,2,layer6->featureMapCount,layer6->singleFeatureMapWidth,layer6->singleFeatureMapHeight,_seed);
+    layer8=new CNNLayer(8,CNN_LAYER_TYPE_MAXPOOL,layer7->featureMapCount,2,2,2,2,0,0,layer7->featureMapCount,layer7->singleFeatureMapWidth,layer7->singleFeatureMapHeight,_seed);
+    layer9=new CNNLayer(9,CNN_LAYER_TYPE_CONV,20,5,5,1,1,2,2,layer8->featureMapCount,layer8->singleFeatureMapWidth,layer8->singleFeatureMapHeight,_seed);
+    layer10=new CNNLayer(10,CNN_LAYER_TYPE_BATCHNORM,layer9->featureMapCount,1,1,1,1,0,0,layer9->featureMapCount,layer9->singleFeatureMapWidth,layer9->singleFeatureMapHeight,_seed);
+    layer11=new CNNLayer(11,CNN_LAYER_TYPE_RELU,layer10->featureMapCount,1,1,1,1,2,2,layer10->featureMapCount,layer10->singleFeatureMapWidth,layer10->singleFeatureMapHeight,_seed);
+    layer12=new CNNLayer(12,CNN_LAYER_TYPE_MAXPOOL,layer11->featureMapCount,2,2,2,2,0,0,layer11->featureMapCount,layer11->singleFeatureMapWidth,layer11->singleFeatureMapHeight,_seed);
+
+    layer13=new CNNLayer(13,CNN_LAYER_TYPE_DROPOUT,layer12->featureMapCount,1,1,1,1,0,0,layer12->featureMapCount,layer12->singleFeatureMapWidth,layer12->singleFeatureMapHeight,_seed);
+    layer13->setDropoutRate(DROPOUT_RATE);
+    layer14=new CNNLayer(14,CNN_LAYER_TYPE_FC,10,0,0,1,1,0,0,layer13->featureMapCount,layer13->singleFeatureMapWidth,layer13->singleFeatureMapHeight,_seed);
+    layer15=new CNNLayer(15,CNN_LAYER_TYPE_SOFTMAX,10,0,0,1,1,0,0,layer14->featureMapCount,layer14->singleFeatureMapWidth,layer14->singleFeatureMapHeight,_seed);
 
     // Store layers in layer array:
 
-    layers=(CNNLayer**)malloc(LAYER_COUNT*sizeof(CNNLayer*));
+    CNNLayer **layers=(CNNLayer**)malloc(LAYER_COUNT*sizeof(CNNLayer*));
     layers[0]=layer1;
     layers[1]=layer2;
     layers[2]=layer3;
@@ -136,63 +257,14 @@ Would you like to download the archive now?").replace("%DIR%",dir),QMessageBox::
     layers[8]=layer9;
     layers[9]=layer10;
     layers[10]=layer11;
-
-    trainingThread=new TrainingThread(this,DEFAULT_LEARNING_RATE,DEFAULT_MOMENTUM,DEFAULT_WEIGHT_DECAY);
-    // Use Qt::QueuedConnection to indicate that the slot is to be executed in the receiving QObject's thread.
-    connect(trainingThread,SIGNAL(iterationFinished(unsigned int,double***)),this,SLOT(trainingThreadIterationFinished(unsigned int,double***)),Qt::QueuedConnection);
-    connect(trainingThread,SIGNAL(finished()),this,SLOT(trainingThreadFinishedWorking()),Qt::QueuedConnection);
-
-    accuracyVector=new std::vector<double>();
-    ui->accuracyLbl->setText(QString("<b>0.0</b> - accuracy of last ")+QString::number(ACCURACY_VECTOR_MAX_SIZE)+QString(" classifications"));
-
-    ui->learningRateBox->setValue(DEFAULT_LEARNING_RATE);
-    ui->momentumBox->setValue(DEFAULT_MOMENTUM);
-    ui->weightDecayBox->setValue(DEFAULT_WEIGHT_DECAY);
-
-    connect(ui->learningRateBox,SIGNAL(valueChanged(double)),this,SLOT(learningRateBoxValueChanged(double)));
-    connect(ui->momentumBox,SIGNAL(valueChanged(double)),this,SLOT(momentumBoxValueChanged(double)));
-    connect(ui->weightDecayBox,SIGNAL(valueChanged(double)),this,SLOT(weightDecayBoxValueChanged(double)));
-}
-
-MainWindow::~MainWindow()
-{
-    for(uint32_t batch=0;batch<BATCH_COUNT;batch++)
-    {
-        for(uint32_t image=0;image<IMAGES_PER_BATCH;image++)
-        {
-            uint32_t pos=batch*IMAGES_PER_BATCH+image;
-            free(imageData[pos]);
-            for(int32_t y=0;y<IMAGE_HEIGHT;y++)
-            {
-                free(imageInputData[pos][0][y]); // R channel
-                free(imageInputData[pos][1][y]); // G channel
-                free(imageInputData[pos][2][y]); // B channel
-            }
-            free(imageInputData[pos][0]); // R channel
-            free(imageInputData[pos][1]); // G channel
-            free(imageInputData[pos][2]); // B channel
-            free(imageInputData[pos]);
-        }
-    }
-    free(imageData);
-    free(imageLabels);
-    free(imageInputData);
-    delete ui;
-    delete pixmapItem;
-    delete scene;
-
-    for(uint32_t layer=0;layer<LAYER_COUNT;layer++)
-        delete layers[layer];
-    free(layers);
-
-    for(uint32_t label=0;label<LABEL_COUNT;label++)
-    {
-        free(desiredOutputValueCache[label][0][0]);
-        free(desiredOutputValueCache[label][0]);
-        free(desiredOutputValueCache[label]);
-    }
-    free(desiredOutputValueCache);
-    delete accuracyVector;
+    layers[11]=layer12;
+    layers[12]=layer13;
+    layers[13]=layer14;
+    layers[14]=layer15;
+
+    CNNLayer::setNetworkTensorLayout(layers,LAYER_COUNT,TENSOR_LAYOUT);
+    CNNLayer::setNetworkStashPrecision(layers,LAYER_COUNT,STASH_PRECISION);
+    return layers;
 }
 
 QString MainWindow::getLabelName(uint8_t label)
@@ -248,6 +320,14 @@ uint32_t MainWindow::getHighestIndex(double *array, uint32_t elementCount)
     return highestIndex;
 }
 
+uint64_t MainWindow::getParameterChecksum()
+{
+    uint64_t checksum=FNV_OFFSET_BASIS;
+    for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        checksum=layers[layerIndex]->getParameterChecksum(checksum);
+    return checksum;
+}
+
 void MainWindow::displayOutput(double ***output, uint8_t correctLabel)
 {
     std::vector<std::pair<uint8_t,double> > resultVector=std::vector<std::pair<uint8_t,double> >();
@@ -298,7 +378,7 @@ void MainWindow::updateExamplesSeenLbl()
 
 void MainWindow::nextBtnClicked()
 {
-    loadImage(((double)rand())/((double)RAND_MAX)*(IMAGES_PER_BATCH*BATCH_COUNT-1)); // Start at 0
+    loadImage(random->nextBelow(IMAGES_PER_BATCH*BATCH_COUNT));
 }
 
 void MainWindow::classifyBtnClicked()
@@ -316,22 +396,28 @@ void MainWindow::classifyBtnClicked()
         ui->statusLbl->update();
 
         // Forward pass
-        // MODIFY IN TRAININGTHREAD.CPP, TOO!
+        // MODIFY IN CNNTRAININGSTEP.CPP, TOO!
 
         // Input for first layer: Image data
         double ***previousLayerOutput=imageInputData[currentImageId];
 
+        // The weights of the last snapshot, which the training thread doesn't update, and an own context in inference mode
+        CNNWeightSnapshot *snapshot=snapshotPublisher->acquire(snapshotReader);
+        CNNLayerContext context=CNNLayerContext();
+
         for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
         {
-            CNNLayer *thisLayer=layers[layerIndex];
-            double ***output=thisLayer->forwardPass(previousLayerOutput);
+            CNNLayer *thisLayer=snapshot->layers[layerIndex];
+            double ***output=thisLayer->forwardPass(previousLayerOutput,context);
+            thisLayer->freeContext(context); // No backward pass
 
             if(layerIndex>0)
                 CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
             previousLayerOutput=output;
         }
+        snapshotPublisher->release(snapshotReader);
 
-        // MODIFY IN TRAININGTHREAD.CPP, TOO!
+        // MODIFY IN CNNTRAININGSTEP.CPP, TOO!
 
         uint8_t thisLabel=imageLabels[currentImageId];
         displayOutput(previousLayerOutput,thisLabel);
@@ -362,6 +448,35 @@ void MainWindow::trainBtnClicked()
     }
 }
 
+void MainWindow::quantizeBtnClicked()
+{
+    if(quantizationThread->isRunning())
+        return;
+    ui->quantizeBtn->setEnabled(false);
+
+    // The images are picked and the snapshot is read here, as the random number generator and the snapshot reader slot belong to the GUI thread;
+    // the calibration and the evaluation of both networks run in quantizationThread (see QuantizationThread::run)
+    uint32_t *calibrationImageIds=(uint32_t*)malloc(QUANTIZATION_CALIBRATION_IMAGE_COUNT*sizeof(uint32_t));
+    for(uint32_t image=0;image<QUANTIZATION_CALIBRATION_IMAGE_COUNT;image++)
+        calibrationImageIds[image]=random->nextBelow(IMAGES_PER_BATCH*BATCH_COUNT);
+    uint32_t *evaluationImageIds=(uint32_t*)malloc(QUANTIZATION_EVALUATION_IMAGE_COUNT*sizeof(uint32_t));
+    for(uint32_t image=0;image<QUANTIZATION_EVALUATION_IMAGE_COUNT;image++)
+        evaluationImageIds[image]=random->nextBelow(IMAGES_PER_BATCH*BATCH_COUNT);
+
+    // Both networks use the inference copy of the layers of the last snapshot (BATCHNORM layers folded into the CONV layers, which the int8 model requires),
+    // so this works while training, too
+    uint32_t inferenceLayerCount;
+    CNNWeightSnapshot *snapshot=snapshotPublisher->acquire(snapshotReader);
+    CNNLayer **inferenceLayers=CNNLayer::createInferenceLayers(snapshot->layers,snapshot->layerCount,inferenceLayerCount);
+    snapshotPublisher->release(snapshotReader);
+
+    quantizationThread->inferenceLayers=inferenceLayers;
+    quantizationThread->inferenceLayerCount=inferenceLayerCount;
+    quantizationThread->calibrationImageIds=calibrationImageIds;
+    quantizationThread->evaluationImageIds=evaluationImageIds;
+    quantizationThread->start();
+}
+
 void MainWindow::learningRateBoxValueChanged(double newValue)
 {
     trainingThread->learningRate=newValue;
@@ -377,21 +492,96 @@ void MainWindow::weightDecayBoxValueChanged(double newValue)
     trainingThread->weightDecay=newValue;
 }
 
-void MainWindow::trainingThreadIterationFinished(unsigned int imageId, double ***output)
+void MainWindow::optimizerBoxIndexChanged(int newIndex)
+{
+    trainingThread->optimizerType=(uint8_t)ui->optimizerBox->itemData(newIndex).toUInt();
+}
+
+void MainWindow::scheduleBoxIndexChanged(int newIndex)
+{
+    trainingThread->scheduleType=(uint8_t)ui->scheduleBox->itemData(newIndex).toUInt();
+}
+
+void MainWindow::pipelineBoxToggled(bool checked)
+{
+    trainingThread->pipelined=checked;
+}
+
+void MainWindow::dataParallelBoxToggled(bool checked)
+{
+    trainingThread->dataParallel=checked;
+}
+
+void MainWindow::trainingThreadIterationFinished(unsigned int imageId, double ***output, double recentLoss, unsigned int exampleCount)
 {
     loadImage(imageId);
-    examplesSeen++;
+    examplesSeen+=exampleCount;
     updateExamplesSeenLbl();
     displayOutput(output,imageLabels[imageId]);
+    ui->lossLbl->setText(QString("<b>")+QString::number(recentLoss,'g',3)+QString("</b> - mean loss of last ")+QString::number(ACCURACY_VECTOR_MAX_SIZE)+QString(" training examples"));
 
     CNNLayer::freeArray(output,layers[LAYER_COUNT-1]->featureMapCount,layers[LAYER_COUNT-1]->singleFeatureMapHeight);
 }
 
+void MainWindow::trainingThreadConfigurationError(QString message)
+{
+    QMessageBox::warning(this,"Training",message);
+}
+
 void MainWindow::trainingThreadFinishedWorking()
 {
     training=false;
     ui->trainBtn->setText("Train");
-    ui->statusLbl->setText("Ready.");
+    QString checkpointFileName=QString(CHECKPOINT_FILE).replace("%APP_DIR%",QApplication::applicationDirPath());
+    if(CNNCheckpoint::save(checkpointFileName.toLocal8Bit().constData(),layers,LAYER_COUNT))
+        ui->statusLbl->setText("Ready.");
+    else
+        ui->statusLbl->setText(QString("Could not save checkpoint \"")+checkpointFileName+QString("\"."));
     ui->trainBtn->update();
     ui->statusLbl->update();
 }
+
+void MainWindow::trainingThreadTargetAccuracyReached(double seconds, unsigned int iterations)
+{
+    ui->timeToAccuracyLbl->setText(QString("<b>")+QString::number(seconds,'f',1)+QString(" s</b> (")+QString::number(iterations)+QString(" examples) - time to ")
+                                   +QString::number(trainingThread->targetAccuracy,'g',3)+QString(" accuracy"));
+    ui->timeToAccuracyLbl->update();
+
+    // Append to the report file, so that runs with different optimizers, schedules, etc. can be compared
+
+    QFile f(QString(TIME_TO_ACCURACY_REPORT_FILE).replace("%APP_DIR%",QApplication::applicationDirPath()));
+    bool writeHeader=!f.exists();
+    if(!f.open(QFile::WriteOnly|QFile::Append|QFile::Text))
+        return;
+    if(writeHeader)
+        f.write("time,optimizer,schedule,learning rate,momentum,weight decay,seed,target accuracy,seconds,examples,parameter checksum\n");
+    QString line=QDateTime::currentDateTime().toString(Qt::ISODate)
+            +QString(",")+CNNOptimizer::getTypeName(trainingThread->optimizerType)
+            +QString(",")+CNNLearningRateSchedule::getTypeName(trainingThread->scheduleType)
+            +QString(",")+QString::number(trainingThread->learningRate)
+            +QString(",")+QString::number(trainingThread->momentum)
+            +QString(",")+QString::number(trainingThread->weightDecay)
+            +QString(",")+QString::number(seed)
+            +QString(",")+QString::number(trainingThread->targetAccuracy)
+            +QString(",")+QString::number(seconds,'f',3)
+            +QString(",")+QString::number(iterations)
+            +QString(",")+QString::number(trainingThread->targetAccuracyChecksum,16) // Identical for bit-identical runs (see RANDOM_SEED)
+            +QString("\n");
+    f.write(line.toUtf8());
+    f.close();
+}
+
+void MainWindow::quantizationThreadStatusChanged(QString status)
+{
+    ui->statusLbl->setText(status);
+    ui->statusLbl->update();
+}
+
+void MainWindow::quantizationThreadFinished(QString report)
+{
+    ui->statusLbl->setText("Ready.");
+    ui->statusLbl->update();
+    ui->quantizeBtn->setEnabled(true);
+
+    QMessageBox::information(this,"Int8 quantization",report);
+}
@@ -14,16 +14,25 @@
 #include <QMessageBox>
 #include <QDesktopServices>
 #include <QFile>
+#include <QDateTime>
+#include <QElapsedTimer>
 
 #include "cnnlayer.h"
+#include "cnnsampler.h"
+#include "cnnquantizedmodel.h"
+#include "cnncheckpoint.h"
+#include "cnnsnapshot.h"
+#include "cnnconvtuner.h"
 #include "graphicssceneex.h"
 #include "trainingthread.h"
+#include "quantizationthread.h"
 
 namespace Ui {
 class MainWindow;
 }
 
 class TrainingThread;
+class QuantizationThread;
 
 struct ResultVectorLessThanKey
 {
@@ -40,10 +49,35 @@ struct ResultVectorLessThanKey
 #define BATCH_COUNT 5
 #define BYTES_PER_IMAGE_IN_FILE 3073 // 1 label byte + 3072 color bytes
 #define LABEL_COUNT 10
-#define LAYER_COUNT 11
+#define LAYER_COUNT 15
+#define DROPOUT_RATE 0.25 // Of the DROPOUT layer in front of the FC layer
 #define DEFAULT_LEARNING_RATE 0.005 // 0.005
 #define DEFAULT_MOMENTUM 0.1 // 0.1
 #define DEFAULT_WEIGHT_DECAY 0.0001
+// 0: seed all random number generators from the current time.
+// Any other value makes training deterministic: the initial weights and the order of the training examples only depend on this seed,
+// so a run can be replayed bit-identically (as long as the hyperparameters are not changed while training), which allows comparing
+// the speed of different kernels without convergence noise. Parallel code paths must reduce in a fixed order to keep this property.
+#define RANDOM_SEED 0
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL // Initial value for CNNLayer::getParameterChecksum
+#define DEFAULT_OPTIMIZER_TYPE CNN_OPTIMIZER_TYPE_SGD_MOMENTUM
+#define DEFAULT_SCHEDULE_TYPE CNN_SCHEDULE_TYPE_CONSTANT
+#define DEFAULT_TARGET_ACCURACY 0.4 // Accuracy over the last ACCURACY_VECTOR_MAX_SIZE training examples for the time-to-accuracy report
+#define PIPELINE_BATCH_SIZE 16 // Examples per batch in pipeline-parallel training (the diffs are averaged over the batch, see CNNPipeline)
+#define DATA_PARALLEL_WORKER_COUNT 0 // Workers of the data-parallel trainer (0: one per core)
+#define DATA_PARALLEL_SYNCHRONIZATION_INTERVAL 32 // Examples per worker between two weight averagings (see CNNDataParallelTrainer)
+#define THREAD_POOL_WORKER_COUNT 0 // Workers of the pool used by the layers for intra-layer parallelism (0: one less than the amount of cores, since the calling thread works, too)
+#define DISTRIBUTED_DEFAULT_STEP_COUNT 100000 // Steps of --distributed-train (every step trains one example per rank)
+#define DISTRIBUTED_REPORT_INTERVAL 1000 // Steps between two progress lines of --distributed-train
+#define SNAPSHOT_INTERVAL 64 // Training examples between two weight snapshots for classifying while training (see CNNSnapshotPublisher)
+#define CHECKPOINT_FILE "%APP_DIR%/checkpoint.cnn" // Written whenever training stops; served by --serve (see main.cpp)
+#define TENSOR_LAYOUT CNN_TENSOR_LAYOUT_NCHW // Layout of the CONV, FC and pooling kernels (see CNN_TENSOR_LAYOUT_NHWC; --benchmark-layouts shows which one is faster)
+#define STASH_PRECISION CNN_STASH_PRECISION_DOUBLE // Of the inputs CONV and FC layers keep for training (CNN_STASH_PRECISION_BF16 or _FP16: a quarter of the memory, slightly rounded weight diffs)
+#define ACTIVATION_MEMORY_BUDGET CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET // Bytes of activations kept for the backward pass when training on one example at a time (smaller budgets recompute more, see CNNActivationCheckpointing)
+#define CONV_TUNING_CACHE_FILE "%APP_DIR%/conv-tuning.txt" // Fastest conv algorithms per layer shape and CPU (see CNNConvTuner)
+#define TIME_TO_ACCURACY_REPORT_FILE "%APP_DIR%/time-to-accuracy.csv"
+#define QUANTIZATION_CALIBRATION_IMAGE_COUNT 500 // Random training images used to calibrate the activation scales of the int8 model
+#define QUANTIZATION_EVALUATION_IMAGE_COUNT 2000 // Random training images classified by both the double precision network and the int8 model for the report
 #define SHOW_FIRST_RESULTS 4
 #define ACCURACY_VECTOR_MAX_SIZE 100
 
@@ -59,23 +93,38 @@ public:
     uint32_t examplesSeen;
     uint32_t currentImageId;
     TrainingThread *trainingThread;
+    QuantizationThread *quantizationThread; // Calibrates and evaluates the int8 model (see quantizeBtnClicked)
     bool training;
     bool classified;
-    // Cache of desired output values for all labels
-    double ****desiredOutputValueCache;
     // Dimensions: image with id -> feature map (R, G or B channel) -> pixel row -> value of pixel in column
     double ****imageInputData;
 
     std::vector<double> *accuracyVector;
 
+    uint64_t seed; // See RANDOM_SEED
+
+    CNNRandom *random; // Used to pick images to display (the training thread uses its own sampler)
+
     CNNLayer **layers;
+    CNNThreadPool *threadPool; // Shared by all layers (see CNNLayer::setThreadPool)
+    // Classifying and quantizing read the weights from the snapshots published by the training thread, never from "layers"
+    CNNSnapshotPublisher *snapshotPublisher;
+    uint32_t snapshotReader; // Slot of the GUI thread
 
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
+    // Reads the CIFAR-10 training batches from dir into arrays of IMAGES_PER_BATCH*BATCH_COUNT entries (_imageData, the pixels for display, may be 0);
+    // returns false without keeping anything allocated if a batch file is missing, incomplete or can't be read
+    static bool loadDataset(const QString &dir,uint32_t **_imageData,uint8_t *_imageLabels,double ****_imageInputData);
+    // Frees the first _batchCount batches (BATCH_COUNT: all of them) loaded by loadDataset
+    static void freeDataset(uint32_t **_imageData,double ****_imageInputData,uint32_t _batchCount);
+    // The network, with the tensor layout and stash precision set (the same for the GUI and the headless training modes)
+    static CNNLayer **createLayers(uint64_t _seed);
     static QString getLabelName(uint8_t label);
     void loadImage(uint32_t imageId);
     static uint32_t getHighestIndex(double *array,uint32_t elementCount);
+    uint64_t getParameterChecksum();
     void displayOutput(double ***output, uint8_t correctLabel);
 
 public slots:
@@ -83,11 +132,20 @@ public slots:
     void nextBtnClicked();
     void classifyBtnClicked();
     void trainBtnClicked();
+    void quantizeBtnClicked();
     void learningRateBoxValueChanged(double newValue);
     void momentumBoxValueChanged(double newValue);
     void weightDecayBoxValueChanged(double newValue);
-    void trainingThreadIterationFinished(unsigned int imageId,double ***output);
+    void optimizerBoxIndexChanged(int newIndex);
+    void scheduleBoxIndexChanged(int newIndex);
+    void pipelineBoxToggled(bool checked);
+    void dataParallelBoxToggled(bool checked);
+    void trainingThreadIterationFinished(unsigned int imageId,double ***output,double recentLoss,unsigned int exampleCount);
+    void trainingThreadConfigurationError(QString message);
     void trainingThreadFinishedWorking();
+    void trainingThreadTargetAccuracyReached(double seconds,unsigned int iterations);
+    void quantizationThreadStatusChanged(QString status);
+    void quantizationThreadFinished(QString report);
 
 private:
     Ui::MainWindow *ui;
@@ -0,0 +1,96 @@
+#include "quantizationthread.h"
+
+QuantizationThread::QuantizationThread(MainWindow *_window)
+{
+    window=_window;
+    inferenceLayers=0;
+    inferenceLayerCount=0;
+    calibrationImageIds=0;
+    evaluationImageIds=0;
+}
+
+QuantizationThread::~QuantizationThread()
+{
+    wait();
+}
+
+void QuantizationThread::run()
+{
+    statusChanged("Quantizing...");
+
+    double ****calibrationImages=(double****)malloc(QUANTIZATION_CALIBRATION_IMAGE_COUNT*sizeof(double***));
+    for(uint32_t image=0;image<QUANTIZATION_CALIBRATION_IMAGE_COUNT;image++)
+        calibrationImages[image]=window->imageInputData[calibrationImageIds[image]];
+    CNNQuantizedModel *quantizedModel=new CNNQuantizedModel(inferenceLayers,inferenceLayerCount,calibrationImages,QUANTIZATION_CALIBRATION_IMAGE_COUNT);
+    free(calibrationImages);
+
+    // Both networks classify the same images
+
+    statusChanged("Evaluating double precision network...");
+
+    QElapsedTimer timer;
+    timer.start();
+    uint32_t doublePrecisionCorrectCount=0;
+    uint8_t *doublePrecisionResults=(uint8_t*)malloc(QUANTIZATION_EVALUATION_IMAGE_COUNT*sizeof(uint8_t));
+    double *probabilities=(double*)malloc(LABEL_COUNT*sizeof(double));
+    CNNLayerContext context=CNNLayerContext(); // Inference mode
+    for(uint32_t image=0;image<QUANTIZATION_EVALUATION_IMAGE_COUNT;image++)
+    {
+        double ***previousLayerOutput=window->imageInputData[evaluationImageIds[image]];
+        for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        {
+            CNNLayer *thisLayer=inferenceLayers[layerIndex];
+            double ***output=thisLayer->forwardPass(previousLayerOutput,context);
+            thisLayer->freeContext(context); // No backward pass
+
+            if(layerIndex>0)
+                CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
+            previousLayerOutput=output;
+        }
+
+        for(uint32_t label=0;label<LABEL_COUNT;label++)
+            probabilities[label]=previousLayerOutput[label][0][0];
+        doublePrecisionResults[image]=MainWindow::getHighestIndex(probabilities,LABEL_COUNT);
+        if(doublePrecisionResults[image]==window->imageLabels[evaluationImageIds[image]])
+            doublePrecisionCorrectCount++;
+
+        CNNLayer::freeArray(previousLayerOutput,inferenceLayers[inferenceLayerCount-1]->featureMapCount,inferenceLayers[inferenceLayerCount-1]->singleFeatureMapHeight);
+    }
+    double doublePrecisionSeconds=timer.nsecsElapsed()/1e9;
+
+    statusChanged("Evaluating int8 network...");
+
+    timer.restart();
+    uint32_t quantizedCorrectCount=0;
+    uint32_t agreementCount=0;
+    for(uint32_t image=0;image<QUANTIZATION_EVALUATION_IMAGE_COUNT;image++)
+    {
+        uint8_t result=quantizedModel->classify(window->imageInputData[evaluationImageIds[image]],probabilities);
+        if(result==window->imageLabels[evaluationImageIds[image]])
+            quantizedCorrectCount++;
+        if(result==doublePrecisionResults[image])
+            agreementCount++;
+    }
+    double quantizedSeconds=timer.nsecsElapsed()/1e9;
+
+    free(probabilities);
+    free(doublePrecisionResults);
+    delete quantizedModel;
+    for(uint32_t layerIndex=0;layerIndex<inferenceLayerCount;layerIndex++)
+        delete inferenceLayers[layerIndex];
+    free(inferenceLayers);
+    inferenceLayers=0;
+    free(calibrationImageIds);
+    calibrationImageIds=0;
+    free(evaluationImageIds);
+    evaluationImageIds=0;
+
+    QString report=QString("Evaluated on ")+QString::number(QUANTIZATION_EVALUATION_IMAGE_COUNT)+QString(" random training images (calibrated on ")+QString::number(QUANTIZATION_CALIBRATION_IMAGE_COUNT)+QString("):\n\n")
+            +QString("Double precision: accuracy ")+QString::number(((double)doublePrecisionCorrectCount)/QUANTIZATION_EVALUATION_IMAGE_COUNT,'g',3)
+            +QString(", ")+QString::number(QUANTIZATION_EVALUATION_IMAGE_COUNT/doublePrecisionSeconds,'f',1)+QString(" images/s\n")
+            +QString("Int8: accuracy ")+QString::number(((double)quantizedCorrectCount)/QUANTIZATION_EVALUATION_IMAGE_COUNT,'g',3)
+            +QString(", ")+QString::number(QUANTIZATION_EVALUATION_IMAGE_COUNT/quantizedSeconds,'f',1)+QString(" images/s\n\n")
+            +QString("Speedup: ")+QString::number(doublePrecisionSeconds/quantizedSeconds,'f',2)
+            +QString("x, same prediction for ")+QString::number(((double)agreementCount)/QUANTIZATION_EVALUATION_IMAGE_COUNT*100.0,'f',1)+QString("% of the images");
+    quantizationFinished(report);
+}
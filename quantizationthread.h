@@ -0,0 +1,45 @@
+#ifndef QUANTIZATIONTHREAD_H
+#define QUANTIZATIONTHREAD_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <QThread>
+#include <QString>
+#include <QElapsedTimer>
+
+#include "cnnlayer.h"
+#include "cnnquantizedmodel.h"
+#include "mainwindow.h"
+
+class MainWindow;
+
+// Calibrates the int8 model and classifies the same random training images with it and with the double precision network (see
+// MainWindow::quantizeBtnClicked), so the GUI stays responsive while it runs. The GUI thread picks the images and creates the inference layers
+// from a snapshot before starting it (the random number generator and the snapshot reader slot belong to the GUI thread).
+
+class QuantizationThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    MainWindow *window; // Only imageInputData and imageLabels are read, which don't change after loading
+
+    // Set before start(), freed by run()
+    CNNLayer **inferenceLayers;
+    uint32_t inferenceLayerCount;
+    uint32_t *calibrationImageIds; // QUANTIZATION_CALIBRATION_IMAGE_COUNT entries
+    uint32_t *evaluationImageIds; // QUANTIZATION_EVALUATION_IMAGE_COUNT entries
+
+    QuantizationThread(MainWindow *_window);
+    ~QuantizationThread();
+
+    void run();
+
+signals:
+    void statusChanged(QString status);
+    // Accuracy and speed of both networks, for the message box
+    void quantizationFinished(QString report);
+};
+
+#endif // QUANTIZATIONTHREAD_H
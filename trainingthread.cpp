@@ -1,6 +1,6 @@
 #include "trainingthread.h"
 
-TrainingThread::TrainingThread(MainWindow *_window, double _learningRate, double _momentum, double _weightDecay)
+TrainingThread::TrainingThread(MainWindow *_window, double _learningRate, double _momentum, double _weightDecay, uint8_t _optimizerType, uint8_t _scheduleType, double _targetAccuracy, uint64_t _seed)
 {
     stopRequested=false;
     window=_window;
@@ -9,89 +9,218 @@ TrainingThread::TrainingThread(MainWindow *_window, double _learningRate, double
     learningRate=_learningRate;
     momentum=_momentum;
     weightDecay=_weightDecay;
+    optimizerType=_optimizerType;
+    scheduleType=_scheduleType;
+    dataParallel=false;
+    pipelined=false;
+    targetAccuracy=_targetAccuracy;
+
+    optimizer=new CNNOptimizer(optimizerType,learningRate,momentum,weightDecay);
+    schedule=new CNNLearningRateSchedule(scheduleType,IMAGES_PER_BATCH*BATCH_COUNT);
+    sampler=new CNNSampler(0,IMAGES_PER_BATCH*BATCH_COUNT,_seed);
+    pipeline=0;
+    dataParallelTrainer=0;
+    activationCheckpointing=0;
+
+    iteration=0;
+    snapshotIteration=0;
+    previousTrainingMilliseconds=0;
+    targetAccuracyReported=false;
+    targetAccuracyChecksum=0;
+
+    recentResults=(uint8_t*)calloc(ACCURACY_VECTOR_MAX_SIZE,sizeof(uint8_t));
+    recentResultCount=0;
+    recentCorrectCount=0;
+    recentLosses=(double*)calloc(ACCURACY_VECTOR_MAX_SIZE,sizeof(double));
 }
 
 TrainingThread::~TrainingThread()
 {
     mutex->unlock();
     delete mutex;
+    delete optimizer;
+    delete schedule;
+    delete sampler;
+    delete pipeline;
+    delete dataParallelTrainer;
+    delete activationCheckpointing;
+    free(recentResults);
+    free(recentLosses);
 }
 
 void TrainingThread::run()
 {
-    srand(time(0));
+    QElapsedTimer timer;
+    timer.start();
+
+    // The layers store the state of the backward pass, BATCHNORM layers normalize with the statistics of each example and DROPOUT layers drop values
+    // while training (see CNNLayerContext::training)
+    for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        window->layers[layerIndex]->setTraining(true);
 
     for(/*;;*/uint64_t cycle=0;cycle<100000000;cycle++)
     {
         if(stopRequested)
             break;
-        uint32_t imageId=((double)rand())/((double)RAND_MAX)*(IMAGES_PER_BATCH*BATCH_COUNT-1); // Start at 0
-        uint8_t imageLabel=window->imageLabels[imageId];
-
-        //forwardPass(imageId);
-
-        // Input for first layer: Image data
-        double ***previousLayerOutput=window->imageInputData[imageId];
-
-        // Forward pass
-        // MODIFY IN MAINWINDOW.CPP, TOO!
-
-        for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        // Between two cycles, when no update is in progress
+        publishSnapshot(false);
+        if(optimizer->type!=optimizerType)
         {
-            CNNLayer *thisLayer=window->layers[layerIndex];
-            double ***output=thisLayer->forwardPass(previousLayerOutput);
-
-            if(layerIndex>0)
-                CNNLayer::freeArray(previousLayerOutput,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight);
-            previousLayerOutput=output;
+            // The optimizer state of one optimizer type is meaningless to another one
+            for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+                window->layers[layerIndex]->resetOptimizerState();
+            delete optimizer;
+            optimizer=new CNNOptimizer(optimizerType,learningRate,momentum,weightDecay);
         }
-
-        // previousLayerOutput now contains the output of the last layer
-
-        // Backward pass
-
-        double ***higherLayerInputDiffs=0;
-
-        for(uint32_t _layerIndex=LAYER_COUNT;_layerIndex>0;_layerIndex--) // _layerIndex is of type uint32_t and cannot be <0, therefore we have to artificially increment it by 1
+        if(schedule->type!=scheduleType)
         {
-            uint32_t layerIndex=_layerIndex-1; // The actual index of this layer
-            CNNLayer *thisLayer=window->layers[layerIndex];
-            CNNLayer *higherLayer=layerIndex<LAYER_COUNT-1?window->layers[layerIndex+1]:0;
+            delete schedule;
+            schedule=new CNNLearningRateSchedule(scheduleType,IMAGES_PER_BATCH*BATCH_COUNT);
+        }
+        optimizer->learningRate=schedule->getLearningRate(learningRate,iteration);
+        optimizer->momentum=schedule->getMomentum(momentum,iteration);
+        optimizer->weightDecay=weightDecay;
+        optimizer->beginStep();
 
-            double ***inputDiffs=0;
-            double ****weightDiffs=0;
-            double *biasDiffs=0;
+        if(dataParallel)
+        {
+            // One round per cycle: every worker trains DATA_PARALLEL_SYNCHRONIZATION_INTERVAL examples, then the weights are averaged into window->layers
+            if(dataParallelTrainer==0)
+            {
+                if(!CNNDataParallelTrainer::isValidConfiguration(LAYER_COUNT,IMAGES_PER_BATCH*BATCH_COUNT,DATA_PARALLEL_WORKER_COUNT,DATA_PARALLEL_SYNCHRONIZATION_INTERVAL))
+                {
+                    configurationError(QString("Data-parallel training needs DATA_PARALLEL_SYNCHRONIZATION_INTERVAL>0 and at most one worker (DATA_PARALLEL_WORKER_COUNT, 0: one per core) per training example."));
+                    break;
+                }
+                dataParallelTrainer=new CNNDataParallelTrainer(window->layers,LAYER_COUNT,window->imageInputData,window->imageLabels,IMAGES_PER_BATCH*BATCH_COUNT,
+                                                               DATA_PARALLEL_WORKER_COUNT,DATA_PARALLEL_SYNCHRONIZATION_INTERVAL,sampler->seed);
+            }
 
-            // Error in calculateDiffs (tested)
+            uint32_t exampleCount=dataParallelTrainer->workers.size()*DATA_PARALLEL_SYNCHRONIZATION_INTERVAL;
+            uint32_t *imageIds=(uint32_t*)malloc(exampleCount*sizeof(uint32_t));
+            double ****outputs=(double****)malloc(exampleCount*sizeof(double***));
+            double *losses=(double*)malloc(exampleCount*sizeof(double));
 
-            thisLayer->calculateDiffs(weightDiffs,biasDiffs,higherLayerInputDiffs,inputDiffs,imageLabel);
-            thisLayer->applyDiffs(weightDiffs,biasDiffs,learningRate,momentum,weightDecay);
+            dataParallelTrainer->trainRound(optimizer,imageIds,outputs,losses);
 
-            if(weightDiffs!=0)
+            finishIteration(exampleCount,imageIds,outputs,losses,timer);
+            free(imageIds);
+            free(outputs);
+            free(losses);
+            continue;
+        }
+        else if(pipelined)
+        {
+            // One batch per cycle; the examples run through the stages of the pipeline concurrently
+            if(pipeline==0)
             {
-                if(thisLayer->type==CNN_LAYER_TYPE_CONV)
-                    CNNLayer::freeWeightTypeArray(weightDiffs,thisLayer->previousLayerFeatureMapCount,thisLayer->featureMapCount,thisLayer->receptiveFieldHeight,thisLayer->receptiveFieldWidth);
-                else if(thisLayer->type==CNN_LAYER_TYPE_FC)
-                    CNNLayer::freeWeightTypeArray(weightDiffs,thisLayer->previousLayerFeatureMapCount,thisLayer->previousLayerSingleFeatureMapHeight,thisLayer->previousLayerSingleFeatureMapWidth,thisLayer->featureMapCount);
+                if(!CNNPipeline::isValidConfiguration(LAYER_COUNT,PIPELINE_BATCH_SIZE))
+                {
+                    configurationError(QString("Pipelined training needs 0<PIPELINE_BATCH_SIZE<=%1 (CNN_PIPELINE_QUEUE_CAPACITY).").arg(CNN_PIPELINE_QUEUE_CAPACITY));
+                    break;
+                }
+                pipeline=new CNNPipeline(window->layers,LAYER_COUNT,PIPELINE_BATCH_SIZE,0);
             }
 
-            if(biasDiffs!=0)
-                CNNLayer::freeBiasTypeArray(biasDiffs);
+            uint32_t imageIds[PIPELINE_BATCH_SIZE];
+            double ***images[PIPELINE_BATCH_SIZE];
+            uint8_t imageLabels[PIPELINE_BATCH_SIZE];
+            double ***outputs[PIPELINE_BATCH_SIZE];
+            double losses[PIPELINE_BATCH_SIZE];
+            for(uint32_t example=0;example<PIPELINE_BATCH_SIZE;example++)
+            {
+                imageIds[example]=sampler->next();
+                images[example]=window->imageInputData[imageIds[example]];
+                imageLabels[example]=window->imageLabels[imageIds[example]];
+            }
 
-            if(layerIndex<LAYER_COUNT-1)
-                CNNLayer::freeArray(higherLayerInputDiffs,higherLayer->previousLayerFeatureMapCount,higherLayer->previousLayerSingleFeatureMapHeight);
+            pipeline->train(images,imageLabels,PIPELINE_BATCH_SIZE,optimizer,outputs,losses);
 
-            higherLayerInputDiffs=inputDiffs; // Will be freed when processing the next layer
+            finishIteration(PIPELINE_BATCH_SIZE,imageIds,outputs,losses,timer);
+            continue;
         }
 
-        if(higherLayerInputDiffs!=window->desiredOutputValueCache[imageLabel]&&higherLayerInputDiffs!=0)
-            CNNLayer::freeArray(higherLayerInputDiffs,window->layers[0]->previousLayerFeatureMapCount,window->layers[0]->previousLayerSingleFeatureMapHeight);
+        uint32_t imageId=sampler->next(); // Every image is visited once per epoch
+        uint8_t imageLabel=window->imageLabels[imageId];
 
-        // previousLayerOutput now contains the output of the last layer
+        if(ACTIVATION_MEMORY_BUDGET!=CNN_ACTIVATION_CHECKPOINTING_UNLIMITED_BUDGET)
+        {
+            // Only the activations of the checkpoint layers are kept during the forward pass, the rest is recomputed by the backward pass
+            if(activationCheckpointing==0)
+                activationCheckpointing=new CNNActivationCheckpointing(window->layers,LAYER_COUNT,ACTIVATION_MEMORY_BUDGET);
+
+            double ***output;
+            double loss;
+            activationCheckpointing->trainStep(window->imageInputData[imageId],imageLabel,optimizer,output,loss);
+            finishIteration(1,&imageId,&output,&loss,timer);
+            continue;
+        }
 
-        iterationFinished(imageId,previousLayerOutput);
+        double loss;
+        double ***output=CNNTrainingStep(window->layers,LAYER_COUNT).run(window->imageInputData[imageId],imageLabel,optimizer,loss);
+        finishIteration(1,&imageId,&output,&loss,timer);
     }
+    publishSnapshot(true);
+    previousTrainingMilliseconds+=timer.elapsed();
+    for(uint32_t layerIndex=0;layerIndex<LAYER_COUNT;layerIndex++)
+        window->layers[layerIndex]->setTraining(false);
     stopRequested=false;
     window->training=false;
 }
 
+void TrainingThread::finishIteration(uint32_t exampleCount, const uint32_t *imageIds, double ****outputs, const double *losses, QElapsedTimer &timer)
+{
+    // Track the accuracy and the loss (of the outputs calculated before the update) for the time-to-accuracy report and the GUI
+
+    for(uint32_t example=0;example<exampleCount;example++)
+    {
+        double ***output=outputs[example];
+        uint32_t predictedLabel=0;
+        for(uint32_t label=1;label<LABEL_COUNT;label++)
+        {
+            if(output[label][0][0]>output[predictedLabel][0][0])
+                predictedLabel=label;
+        }
+        uint32_t resultIndex=iteration%ACCURACY_VECTOR_MAX_SIZE;
+        if(recentResultCount==ACCURACY_VECTOR_MAX_SIZE)
+            recentCorrectCount-=recentResults[resultIndex];
+        else
+            recentResultCount++;
+        recentResults[resultIndex]=predictedLabel==window->imageLabels[imageIds[example]]?1:0;
+        recentCorrectCount+=recentResults[resultIndex];
+        recentLosses[resultIndex]=losses[example];
+
+        schedule->reportLoss(losses[example]);
+        iteration++;
+
+        if(!targetAccuracyReported&&recentResultCount==ACCURACY_VECTOR_MAX_SIZE&&recentCorrectCount>=targetAccuracy*ACCURACY_VECTOR_MAX_SIZE)
+        {
+            targetAccuracyReported=true;
+            targetAccuracyChecksum=window->getParameterChecksum();
+            targetAccuracyReached(((double)(previousTrainingMilliseconds+timer.elapsed()))/1000.0,(unsigned int)iteration);
+        }
+
+        // The GUI shows (and frees) the last output only
+        if(example<exampleCount-1)
+            CNNLayer::freeArray(output,window->layers[LAYER_COUNT-1]->featureMapCount,window->layers[LAYER_COUNT-1]->singleFeatureMapHeight);
+    }
+
+    iterationFinished(imageIds[exampleCount-1],outputs[exampleCount-1],getRecentLoss(),exampleCount);
+}
+
+double TrainingThread::getRecentLoss()
+{
+    double lossSum=0.0;
+    for(uint32_t resultIndex=0;resultIndex<recentResultCount;resultIndex++)
+        lossSum+=recentLosses[resultIndex];
+    return recentResultCount>0?lossSum/recentResultCount:0.0;
+}
+
+void TrainingThread::publishSnapshot(bool force)
+{
+    if(iteration>=snapshotIteration+SNAPSHOT_INTERVAL||(force&&iteration>snapshotIteration))
+    {
+        window->snapshotPublisher->publish(window->layers,LAYER_COUNT,iteration);
+        snapshotIteration=iteration;
+    }
+}
@@ -7,8 +7,16 @@
 
 #include <QThread>
 #include <QMutex>
+#include <QElapsedTimer>
 
 #include "cnnlayer.h"
+#include "cnnoptimizer.h"
+#include "cnnschedule.h"
+#include "cnnsampler.h"
+#include "cnntrainingstep.h"
+#include "cnnpipeline.h"
+#include "cnndataparallel.h"
+#include "cnnactivationcheckpointing.h"
 #include "mainwindow.h"
 
 class MainWindow;
@@ -22,17 +30,56 @@ public:
     MainWindow *window;
     QMutex *mutex;
 
+    // Can be changed while training (through the GUI); picked up at the beginning of the next iteration
     double learningRate;
     double momentum;
     double weightDecay;
+    uint8_t optimizerType;
+    uint8_t scheduleType;
+    bool dataParallel; // Train with CNNDataParallelTrainer on all cores (takes precedence over "pipelined")
+    bool pipelined; // Train on batches of PIPELINE_BATCH_SIZE examples with CNNPipeline instead of one example at a time
+    double targetAccuracy; // Accuracy over the last ACCURACY_VECTOR_MAX_SIZE training examples at which targetAccuracyReached is emitted
 
-    TrainingThread(MainWindow *_window,double _learningRate,double _momentum,double _weightDecay);
+    CNNOptimizer *optimizer;
+    CNNLearningRateSchedule *schedule;
+    CNNSampler *sampler; // Order in which the training examples are visited
+    CNNPipeline *pipeline; // Created when pipelined training is used for the first time
+    CNNDataParallelTrainer *dataParallelTrainer; // Created when data-parallel training is used for the first time
+    CNNActivationCheckpointing *activationCheckpointing; // Created when training on one example at a time with an ACTIVATION_MEMORY_BUDGET for the first time
+
+    // Training progress (kept when training is stopped and restarted)
+    uint64_t iteration; // Drives the schedule
+    uint64_t snapshotIteration; // Iteration of the last weight snapshot published for the GUI (see MainWindow::snapshotPublisher)
+    qint64 previousTrainingMilliseconds; // Wall-clock time spent training before the current run
+    bool targetAccuracyReported;
+    uint64_t targetAccuracyChecksum; // Parameter checksum (see MainWindow::getParameterChecksum) at the time the target accuracy was reached
+
+    // Results of the last ACCURACY_VECTOR_MAX_SIZE training examples (1 if classified correctly before the update, else 0), as a ring buffer
+    uint8_t *recentResults;
+    uint32_t recentResultCount;
+    uint32_t recentCorrectCount;
+    // Cross-entropy losses (see CNNLayer::loss) of the same examples, as a ring buffer (same index as recentResults)
+    double *recentLosses;
+
+    TrainingThread(MainWindow *_window,double _learningRate,double _momentum,double _weightDecay,uint8_t _optimizerType,uint8_t _scheduleType,double _targetAccuracy,uint64_t _seed);
     ~TrainingThread();
 
     void run();
+    // Bookkeeping after the examples of one iteration (an example, a pipeline batch or a data-parallel round) have been trained on: accuracy, loss,
+    // iteration count and time-to-accuracy report for every example; passes the output of the last example on to the GUI and frees the other ones
+    void finishIteration(uint32_t exampleCount,const uint32_t *imageIds,double ****outputs,const double *losses,QElapsedTimer &timer);
+    // Mean of recentLosses, summed when read (a running sum that adds and subtracts every loss drifts away from the buffer over millions of examples)
+    double getRecentLoss();
+    // Publishes a snapshot of the weights if SNAPSHOT_INTERVAL examples were trained on since the last one (or if "force" is set and any were)
+    void publishSnapshot(bool force);
 
 signals:
-    void iterationFinished(unsigned int imageId,double ***output);
+    // Once per iteration (see finishIteration), with the last example of it; recentLoss: mean loss of the last ACCURACY_VECTOR_MAX_SIZE training examples;
+    // exampleCount: examples trained on in the iteration
+    void iterationFinished(unsigned int imageId,double ***output,double recentLoss,unsigned int exampleCount);
+    // The selected trainer can't be used with the compiled-in configuration; training stops
+    void configurationError(QString message);
+    void targetAccuracyReached(double seconds,unsigned int iterations);
 };
 
 #endif // TRAININGTHREAD_H